@@ -0,0 +1,84 @@
+
+#include "tdb/key_search.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+// Compares the in node lower bound implementations across node fill levels. Each node holds sorted keys
+// with random gaps and is probed with a random mix of present and absent keys.
+
+static double _ns_per_search(key_search_fn fn, const vector<int64_t>& keys, const vector<int64_t>& probes, size_t rounds)
+{
+    uint64_t sink = 0;
+    auto start = chrono::steady_clock::now();
+    for(size_t r = 0; r < rounds; ++r)
+    {
+        for(auto p : probes)
+            sink += fn(keys.data(), (uint16_t)keys.size(), p);
+    }
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+    // Keep the searches from being optimized away.
+    if(sink == 42)
+        printf(" ");
+
+    return (double)elapsed / (double)(rounds * probes.size());
+}
+
+int main(int argc, char* argv[])
+{
+    const size_t rounds = (argc > 1)?(size_t)atoi(argv[1]):200;
+
+    vector<key_search_kind> kinds = {KEY_SEARCH_LINEAR, KEY_SEARCH_BINARY, KEY_SEARCH_SSE42, KEY_SEARCH_AVX2};
+
+    printf("dispatch: %s\n", key_search_name(key_search_impl()));
+    printf("%-8s", "keys");
+    for(auto kind : kinds)
+        if(key_search_supported(kind))
+            printf("%12s", key_search_name(kind));
+    printf("   (ns per search)\n");
+
+    default_random_engine rng(42);
+
+    for(uint16_t n : {4, 8, 16, 32, 64, 128, 163, 255})
+    {
+        vector<int64_t> keys(n);
+        int64_t k = 0;
+        for(auto& key : keys)
+        {
+            k += 1 + (rng() % 16);
+            key = k;
+        }
+
+        vector<int64_t> probes(4096);
+        uniform_int_distribution<int64_t> dist(0, k + 16);
+        for(auto& p : probes)
+            p = dist(rng);
+
+        printf("%-8u", (unsigned)n);
+        for(auto kind : kinds)
+        {
+            if(!key_search_supported(kind))
+                continue;
+
+            key_search_fn fn = lower_bound_linear;
+            switch(kind)
+            {
+                case KEY_SEARCH_LINEAR: fn = lower_bound_linear; break;
+                case KEY_SEARCH_BINARY: fn = lower_bound_binary; break;
+                case KEY_SEARCH_SSE42: fn = lower_bound_sse42; break;
+                case KEY_SEARCH_AVX2: fn = lower_bound_avx2; break;
+            }
+
+            printf("%12.2f", _ns_per_search(fn, keys, probes, rounds));
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
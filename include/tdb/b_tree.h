@@ -5,38 +5,404 @@
 // TODO
 // - Write more tests.
 // - Shrink the pager page size to be closer / equal to node size.
-// - More atomic removes
-//   - Since inserts are append only I think we can delete a key with the following steps:
-//      - Read of the ofs of the root node.
-//      - Traverse the tree to find the key to delete.
-//      - Update valid flag of the key to delete.
-//      - CAS update of root node. If we fail, we need to traverse the tree again and try to delete the key again. *NOTE* This relies on __sync_bool_compare_and_swap() returning true when the cmpval and exchval are the same.
 
 #include "tdb/b_tree_node.h"
+#include "tdb/bloom_filter.h"
+#include "tdb/external_sort.h"
+#include "tdb/wal.h"
 #include <string>
 #include <stdexcept>
 #include <memory>
 #include <optional>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <functional>
+#include <unordered_set>
+#include <shared_mutex>
+#include <atomic>
+#include <mutex>
+
+// With DURABILITY_WAL every write (insert, insert_batch, upsert, compare_and_set and remove) is appended to a
+// write ahead log (file_name + ".wal") and is durable when the call returns, concurrent writers share log
+// flushes (see wal). bulk_load is not logged, it holds off every other writer and takes a checkpoint before
+// it returns (or throws, a load that fails part way keeps what it published). The data file itself is only fsync'd by checkpoint(), which records the current root in
+// the header and empties the log. Pages of the checkpointed version are not reused until the next
+// checkpoint, so if the process dies the next open with DURABILITY_WAL rolls back to the checkpointed root
+// and replays the log over it.
+//
+// A file whose DURABILITY_WAL session did not close cleanly has to be reopened with DURABILITY_WAL (which
+// recovers it) before it is used without the log.
+enum durability
+{
+    DURABILITY_NONE,
+    DURABILITY_WAL
+};
+
+// Root CAS activity of the writers on one b_tree object. A writer that loses the root CAS retries, an insert
+// (or upsert / compare_and_set) retry keeps the part of its copied arm that the competing writer did not
+// change (reused_nodes) and takes the pages it needs first from what its lost attempts left behind
+// (recycled_pages) instead of the shared free list.
+struct b_tree_stats
+{
+    uint64_t writes;
+    uint64_t retries;
+    uint64_t max_retries;       // the most retries any single write needed
+    uint64_t reused_nodes;
+    uint64_t recycled_pages;
+};
 
 class b_tree
 {
+friend class lsm_tree;
 public:
-    b_tree(const std::string& file_name, uint16_t min_degree);
+    class cursor;
+
+    // A snapshot pins the version of the tree that is current when it is constructed. Reads through it
+    // (and cursors opened on it) see exactly that version however much is written afterwards, without
+    // blocking writers or retrying against them. On a partitioned tree the roots are collected until two
+    // passes agree, so the snapshot is a single point in time across partitions.
+    //
+    // A snapshot holds a pager::snapshot_guard, which is how the pagers reclaimer learns that the version is
+    // still in use: nothing retired while any snapshot is alive is reused, so a long lived snapshot makes
+    // the file grow under write load. Snapshots (and cursors) taken in the same epoch share one registry
+    // entry, constructing one throws if pager::snapshot_slots() distinct epochs are already pinned. A
+    // snapshot must not outlive its tree.
+    class snapshot
+    {
+    public:
+        snapshot(const b_tree& t);
+        snapshot(const snapshot&) = delete;
+        snapshot(snapshot&&) = delete;
+        ~snapshot() noexcept;
+        snapshot& operator=(const snapshot&) = delete;
+        snapshot& operator=(snapshot&&) = delete;
+
+        std::optional<int64_t> search(int64_t k) const;
+        // Returns the live keys (and their values) in [lo, hi] in ascending order.
+        std::vector<std::pair<int64_t, int64_t>> range(int64_t lo, int64_t hi) const;
+
+    private:
+        friend class cursor;
+
+        const b_tree& _t;
+        pager::snapshot_guard _guard;
+        std::vector<int64_t> _roots;
+    };
+
+    // A cursor walks the keys of the tree in order. It captures the root when it is constructed and
+    // every movement works against that version of the tree, inserts that publish a new root while the
+    // cursor is open are not seen (and the pages of that version are not reused until the cursor is
+    // destroyed). Lazily removed keys are skipped. A cursor pins its version the way a snapshot does, a
+    // cursor opened on a snapshot relies on the snapshots pin.
+    //
+    // On a partitioned tree the cursor captures the root of every partition (the same way a snapshot
+    // does) and merges them, a key lives in exactly one partition.
+    class cursor
+    {
+    public:
+        cursor(const b_tree& t);
+        // Walks the version pinned by the snapshot, which must outlive the cursor.
+        cursor(const snapshot& s);
+        // Walks only the tree under root_ofs (e.g. one partition).
+        cursor(const b_tree& t, int64_t root_ofs);
+
+        // Positions the cursor on the first key >= lower. Returns valid().
+        bool seek(int64_t lower);
+        bool seek_first();
+        bool seek_last();
+
+        bool next();
+        bool prev();
+
+        bool valid() const {return _cur < _parts.size();}
+        int64_t key() const;
+        int64_t value() const;
+
+    private:
+        struct frame
+        {
+            b_tree_node node;
+            uint16_t i;
+        };
+
+        // The walk of a single root.
+        class part
+        {
+        public:
+            part(const b_tree& t, int64_t root_ofs);
+
+            bool seek(int64_t lower);
+            bool seek_first();
+            bool seek_last();
+
+            bool next();
+            bool prev();
+
+            bool valid() const {return !_stack.empty();}
+            int64_t key() const {return _top().node._key(_top().i);}
+            int64_t value() const {return _top().node._val(_top().i);}
+
+        private:
+            const frame& _top() const {return _stack.back();}
+            frame& _top() {return _stack.back();}
+
+            void _descend_leftmost(int64_t ofs);
+            void _descend_rightmost(int64_t ofs);
+            void _ascend_forward();
+            void _ascend_backward();
+            bool _step_forward();
+            bool _step_backward();
+
+            const b_tree* _t;
+            int64_t _root_ofs;
+            // Every frame except the top one is an internal node and i is the child currently being walked.
+            // The top frame is the current position and i is the index of the current key.
+            std::vector<frame> _stack;
+        };
+
+        // Makes the part positioned on the smallest (or largest) key the current one.
+        bool _pick(bool smallest);
+
+        // Null for a cursor on a snapshot.
+        std::unique_ptr<pager::snapshot_guard> _guard;
+        std::vector<part> _parts;
+        // Index of the part holding the current key (_parts.size() when there is none). Moving forward every
+        // other part is positioned on its first key after the current one, moving backward on its last key
+        // before it.
+        size_t _cur;
+        bool _forward;
+    };
+
+    b_tree(const std::string& file_name, durability d = DURABILITY_NONE);
+    b_tree(const std::string& file_name, size_t pool_frames, eviction ev, durability d = DURABILITY_NONE);
+    b_tree(const b_tree&) = delete;
+    b_tree(b_tree&&) = delete;
+    ~b_tree() noexcept;
+    b_tree& operator=(const b_tree&) = delete;
+    b_tree& operator=(b_tree&&) = delete;
  
     void insert(int64_t key, int64_t value);
+    // Inserts every key / value pair in the batch as a single new version of the tree. The batch is sorted
+    // and applied to one private copy-on-write version (each touched node is copied once, no matter how
+    // many of the keys land in it) which is published with a single root CAS. The batch is all or nothing,
+    // if any key is already present (or appears twice) nothing is inserted.
+    //
+    // On a partitioned tree every partition the batch touches gets its own version. They are all built
+    // before the first is published, but published one partition at a time, so readers can briefly see
+    // part of the batch (and a key inserted concurrently by another writer can still fail the batch after
+    // some partitions are published).
+    void insert_batch(std::vector<std::pair<int64_t, int64_t>> batch);
+    // Inserts the key, or replaces its value if it is already present. Either way it is one arm copy and
+    // one root CAS (an existing key has only its slot rewritten in the copy).
+    void upsert(int64_t key, int64_t value);
+    // Replaces the value of key with desired if its current value is expected. Returns false, having
+    // written nothing, if the key is not present or holds another value.
+    bool compare_and_set(int64_t key, int64_t expected, int64_t desired);
+    // On a file with a filter a key the filter has never seen is answered from the filter alone, without
+    // touching the tree.
     std::optional<int64_t> search(int64_t k);
+    // False if k is certainly not in the tree, true if it may be (always true without a filter). Removed
+    // keys stay in the filter until the file is vacuumed.
+    bool may_contain(int64_t k) const {return !_filter || _filter->may_contain(k);}
+    // Removes are lazy by default, the key is only marked invalid (one arm copy, no rebalancing). Once the
+    // share of invalid keys in the tree would pass the tombstone ratio the remove is physical instead: the
+    // key is deleted with the usual B-tree borrow / merge / root collapse, applied to a private copy of
+    // every node it touches, and the invalid keys of the leaf it ends in are dropped along with it. A ratio
+    // of 0 makes every remove physical and a ratio of 1 makes every remove lazy.
     void remove(int64_t k);
+    void set_tombstone_ratio(double ratio);
+    static constexpr double default_tombstone_ratio = 0.25;
+
+    // Key counts maintained in the file header.
+    uint64_t live_keys() const;
+    uint64_t tombstones() const;
+
     void write_dot_file(const std::string& file_name);
 
-    static void create_db_file(const std::string& file_name);
-    static void vacuum(const std::string& file_name);
+    // Returns the live keys (and their values) in [lo, hi] in ascending order.
+    std::vector<std::pair<int64_t, int64_t>> range(int64_t lo, int64_t hi) const;
+
+    // Builds the tree bottom up from key / value pairs sorted by strictly increasing key. The tree must be
+    // empty. Nodes are packed to fill_factor of their capacity (clamped so that every node still holds at
+    // least min_degree keys), pages are appended in key order and the result is published with a single
+    // root CAS. IT must be a forward iterator, the input is counted before it is consumed.
+    //
+    // A partitioned tree can not be built in a single pass (each partition would need its count up front)
+    // so there the input is applied in sorted chunks with insert_batch() and fill_factor is ignored.
+    template<typename IT>
+    void bulk_load(IT begin, IT end, double fill_factor = 1.0)
+    {
+        auto count = (uint64_t)std::distance(begin, end);
+        _bulk_load(count, [&begin](){return (std::pair<int64_t, int64_t>)*begin++;}, fill_factor);
+    }
+
+    // As above but takes its input from an external_sorter, so the input does not need to be sorted or
+    // fit in memory.
+    void bulk_load(external_sorter& sorter, double fill_factor = 1.0);
+
+    buffer_pool_stats pool_stats() const {return _p.pool_stats();}
+    b_tree_stats stats() const;
+    // Snapshots of this tree that are currently alive.
+    uint64_t open_snapshots() const {return _snapshots.load(std::memory_order_relaxed);}
+
+    // Makes the current version of the tree durable in the data file and empties the log. Only meaningful
+    // with DURABILITY_WAL (it is also done automatically every so many log records and on close).
+    void checkpoint();
+    wal_stats log_stats() const;
+
+    uint16_t min_degree() const {return _min_degree;}
+    node_layout layout() const {return _layout;}
+    uint16_t partitions() const {return _partitions;}
+    // The keys the filter was sized for, 0 if the file has no filter.
+    uint64_t filter_capacity() const {return (_filter)?_filter->capacity():0;}
+
+    // A min_degree of 0 picks the largest min_degree whose nodes fit in a page. The min_degree and node
+    // layout are stored in the file header so every b_tree opened on the file uses the same format.
+    //
+    // With more than one partition (up to pager::root_slots()) keys are hash partitioned over that many
+    // independent trees, each published through its own root slot, so writers to different partitions
+    // never fail each others root CAS. Point operations touch one partition, cursors and range() merge
+    // them.
+    //
+    // With filter_keys a blocked Bloom filter sized for that many keys (see bloom_filter) is kept in the
+    // file. Every key written is added to it before its version is published and search() consults it
+    // before the tree, so most searches for missing keys cost one cache line. Going past filter_keys only
+    // raises the false positive rate.
+    static void create_db_file(const std::string& file_name, uint16_t min_degree = 0, node_layout layout = NODE_LAYOUT_PACKED, uint16_t partitions = 1, uint64_t filter_keys = 0);
+    // Rewrites the file with only its live keys, densely packed, and atomically renames the result over
+    // the original. The live keys are streamed in order into a bulk load of a temporary file next to the
+    // original, which is fsync'd before the rename. A filter is rebuilt from the live keys alone (sized for
+    // at least as many keys as before). Nothing else may write to the file while it runs.
+    static void vacuum(const std::string& file_name, double fill_factor = 1.0);
 
 private:
-    b_tree_node _copy_arm(int64_t key, int64_t node_ofs);
-    void _insert_atomic_recursive(int64_t key, int64_t value, int64_t node_ofs);
+    static uint16_t _read_min_degree(const pager& p);
+    static node_layout _read_layout(const pager& p);
+    static uint16_t _read_partitions(const pager& p);
+    static std::unique_ptr<bloom_filter> _read_filter(const pager& p);
+
+    size_t _partition(int64_t key) const;
+    // The root of every partition as of a single point in time, the caller must hold an epoch (or
+    // snapshot) guard.
+    std::vector<int64_t> _collect_roots() const;
+    // Looks k up under root_ofs through node_views, the caller must hold an epoch guard.
+    std::optional<int64_t> _search(int64_t root_ofs, int64_t k) const;
+    // A view of the node at ofs, whose page the caller has pinned.
+    node_view _node_view(uint8_t* page) const {return node_view(page, *_offsets);}
+
+    enum write_mode
+    {
+        WRITE_INSERT,
+        WRITE_UPSERT,
+        WRITE_CAS
+    };
+
+    // The copied arm of an insert attempt, kept across retries.
+    struct arm_node
+    {
+        uint64_t orig;                  // the node that was copied
+        uint64_t copy;
+        bool clean;                     // copy replaces orig as a whole (its parent did not split it)
+        std::vector<uint64_t> pages;    // copy and any nodes split off its children
+    };
+
+    struct write_attempt
+    {
+        std::vector<arm_node> path;     // root first
+        std::vector<uint64_t> above;    // nodes created by a root split
+        std::vector<uint64_t> spare;    // pages of lost attempts (never published), used before the free list
+    };
+
+    void _insert(int64_t key, int64_t value);
+    bool _write(write_mode mode, int64_t key, int64_t value, int64_t expected);
+    size_t _salvage_point(int64_t key, uint64_t root_ofs, const write_attempt& a) const;
+    b_tree_node _copy_path(int64_t key, int64_t node_ofs, write_attempt& a, size_t level);
+    int64_t _spare_page(write_attempt& a);
+    void _count_write(uint64_t retries);
+    void _insert_batch(const std::vector<std::pair<int64_t, int64_t>>& batch);
+    void _remove(int64_t k);
+    void _count_keys(int64_t live, int64_t tombstones);
+    void _recount_keys();
+
+    void _open_wal(const std::string& file_name);
+    void _checkpoint();
+    void _maybe_checkpoint(uint64_t lsn);
+    std::mutex& _key_lock(int64_t key);
+
+    struct bulk_plan
+    {
+        int height;
+        uint16_t fill_keys;
+        std::vector<uint64_t> fill_cap;     // entries in a subtree of height h packed at the fill factor
+        std::vector<uint64_t> max_cap;      // entries in a subtree of height h with every node full
+        std::vector<uint64_t> min_cap;      // entries in a subtree of height h with every node at minimum
+    };
+
+    bulk_plan _bulk_plan(uint64_t count, double fill_factor) const;
+    // Checkpoints around _bulk_load_unlogged() when there is a log.
+    void _bulk_load(uint64_t count, const std::function<std::pair<int64_t, int64_t>()>& next, double fill_factor);
+    void _bulk_load_unlogged(uint64_t count, const std::function<std::pair<int64_t, int64_t>()>& next, double fill_factor);
+    // Builds the tree of one partition, every key in the input must belong to it.
+    void _bulk_load_partition(size_t part, uint64_t count, const std::function<std::pair<int64_t, int64_t>()>& next, double fill_factor);
+    int64_t _bulk_build(const std::function<std::pair<int64_t, int64_t>()>& next, uint64_t count, int h, const bulk_plan& plan, std::optional<int64_t>& last_key);
+
+    // Records the pages it allocates (so a failed attempt can give them back) and the pages it copied
+    // (which are retired once the copy is published).
+    b_tree_node _copy_arm(int64_t key, int64_t node_ofs, std::vector<uint64_t>& retired, std::vector<uint64_t>& allocated);
+    // Returns true if the key was lazily removed and has been made valid again. level is the index in
+    // a.path of the node at node_ofs (-1 for a new root).
+    bool _insert_atomic_recursive(int64_t key, int64_t value, int64_t node_ofs, write_attempt& a, int level);
+
+    struct cow_version
+    {
+        std::unordered_set<uint64_t> owned;     // pages allocated by this version, safe to modify
+        std::vector<uint64_t> retired;
+        std::vector<uint64_t> allocated;
+        std::vector<uint64_t> discarded;        // allocated by this version and unlinked again
+    };
+
+    uint64_t _private_node(uint64_t ofs, cow_version& v);
+    uint64_t _insert_private(int64_t key, int64_t value, uint64_t root_ofs, cow_version& v, bool& revived);
+
+    // Physical delete. Returns the new root ofs, swept counts the invalid keys dropped along the way.
+    uint64_t _erase_private(int64_t key, uint64_t root_ofs, cow_version& v, uint64_t& swept);
+    bool _erase(int64_t key, uint64_t ofs, cow_version& v, uint64_t& swept);
+    // Removes the smallest (or largest) entry below ofs and moves it into entry i of dst.
+    void _erase_edge(uint64_t ofs, bool largest, b_tree_node& dst, uint16_t i, cow_version& v, uint64_t& swept);
+    // Makes child i of node private and gives it at least min_degree keys (borrowing from or merging with a
+    // sibling), returns the ofs of the child to descend into.
+    uint64_t _fill_child(b_tree_node& node, uint16_t i, cow_version& v);
+    uint16_t _sweep_leaf(b_tree_node& leaf);
+    void _unlink_node(uint64_t ofs, cow_version& v);
 
     pager _p;
     uint16_t _min_degree;
+    node_layout _layout;
+    // Every node of the tree has the same min_degree and layout, so they share one set of offsets.
+    const node_offsets* _offsets;
+    uint16_t _partitions;
+    // Null when the file has no filter.
+    std::unique_ptr<bloom_filter> _filter;
+
+    std::unique_ptr<wal> _wal;
+    // Writers hold it shared from applying an operation until it is in the log, checkpoint() holds it
+    // exclusively so the root it records contains exactly the operations up to the lsn it records.
+    std::shared_mutex _checkpointLock;
+    // Operations on the same key are applied and logged under the keys stripe so the log has them in the
+    // order they took effect (operations on different keys commute).
+    std::unique_ptr<std::mutex[]> _keyLocks;
+    std::atomic<uint64_t> _checkpointLsn;
+    // Keeps the pages of the checkpointed version from being reused.
+    std::unique_ptr<pager::epoch_guard> _checkpointGuard;
+    std::atomic<double> _tombstoneRatio;
+
+    std::atomic<uint64_t> _writes;
+    std::atomic<uint64_t> _retries;
+    std::atomic<uint64_t> _maxRetries;
+    std::atomic<uint64_t> _reusedNodes;
+    std::atomic<uint64_t> _recycledPages;
+    mutable std::atomic<uint64_t> _snapshots;
 };
 
 #endif
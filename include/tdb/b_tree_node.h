@@ -7,46 +7,192 @@
 #include <map>
 #include <optional>
 #include <tuple>
+#include <type_traits>
+
+enum node_layout
+{
+    // 6 byte header (min_degree, leaf, num_keys) followed by keys, one valid byte per key, values and
+    // child offsets packed back to back. The valid bytes leave values and child offsets misaligned.
+    NODE_LAYOUT_PACKED = 0,
+
+    // 64 byte header (min_degree, leaf, num_keys, padding) with the valid flags stored as a bitmap in
+    // the rest of the header, keys start on the next cache line and every array is 8 byte aligned.
+    NODE_LAYOUT_ALIGNED = 1,
+
+    // Variable length entries in a slotted page (see blob_node.h), only used by blob_b_tree.
+    NODE_LAYOUT_SLOTTED = 2,
+
+    // Fixed size keys and values of any trivially copyable type with offsets computed at compile time
+    // (see typed_b_tree.h), only used by typed_b_tree.
+    NODE_LAYOUT_TYPED = 3,
+
+    // Frame of reference, bit packed keys, values and children (see compressed_node.h), only used by
+    // compressed_b_tree.
+    NODE_LAYOUT_COMPRESSED = 4
+};
+
+// Where the fields of a node live in its page. Offsets depend only on the min_degree and layout, every
+// one a page can hold is worked out at compile time into a table so a node never computes them.
+struct node_offsets
+{
+    node_layout layout;
+    uint32_t valid_keys;
+    uint32_t keys;
+    uint32_t vals;
+    uint32_t child_ofs;
+    uint32_t size;
+
+    static constexpr node_offsets compute(uint16_t min_degree, node_layout layout)
+    {
+        size_t max_keys = ((size_t)min_degree * 2) - 1;
+        size_t valid_keys = 0, keys = 0, vals = 0;
+
+        if(layout == NODE_LAYOUT_ALIGNED)
+        {
+            const size_t header_size = 64;
+            const size_t header_fields = sizeof(uint16_t) * 4;  // min_degree, leaf, num_keys, padding
+
+            // The bitmap lives in the header when it fits, otherwise it gets cache lines of its own.
+            size_t bitmap_size = ((max_keys + 63) / 64) * sizeof(uint64_t);
+            if(bitmap_size <= header_size - header_fields)
+            {
+                valid_keys = header_fields;
+                keys = header_size;
+            }
+            else
+            {
+                valid_keys = header_size;
+                keys = header_size + (((bitmap_size + 63) / 64) * 64);
+            }
+
+            vals = keys + (sizeof(int64_t) * max_keys);
+        }
+        else
+        {
+            keys = sizeof(uint16_t) * 3;                        // min_degree, leaf, num_keys
+            valid_keys = keys + (sizeof(int64_t) * max_keys);
+            vals = valid_keys + (sizeof(uint8_t) * max_keys);
+        }
+
+        size_t child_ofs = vals + (sizeof(int64_t) * max_keys);
+        size_t size = child_ofs + (sizeof(int64_t) * (max_keys + 1));
+
+        return {layout, (uint32_t)valid_keys, (uint32_t)keys, (uint32_t)vals, (uint32_t)child_ofs, (uint32_t)size};
+    }
+
+    // The offsets of a node in a page, from the table. Throws if no node of that min_degree fits in a page.
+    static const node_offsets& of(uint16_t min_degree, node_layout layout);
+};
+
+// node_view is a node page seen through its offsets, nothing more than two pointers. Field addresses are
+// worked out when they are asked for, so a traversal that only needs the keys of a node pays for nothing
+// else, and a view is trivially copyable (pass it by value). A node_view does not pin its page, the caller
+// keeps the page pinned (pin_page() / unpin_page(), free in mmap mode) for as long as it uses the view.
+class node_view
+{
+public:
+    node_view() = default;
+    node_view(uint8_t* page, const node_offsets& o) : _page(page), _o(&o) {}
+    // Looks the offsets up from the min_degree in the page.
+    node_view(uint8_t* page, node_layout layout) : _page(page), _o(&node_offsets::of(*(uint16_t*)page, layout)) {}
+
+    uint8_t* page() const {return _page;}
+    const node_offsets& offsets() const {return *_o;}
+
+    uint16_t min_degree() const {return ((const uint16_t*)_page)[0];}
+    bool leaf() const {return ((const uint16_t*)_page)[1] != 0;}
+    uint16_t num_keys() const {return ((const uint16_t*)_page)[2];}
+    int64_t* keys() const {return (int64_t*)(_page + _o->keys);}
+    int64_t* vals() const {return (int64_t*)(_page + _o->vals);}
+    int64_t* child_ofs() const {return (int64_t*)(_page + _o->child_ofs);}
+
+    bool valid_key(uint16_t i) const
+    {
+        auto valid_keys = _page + _o->valid_keys;
+        if(_o->layout == NODE_LAYOUT_ALIGNED)
+            return ((((const uint64_t*)valid_keys)[i >> 6] >> (i & 63)) & 1) != 0;
+        return valid_keys[i] != 0;
+    }
+    void set_valid_key(uint16_t i, bool v) const
+    {
+        auto valid_keys = _page + _o->valid_keys;
+        if(_o->layout == NODE_LAYOUT_ALIGNED)
+        {
+            auto& word = ((uint64_t*)valid_keys)[i >> 6];
+            word = (v)?(word | (1ULL << (i & 63))):(word & ~(1ULL << (i & 63)));
+        }
+        else valid_keys[i] = (v)?1:0;
+    }
+
+private:
+    uint8_t* _page;
+    const node_offsets* _o;
+};
+
+static_assert(std::is_trivially_copyable<node_view>::value, "node_view must stay trivially copyable.");
+
+// b_tree_node is a node_view that holds a pin on its page, so that in buffer pool mode the frame cannot be
+// evicted out from under it (in mmap mode pins are free). Constructing one does no syscalls and copying
+// one just copies the view.
 
 class b_tree_node
 {
 friend class b_tree;
 public:
     b_tree_node(const b_tree_node& obj); // Object copy constructor, non deep copy
-    b_tree_node(const pager& p, uint16_t min_degree, bool leaf);
-    b_tree_node(const pager& p, int64_t ofs);
+    // Formats a new empty node in the page at ofs (a page the caller already owns) or, if ofs is 0, in a
+    // newly allocated page.
+    b_tree_node(const pager& p, node_layout layout, uint16_t min_degree, bool leaf, int64_t ofs = 0);
+    b_tree_node(const pager& p, node_layout layout, int64_t ofs);
+    ~b_tree_node() noexcept;
+
+    // Bytes of page needed by a node with the given min_degree.
+    static size_t node_size(uint16_t min_degree, node_layout layout = NODE_LAYOUT_PACKED);
+    // The largest min_degree whose nodes fit in a page of page_size bytes.
+    static uint16_t max_min_degree(size_t page_size, node_layout layout = NODE_LAYOUT_PACKED);
 
 private:
     int64_t _ofs() const {return _ofs_field;}
-    uint16_t _min_degree() const {return *_min_degree_field;}
-    bool _leaf() const {return (*_leaf_field) != 0;}
-    uint16_t _num_keys() const {return *_num_keys_field;}
-    void _set_num_keys(uint16_t n) {*_num_keys_field = n;}
-    int64_t _key(uint16_t i) const {return _keys_field[i];}
-    void _set_key(uint16_t i, int64_t k) {_keys_field[i] = k;}
-    bool _valid_key(uint16_t i) const {return (_valid_keys_field[i] == 0)?false:true;}
-    void _set_valid_key(uint16_t i, bool v) {_valid_keys_field[i] = (v)?1:0;}
-    int64_t _val(uint16_t i) const {return _vals_field[i];}
-    void _set_val(uint16_t i, int64_t v) {_vals_field[i] = v;}
-    int64_t _child_ofs(uint16_t i) const {return _child_ofs_field[i];}
-    void _set_child_ofs(uint16_t i, int64_t ofs) {_child_ofs_field[i] = ofs;}
+    node_layout _layout() const {return _view.offsets().layout;}
+    uint16_t _min_degree() const {return _view.min_degree();}
+    bool _leaf() const {return _view.leaf();}
+    uint16_t _num_keys() const {return _view.num_keys();}
+    void _set_num_keys(uint16_t n) {_mark_dirty(); ((uint16_t*)_view.page())[2] = n;}
+    int64_t _key(uint16_t i) const {return _view.keys()[i];}
+    void _set_key(uint16_t i, int64_t k) {_mark_dirty(); _view.keys()[i] = k;}
+    bool _valid_key(uint16_t i) const {return _view.valid_key(i);}
+    void _set_valid_key(uint16_t i, bool v) {_mark_dirty(); _view.set_valid_key(i, v);}
+    int64_t _val(uint16_t i) const {return _view.vals()[i];}
+    void _set_val(uint16_t i, int64_t v) {_mark_dirty(); _view.vals()[i] = v;}
+    int64_t _child_ofs(uint16_t i) const {return _view.child_ofs()[i];}
+    void _set_child_ofs(uint16_t i, int64_t ofs) {_mark_dirty(); _view.child_ofs()[i] = ofs;}
     bool _full() const {return _num_keys() == 2*_min_degree() - 1;}
+    void _mark_dirty() {_dirty = true;}
 
-    void _insert_non_full(int64_t k, int64_t v);
-    void _split_child(int i, int64_t ofs);
-    std::optional<int64_t> _search(int64_t k);
+    // Returns true if k was a lazily removed key that has been made valid again.
+    bool _insert_non_full(int64_t k, int64_t v);
+    // The node split off is formatted in new_ofs (allocated if 0).
+    void _split_child(int i, int64_t ofs, int64_t new_ofs = 0);
     void _remove(int64_t k);
+    // Replaces the value of k if it is present (and valid), returns false otherwise.
+    bool _update(int64_t k, int64_t v);
+
+    // Physical delete primitives (CLRS style). They modify this node and the children they name in place,
+    // so the caller must own private copies of all of them.
+    void _copy_entry(uint16_t i, const b_tree_node& src, uint16_t j);
+    // Leaf only, drops entry i.
+    void _remove_at(uint16_t i);
+    // Child i takes key i-1 from this node, key i-1 is replaced by the last key of child i-1.
+    void _borrow_from_left(uint16_t i);
+    // Child i takes key i from this node, key i is replaced by the first key of child i+1.
+    void _borrow_from_right(uint16_t i);
+    // Child i absorbs key i and every entry of child i+1, which is unlinked. Returns the unlinked ofs.
+    int64_t _merge_children(uint16_t i);
 
     const pager& _p;
     int64_t _ofs_field;
-    r_memory_map _mm;
-    uint16_t* _min_degree_field;
-    uint16_t* _leaf_field;
-    uint16_t* _num_keys_field;
-    int64_t* _keys_field;
-    uint8_t* _valid_keys_field;
-    int64_t* _vals_field;
-    int64_t* _child_ofs_field;
+    node_view _view;
+    bool _dirty;
 };
 
 #endif
@@ -0,0 +1,57 @@
+
+#ifndef __blob_b_tree_h
+#define __blob_b_tree_h
+
+#include "tdb/blob_node.h"
+#include "tdb/cow_tree.h"
+#include "tdb/pager.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <utility>
+
+// blob_b_tree is a B-tree of byte string keys and values, stored in blob_node slotted pages (see
+// blob_node.h). Keys are compared as unsigned bytes and can be up to max_key_size bytes long. Values of
+// up to max_inline_value_size bytes are stored in the node, longer ones in a chain of overflow pages that
+// the node points to (so a large value costs the node only 8 bytes).
+//
+// Writes, removes and scans are cow_tree's (see cow_tree.h). A large value is written to its overflow pages
+// once before the write starts and every attempt points at the same chain, the chain of a value that is
+// replaced or removed is retired with the nodes that referenced it.
+//
+// The file header is tagged NODE_LAYOUT_SLOTTED, b_tree refuses to open a blob_b_tree file and vice versa.
+// The int64_t b_tree remains the fast path for fixed width keys.
+
+class blob_b_tree final
+{
+public:
+    blob_b_tree(const std::string& file_name);
+    blob_b_tree(const blob_b_tree&) = delete;
+    blob_b_tree(blob_b_tree&&) = delete;
+    ~blob_b_tree() noexcept;
+    blob_b_tree& operator=(const blob_b_tree&) = delete;
+    blob_b_tree& operator=(blob_b_tree&&) = delete;
+
+    // Throws if the key is already present.
+    void insert(std::string_view key, std::string_view value);
+    // Inserts the key, or replaces its value if it is already present.
+    void upsert(std::string_view key, std::string_view value);
+    std::optional<std::string> search(std::string_view key) const;
+    void remove(std::string_view key);
+
+    // Returns the keys (and their values) in [lo, hi] in ascending order.
+    std::vector<std::pair<std::string, std::string>> range(std::string_view lo, std::string_view hi) const;
+
+    static void create_db_file(const std::string& file_name);
+
+    static const size_t max_key_size = 512;
+    static const size_t max_inline_value_size = 256;
+
+private:
+    void _write(cow_write_mode mode, std::string_view key, std::string_view value);
+
+    pager _p;
+};
+
+#endif
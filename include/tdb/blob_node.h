@@ -0,0 +1,95 @@
+
+#ifndef __blob_node_h
+#define __blob_node_h
+
+#include "tdb/pager.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+// blob_node is the node format of blob_b_tree, a slotted page of variable length entries. A small slot
+// array (one 2 byte cell offset per entry, in key order) grows from the front of the page and the cells
+// grow from the back. The longest prefix shared by every key in the node is stored once in the header and
+// cut off the front of every key.
+//
+// Page layout
+//   [0, 2)    entry count
+//   [2, 4)    flags (leaf)
+//   [4, 6)    prefix length
+//   [6, 8)    reserved
+//   [8, 16)   rightmost child ofs (internal nodes)
+//   [16, ...) prefix bytes followed by the slot array
+//
+// Cell layout
+//   [0, 2)    key suffix length
+//   [2, 4)    flags (removed, overflow)
+//   [4, 8)    value size
+//   [8, 16)   ofs of the child left of the key (internal nodes only)
+//   key suffix bytes, then the value bytes or the 8 byte ofs of its first overflow page
+//
+// Like b_tree_node, a blob_node is a view that pins its page for as long as it exists. Nodes are never
+// modified once written, a write decodes the nodes it touches into blob_entry vectors and writes them out
+// to new pages.
+
+enum blob_entry_flags : uint16_t
+{
+    BLOB_REMOVED = 1,
+    BLOB_OVERFLOW = 2
+};
+
+struct blob_entry
+{
+    std::string key;
+    uint16_t flags;
+    uint32_t value_size;
+    std::string value;      // empty when the value lives in overflow pages
+    uint64_t overflow;
+    uint64_t child;         // the child left of the key (internal nodes)
+};
+
+class blob_node final
+{
+public:
+    blob_node(const pager& p, uint64_t ofs);
+    blob_node(const blob_node&) = delete;
+    blob_node(blob_node&&) = delete;
+    ~blob_node() noexcept;
+    blob_node& operator=(const blob_node&) = delete;
+    blob_node& operator=(blob_node&&) = delete;
+
+    uint16_t count() const {return *(uint16_t*)_page;}
+    bool leaf() const {return (*(uint16_t*)(_page + 2) & 1) != 0;}
+
+    // Returns the index of the first entry whose key is >= k and sets found if that key is k.
+    uint16_t lower_bound(std::string_view k, bool& found) const;
+
+    std::string key(uint16_t i) const;
+    uint16_t flags(uint16_t i) const {return *(uint16_t*)(_cell(i) + 2);}
+    uint32_t value_size(uint16_t i) const {return *(uint32_t*)(_cell(i) + 4);}
+    // Only meaningful if the entry is not BLOB_OVERFLOW.
+    std::string_view inline_value(uint16_t i) const;
+    uint64_t overflow(uint16_t i) const;
+    // Child i is left of key i, child count() is the rightmost.
+    uint64_t child(uint16_t i) const;
+
+    blob_entry entry(uint16_t i) const;
+    void entries(std::vector<blob_entry>& out) const;
+
+    // Bytes needed by a node holding entries [first, last).
+    static size_t encoded_size(const std::vector<blob_entry>& entries, size_t first, size_t last, bool leaf);
+    // Writes a node holding entries [first, last) to the page at ofs, which the caller owns.
+    static void write(const pager& p, uint64_t ofs, bool leaf, const std::vector<blob_entry>& entries, size_t first, size_t last, uint64_t right_child);
+
+private:
+    std::string_view _prefix() const {return std::string_view((const char*)_page + 16, *(uint16_t*)(_page + 4));}
+    const uint8_t* _cell(uint16_t i) const;
+    std::string_view _suffix(uint16_t i) const;
+    size_t _cell_header() const {return (leaf())?8:16;}
+
+    const pager& _p;
+    uint64_t _ofs;
+    uint8_t* _page;
+};
+
+#endif
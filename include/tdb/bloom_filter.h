@@ -0,0 +1,57 @@
+
+#ifndef __bloom_filter_h
+#define __bloom_filter_h
+
+#include "tdb/pager.h"
+#include <cstdint>
+
+// bloom_filter is a blocked Bloom filter over int64_t keys kept in a contiguous run of pages of a pagers
+// file. Each key hashes to one 64 byte block (a single cache line) and sets one bit in each of its eight
+// words, so a lookup is one cache line read and a miss is usually known without touching anything else.
+// At bits_per_key bits a key about 1 in 100 keys that were never added still test positive.
+//
+// Keys can only be added. add() sets bits with atomic ORs so concurrent writers never lose each others
+// bits, and a key is visible to may_contain() once add() returns. A filter has no notion of removal, a
+// removed key stays positive until the filter is rebuilt.
+//
+// The pages are allocated once, when the file is created, and are never freed or retired. The filter does
+// not pin them for longer than a call.
+
+class bloom_filter final
+{
+public:
+    bloom_filter(const pager& p, uint64_t ofs, uint64_t blocks);
+    bloom_filter(const bloom_filter&) = delete;
+    bloom_filter(bloom_filter&&) = delete;
+    ~bloom_filter() noexcept;
+    bloom_filter& operator=(const bloom_filter&) = delete;
+    bloom_filter& operator=(bloom_filter&&) = delete;
+
+    void add(int64_t key) const;
+    // False means the key was never added, true means it probably was.
+    bool may_contain(int64_t key) const;
+
+    uint64_t ofs() const {return _ofs;}
+    uint64_t blocks() const {return _blocks;}
+    // The keys the filter was sized for.
+    uint64_t capacity() const;
+
+    static const uint64_t bits_per_key = 10;
+
+    // Blocks needed to hold keys at bits_per_key.
+    static uint64_t blocks_for(uint64_t keys);
+    // Appends and zeroes the pages of a filter of blocks blocks, returns the ofs of the first. The pages
+    // must come out of the pager contiguously, which only a pager with an empty free list guarantees (a
+    // newly created file).
+    static uint64_t create(const pager& p, uint64_t blocks);
+
+private:
+    uint64_t _block(uint64_t h) const;
+    uint64_t _page_ofs(uint64_t block) const;
+
+    const pager& _p;
+    uint64_t _ofs;
+    uint64_t _blocks;
+};
+
+#endif
@@ -0,0 +1,97 @@
+
+#ifndef __buffer_pool_h
+#define __buffer_pool_h
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+// buffer_pool is a fixed size table of in memory page frames backed by pread() / pwrite(). Callers pin a
+// page to get a pointer to its frame and unpin it when they are done (optionally marking it dirty). Only
+// unpinned frames are candidates for eviction, dirty frames are written back before they are reused.
+
+enum eviction
+{
+    EVICT_CLOCK,
+    EVICT_LRU_K,
+    EVICT_2Q
+};
+
+struct buffer_pool_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t write_backs;
+};
+
+class eviction_policy
+{
+public:
+    virtual ~eviction_policy() noexcept {}
+
+    // Called when a page has been read into a frame.
+    virtual void loaded(size_t frame, uint64_t ofs) = 0;
+    // Called when a pin is satisfied from a frame that was already resident.
+    virtual void accessed(size_t frame) = 0;
+    // Called after a frame has been chosen as a victim and emptied.
+    virtual void evicted(size_t frame, uint64_t ofs) = 0;
+    // Chooses a resident frame to evict. Only frames for which evictable() returns true may be chosen.
+    virtual bool victim(const std::function<bool(size_t)>& evictable, size_t& frame) = 0;
+
+    static std::unique_ptr<eviction_policy> create(eviction ev, size_t nFrames);
+};
+
+class buffer_pool final
+{
+public:
+    buffer_pool(int fd, size_t nFrames, eviction ev, size_t pageSize);
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool(buffer_pool&&) = delete;
+    ~buffer_pool() noexcept;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+    buffer_pool& operator=(buffer_pool&&) = delete;
+
+    uint8_t* pin(uint64_t ofs);
+    void unpin(uint64_t ofs, bool dirty);
+
+    void flush();
+
+    size_t num_frames() const {return _frames.size();}
+
+    buffer_pool_stats stats() const;
+
+private:
+    struct frame
+    {
+        uint64_t ofs;
+        uint32_t pins;
+        bool valid;
+        bool dirty;
+    };
+
+    size_t _acquire_frame();
+    void _write_back(size_t f);
+    uint8_t* _frame_mem(size_t f) const {return _mem.get() + (f * _pageSize);}
+
+    int _fd;
+    size_t _pageSize;
+    std::unique_ptr<uint8_t[]> _mem;
+    std::vector<frame> _frames;
+    std::vector<size_t> _free;
+    std::unordered_map<uint64_t, size_t> _table;
+    std::unique_ptr<eviction_policy> _policy;
+    mutable std::mutex _lock;
+
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+    std::atomic<uint64_t> _evictions;
+    std::atomic<uint64_t> _writeBacks;
+};
+
+#endif
@@ -0,0 +1,54 @@
+
+#ifndef __compressed_b_tree_h
+#define __compressed_b_tree_h
+
+#include "tdb/compressed_node.h"
+#include "tdb/cow_tree.h"
+#include "tdb/pager.h"
+#include <string>
+#include <vector>
+#include <optional>
+#include <utility>
+
+// compressed_b_tree is a B-tree of int64_t keys and values stored in compressed_node pages (see
+// compressed_node.h). How many entries a node holds depends on how well they pack, so nodes are split by
+// their encoded size rather than by a min_degree. A node that overflows because of an entry added at its
+// end (the usual case for increasing keys such as timestamps) keeps as much as fits on the left, so trees
+// built by appending have full leaves instead of half full ones.
+//
+// Writes, removes and scans are cow_tree's (see cow_tree.h). Re-encoding is the cost of a write, so only
+// the node holding the key (or the leaf it goes in) and nodes that split or merge are decoded, the other
+// nodes of the copied arm are copied packed with one child slot rewritten unless the new child falls
+// outside the frame of their children. A removed key that stays in an internal node has its value zeroed
+// so it does not widen the value frame.
+//
+// Use b_tree for keys that do not compress (its writes never re-encode a node) and for what this tree
+// does not do (logging, partitions, snapshots, bulk loads).
+
+class compressed_b_tree final
+{
+public:
+    compressed_b_tree(const std::string& file_name);
+    compressed_b_tree(const compressed_b_tree&) = delete;
+    compressed_b_tree(compressed_b_tree&&) = delete;
+    ~compressed_b_tree() noexcept;
+    compressed_b_tree& operator=(const compressed_b_tree&) = delete;
+    compressed_b_tree& operator=(compressed_b_tree&&) = delete;
+
+    // Throws if the key is already present.
+    void insert(int64_t key, int64_t value);
+    // Inserts the key, or replaces its value if it is already present.
+    void upsert(int64_t key, int64_t value);
+    std::optional<int64_t> search(int64_t key) const;
+    void remove(int64_t key);
+
+    // Returns the live keys (and their values) in [lo, hi] in ascending order.
+    std::vector<std::pair<int64_t, int64_t>> range(int64_t lo, int64_t hi) const;
+
+    static void create_db_file(const std::string& file_name);
+
+private:
+    pager _p;
+};
+
+#endif
@@ -0,0 +1,88 @@
+
+#ifndef __compressed_node_h
+#define __compressed_node_h
+
+#include "tdb/pager.h"
+#include <vector>
+#include <cstdint>
+
+// compressed_node is the node format of compressed_b_tree. Keys, values and child block indexes are each
+// stored frame of reference: the smallest of them once in the header and every one as its difference
+// from that, bit packed at the width of the largest difference. Keys that are close together (timestamps,
+// sequence ids) take a few bits each instead of 8 bytes.
+//
+// Page layout
+//   [0, 2)    entry count
+//   [2, 3)    leaf
+//   [3, 4)    key width (bits)
+//   [4, 5)    value width
+//   [5, 6)    child width (internal nodes)
+//   [6, 8)    reserved
+//   [8, 16)   key base
+//   [16, 24)  value base
+//   [24, 32)  child base (a block index)
+//   [32, ...) valid bitmap, packed keys, packed values and (internal nodes) packed children, each a whole
+//             number of 8 byte words
+//
+// Searches work on the packed key differences in place, nothing is decoded but the few keys the binary
+// search looks at. Like blob_node, a compressed_node is a view that pins its page for as long as it exists
+// and nodes are never modified once written.
+
+struct compressed_entry
+{
+    int64_t key;
+    int64_t value;
+    bool valid;
+    uint64_t child;     // the child left of the key (internal nodes)
+};
+
+class compressed_node final
+{
+public:
+    compressed_node(const pager& p, uint64_t ofs);
+    compressed_node(const compressed_node&) = delete;
+    compressed_node(compressed_node&&) = delete;
+    ~compressed_node() noexcept;
+    compressed_node& operator=(const compressed_node&) = delete;
+    compressed_node& operator=(compressed_node&&) = delete;
+
+    uint16_t count() const {return *(const uint16_t*)_page;}
+    bool leaf() const {return _page[2] != 0;}
+
+    // Returns the index of the first entry whose key is >= k and sets found if that key is k.
+    uint16_t lower_bound(int64_t k, bool& found) const;
+
+    int64_t key(uint16_t i) const;
+    int64_t value(uint16_t i) const;
+    bool valid(uint16_t i) const;
+    // Child i is left of key i, child count() is the rightmost.
+    uint64_t child(uint16_t i) const;
+
+    // Decodes every entry.
+    void entries(std::vector<compressed_entry>& out) const;
+
+    // Bytes needed by a node holding entries [first, last).
+    static size_t encoded_size(const std::vector<compressed_entry>& entries, size_t first, size_t last, bool leaf, uint64_t right_child);
+    // Writes a node holding entries [first, last) to the page at ofs, which the caller owns. Returns false
+    // (having written nothing) if they do not fit in a page.
+    static bool write(const pager& p, uint64_t ofs, bool leaf, const std::vector<compressed_entry>& entries, size_t first, size_t last, uint64_t right_child);
+    // Writes a copy of the internal node at src_ofs with child i replaced to the page at ofs, without
+    // decoding it. Returns false if the new child does not fit the frame of the old children (the node
+    // then has to be written out in full).
+    static bool write_with_child(const pager& p, uint64_t ofs, uint64_t src_ofs, uint16_t i, uint64_t child);
+
+    // A bound on the entries in a node, however narrow they pack.
+    static const size_t max_entries = 2048;
+
+private:
+    const uint64_t* _valid_words() const {return (const uint64_t*)(_page + 32);}
+    const uint64_t* _key_words() const;
+    const uint64_t* _value_words() const;
+    const uint64_t* _child_words() const;
+
+    const pager& _p;
+    uint64_t _ofs;
+    uint8_t* _page;
+};
+
+#endif
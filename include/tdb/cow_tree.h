@@ -0,0 +1,410 @@
+
+#ifndef __cow_tree_h
+#define __cow_tree_h
+
+#include "tdb/pager.h"
+#include <string>
+#include <vector>
+#include <optional>
+#include <utility>
+#include <stdexcept>
+#include <cstdint>
+
+// cow_tree is the search, range scan and write path shared by the B-trees whose nodes are variable sized
+// pages that are decoded into entry vectors and encoded again whole (blob_b_tree and compressed_b_tree).
+// A write copies the arm down to the key, decoding only the nodes whose entries change, writes the copy
+// out bottom up (splitting any node that no longer fits) and publishes it with a root CAS, starting over
+// from the new root if another writer got there first. Readers are never blocked.
+//
+// Removes are physical in leaves and lazy in internal nodes, where the key has to keep separating its
+// children and is replaced by F::tombstone(). A leaf a remove leaves under a quarter full is merged with a
+// sibling when the two fit in one node (the separator between them moves down unless it is a tombstone).
+// Internal nodes are never merged, so a tree that shrinks keeps its height. A root left without entries
+// is replaced by its only child.
+//
+// F describes the node format:
+//   node, entry         the node view (lower_bound, count, leaf, key, child, entries) and its decoded entry,
+//                       which has a child member (the child left of the key)
+//   key_arg, key_type   how keys are passed in and how the node returns them, value_type likewise
+//   live(n, i)          whether entry i of a node is a live key (not a tombstone), live(e) for an entry
+//   tombstone(e)        e with its value dropped, for a removed key that stays in an internal node
+//   release(p, e, out)  adds the pages only e references (they are retired with the path)
+//   value(p, n, i)      the value of entry i
+//   encoded_size(...)   bytes a node holding entries [first, last) needs
+//   write(...)          encodes entries [first, last) to a page, false (having written nothing) if they
+//                       do not fit
+//   write_with_child    copies the node at src with child i replaced without decoding it, false if the
+//                       format can not
+//   split_point(...)    the entry to split an overflowing node around, changed is the one the write added
+
+enum cow_write_mode
+{
+    COW_INSERT,
+    COW_UPSERT,
+    COW_REMOVE
+};
+
+// A node on the path of a write. A node that only gets a new child is not decoded unless F can not
+// rewrite the child in place.
+template<typename E>
+struct cow_level
+{
+    uint64_t ofs;
+    bool leaf;
+    bool decoded;
+    std::vector<E> entries;
+    uint64_t right_child;
+    uint16_t i;     // the child descended into, or the entry the write changes
+};
+
+template<typename F>
+class cow_tree final
+{
+public:
+    using node = typename F::node;
+    using entry = typename F::entry;
+    using key_arg = typename F::key_arg;
+    using key_type = typename F::key_type;
+    using value_type = typename F::value_type;
+    using level = cow_level<entry>;
+
+    cow_tree(const pager& p) :
+        _p(p)
+    {
+    }
+    cow_tree(const cow_tree&) = delete;
+    cow_tree(cow_tree&&) = delete;
+    ~cow_tree() noexcept {}
+    cow_tree& operator=(const cow_tree&) = delete;
+    cow_tree& operator=(cow_tree&&) = delete;
+
+    std::optional<value_type> search(key_arg key) const
+    {
+        pager::epoch_guard guard(_p);
+        auto ofs = _p.root_ofs();
+        while(ofs != 0)
+        {
+            node n(_p, ofs);
+            bool found;
+            auto i = n.lower_bound(key, found);
+            if(found)
+            {
+                if(!F::live(n, i))
+                    return std::nullopt;
+                return F::value(_p, n, i);
+            }
+            if(n.leaf())
+                break;
+            ofs = n.child(i);
+        }
+        return std::nullopt;
+    }
+
+    // Returns the live keys (and their values) in [lo, hi] in ascending order.
+    std::vector<std::pair<key_type, value_type>> range(key_arg lo, key_arg hi) const
+    {
+        std::vector<std::pair<key_type, value_type>> result;
+
+        pager::epoch_guard guard(_p);
+        auto root_ofs = _p.root_ofs();
+        if(root_ofs != 0)
+            _range(root_ofs, lo, hi, result);
+
+        return result;
+    }
+
+    // e is the entry an insert or upsert writes (its key is key), a remove ignores it. An insert of a key
+    // that is present throws.
+    void write(cow_write_mode mode, key_arg key, const entry& e)
+    {
+        std::vector<uint64_t> allocated;
+        std::vector<uint64_t> dropped;
+        std::vector<level> path;
+        bool changed = false;
+
+        try
+        {
+            pager::epoch_guard guard(_p);
+
+            bool written = false;
+            while(!written)
+            {
+                path.clear();
+                dropped.clear();
+
+                auto old_root_ofs = _p.root_ofs();
+                changed = _descend(mode, key, e, old_root_ofs, path, dropped);
+                if(!changed)
+                    break;
+
+                if(mode == COW_REMOVE && path.back().leaf)
+                    _merge_leaf(path, dropped);
+
+                auto new_root_ofs = _write_path(path, allocated);
+
+                if(_p.set_root_ofs(old_root_ofs, new_root_ofs))
+                {
+                    allocated.clear();
+                    written = true;
+                }
+                else
+                {
+                    for(auto ofs : allocated)
+                        _p.free_page(ofs);
+                    allocated.clear();
+                }
+            }
+        }
+        catch(...)
+        {
+            // A duplicate key or a pager failure, nothing of the attempt in progress was published.
+            for(auto ofs : allocated)
+                _p.free_page(ofs);
+            throw;
+        }
+
+        if(!changed)
+            return;
+
+        auto retired = dropped;
+        for(auto& l : path)
+        {
+            if(l.ofs != 0)
+                retired.push_back(l.ofs);
+        }
+        _p.retire_pages(retired);
+    }
+
+private:
+    void _decode(level& l) const
+    {
+        if(l.decoded)
+            return;
+
+        node n(_p, l.ofs);
+        n.entries(l.entries);
+        l.right_child = (l.leaf)?0:n.child(n.count());
+        l.decoded = true;
+    }
+
+    // Fills path down to the node the write changes and changes its entries, returns false if the write
+    // has nothing to do. The descent searches the nodes in place, a level is only decoded once it is known
+    // to change.
+    bool _descend(cow_write_mode mode, key_arg key, const entry& e, uint64_t root_ofs, std::vector<level>& path, std::vector<uint64_t>& dropped) const
+    {
+        if(root_ofs == 0)
+        {
+            if(mode == COW_REMOVE)
+                return false;
+            path.push_back({0, true, true, {e}, 0, 0});
+            return true;
+        }
+
+        auto ofs = root_ofs;
+        while(true)
+        {
+            node n(_p, ofs);
+            path.push_back({ofs, n.leaf(), false, {}, 0, 0});
+            auto& l = path.back();
+
+            bool found;
+            l.i = n.lower_bound(key, found);
+
+            if(found)
+            {
+                auto live = F::live(n, l.i);
+                if(mode == COW_INSERT && live)
+                    throw std::runtime_error("Duplicate key");
+                if(mode == COW_REMOVE && !live)
+                    return false;
+
+                _decode(l);
+                auto& old = l.entries[l.i];
+                // Whatever the old entry references stays reachable from the version that was copied.
+                F::release(_p, old, dropped);
+                if(mode == COW_REMOVE)
+                {
+                    if(l.leaf)
+                        l.entries.erase(begin(l.entries) + l.i);
+                    else old = F::tombstone(old);
+                }
+                else
+                {
+                    auto child = old.child;
+                    old = e;
+                    old.child = child;
+                }
+                return true;
+            }
+
+            if(l.leaf)
+            {
+                if(mode == COW_REMOVE)
+                    return false;
+                _decode(l);
+                l.entries.insert(begin(l.entries) + l.i, e);
+                return true;
+            }
+
+            ofs = n.child(l.i);
+        }
+    }
+
+    // Merges the leaf at the end of the path with a sibling if it is under a quarter full and the two fit
+    // in one node, the sibling is added to dropped.
+    void _merge_leaf(std::vector<level>& path, std::vector<uint64_t>& dropped) const
+    {
+        if(path.size() < 2)
+            return;
+
+        auto& leaf = path.back();
+        if(F::encoded_size(leaf.entries, 0, leaf.entries.size(), true, 0) >= pager::block_size() / 4)
+            return;
+
+        // The sibling right of the leaf and the separator between them, or the one left of it when the
+        // leaf is the rightmost child.
+        auto& parent = path[path.size() - 2];
+        _decode(parent);
+        if(parent.entries.empty())
+            return;
+        bool rightmost = parent.i == parent.entries.size();
+        size_t s = (rightmost)?parent.i - 1u:parent.i;
+        auto sibling_ofs = (rightmost)?parent.entries[s].child:
+                           (s + 1 < parent.entries.size())?parent.entries[s + 1].child:parent.right_child;
+
+        std::vector<entry> sibling;
+        {
+            node n(_p, sibling_ofs);
+            n.entries(sibling);
+        }
+
+        std::vector<entry> merged = (rightmost)?sibling:leaf.entries;
+        auto sep = parent.entries[s];
+        if(F::live(sep))
+        {
+            sep.child = 0;
+            merged.push_back(sep);
+        }
+        auto& after = (rightmost)?leaf.entries:sibling;
+        merged.insert(end(merged), begin(after), end(after));
+
+        if(F::encoded_size(merged, 0, merged.size(), true, 0) > pager::block_size())
+            return;
+
+        // The merged leaf takes the place of whichever of the two was right of the separator.
+        leaf.entries = std::move(merged);
+        parent.entries.erase(begin(parent.entries) + s);
+        parent.i = (uint16_t)s;
+        dropped.push_back(sibling_ofs);
+    }
+
+    // Writes the path out bottom up (splitting whatever no longer fits), returns the new root ofs.
+    uint64_t _write_path(std::vector<level>& path, std::vector<uint64_t>& allocated) const
+    {
+        auto new_page = [&](){
+            auto ofs = _p.append_page();
+            allocated.push_back(ofs);
+            return ofs;
+        };
+
+        // Carried up from the level just written: its new page (below), or after a split the two pages it
+        // became (left, right) and the entry that has to go between them in this level (sep).
+        uint64_t below = 0, left = 0, right = 0;
+        bool split = false;
+        entry sep {};
+
+        for(size_t l = path.size(); l-- > 0;)
+        {
+            auto& lv = path[l];
+            uint64_t page = 0;
+
+            if(l + 1 < path.size())
+            {
+                if(!split && !lv.decoded)
+                {
+                    page = new_page();
+                    if(F::write_with_child(_p, page, lv.ofs, lv.i, below))
+                    {
+                        below = page;
+                        continue;
+                    }
+                }
+
+                _decode(lv);
+                if(split)
+                {
+                    sep.child = left;
+                    lv.entries.insert(begin(lv.entries) + lv.i, sep);
+                    if(lv.i + 1u < lv.entries.size())
+                        lv.entries[lv.i + 1].child = right;
+                    else lv.right_child = right;
+                }
+                else if(lv.i < lv.entries.size())
+                    lv.entries[lv.i].child = below;
+                else lv.right_child = below;
+            }
+
+            auto n = lv.entries.size();
+
+            // The last key of a root leaf is gone, the tree is empty again. A root whose last separator
+            // went in a merge is replaced by its only child.
+            if(l == 0 && n == 0 && page == 0)
+                return (lv.leaf)?0:below;
+
+            if(page == 0)
+                page = new_page();
+            if(F::write(_p, page, lv.leaf, lv.entries, 0, n, lv.right_child))
+            {
+                split = false;
+                below = page;
+                continue;
+            }
+
+            auto m = F::split_point(lv.entries, lv.leaf, lv.right_child, lv.i);
+
+            left = page;
+            right = new_page();
+            if(!F::write(_p, left, lv.leaf, lv.entries, 0, m, lv.entries[m].child) ||
+               !F::write(_p, right, lv.leaf, lv.entries, m + 1, n, lv.right_child))
+                throw std::runtime_error("Unable to split node.");
+            sep = lv.entries[m];
+            split = true;
+        }
+
+        if(!split)
+            return below;
+
+        std::vector<entry> root_entries = {sep};
+        root_entries[0].child = left;
+        auto root_ofs = new_page();
+        F::write(_p, root_ofs, false, root_entries, 0, 1, right);
+        return root_ofs;
+    }
+
+    // In order walk that stops (returns false) at the first key above hi.
+    bool _range(uint64_t ofs, key_arg lo, key_arg hi, std::vector<std::pair<key_type, value_type>>& out) const
+    {
+        node n(_p, ofs);
+        bool found;
+        auto i = n.lower_bound(lo, found);
+        for(uint16_t j = i; j <= n.count(); ++j)
+        {
+            // Child i holds keys below key i, which is lo when found, so it has nothing in range.
+            if(!n.leaf() && !(found && j == i) && !_range(n.child(j), lo, hi, out))
+                return false;
+            if(j == n.count())
+                break;
+
+            auto k = n.key(j);
+            if(hi < key_arg(k))
+                return false;
+            if(F::live(n, j))
+                out.push_back(std::make_pair(k, F::value(_p, n, j)));
+        }
+        return true;
+    }
+
+    const pager& _p;
+};
+
+#endif
@@ -0,0 +1,60 @@
+
+#ifndef __external_sort_h
+#define __external_sort_h
+
+#include "tdb/file_utils.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <cstdint>
+
+// external_sorter sorts key / value pairs that may not fit in memory. Pairs are buffered until the memory
+// budget is reached, then the buffer is sorted and spilled to a run file. finish() spills what is left and
+// next() performs a k-way merge of the runs. Run files are named run_prefix + N and are removed when the
+// sorter is destroyed.
+
+class external_sorter final
+{
+public:
+    external_sorter(const std::string& run_prefix, size_t memory_budget = 64 * 1024 * 1024);
+    external_sorter(const external_sorter&) = delete;
+    external_sorter(external_sorter&&) = delete;
+    ~external_sorter() noexcept;
+    external_sorter& operator=(const external_sorter&) = delete;
+    external_sorter& operator=(external_sorter&&) = delete;
+
+    void add(int64_t key, int64_t value);
+
+    void finish();
+
+    uint64_t size() const {return _size;}
+
+    // Returns the pairs in ascending key order. Only valid after finish().
+    bool next(std::pair<int64_t, int64_t>& kv);
+
+private:
+    struct run
+    {
+        r_file f;
+        std::vector<std::pair<int64_t, int64_t>> buffer;
+        size_t pos;
+        uint64_t remaining;
+    };
+
+    void _spill();
+    bool _refill(run& r);
+
+    std::string _run_prefix;
+    size_t _max_buffered;
+    std::vector<std::pair<int64_t, int64_t>> _buffer;
+    std::vector<std::string> _run_files;
+    std::vector<uint64_t> _run_sizes;
+    std::vector<std::unique_ptr<run>> _runs;
+    std::vector<size_t> _heap;
+    size_t _buffer_pos;
+    uint64_t _size;
+    bool _finished;
+};
+
+#endif
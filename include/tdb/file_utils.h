@@ -3,6 +3,7 @@
 #define __file_utils_h
 
 #include <map>
+#include <string>
 #include <cstring>
 #include <cstdint>
 #include <cstdlib>
@@ -62,6 +63,11 @@ void block_read_file(T* p, size_t size, const F& f, size_t blockSize = 4096)
     }
 }
 
+// Returns the directory part of a path ("." if there is none).
+std::string dir_name(const std::string& path);
+// fsync()s the directory containing path, which makes a rename or unlink of path durable.
+void fsync_dir_of(const std::string& path);
+
 class r_file final
 {
 public:
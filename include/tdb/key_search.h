@@ -0,0 +1,41 @@
+
+#ifndef __key_search_h
+#define __key_search_h
+
+#include <cstdint>
+#include <atomic>
+
+// In node key search. Every routine returns the index of the first key in the sorted array keys[0..n)
+// that is not less than k (n if there is none), i.e. the same thing as std::lower_bound().
+//
+// key_lower_bound() dispatches to the fastest implementation the CPU supports. The CPU is probed once,
+// on the first call. The individual implementations are exposed for testing and benchmarking, the SIMD
+// ones must only be called when key_search_impl() says they are supported.
+
+typedef uint16_t (*key_search_fn)(const int64_t* keys, uint16_t n, int64_t k);
+
+enum key_search_kind
+{
+    KEY_SEARCH_LINEAR,
+    KEY_SEARCH_BINARY,
+    KEY_SEARCH_SSE42,
+    KEY_SEARCH_AVX2
+};
+
+uint16_t lower_bound_linear(const int64_t* keys, uint16_t n, int64_t k);
+uint16_t lower_bound_binary(const int64_t* keys, uint16_t n, int64_t k);
+uint16_t lower_bound_sse42(const int64_t* keys, uint16_t n, int64_t k);
+uint16_t lower_bound_avx2(const int64_t* keys, uint16_t n, int64_t k);
+
+bool key_search_supported(key_search_kind kind);
+key_search_kind key_search_impl();
+const char* key_search_name(key_search_kind kind);
+
+extern std::atomic<key_search_fn> _key_lower_bound;
+
+inline uint16_t key_lower_bound(const int64_t* keys, uint16_t n, int64_t k)
+{
+    return _key_lower_bound.load(std::memory_order_relaxed)(keys, n, k);
+}
+
+#endif
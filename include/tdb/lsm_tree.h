@@ -0,0 +1,157 @@
+
+#ifndef __lsm_tree_h
+#define __lsm_tree_h
+
+#include "tdb/b_tree.h"
+#include "tdb/wal.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <functional>
+
+// lsm_tree is a log structured key / value store built from the other components. Writes go to an in
+// memory sorted memtable (and, with DURABILITY_WAL, to a per memtable write ahead log). A full memtable is
+// frozen and a background flush thread writes it out as an immutable sorted run, so the disk only ever
+// sees large sequential writes. A run is a pair of bulk loaded b_tree files, one holding the values written and
+// one holding the keys removed (tombstones that hide older values).
+//
+// Compaction is tiered. A flushed run starts in tier 0 and whenever a tier holds fanout runs a second
+// background thread merges them into one run of the next tier. Compaction never holds up a flush, so
+// writers only stall when flushing itself falls behind, not for the length of a large merge. Tombstones are dropped when the merge
+// includes the oldest run. Reads check the memtables and then the runs from newest to oldest.
+//
+// Files are name + ".manifest" (the current list of runs, replaced atomically), name + ".run.<id>.puts"
+// and ".dels", and name + ".wal.<generation>".
+//
+// Unlike b_tree::insert, put() overwrites an existing value.
+
+struct lsm_stats
+{
+    uint64_t flushes;
+    uint64_t compactions;
+    size_t runs;
+};
+
+class lsm_tree final
+{
+public:
+    lsm_tree(const std::string& name, size_t memtable_entries = 256 * 1024, durability d = DURABILITY_NONE);
+    lsm_tree(const lsm_tree&) = delete;
+    lsm_tree(lsm_tree&&) = delete;
+    ~lsm_tree() noexcept;
+    lsm_tree& operator=(const lsm_tree&) = delete;
+    lsm_tree& operator=(lsm_tree&&) = delete;
+
+    void put(int64_t key, int64_t value);
+    void remove(int64_t key);
+
+    std::optional<int64_t> get(int64_t key) const;
+
+    // Returns the live keys (and their values) in [lo, hi] in ascending order.
+    std::vector<std::pair<int64_t, int64_t>> range(int64_t lo, int64_t hi) const;
+
+    // Writes the memtable out as a run and waits until every pending flush and compaction has finished.
+    void flush();
+
+    lsm_stats stats() const;
+
+    static const size_t fanout = 4;
+
+private:
+    struct entry
+    {
+        int64_t value;
+        bool removed;
+    };
+
+    typedef std::map<int64_t, entry> memtable;
+    // Produces entries in ascending key order, returns false at the end.
+    typedef std::function<bool(int64_t&, entry&)> stream;
+
+    struct mem
+    {
+        memtable table;
+        std::shared_ptr<wal> log;
+        uint64_t gen;
+    };
+
+    struct run
+    {
+        run(const std::string& name, uint64_t id, uint32_t tier);
+        run(const run&) = delete;
+        run(run&&) = delete;
+        ~run() noexcept;
+        run& operator=(const run&) = delete;
+        run& operator=(run&&) = delete;
+
+        uint64_t id;
+        uint32_t tier;
+        std::string puts_name;
+        std::string dels_name;
+        std::unique_ptr<b_tree> puts;
+        std::unique_ptr<b_tree> dels;
+        // Set once the run has been compacted away, the last reader to let go of it removes its files.
+        std::atomic<bool> obsolete;
+    };
+
+    // Newest first.
+    typedef std::vector<std::shared_ptr<run>> run_list;
+
+    void _write(int64_t key, const entry& e);
+    void _rotate(std::unique_lock<std::shared_mutex>& g, size_t min_entries);
+    std::shared_ptr<mem> _new_mem(uint64_t gen);
+
+    std::shared_ptr<const run_list> _runs_snapshot() const;
+    std::shared_ptr<run> _build_run(uint32_t tier, const std::function<stream()>& open_stream, bool keep_tombstones);
+    void _flush_mem(const std::shared_ptr<mem>& m);
+    bool _compact_once();
+    // Applies change to the current run list and makes the result current (and durable in the manifest).
+    // Flushes and compactions land concurrently, so each describes its change against whatever list is
+    // current when it is installed.
+    void _install(const std::function<void(run_list&)>& change, uint64_t flushed_gen);
+
+    void _open();
+    void _write_manifest(const run_list& runs, uint64_t flushed_gen);
+    void _remove_orphans();
+    std::string _wal_name(uint64_t gen) const;
+
+    void _flush_thread();
+    void _compact_thread();
+
+    std::string _name;
+    size_t _memtableEntries;
+    durability _durability;
+
+    mutable std::shared_mutex _memLock;
+    std::condition_variable_any _workCond;
+    std::shared_ptr<mem> _active;
+    std::deque<std::shared_ptr<mem>> _immutables;
+    bool _flushing;
+    // Set by a flush, cleared when the compaction thread picks it up.
+    bool _compactPending;
+    bool _compacting;
+    bool _stop;
+    std::exception_ptr _error;
+
+    mutable std::mutex _runsLock;
+    std::shared_ptr<const run_list> _runs;
+    uint64_t _nextRunId;
+    uint64_t _flushedGen;
+
+    std::atomic<uint64_t> _flushes;
+    std::atomic<uint64_t> _compactions;
+
+    std::thread _flusher;
+    std::thread _compactor;
+};
+
+#endif
@@ -3,45 +3,194 @@
 #define __pager_h
 
 #include "tdb/file_utils.h"
+#include "tdb/buffer_pool.h"
 #include <string>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+// pager keeps a single shared mapping of the whole file. The mapping is reserved up front (larger than
+// the file) so that growing the file never moves it, which means the pointers handed out by page_from()
+// stay valid for the lifetime of the pager and can be used concurrently without any remapping.
+//
+// Alternatively a pager can be constructed in buffer pool mode. In that mode only the header page is
+// mapped and every other page is read into a bounded set of frames. Code that touches pages should go
+// through pin_page() / unpin_page(), which work in both modes (in mmap mode they cost nothing).
+//
+// Pages that are no longer referenced are kept on a free list (persisted in the file, linked through the
+// first 8 bytes of each free page) and append_page() reuses them before growing the file. Pages that were
+// reachable from a root that has since been replaced cannot be reused right away because a reader may
+// still be walking the old root, so they are retired instead. Readers announce themselves with an
+// epoch_guard and a retired page is only moved to the free list once every guard that was active when
+// it was retired has gone away. Reclamation assumes that every user of a file in the process goes
+// through the same pager.
+//
+// New pages are claimed with a single atomic add on the nblocks field of the header, the file itself is
+// grown ahead of nblocks in extents so most appends make no system call at all. The unused tail of the
+// last extent is trimmed off when the pager is destroyed (another pager with the file open at the time
+// would still think the file extends to the end of its extent, so this is the same single pager per file
+// assumption as above).
 
 class pager final
 {
 public:
-    pager(const std::string& fileName);
+    class epoch_guard final
+    {
+    public:
+        epoch_guard(const pager& p);
+        epoch_guard(const epoch_guard&) = delete;
+        epoch_guard(epoch_guard&&) = delete;
+        ~epoch_guard() noexcept;
+        epoch_guard& operator=(const epoch_guard&) = delete;
+        epoch_guard& operator=(epoch_guard&&) = delete;
+
+    private:
+        const pager& _p;
+        size_t _slot;
+    };
+
+    // A snapshot_guard pins the current epoch like an epoch_guard, for readers that live far longer than
+    // one operation (snapshots and cursors). They are registered apart from the epoch_guard slots, so any
+    // number of them can not starve ordinary readers of a slot. Guards taken in the same epoch share one
+    // refcounted registry entry, and if snapshot_slots() distinct epochs are already pinned the constructor
+    // throws rather than waiting.
+    class snapshot_guard final
+    {
+    public:
+        snapshot_guard(const pager& p);
+        snapshot_guard(const snapshot_guard&) = delete;
+        snapshot_guard(snapshot_guard&&) = delete;
+        ~snapshot_guard() noexcept;
+        snapshot_guard& operator=(const snapshot_guard&) = delete;
+        snapshot_guard& operator=(snapshot_guard&&) = delete;
+
+    private:
+        const pager& _p;
+        size_t _slot;
+    };
+
+    pager(const std::string& fileName, uint64_t reserveSize = default_reserve_size());
+    pager(const std::string& fileName, size_t poolFrames, eviction ev);
     pager(const pager&) = delete;
     pager(pager&&) = delete;
     ~pager() noexcept;
     pager& operator=(const pager&) = delete;
     pager& operator=(pager&&) = delete;
 
-    static size_t block_size();
+    static constexpr size_t block_size() {return 4096;}
+    static uint64_t default_reserve_size();
+    static uint64_t default_extent_size();
+
+    // Sets how far the file is grown each time an append runs past its end. extent_size must be a
+    // multiple of the block size. With preallocate the extent is allocated on disk with fallocate()
+    // (where supported) rather than left sparse.
+    void set_extent_size(uint64_t extent_size, bool preallocate = false);
 
     static void create(const std::string& fileName);
 
     uint64_t block_start_from(uint64_t ofs) const;
 
-    r_memory_map map_page_from(uint64_t ofs) const;
+    uint8_t* page_from(uint64_t ofs) const;
+
+    inline uint8_t* pin_page(uint64_t ofs) const
+    {
+        return (_pool)?_pool->pin(ofs):page_from(ofs);
+    }
+
+    inline void unpin_page(uint64_t ofs, bool dirty) const
+    {
+        if(_pool)
+            _pool->unpin(ofs, dirty);
+    }
+
+    bool pooled() const {return _pool.get() != nullptr;}
+    buffer_pool_stats pool_stats() const;
 
     uint64_t append_page() const;
 
-    uint64_t root_ofs() const;
-    bool set_root_ofs(uint64_t lastVal, uint64_t newVal) const;
+    // Returns a page that was never reachable from a published root to the free list immediately.
+    void free_page(uint64_t ofs) const;
+    // Retires pages that were reachable from a root that has just been replaced.
+    void retire_pages(const std::vector<uint64_t>& pages) const;
+    // Moves every retired page that no reader can still reference to the free list.
+    void reclaim() const;
+
+    // Forgets every free page (they are leaked until the file is vacuumed). Used by recovery, after a crash
+    // the on disk free list may link through pages that were reused.
+    void reset_free_list() const;
+
+    uint64_t free_page_count() const;
+    size_t retired_page_count() const;
+    // Distinct epochs that snapshot_guards can pin at once.
+    static size_t snapshot_slots();
+
+    // The header page holds the pagers own fields followed by an area that belongs to the pagers user.
+    uint8_t* user_header() const;
+    static size_t user_header_size();
+
+    // The header has root_slots() independent roots, each on its own cache line so writers publishing to
+    // different slots do not contend. Single root users only ever use slot 0.
+    static size_t root_slots();
+    uint64_t root_ofs(size_t slot = 0) const;
+    bool set_root_ofs(uint64_t lastVal, uint64_t newVal, size_t slot = 0) const;
 
     void sync() const;
 
 private:
     uint32_t _read_nblocks() const;
 
-    bool _update_nblocks(uint32_t lastVal, uint32_t newVal) const;
+    uint32_t _claim_nblocks() const;
+    void _unclaim_nblocks() const;
+
+    uint64_t _read_root_ofs(size_t slot) const;
+
+    bool _update_root_ofs(uint64_t lastVal, uint64_t newVal, size_t slot) const;
+    uint64_t* _root_slot(size_t slot) const;
+
+    void _grow_file(uint64_t size) const;
+    void _trim_file() const;
+
+    uint64_t _pop_free() const;
+    void _push_free(uint64_t ofs) const;
+    uint64_t _read_next_free(uint64_t ofs) const;
+    void _write_next_free(uint64_t ofs, uint64_t next) const;
+    uint64_t* _free_head() const;
 
-    uint64_t _read_root_ofs() const;
+    size_t _enter_epoch() const;
+    void _exit_epoch(size_t slot) const;
+    size_t _pin_snapshot() const;
+    void _unpin_snapshot(size_t slot) const;
 
-    bool _update_root_ofs(uint64_t lastVal, uint64_t newVal) const;
+    struct alignas(64) epoch_slot
+    {
+        std::atomic<uint64_t> active {0};
+    };
 
     std::string _fileName;
     r_file _f;
+    uint64_t _reserveSize;
     r_memory_map _mm;
+    mutable std::mutex _growLock;
+    mutable std::atomic<uint64_t> _fileSize;
+    std::atomic<uint64_t> _extentSize;
+    std::atomic<bool> _preallocate;
+    std::unique_ptr<buffer_pool> _pool;
+
+    mutable std::atomic<uint64_t> _epoch;
+    std::unique_ptr<epoch_slot[]> _slots;
+
+    struct snapshot_slot
+    {
+        uint64_t epoch;
+        uint64_t refs;
+    };
+
+    mutable std::mutex _snapshotLock;
+    std::unique_ptr<snapshot_slot[]> _snapshotSlots;
+    mutable std::mutex _limboLock;
+    mutable std::deque<std::pair<uint64_t, uint64_t>> _limbo;
 };
 
 #endif
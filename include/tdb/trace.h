@@ -0,0 +1,65 @@
+
+#ifndef __trace_h
+#define __trace_h
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Structured tracing for the insert and delete paths. Build with -DTDB_TRACE=ON to enable it. When enabled, every
+// TDB_TRACE() appends a fixed size record to a ring buffer owned by the calling thread (no locks, no
+// I/O) and trace_dump() writes the contents of every threads ring on demand. When disabled TDB_TRACE()
+// compiles to nothing and its arguments are not evaluated.
+
+#ifndef TDB_TRACE_RING_SIZE
+#define TDB_TRACE_RING_SIZE 4096
+#endif
+
+enum trace_event
+{
+    TRACE_ARM_COPY,         // a = new node ofs, b = source node ofs
+    TRACE_SPLIT,            // a = parent ofs, b = ofs of the child being split
+    TRACE_ROOT_SPLIT,       // a = new root ofs, b = old root ofs
+    TRACE_ROOT_CAS_RETRY,   // a = attempt, b = root ofs the CAS expected
+    TRACE_BORROW,           // a = parent ofs, b = ofs of the child that took a key from a sibling
+    TRACE_MERGE,            // a = parent ofs, b = ofs of the child that absorbed its right sibling
+    TRACE_ROOT_COLLAPSE,    // a = new root ofs (0 for an empty tree), b = old root ofs
+    TRACE_FILE_GROW,        // a = new file size, b = old file size
+    TRACE_PAGE_APPEND       // a = ofs of the new page
+};
+
+struct trace_record
+{
+    uint64_t ts;
+    uint64_t thread;
+    trace_event event;
+    int64_t a;
+    int64_t b;
+};
+
+const char* trace_event_name(trace_event ev);
+
+void trace_record_event(trace_event ev, int64_t a, int64_t b);
+
+// Copies the records of every threads ring, oldest first per thread. Intended to be called when the
+// traced threads are quiescent, records written concurrently with a snapshot may be torn.
+std::vector<trace_record> trace_snapshot();
+void trace_dump(FILE* f);
+void trace_clear();
+
+constexpr bool trace_enabled()
+{
+#ifdef TDB_TRACE_ENABLED
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef TDB_TRACE_ENABLED
+#define TDB_TRACE(ev, a, b) trace_record_event((ev), (int64_t)(a), (int64_t)(b))
+#else
+#define TDB_TRACE(ev, a, b) do { (void)sizeof(a); (void)sizeof(b); } while(false)
+#endif
+
+#endif
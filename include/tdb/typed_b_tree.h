@@ -0,0 +1,534 @@
+
+#ifndef __typed_b_tree_h
+#define __typed_b_tree_h
+
+#include "tdb/b_tree_node.h"
+#include "tdb/pager.h"
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// typed_b_tree<K, V, Compare, MinDegree> is a header only B-tree of fixed size keys and values of any
+// trivially copyable types, ordered by Compare (a strict weak ordering, std::less<K> by default). Where
+// b_tree_node works out where its arrays live from the min_degree in every page it maps, a typed_b_tree
+// node has its layout fixed at compile time: every field is a constant offset into the page, a node copy is
+// a memcpy of a constant size and the in node search runs a constant number of branch free steps (so the
+// compiler can unroll it). Each array is aligned for its own type, so uint32_t keys cost 4 bytes and 16
+// byte keys are not padded out to a multiple of 8.
+//
+// MinDegree 0 picks the largest min_degree whose nodes fit in a page.
+//
+// Writers work like b_tree writers: the arm down to the key is copied (splitting full nodes on the way
+// down) and published with a root CAS, readers are never blocked. Removes are lazy, the key is only marked
+// invalid and inserting it again makes it valid where it is.
+//
+// The file header records NODE_LAYOUT_TYPED along with the key size, value size and min_degree, a file is
+// only opened by a typed_b_tree with the same ones (b_tree and blob_b_tree refuse it). The int64_t b_tree
+// remains the tree with write ahead logging, partitions, snapshots and physical deletes.
+
+// A 16 byte UUID key, ordered by its bytes.
+struct uuid_key
+{
+    uint8_t bytes[16];
+};
+
+inline bool operator<(const uuid_key& a, const uuid_key& b) {return memcmp(a.bytes, b.bytes, sizeof(a.bytes)) < 0;}
+inline bool operator==(const uuid_key& a, const uuid_key& b) {return memcmp(a.bytes, b.bytes, sizeof(a.bytes)) == 0;}
+
+// Node layout of a typed_b_tree
+//   [0, 2)    num_keys
+//   [2, 4)    leaf
+//   [8, ...)  valid bitmap, one bit per key
+//   keys, values and child offsets, each array aligned for its type
+template<typename K, typename V>
+struct typed_node_layout
+{
+    struct offsets
+    {
+        size_t max_keys;
+        size_t valid_keys;
+        size_t keys;
+        size_t vals;
+        size_t child_ofs;
+        size_t size;
+    };
+
+    static constexpr size_t align(size_t n, size_t a) {return ((n + a - 1) / a) * a;}
+
+    static constexpr offsets of(uint16_t min_degree)
+    {
+        offsets o {};
+        o.max_keys = ((size_t)min_degree * 2) - 1;
+        o.valid_keys = sizeof(uint64_t);
+        o.keys = align(o.valid_keys + (((o.max_keys + 63) / 64) * sizeof(uint64_t)), alignof(K));
+        o.vals = align(o.keys + (sizeof(K) * o.max_keys), alignof(V));
+        o.child_ofs = align(o.vals + (sizeof(V) * o.max_keys), alignof(uint64_t));
+        o.size = o.child_ofs + (sizeof(uint64_t) * (o.max_keys + 1));
+        return o;
+    }
+
+    // The largest min_degree whose nodes fit in a page (0 if not even a min_degree of 2 does).
+    static constexpr uint16_t max_min_degree()
+    {
+        if(of(2).size > pager::block_size())
+            return 0;
+        uint16_t min_degree = 2;
+        while(of(min_degree + 1).size <= pager::block_size())
+            ++min_degree;
+        return min_degree;
+    }
+};
+
+template<typename K, typename V, typename Compare = std::less<K>, uint16_t MinDegree = 0>
+class typed_b_tree final
+{
+    static_assert(std::is_trivially_copyable<K>::value, "typed_b_tree keys must be trivially copyable.");
+    static_assert(std::is_trivially_copyable<V>::value, "typed_b_tree values must be trivially copyable.");
+    static_assert(MinDegree != 1, "typed_b_tree min_degree must be at least 2.");
+
+public:
+    typedef typed_node_layout<K, V> layout_type;
+
+    static constexpr uint16_t min_degree = (MinDegree != 0)?MinDegree:layout_type::max_min_degree();
+    static constexpr typename layout_type::offsets layout = layout_type::of(min_degree);
+    static constexpr uint16_t max_keys = (uint16_t)layout.max_keys;
+
+    static_assert(min_degree >= 2 && layout.size <= pager::block_size(), "typed_b_tree nodes must fit in a page.");
+
+    typed_b_tree(const std::string& file_name) :
+        _p(file_name),
+        _cmp()
+    {
+        auto hdr = _p.user_header();
+        if(*(uint16_t*)(hdr + MIN_DEGREE_OFS) != min_degree ||
+           *(uint16_t*)(hdr + LAYOUT_OFS) != NODE_LAYOUT_TYPED ||
+           *(uint32_t*)(hdr + KEY_SIZE_OFS) != sizeof(K) ||
+           *(uint32_t*)(hdr + VALUE_SIZE_OFS) != sizeof(V))
+            throw std::runtime_error("File is not a typed_b_tree of this key size, value size and min_degree.");
+    }
+    typed_b_tree(const typed_b_tree&) = delete;
+    typed_b_tree(typed_b_tree&&) = delete;
+    ~typed_b_tree() noexcept {}
+    typed_b_tree& operator=(const typed_b_tree&) = delete;
+    typed_b_tree& operator=(typed_b_tree&&) = delete;
+
+    // Throws if the key is already present.
+    void insert(const K& key, const V& value)
+    {
+        _write(WRITE_INSERT, key, value);
+    }
+
+    // Inserts the key, or replaces its value if it is already present.
+    void upsert(const K& key, const V& value)
+    {
+        _write(WRITE_UPSERT, key, value);
+    }
+
+    std::optional<V> search(const K& key) const
+    {
+        pager::epoch_guard guard(_p);
+        auto ofs = _p.root_ofs();
+        while(ofs != 0)
+        {
+            node n(_p, ofs);
+            auto i = _lower_bound(n, key);
+            if(i < n.num_keys() && !_cmp(key, n.keys()[i]))
+            {
+                if(!n.valid(i))
+                    return std::nullopt;
+                return n.vals()[i];
+            }
+            if(n.leaf())
+                break;
+            ofs = n.children()[i];
+        }
+        return std::nullopt;
+    }
+
+    void remove(const K& key)
+    {
+        _write(WRITE_REMOVE, key, V());
+    }
+
+    // Returns the live keys (and their values) in [lo, hi] in ascending order.
+    std::vector<std::pair<K, V>> range(const K& lo, const K& hi) const
+    {
+        std::vector<std::pair<K, V>> result;
+
+        pager::epoch_guard guard(_p);
+        auto root_ofs = _p.root_ofs();
+        if(root_ofs != 0)
+            _range(root_ofs, lo, hi, result);
+
+        return result;
+    }
+
+    static void create_db_file(const std::string& file_name)
+    {
+        pager::create(file_name);
+
+        pager p(file_name);
+        auto hdr = p.user_header();
+        *(uint16_t*)(hdr + MIN_DEGREE_OFS) = min_degree;
+        *(uint16_t*)(hdr + LAYOUT_OFS) = NODE_LAYOUT_TYPED;
+        *(uint32_t*)(hdr + KEY_SIZE_OFS) = sizeof(K);
+        *(uint32_t*)(hdr + VALUE_SIZE_OFS) = sizeof(V);
+    }
+
+private:
+    // typed_b_tree header layout (within the pagers user header), min_degree and layout sit where b_tree
+    // keeps them.
+    static constexpr size_t MIN_DEGREE_OFS = 0;
+    static constexpr size_t LAYOUT_OFS = 2;
+    static constexpr size_t KEY_SIZE_OFS = 4;
+    static constexpr size_t VALUE_SIZE_OFS = 8;
+
+    // Each step at least halves the part of the keys still in play, so this many steps narrow any node
+    // down to a single key.
+    static constexpr unsigned _search_steps()
+    {
+        unsigned steps = 0;
+        while(((size_t)1 << steps) < layout.max_keys)
+            ++steps;
+        return steps;
+    }
+
+    enum write_mode
+    {
+        WRITE_INSERT,
+        WRITE_UPSERT,
+        WRITE_REMOVE
+    };
+
+    // A view over a node page that pins it for as long as it exists.
+    class node final
+    {
+    public:
+        node(const pager& p, uint64_t ofs) :
+            _p(p),
+            _ofs(ofs),
+            _page(p.pin_page(ofs)),
+            _dirty(false)
+        {
+        }
+        node(const node&) = delete;
+        node(node&&) = delete;
+        ~node() noexcept
+        {
+            try
+            {
+                _p.unpin_page(_ofs, _dirty);
+            }
+            catch(...)
+            {
+            }
+        }
+        node& operator=(const node&) = delete;
+        node& operator=(node&&) = delete;
+
+        uint16_t num_keys() const {return *(const uint16_t*)_page;}
+        bool leaf() const {return *(const uint16_t*)(_page + 2) != 0;}
+        bool full() const {return num_keys() == max_keys;}
+        bool valid(uint16_t i) const {return ((_bitmap()[i >> 6] >> (i & 63)) & 1) != 0;}
+
+        const K* keys() const {return (const K*)(_page + layout.keys);}
+        const V* vals() const {return (const V*)(_page + layout.vals);}
+        const uint64_t* children() const {return (const uint64_t*)(_page + layout.child_ofs);}
+
+        // Everything below writes to a page the caller owns.
+
+        void format(bool leaf)
+        {
+            _dirty = true;
+            memset(_page, 0, layout.size);
+            *(uint16_t*)(_page + 2) = (leaf)?1:0;
+        }
+        void copy_from(const node& src)
+        {
+            _dirty = true;
+            memcpy(_page, src._page, layout.size);
+        }
+        void set_num_keys(uint16_t n) {_dirty = true; *(uint16_t*)_page = n;}
+        void set_valid(uint16_t i, bool v)
+        {
+            _dirty = true;
+            auto& word = _bitmap()[i >> 6];
+            word = (v)?(word | (1ULL << (i & 63))):(word & ~(1ULL << (i & 63)));
+        }
+        void set_key(uint16_t i, const K& k) {_dirty = true; _keys()[i] = k;}
+        void set_val(uint16_t i, const V& v) {_dirty = true; _vals()[i] = v;}
+        void set_child(uint16_t i, uint64_t ofs) {_dirty = true; _children()[i] = ofs;}
+
+        // Opens a gap at key i (and child i + 1 when internal).
+        void shift_right(uint16_t i)
+        {
+            _dirty = true;
+            auto n = num_keys();
+            memmove(_keys() + i + 1, _keys() + i, sizeof(K) * (n - i));
+            memmove(_vals() + i + 1, _vals() + i, sizeof(V) * (n - i));
+            if(!leaf())
+                memmove(_children() + i + 2, _children() + i + 1, sizeof(uint64_t) * (n - i));
+            for(uint16_t j = n; j > i; --j)
+                set_valid(j, valid(j - 1));
+            set_num_keys(n + 1);
+        }
+
+        // Copies keys [first, first + count) of src (and the children around them when internal) to the
+        // front of this node. The key count is left to the caller.
+        void copy_keys_from(const node& src, uint16_t first, uint16_t count)
+        {
+            _dirty = true;
+            memcpy(_keys(), src.keys() + first, sizeof(K) * count);
+            memcpy(_vals(), src.vals() + first, sizeof(V) * count);
+            if(!leaf())
+                memcpy(_children(), src.children() + first, sizeof(uint64_t) * (count + 1));
+            for(uint16_t j = 0; j < count; ++j)
+                set_valid(j, src.valid(first + j));
+        }
+
+        uint64_t ofs() const {return _ofs;}
+
+    private:
+        const uint64_t* _bitmap() const {return (const uint64_t*)(_page + layout.valid_keys);}
+        uint64_t* _bitmap() {return (uint64_t*)(_page + layout.valid_keys);}
+        // Only the writers above use these, and they mark the page dirty.
+        K* _keys() {return (K*)(_page + layout.keys);}
+        V* _vals() {return (V*)(_page + layout.vals);}
+        uint64_t* _children() {return (uint64_t*)(_page + layout.child_ofs);}
+
+        const pager& _p;
+        uint64_t _ofs;
+        uint8_t* _page;
+        bool _dirty;
+    };
+
+    // Returns the index of the first key in n that is not less than k.
+    uint16_t _lower_bound(const node& n, const K& k) const
+    {
+        auto count = n.num_keys();
+        if(count == 0)
+            return 0;
+
+        // Once the range is down to one key the step leaves it alone, so running the fixed number of steps
+        // for a node that is not full is harmless.
+        auto keys = n.keys();
+        const K* base = keys;
+        uint16_t len = count;
+        for(unsigned step = 0; step < _search_steps(); ++step)
+        {
+            uint16_t half = len / 2;
+            base = (_cmp(base[half], k))?base + half:base;
+            len -= half;
+        }
+        return (uint16_t)((base - keys) + ((_cmp(*base, k))?1:0));
+    }
+
+    void _write(write_mode mode, const K& key, const V& value)
+    {
+        std::vector<uint64_t> retired;
+        std::vector<uint64_t> allocated;
+        bool changed = false;
+
+        {
+            pager::epoch_guard guard(_p);
+
+            while(true)
+            {
+                retired.clear();
+                auto old_root_ofs = _p.root_ofs();
+                uint64_t new_root_ofs = 0;
+
+                try
+                {
+                    changed = _write_attempt(mode, key, value, old_root_ofs, new_root_ofs, retired, allocated);
+                }
+                catch(...)
+                {
+                    // Nothing we allocated was ever published.
+                    for(auto ofs : allocated)
+                        _p.free_page(ofs);
+                    throw;
+                }
+
+                if(changed && _p.set_root_ofs(old_root_ofs, new_root_ofs))
+                    break;
+
+                for(auto ofs : allocated)
+                    _p.free_page(ofs);
+                allocated.clear();
+
+                if(!changed)
+                    break;
+            }
+        }
+
+        if(changed)
+            _p.retire_pages(retired);
+    }
+
+    // Builds a private copy of the arm down to key with the write applied. Returns false if the write
+    // changes nothing.
+    bool _write_attempt(write_mode mode, const K& key, const V& value, uint64_t root_ofs, uint64_t& new_root_ofs, std::vector<uint64_t>& retired, std::vector<uint64_t>& allocated)
+    {
+        auto new_page = [&](){
+            auto ofs = _p.append_page();
+            allocated.push_back(ofs);
+            return ofs;
+        };
+        auto copy = [&](uint64_t ofs){
+            auto copy_ofs = new_page();
+            node src(_p, ofs);
+            node dst(_p, copy_ofs);
+            dst.copy_from(src);
+            retired.push_back(ofs);
+            return copy_ofs;
+        };
+
+        if(root_ofs == 0)
+        {
+            if(mode == WRITE_REMOVE)
+                return false;
+            new_root_ofs = new_page();
+            node root(_p, new_root_ofs);
+            root.format(true);
+            root.shift_right(0);
+            root.set_key(0, key);
+            root.set_val(0, value);
+            root.set_valid(0, true);
+            return true;
+        }
+
+        // Full nodes are split on the way down so there is always room for the key that comes up from
+        // below. A remove never adds a key and splits nothing.
+        bool split = mode != WRITE_REMOVE;
+
+        new_root_ofs = copy(root_ofs);
+        if(split)
+        {
+            node root(_p, new_root_ofs);
+            if(root.full())
+            {
+                auto top_ofs = new_page();
+                node top(_p, top_ofs);
+                top.format(false);
+                top.set_child(0, new_root_ofs);
+                _split_child(top, 0, new_page());
+                new_root_ofs = top_ofs;
+            }
+        }
+
+        auto ofs = new_root_ofs;
+        while(true)
+        {
+            node n(_p, ofs);
+            auto i = _lower_bound(n, key);
+
+            if(i < n.num_keys() && !_cmp(key, n.keys()[i]))
+            {
+                bool valid = n.valid(i);
+                if(mode == WRITE_INSERT && valid)
+                    throw std::runtime_error("Duplicate key");
+                if(mode == WRITE_REMOVE)
+                {
+                    if(!valid)
+                        return false;
+                    n.set_valid(i, false);
+                    return true;
+                }
+                n.set_val(i, value);
+                n.set_valid(i, true);
+                return true;
+            }
+
+            if(n.leaf())
+            {
+                if(mode == WRITE_REMOVE)
+                    return false;
+                n.shift_right(i);
+                n.set_key(i, key);
+                n.set_val(i, value);
+                n.set_valid(i, true);
+                return true;
+            }
+
+            n.set_child(i, copy(n.children()[i]));
+
+            if(split)
+            {
+                bool full;
+                {
+                    node child(_p, n.children()[i]);
+                    full = child.full();
+                }
+                if(full)
+                {
+                    // Both halves are private copies now, the descent goes straight into either.
+                    _split_child(n, i, new_page());
+                    if(_cmp(n.keys()[i], key))
+                        ++i;
+                    else if(!_cmp(key, n.keys()[i]))
+                        continue;   // the middle key that moved up is the key itself
+                }
+            }
+
+            ofs = n.children()[i];
+        }
+    }
+
+    // Splits the full child i of parent (both private copies) around its middle key, the upper half goes to
+    // the page at new_ofs.
+    void _split_child(node& parent, uint16_t i, uint64_t new_ofs)
+    {
+        const uint16_t t = min_degree;
+
+        node child(_p, parent.children()[i]);
+        node sibling(_p, new_ofs);
+        sibling.format(child.leaf());
+
+        sibling.copy_keys_from(child, t, t - 1);
+        sibling.set_num_keys(t - 1);
+
+        parent.shift_right(i);
+        parent.set_key(i, child.keys()[t - 1]);
+        parent.set_val(i, child.vals()[t - 1]);
+        parent.set_valid(i, child.valid(t - 1));
+        parent.set_child(i + 1, new_ofs);
+
+        // Clear the bits that moved out so a later shift into them starts clean.
+        for(uint16_t j = t - 1; j < max_keys; ++j)
+            child.set_valid(j, false);
+        child.set_num_keys(t - 1);
+    }
+
+    // Returns false once a key past hi has been seen.
+    bool _range(uint64_t ofs, const K& lo, const K& hi, std::vector<std::pair<K, V>>& out) const
+    {
+        node n(_p, ofs);
+        auto i = _lower_bound(n, lo);
+        bool found = i < n.num_keys() && !_cmp(lo, n.keys()[i]);
+        for(uint16_t j = i; j <= n.num_keys(); ++j)
+        {
+            // Everything left of key i is below lo when key i is lo itself.
+            if(!n.leaf() && !(found && j == i) && !_range(n.children()[j], lo, hi, out))
+                return false;
+            if(j == n.num_keys())
+                break;
+            if(_cmp(hi, n.keys()[j]))
+                return false;
+            if(n.valid(j))
+                out.push_back(std::make_pair(n.keys()[j], n.vals()[j]));
+        }
+        return true;
+    }
+
+    pager _p;
+    Compare _cmp;
+};
+
+#endif
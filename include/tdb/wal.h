@@ -0,0 +1,90 @@
+
+#ifndef __wal_h
+#define __wal_h
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+// wal is an append only log of fixed size, checksummed records. append() assigns the next log sequence
+// number and buffers the record, commit() blocks until the record is durable. Commits are grouped: the
+// first committer to find no flush in progress becomes the leader and writes every buffered record with a
+// single write() + fdatasync(), committers that arrive while it is flushing wait and are usually covered
+// by the leaders flush (or become the leader of the next one).
+//
+// read() returns the longest valid prefix of a log, a torn or partially written tail is ignored. Records
+// appended together with append_batch() are returned all together or not at all.
+
+enum wal_op : uint32_t
+{
+    WAL_INSERT = 1,
+    WAL_REMOVE = 2,
+    WAL_UPSERT = 3
+};
+
+// Set in the op of every record of a batch except the last.
+static const uint32_t WAL_MORE = 0x80000000;
+
+struct wal_record
+{
+    uint64_t lsn;
+    int64_t key;
+    int64_t value;
+    uint32_t op;
+    uint32_t check;
+};
+
+struct wal_stats
+{
+    uint64_t records;
+    uint64_t syncs;
+};
+
+class wal final
+{
+public:
+    wal(const std::string& file_name, uint64_t next_lsn);
+    wal(const wal&) = delete;
+    wal(wal&&) = delete;
+    ~wal() noexcept;
+    wal& operator=(const wal&) = delete;
+    wal& operator=(wal&&) = delete;
+
+    uint64_t append(wal_op op, int64_t key, int64_t value);
+    // Appends the pairs as consecutive records and returns the lsn of the last one.
+    uint64_t append_batch(wal_op op, const std::vector<std::pair<int64_t, int64_t>>& kvs);
+    void commit(uint64_t lsn);
+
+    // The lsn of the most recently appended record (0 if nothing has been appended).
+    uint64_t last_lsn() const;
+
+    // Discards the whole log. Everything up to through_lsn must already be durable elsewhere (i.e. it is
+    // covered by a checkpoint), pending commits up to through_lsn are released.
+    void truncate(uint64_t through_lsn);
+
+    wal_stats stats() const;
+
+    static std::vector<wal_record> read(const std::string& file_name);
+
+private:
+    static uint32_t _check(const wal_record& r);
+
+    std::string _fileName;
+    int _fd;
+    mutable std::mutex _lock;
+    std::condition_variable _cond;
+    std::vector<wal_record> _pending;
+    uint64_t _nextLsn;
+    uint64_t _durableLsn;
+    bool _flushing;
+    bool _failed;
+
+    std::atomic<uint64_t> _records;
+    std::atomic<uint64_t> _syncs;
+};
+
+#endif
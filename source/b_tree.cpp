@@ -1,85 +1,715 @@
 #include "tdb/b_tree.h"
+#include "tdb/trace.h"
+#include "tdb/key_search.h"
 #include <iostream>
 #include <fstream>
 #include <queue>
+#include <cstdio>
+#include <algorithm>
+#include <exception>
+#include <unistd.h>
 
 using namespace std;
 
-b_tree::b_tree(const string& file_name, uint16_t min_degree) :
+// b_tree header layout (within the pagers user header)
+//   [0, 2)    min_degree
+//   [2, 4)    node layout
+//   [4, 8)    wal state
+//   [8, 16)   checkpointed root ofs
+//   [16, 24)  checkpointed lsn
+//   [24, 32)  live keys
+//   [32, 40)  tombstones (lazily removed keys)
+//   [40, 44)  key counts valid
+//   [44, 46)  partitions (0 in files written before partitions existed, which have 1)
+//   [48, 56)  bloom filter ofs (0 for none)
+//   [56, 64)  bloom filter blocks
+//   [64, 312) checkpointed root ofs of partitions 1 and up
+static const size_t MIN_DEGREE_OFS = 0;
+static const size_t LAYOUT_OFS = 2;
+static const size_t WAL_STATE_OFS = 4;
+static const size_t CHECKPOINT_ROOT_OFS = 8;
+static const size_t CHECKPOINT_LSN_OFS = 16;
+static const size_t LIVE_KEYS_OFS = 24;
+static const size_t TOMBSTONES_OFS = 32;
+static const size_t KEY_COUNTS_VALID_OFS = 40;
+static const size_t PARTITIONS_OFS = 44;
+static const size_t FILTER_OFS = 48;
+static const size_t FILTER_BLOCKS_OFS = 56;
+static const size_t CHECKPOINT_ROOTS_OFS = 64;
+
+// WAL_STATE_NONE means the file has never been opened with a log, WAL_STATE_OPEN means a session with a log
+// is running (or died) and the log has to be replayed over the checkpoint on the next open.
+static const uint32_t WAL_STATE_NONE = 0;
+static const uint32_t WAL_STATE_CLEAN = 1;
+static const uint32_t WAL_STATE_OPEN = 2;
+
+static const size_t KEY_LOCK_STRIPES = 64;
+static const uint64_t CHECKPOINT_INTERVAL = 64 * 1024;
+// Pairs a bulk_load of a partitioned tree applies per _insert_batch().
+static const size_t BULK_CHUNK = 64 * 1024;
+
+static uint64_t* _checkpoint_root(uint8_t* hdr, size_t part)
+{
+    if(part == 0)
+        return (uint64_t*)(hdr + CHECKPOINT_ROOT_OFS);
+    return (uint64_t*)(hdr + CHECKPOINT_ROOTS_OFS + ((part - 1) * sizeof(uint64_t)));
+}
+
+b_tree::b_tree(const string& file_name, durability d) :
     _p(file_name),
-    _min_degree(min_degree)
-{
-}
-
-void b_tree::insert(int64_t key, int64_t value) {
-    bool inserted = false;
-    int attempt = 0;
-    while (!inserted) {
-        int64_t old_root_ofs = _p.root_ofs();
-        if (old_root_ofs == 0) {
-            // If the tree is empty, create a new root node and insert the key-value pair
-            b_tree_node root(_p, _min_degree, true);
-            root._set_num_keys(1);
-            root._set_key(0, key);
-            root._set_valid_key(0, true);
-            root._set_val(0, value);
-            if(_p.set_root_ofs(0, root._ofs()))
-                inserted = true;
-            else { printf("Failed to set root ofs 1 %d\n",attempt); ++attempt; }
-        } else {
-            // Copy the arm of the tree from the root to the leaf node
-            printf("Copied arm ofs: ");
-            b_tree_node copied_root = _copy_arm(key, old_root_ofs);
-            printf("\n");
-
-            // Traverse down the copied arm and insert the key-value pair
-            if (copied_root._num_keys() == 2 * _min_degree - 1) {
-                printf("Root is full\n");
-                // If the root node is full, split it preemptively
-                b_tree_node new_root(_p, _min_degree, false);
-                new_root._set_child_ofs(0, copied_root._ofs());
-                new_root._split_child(0, copied_root._ofs());
-                printf("insert ofs s: ");
-                _insert_atomic_recursive(key, value, new_root._ofs());
-                printf("\n");
-
-                if(_p.set_root_ofs(old_root_ofs, new_root._ofs()))
-                    inserted = true;
-                else { printf("Failed to set root ofs 2 %d\n",attempt); ++attempt; }
+    _min_degree(_read_min_degree(_p)),
+    _layout(_read_layout(_p)),
+    _offsets(&node_offsets::of(_min_degree, _layout)),
+    _partitions(_read_partitions(_p)),
+    _filter(_read_filter(_p)),
+    _wal(),
+    _checkpointLock(),
+    _keyLocks(),
+    _checkpointLsn(0),
+    _checkpointGuard(),
+    _tombstoneRatio(default_tombstone_ratio),
+    _writes(0),
+    _retries(0),
+    _maxRetries(0),
+    _reusedNodes(0),
+    _recycledPages(0),
+    _snapshots(0)
+{
+    if(d == DURABILITY_WAL)
+        _open_wal(file_name);
+    if(*(uint32_t*)(_p.user_header() + KEY_COUNTS_VALID_OFS) == 0)
+        _recount_keys();
+}
+
+b_tree::b_tree(const string& file_name, size_t pool_frames, eviction ev, durability d) :
+    _p(file_name, pool_frames, ev),
+    _min_degree(_read_min_degree(_p)),
+    _layout(_read_layout(_p)),
+    _offsets(&node_offsets::of(_min_degree, _layout)),
+    _partitions(_read_partitions(_p)),
+    _filter(_read_filter(_p)),
+    _wal(),
+    _checkpointLock(),
+    _keyLocks(),
+    _checkpointLsn(0),
+    _checkpointGuard(),
+    _tombstoneRatio(default_tombstone_ratio),
+    _writes(0),
+    _retries(0),
+    _maxRetries(0),
+    _reusedNodes(0),
+    _recycledPages(0),
+    _snapshots(0)
+{
+    if(d == DURABILITY_WAL)
+        _open_wal(file_name);
+    if(*(uint32_t*)(_p.user_header() + KEY_COUNTS_VALID_OFS) == 0)
+        _recount_keys();
+}
+
+b_tree::~b_tree() noexcept
+{
+    if(_wal)
+    {
+        try
+        {
+            unique_lock<shared_mutex> g(_checkpointLock);
+            _checkpoint();
+            *(uint32_t*)(_p.user_header() + WAL_STATE_OFS) = WAL_STATE_CLEAN;
+            _p.sync();
+        }
+        catch(...)
+        {
+        }
+    }
+}
+
+void b_tree::insert(int64_t key, int64_t value)
+{
+    if(!_wal)
+    {
+        _insert(key, value);
+        return;
+    }
+
+    uint64_t lsn;
+    {
+        shared_lock<shared_mutex> cg(_checkpointLock);
+        lock_guard<mutex> kg(_key_lock(key));
+        _insert(key, value);
+        lsn = _wal->append(WAL_INSERT, key, value);
+    }
+    _wal->commit(lsn);
+    _maybe_checkpoint(lsn);
+}
+
+void b_tree::upsert(int64_t key, int64_t value)
+{
+    if(!_wal)
+    {
+        _write(WRITE_UPSERT, key, value, 0);
+        return;
+    }
+
+    uint64_t lsn;
+    {
+        shared_lock<shared_mutex> cg(_checkpointLock);
+        lock_guard<mutex> kg(_key_lock(key));
+        _write(WRITE_UPSERT, key, value, 0);
+        lsn = _wal->append(WAL_UPSERT, key, value);
+    }
+    _wal->commit(lsn);
+    _maybe_checkpoint(lsn);
+}
+
+bool b_tree::compare_and_set(int64_t key, int64_t expected, int64_t desired)
+{
+    if(!_wal)
+        return _write(WRITE_CAS, key, desired, expected);
+
+    uint64_t lsn;
+    {
+        shared_lock<shared_mutex> cg(_checkpointLock);
+        lock_guard<mutex> kg(_key_lock(key));
+        if(!_write(WRITE_CAS, key, desired, expected))
+            return false;
+        // Replaying the outcome is enough, the comparison already happened.
+        lsn = _wal->append(WAL_UPSERT, key, desired);
+    }
+    _wal->commit(lsn);
+    _maybe_checkpoint(lsn);
+    return true;
+}
+
+void b_tree::_insert(int64_t key, int64_t value)
+{
+    _write(WRITE_INSERT, key, value, 0);
+}
+
+bool b_tree::_write(write_mode mode, int64_t key, int64_t value, int64_t expected)
+{
+    auto part = _partition(key);
+    write_attempt a;
+
+    // The key is in the filter before any version holding it can be published. A lost or failed attempt
+    // leaves it there, which only costs a false positive.
+    if(_filter && mode != WRITE_CAS)
+        _filter->add(key);
+    bool written = false;
+    bool replaced = false;
+    bool revived = false;
+    uint64_t attempt = 0;
+
+    auto release = [&](){
+        // Nothing we allocated was ever published.
+        for(auto& n : a.path)
+        {
+            for(auto ofs : n.pages)
+                _p.free_page(ofs);
+        }
+        for(auto ofs : a.above)
+            _p.free_page(ofs);
+        for(auto ofs : a.spare)
+            _p.free_page(ofs);
+    };
+
+    {
+        // Held across every attempt, a retry compares page offsets with the ones an earlier attempt saw so
+        // none of them may be reused in between.
+        pager::epoch_guard guard(_p);
+
+        try {
+            while (!written) {
+                int64_t old_root_ofs = _p.root_ofs(part);
+
+                // A comparison that fails should not cost an arm copy.
+                if (mode == WRITE_CAS) {
+                    auto current = _search(old_root_ofs, key);
+                    if (!current || *current != expected) {
+                        release();
+                        _count_write(attempt);
+                        return false;
+                    }
+                }
+
+                // After a lost CAS keep what the last attempt built below the shallowest node of its path
+                // that the competing writer left alone, only the path above it has to be copied again.
+                auto salvage = (attempt > 0)?_salvage_point(key, old_root_ofs, a):a.path.size();
+                for (size_t l = 0; l < salvage && l < a.path.size(); ++l)
+                    a.spare.insert(end(a.spare), begin(a.path[l].pages), end(a.path[l].pages));
+                a.spare.insert(end(a.spare), begin(a.above), end(a.above));
+                a.above.clear();
+                a.path.erase(begin(a.path), begin(a.path) + std::min(salvage, a.path.size()));
+
+                int64_t new_root_ofs;
+                if (!a.path.empty()) {
+                    // The salvaged nodes already hold the write (replaced and revived still describe it).
+                    for (auto& n : a.path)
+                        _reusedNodes.fetch_add(n.pages.size(), memory_order_relaxed);
+                    new_root_ofs = _copy_path(key, old_root_ofs, a, 0)._ofs();
+                } else if (old_root_ofs == 0) {
+                    replaced = false;
+                    revived = false;
+                    // If the tree is empty, create a new root node and insert the key-value pair
+                    b_tree_node root(_p, _layout, _min_degree, true, _spare_page(a));
+                    a.above.push_back(root._ofs());
+                    root._set_num_keys(1);
+                    root._set_key(0, key);
+                    root._set_valid_key(0, true);
+                    root._set_val(0, value);
+                    new_root_ofs = root._ofs();
+                } else {
+                    // Copy the arm of the tree from the root down to the key (or the leaf it belongs in)
+                    b_tree_node copied_root = _copy_path(key, old_root_ofs, a, 0);
+                    new_root_ofs = copied_root._ofs();
+                    revived = false;
+
+                    // An update only rewrites the slot of the key in the copied arm.
+                    replaced = (mode != WRITE_INSERT) && copied_root._update(key, value);
+
+                    if (!replaced && copied_root._num_keys() == 2 * _min_degree - 1) {
+                        // If the root node is full, split it preemptively
+                        b_tree_node new_root(_p, _layout, _min_degree, false, _spare_page(a));
+                        a.above.push_back(new_root._ofs());
+                        TDB_TRACE(TRACE_ROOT_SPLIT, new_root._ofs(), copied_root._ofs());
+                        new_root._set_child_ofs(0, copied_root._ofs());
+                        new_root._split_child(0, copied_root._ofs(), _spare_page(a));
+                        a.above.push_back(new_root._child_ofs(1));
+                        a.path[0].clean = false;
+                        revived = _insert_atomic_recursive(key, value, new_root._ofs(), a, -1);
+                        new_root_ofs = new_root._ofs();
+                    } else if (!replaced)
+                        revived = _insert_atomic_recursive(key, value, copied_root._ofs(), a, 0);
+                }
+
+                if(_p.set_root_ofs(old_root_ofs, new_root_ofs, part))
+                    written = true;
+                else
+                {
+                    ++attempt;
+                    TDB_TRACE(TRACE_ROOT_CAS_RETRY, attempt, old_root_ofs);
+                }
             }
-            else
+        } catch(...) {
+            release();
+            throw;
+        }
+    }
+
+    vector<uint64_t> retired;
+    for (auto& n : a.path) {
+        if (n.orig != 0)
+            retired.push_back(n.orig);
+    }
+    _p.retire_pages(retired);
+    for (auto ofs : a.spare)
+        _p.free_page(ofs);
+
+    _count_write(attempt);
+
+    if (revived)
+        _count_keys(1, -1);
+    else if (!replaced)
+        _count_keys(1, 0);
+
+    return true;
+}
+
+size_t b_tree::_salvage_point(int64_t key, uint64_t root_ofs, const write_attempt& a) const
+{
+    // Follow the key down the new version until we reach a node the last attempt replaced as a whole. The
+    // node is unchanged (pages are never modified once published) so the replacement is still good.
+    auto ofs = root_ofs;
+    while (ofs != 0) {
+        for (size_t l = 1; l < a.path.size(); ++l) {
+            if (a.path[l].clean && a.path[l].orig == ofs)
+                return l;
+        }
+
+        auto page = _p.pin_page(ofs);
+        auto node = _node_view(page);
+        int i = key_lower_bound(node.keys(), node.num_keys(), key);
+        auto next = (node.leaf() || (i < node.num_keys() && node.keys()[i] == key))?0:node.child_ofs()[i];
+        _p.unpin_page(ofs, false);
+        ofs = next;
+    }
+
+    return a.path.size();
+}
+
+int64_t b_tree::_spare_page(write_attempt& a)
+{
+    if (a.spare.empty())
+        return 0;
+
+    auto ofs = a.spare.back();
+    a.spare.pop_back();
+    _recycledPages.fetch_add(1, memory_order_relaxed);
+    return ofs;
+}
+
+void b_tree::_count_write(uint64_t retries)
+{
+    _writes.fetch_add(1, memory_order_relaxed);
+    if (retries == 0)
+        return;
+
+    _retries.fetch_add(retries, memory_order_relaxed);
+    auto most = _maxRetries.load(memory_order_relaxed);
+    while (retries > most && !_maxRetries.compare_exchange_weak(most, retries, memory_order_relaxed)) {
+    }
+}
+
+b_tree_stats b_tree::stats() const
+{
+    b_tree_stats s;
+    s.writes = _writes.load(memory_order_relaxed);
+    s.retries = _retries.load(memory_order_relaxed);
+    s.max_retries = _maxRetries.load(memory_order_relaxed);
+    s.reused_nodes = _reusedNodes.load(memory_order_relaxed);
+    s.recycled_pages = _recycledPages.load(memory_order_relaxed);
+    return s;
+}
+
+void b_tree::insert_batch(vector<pair<int64_t, int64_t>> batch)
+{
+    if(batch.empty())
+        return;
+
+    // Sorted keys walk the tree left to right, so consecutive keys mostly land in nodes this version
+    // already owns.
+    sort(begin(batch), end(batch), [](const pair<int64_t, int64_t>& a, const pair<int64_t, int64_t>& b){
+        return a.first < b.first;
+    });
+
+    if(!_wal)
+    {
+        _insert_batch(batch);
+        return;
+    }
+
+    // Stripes are always taken in index order so two batches can not deadlock.
+    vector<size_t> stripes;
+    for(auto& kv : batch)
+        stripes.push_back(&_key_lock(kv.first) - &_keyLocks[0]);
+    sort(begin(stripes), end(stripes));
+    stripes.erase(unique(begin(stripes), end(stripes)), end(stripes));
+
+    uint64_t lsn;
+    {
+        shared_lock<shared_mutex> cg(_checkpointLock);
+        for(auto s : stripes)
+            _keyLocks[s].lock();
+        try
+        {
+            _insert_batch(batch);
+            lsn = _wal->append_batch(WAL_INSERT, batch);
+        }
+        catch(...)
+        {
+            for(auto s : stripes)
+                _keyLocks[s].unlock();
+            throw;
+        }
+        for(auto s : stripes)
+            _keyLocks[s].unlock();
+    }
+    _wal->commit(lsn);
+    _maybe_checkpoint(lsn);
+}
+
+void b_tree::_insert_batch(const vector<pair<int64_t, int64_t>>& batch)
+{
+    // Every partition the batch touches gets its own private version (the keys stay sorted within each).
+    // All of them are built before the first is published so a key that is already present fails the
+    // whole batch.
+    struct part_version
+    {
+        size_t part;
+        vector<pair<int64_t, int64_t>> kvs;
+        cow_version v;
+        uint64_t old_root_ofs;
+        uint64_t root_ofs;
+        int64_t revived;
+        bool published;
+    };
+
+    vector<part_version> parts;
+    {
+        vector<size_t> index(_partitions, _partitions);
+        for(auto& kv : batch)
+        {
+            if(_filter)
+                _filter->add(kv.first);
+
+            auto part = _partition(kv.first);
+            if(index[part] == _partitions)
+            {
+                index[part] = parts.size();
+                parts.push_back({part, {}, {}, 0, 0, 0, false});
+            }
+            parts[index[part]].kvs.push_back(kv);
+        }
+    }
+
+    auto build = [this](part_version& pv){
+        pv.v.owned.clear();
+        pv.v.retired.clear();
+        pv.v.allocated.clear();
+        pv.old_root_ofs = _p.root_ofs(pv.part);
+        pv.root_ofs = pv.old_root_ofs;
+        pv.revived = 0;
+        for(auto& kv : pv.kvs)
+        {
+            bool r;
+            pv.root_ofs = _insert_private(kv.first, kv.second, pv.root_ofs, pv.v, r);
+            pv.revived += (r)?1:0;
+        }
+    };
+
+    uint64_t attempt = 0;
+    exception_ptr error;
+    {
+        pager::epoch_guard guard(_p);
+        try
+        {
+            for(auto& pv : parts)
+                build(pv);
+
+            // A partition that moved while the others were built is rebuilt before anything is published,
+            // so a key a concurrent writer added meanwhile still fails the whole batch.
+            bool moved = true;
+            while(moved)
+            {
+                moved = false;
+                for(auto& pv : parts)
+                {
+                    if(_p.root_ofs(pv.part) != pv.old_root_ofs)
+                    {
+                        for(auto ofs : pv.v.allocated)
+                            _p.free_page(ofs);
+                        pv.v.allocated.clear();
+                        build(pv);
+                        moved = true;
+                    }
+                }
+            }
+
+            for(auto& pv : parts)
+            {
+                while(!_p.set_root_ofs(pv.old_root_ofs, pv.root_ofs, pv.part))
+                {
+                    ++attempt;
+                    TDB_TRACE(TRACE_ROOT_CAS_RETRY, attempt, pv.old_root_ofs);
+                    for(auto ofs : pv.v.allocated)
+                        _p.free_page(ofs);
+                    pv.v.allocated.clear();
+                    build(pv);
+                }
+                pv.published = true;
+            }
+        }
+        catch(...)
+        {
+            // Partitions published before the failure stay published, they are accounted for below.
+            for(auto& pv : parts)
             {
-                printf("insert ofs: ");
-                _insert_atomic_recursive(key, value, copied_root._ofs());
-                printf("\n");
-                if(_p.set_root_ofs(old_root_ofs, copied_root._ofs()))
-                    inserted = true;
-                else { printf("Failed to set root ofs 3 %d\n",attempt); ++attempt; }
+                if(!pv.published)
+                {
+                    for(auto ofs : pv.v.allocated)
+                        _p.free_page(ofs);
+                }
             }
+            error = current_exception();
         }
     }
+
+    int64_t inserted = 0, revived = 0;
+    for(auto& pv : parts)
+    {
+        if(!pv.published)
+            continue;
+        _p.retire_pages(pv.v.retired);
+        inserted += (int64_t)pv.kvs.size();
+        revived += pv.revived;
+    }
+
+    if(inserted > 0)
+    {
+        _count_write(attempt);
+        _count_keys(inserted, -revived);
+    }
+
+    if(error)
+        rethrow_exception(error);
 }
 
 optional<int64_t> b_tree::search(int64_t k)
 {
-    auto root_ofs = _p.root_ofs();
-    std::optional<int64_t> result;
-    if (root_ofs != 0)
+    if(!may_contain(k))
+        return nullopt;
+
+    pager::epoch_guard guard(_p);
+    return _search(_p.root_ofs(_partition(k)), k);
+}
+
+void b_tree::remove(int64_t k)
+{
+    if(!_wal)
     {
-        b_tree_node root(_p, root_ofs);
-        result = root._search(k);
+        _remove(k);
+        return;
     }
-    return result;
+
+    uint64_t lsn;
+    {
+        shared_lock<shared_mutex> cg(_checkpointLock);
+        lock_guard<mutex> kg(_key_lock(k));
+        _remove(k);
+        lsn = _wal->append(WAL_REMOVE, k, 0);
+    }
+    _wal->commit(lsn);
+    _maybe_checkpoint(lsn);
 }
 
-void b_tree::remove(int64_t k)
+void b_tree::_remove(int64_t k)
+{
+    // Removes are published exactly like inserts, the arm down to the key is copied, the key is marked
+    // invalid in the copy and the copy is swapped in with a root CAS. Clearing the flag in place would race
+    // with an insert that copied the node before the flag was cleared.
+    //
+    // A physical remove is the same except that the nodes it touches (the arm and any siblings it borrows
+    // from or merges with) are copied into a private version first.
+    auto live = (double)live_keys();
+    auto dead = (double)tombstones();
+    bool physical = dead + 1 > _tombstoneRatio.load(memory_order_relaxed) * (live + dead);
+
+    auto part = _partition(k);
+    bool removed = false;
+    uint64_t attempt = 0;
+    uint64_t swept = 0;
+    cow_version v;
+    while (!removed) {
+        v.owned.clear();
+        v.retired.clear();
+        v.allocated.clear();
+        v.discarded.clear();
+        swept = 0;
+        try {
+            pager::epoch_guard guard(_p);
+            int64_t old_root_ofs = _p.root_ofs(part);
+            if (old_root_ofs == 0)
+                return;
+
+            // Removing a key that is not there should not cost an arm copy.
+            if (!_search(old_root_ofs, k))
+                return;
+
+            uint64_t new_root_ofs;
+            if (physical)
+                new_root_ofs = _erase_private(k, old_root_ofs, v, swept);
+            else
+            {
+                b_tree_node copied_root = _copy_arm(k, old_root_ofs, v.retired, v.allocated);
+                copied_root._remove(k);
+                new_root_ofs = copied_root._ofs();
+            }
+
+            if(_p.set_root_ofs(old_root_ofs, new_root_ofs, part))
+                removed = true;
+            else
+            {
+                ++attempt;
+                TDB_TRACE(TRACE_ROOT_CAS_RETRY, attempt, old_root_ofs);
+            }
+        } catch(...) {
+            for(auto ofs : v.allocated)
+                _p.free_page(ofs);
+            throw;
+        }
+
+        if(removed)
+        {
+            _p.retire_pages(v.retired);
+            // Never reachable from a published root, so nobody else can be reading them.
+            for(auto ofs : v.discarded)
+                _p.free_page(ofs);
+        }
+        else
+        {
+            for(auto ofs : v.allocated)
+                _p.free_page(ofs);
+        }
+    }
+
+    _count_write(attempt);
+    if(physical)
+        _count_keys(-1, -(int64_t)swept);
+    else _count_keys(-1, 1);
+}
+
+void b_tree::set_tombstone_ratio(double ratio)
+{
+    if(ratio < 0.0 || ratio > 1.0)
+        throw runtime_error("The tombstone ratio must be between 0 and 1.");
+    _tombstoneRatio.store(ratio, memory_order_relaxed);
+}
+
+uint64_t b_tree::live_keys() const
+{
+    auto n = __atomic_load_n((int64_t*)(_p.user_header() + LIVE_KEYS_OFS), __ATOMIC_RELAXED);
+    return (n > 0)?(uint64_t)n:0;
+}
+
+uint64_t b_tree::tombstones() const
+{
+    auto n = __atomic_load_n((int64_t*)(_p.user_header() + TOMBSTONES_OFS), __ATOMIC_RELAXED);
+    return (n > 0)?(uint64_t)n:0;
+}
+
+void b_tree::_count_keys(int64_t live, int64_t tombstones)
+{
+    // The counts only steer when removes become physical, they are allowed to be briefly out of step with
+    // the published root.
+    auto hdr = _p.user_header();
+    if(live != 0)
+        __atomic_fetch_add((int64_t*)(hdr + LIVE_KEYS_OFS), live, __ATOMIC_RELAXED);
+    if(tombstones != 0)
+        __atomic_fetch_add((int64_t*)(hdr + TOMBSTONES_OFS), tombstones, __ATOMIC_RELAXED);
+}
+
+void b_tree::_recount_keys()
 {
-    auto root_ofs = _p.root_ofs();
-    if (root_ofs != 0)
+    // Files written before the counts existed (or rolled back to a checkpoint) are counted once.
+    pager::epoch_guard guard(_p);
+    int64_t live = 0, dead = 0;
+    vector<int64_t> pending;
+    for(size_t part = 0; part < _partitions; ++part)
     {
-        b_tree_node root(_p, root_ofs);
-        root._remove(k);
+        if(_p.root_ofs(part) != 0)
+            pending.push_back(_p.root_ofs(part));
     }
+    while(!pending.empty())
+    {
+        b_tree_node node(_p, _layout, pending.back());
+        pending.pop_back();
+        for(uint16_t i = 0; i < node._num_keys(); ++i)
+        {
+            if(node._valid_key(i))
+                ++live;
+            else ++dead;
+        }
+        if(!node._leaf())
+        {
+            for(uint16_t i = 0; i <= node._num_keys(); ++i)
+                pending.push_back(node._child_ofs(i));
+        }
+    }
+
+    auto hdr = _p.user_header();
+    *(int64_t*)(hdr + LIVE_KEYS_OFS) = live;
+    *(int64_t*)(hdr + TOMBSTONES_OFS) = dead;
+    *(uint32_t*)(hdr + KEY_COUNTS_VALID_OFS) = 1;
 }
 
 void b_tree::write_dot_file(const string& file_name)
@@ -94,14 +724,19 @@ void b_tree::write_dot_file(const string& file_name)
     file << "digraph BTree {\n";
     file << "  node [shape=record];\n";
 
+    pager::epoch_guard guard(_p);
     queue<pair<int64_t, int>> q;
     int node_id = 0;
-    auto root_ofs = _p.root_ofs();
-    q.push({root_ofs, node_id++});
+    for(size_t part = 0; part < _partitions; ++part)
+    {
+        auto root_ofs = _p.root_ofs(part);
+        if(root_ofs != 0)
+            q.push({root_ofs, -1});
+    }
 
     while (!q.empty())
     {
-        b_tree_node node(_p, q.front().first);
+        b_tree_node node(_p, _layout, q.front().first);
         int parent_id = q.front().second;
         q.pop();
 
@@ -135,72 +770,1174 @@ void b_tree::write_dot_file(const string& file_name)
     file.close();
 }
 
-void b_tree::create_db_file(const std::string& file_name)
+vector<pair<int64_t, int64_t>> b_tree::range(int64_t lo, int64_t hi) const
 {
-    pager::create(file_name);
+    vector<pair<int64_t, int64_t>> result;
+
+    cursor c(*this);
+    for(c.seek(lo); c.valid() && c.key() <= hi; c.next())
+        result.push_back(make_pair(c.key(), c.value()));
+
+    return result;
 }
 
-void b_tree::vacuum(const std::string& file_name)
+void b_tree::bulk_load(external_sorter& sorter, double fill_factor)
 {
-    // create temp file name
-    // call create_db_file with temp file name
-    // pager open file_name
-    // read root node and traverse tree writing each element to temp file
-    // rename temp file to file_name
+    sorter.finish();
+    _bulk_load(sorter.size(), [&sorter](){
+        pair<int64_t, int64_t> kv;
+        if(!sorter.next(kv))
+            throw runtime_error("external_sorter ran dry during bulk_load.");
+        return kv;
+    }, fill_factor);
 }
 
-b_tree_node b_tree::_copy_arm(int64_t key, int64_t node_ofs)
+void b_tree::create_db_file(const std::string& file_name, uint16_t min_degree, node_layout layout, uint16_t partitions, uint64_t filter_keys)
 {
-    b_tree_node current_node(_p, node_ofs);
-    b_tree_node new_node(_p, current_node._min_degree(), current_node._leaf());
+    if(layout != NODE_LAYOUT_PACKED && layout != NODE_LAYOUT_ALIGNED)
+        throw runtime_error("Invalid node layout.");
 
-    printf("%ld ", new_node._ofs());
-
-    // Copy keys, values, and valid flags from the current node to the new node
-    memcpy(new_node._mm.map().first, current_node._mm.map().first, _p.block_size());
+    if(min_degree == 0)
+        min_degree = b_tree_node::max_min_degree(pager::block_size(), layout);
 
-    int i = 0;
-    while (i < current_node._num_keys() && key > current_node._key(i))
-        i++;
+    if(min_degree < 2 || b_tree_node::node_size(min_degree, layout) > pager::block_size())
+        throw runtime_error("Invalid min_degree.");
 
-    // If the current node is a leaf, return the new node
-    if (current_node._leaf())
-        return new_node;
+    if(partitions < 1 || partitions > pager::root_slots())
+        throw runtime_error("Invalid number of partitions.");
 
-    // If the current node is an internal node, recursively copy the child arm
-    b_tree_node child_node = _copy_arm(key, current_node._child_ofs(i));
+    pager::create(file_name);
 
-    // Update the child offset in the new node to point to the copied child arm
-    new_node._set_child_ofs(i, child_node._ofs());
+    pager p(file_name);
+    *(uint16_t*)(p.user_header() + MIN_DEGREE_OFS) = min_degree;
+    *(uint16_t*)(p.user_header() + LAYOUT_OFS) = (uint16_t)layout;
+    *(uint32_t*)(p.user_header() + KEY_COUNTS_VALID_OFS) = 1;
+    *(uint16_t*)(p.user_header() + PARTITIONS_OFS) = partitions;
 
-    return new_node;
+    // Allocated before any node so its pages are contiguous.
+    if(filter_keys > 0)
+    {
+        auto blocks = bloom_filter::blocks_for(filter_keys);
+        *(uint64_t*)(p.user_header() + FILTER_OFS) = bloom_filter::create(p, blocks);
+        *(uint64_t*)(p.user_header() + FILTER_BLOCKS_OFS) = blocks;
+    }
 }
 
-void b_tree::_insert_atomic_recursive(int64_t key, int64_t value, int64_t node_ofs)
+void b_tree::vacuum(const std::string& file_name, double fill_factor)
 {
-    b_tree_node node(_p, node_ofs);
-    printf("%ld ", node._ofs());
+    auto temp_name = file_name + ".vacuum";
 
-    // If the node is a leaf, insert the key-value pair
-    if (node._leaf())
-        node._insert_non_full(key, value);
-    else
+    try
     {
-        // If the node is an internal node, find the appropriate child to descend into
-        int i = 0;
-        while (i < node._num_keys() && key > node._key(i))
-            i++;
+        b_tree src(file_name);
 
-        b_tree_node child(_p, node._child_ofs(i));
-        if (child._num_keys() == 2 * _min_degree - 1) {
-            // If the child node is full, split it before descending
-            printf("split child ofs\n");
-            node._split_child(i, child._ofs());
-            if (key > node._key(i))
-                i++;
+        auto filter_keys = (src._filter)?std::max(src._filter->capacity(), src.live_keys()):0;
+        create_db_file(temp_name, src._min_degree, src._layout, src._partitions, filter_keys);
+
+        {
+            b_tree dst(temp_name);
+
+            // The keys of a partition hash to the same partition of the new file, so each partition is
+            // bulk loaded from its own sorted stream.
+            for(size_t part = 0; part < src._partitions; ++part)
+            {
+                auto root_ofs = src._p.root_ofs(part);
+
+                // Both passes read the same version of the tree.
+                uint64_t count = 0;
+                cursor counter(src, root_ofs);
+                for(counter.seek_first(); counter.valid(); counter.next())
+                    ++count;
+
+                cursor c(src, root_ofs);
+                c.seek_first();
+                dst._bulk_load_partition(part, count, [&c](){
+                    if(!c.valid())
+                        throw runtime_error("Source tree changed during vacuum.");
+                    auto kv = make_pair(c.key(), c.value());
+                    c.next();
+                    return kv;
+                }, fill_factor);
+            }
+
+            dst._p.sync();
         }
 
-        // Recursively insert the key-value pair into the appropriate child
-        _insert_atomic_recursive(key, value, node._child_ofs(i));
+        if(rename(temp_name.c_str(), file_name.c_str()) != 0)
+            throw runtime_error("Unable to rename vacuumed file into place.");
     }
+    catch(...)
+    {
+        unlink(temp_name.c_str());
+        throw;
+    }
+
+    // Make the rename itself durable.
+    fsync_dir_of(file_name);
+}
+
+void b_tree::checkpoint()
+{
+    if(!_wal)
+        return;
+
+    unique_lock<shared_mutex> g(_checkpointLock);
+    _checkpoint();
+}
+
+wal_stats b_tree::log_stats() const
+{
+    if(!_wal)
+        return {0, 0};
+    return _wal->stats();
+}
+
+void b_tree::_open_wal(const string& file_name)
+{
+    auto log_name = file_name + ".wal";
+    auto hdr = _p.user_header();
+    auto state = *(uint32_t*)(hdr + WAL_STATE_OFS);
+    auto checkpoint_lsn = *(uint64_t*)(hdr + CHECKPOINT_LSN_OFS);
+
+    vector<wal_record> replay;
+    if(state == WAL_STATE_OPEN)
+    {
+        // The last session died. Pages written since its last checkpoint may be anywhere between the old
+        // and new versions on disk, but the checkpointed version itself was never touched, so roll back
+        // to it and replay the log.
+        for(size_t part = 0; part < _partitions; ++part)
+            _p.set_root_ofs(_p.root_ofs(part), *_checkpoint_root(hdr, part), part);
+        _p.reset_free_list();
+        *(uint32_t*)(hdr + KEY_COUNTS_VALID_OFS) = 0;
+        replay = wal::read(log_name);
+    }
+
+    auto last_lsn = checkpoint_lsn;
+    for(auto& r : replay)
+    {
+        if(r.lsn <= checkpoint_lsn)
+            continue;
+
+        auto op = r.op & ~WAL_MORE;
+        if(op == WAL_INSERT)
+            _insert(r.key, r.value);
+        else if(op == WAL_UPSERT)
+            _write(WRITE_UPSERT, r.key, r.value, 0);
+        else _remove(r.key);
+
+        last_lsn = r.lsn;
+    }
+
+    _keyLocks.reset(new mutex[KEY_LOCK_STRIPES]);
+    _wal = make_unique<wal>(log_name, last_lsn + 1);
+
+    *(uint32_t*)(hdr + WAL_STATE_OFS) = WAL_STATE_OPEN;
+    _checkpoint();
+}
+
+void b_tree::_checkpoint()
+{
+    // Entered before the root is read, so nothing reachable from it can be reused while it is held.
+    auto guard = make_unique<pager::epoch_guard>(_p);
+    vector<uint64_t> roots;
+    for(size_t part = 0; part < _partitions; ++part)
+        roots.push_back(_p.root_ofs(part));
+    auto lsn = _wal->last_lsn();
+
+    // The version has to be on disk before the header points at it.
+    _p.sync();
+
+    auto hdr = _p.user_header();
+    for(size_t part = 0; part < _partitions; ++part)
+        *_checkpoint_root(hdr, part) = roots[part];
+    *(uint64_t*)(hdr + CHECKPOINT_LSN_OFS) = lsn;
+    _p.sync();
+
+    _wal->truncate(lsn);
+
+    _checkpointGuard = std::move(guard);
+    _checkpointLsn.store(lsn);
+}
+
+void b_tree::_maybe_checkpoint(uint64_t lsn)
+{
+    auto checkpoint_lsn = _checkpointLsn.load();
+    if(lsn < checkpoint_lsn || lsn - checkpoint_lsn < CHECKPOINT_INTERVAL)
+        return;
+
+    unique_lock<shared_mutex> g(_checkpointLock);
+    if(_wal->last_lsn() - _checkpointLsn.load() >= CHECKPOINT_INTERVAL)
+        _checkpoint();
+}
+
+mutex& b_tree::_key_lock(int64_t key)
+{
+    auto h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    return _keyLocks[(h >> 32) % KEY_LOCK_STRIPES];
+}
+
+uint16_t b_tree::_read_min_degree(const pager& p)
+{
+    auto min_degree = *(uint16_t*)(p.user_header() + MIN_DEGREE_OFS);
+    if(min_degree < 2)
+        throw runtime_error("File header does not contain a valid min_degree.");
+    return min_degree;
+}
+
+node_layout b_tree::_read_layout(const pager& p)
+{
+    auto layout = *(uint16_t*)(p.user_header() + LAYOUT_OFS);
+    if(layout != NODE_LAYOUT_PACKED && layout != NODE_LAYOUT_ALIGNED)
+        throw runtime_error("File header does not contain a valid node layout.");
+    return (node_layout)layout;
+}
+
+uint16_t b_tree::_read_partitions(const pager& p)
+{
+    auto partitions = *(uint16_t*)(p.user_header() + PARTITIONS_OFS);
+    if(partitions == 0)
+        return 1;
+    if(partitions > pager::root_slots())
+        throw runtime_error("File header does not contain a valid number of partitions.");
+    return partitions;
+}
+
+unique_ptr<bloom_filter> b_tree::_read_filter(const pager& p)
+{
+    auto ofs = *(uint64_t*)(p.user_header() + FILTER_OFS);
+    if(ofs == 0)
+        return nullptr;
+    return make_unique<bloom_filter>(p, ofs, *(uint64_t*)(p.user_header() + FILTER_BLOCKS_OFS));
+}
+
+vector<int64_t> b_tree::_collect_roots() const
+{
+    vector<int64_t> roots(_partitions);
+    for(size_t part = 0; part < _partitions; ++part)
+        roots[part] = _p.root_ofs(part);
+
+    // With several partitions keep collecting until two passes agree, the roots then all held those values
+    // at the moment the second pass began. A root can not change and come back because its page is not
+    // reused while our caller's guard is held.
+    if(_partitions > 1)
+    {
+        while(true)
+        {
+            bool same = true;
+            for(size_t part = 0; part < _partitions; ++part)
+            {
+                auto root_ofs = (int64_t)_p.root_ofs(part);
+                if(root_ofs != roots[part])
+                {
+                    roots[part] = root_ofs;
+                    same = false;
+                }
+            }
+            if(same)
+                break;
+        }
+    }
+
+    return roots;
+}
+
+optional<int64_t> b_tree::_search(int64_t root_ofs, int64_t k) const
+{
+    // Iterative, each node is pinned only while it is looked at (its parent is never needed again).
+    auto ofs = root_ofs;
+    while (ofs != 0)
+    {
+        auto page = _p.pin_page(ofs);
+        auto node = _node_view(page);
+        int i = key_lower_bound(node.keys(), node.num_keys(), k);
+
+        optional<int64_t> result;
+        int64_t next = 0;
+        if (i < node.num_keys() && node.keys()[i] == k)
+        {
+            if (node.valid_key(i))
+                result = node.vals()[i];
+        }
+        else if (!node.leaf())
+            next = node.child_ofs()[i];
+        _p.unpin_page(ofs, false);
+
+        if (result || next == 0)
+            return result;
+        ofs = next;
+    }
+
+    return nullopt;
+}
+
+size_t b_tree::_partition(int64_t key) const
+{
+    if(_partitions == 1)
+        return 0;
+
+    // Hashed rather than split by key range so ascending keys (the worst case for root CAS contention in
+    // a single tree) are spread over every partition.
+    auto h = ((uint64_t)key ^ ((uint64_t)key >> 31)) * 0xBF58476D1CE4E5B9ULL;
+    return (h >> 32) % _partitions;
+}
+
+static uint64_t _sat_add(uint64_t a, uint64_t b)
+{
+    return (a > UINT64_MAX - b)?UINT64_MAX:a + b;
+}
+
+static uint64_t _sat_mul(uint64_t a, uint64_t b)
+{
+    return (b != 0 && a > UINT64_MAX / b)?UINT64_MAX:a * b;
+}
+
+b_tree::bulk_plan b_tree::_bulk_plan(uint64_t count, double fill_factor) const
+{
+    uint16_t max_keys = (2 * _min_degree) - 1;
+
+    bulk_plan plan;
+    plan.fill_keys = (uint16_t)std::min<double>(max_keys, std::max<double>(_min_degree, fill_factor * max_keys + 0.5));
+    plan.fill_cap = {plan.fill_keys};
+    plan.max_cap = {max_keys};
+    plan.min_cap = {(uint64_t)(_min_degree - 1)};
+
+    auto grow = [&](){
+        auto h = plan.fill_cap.size() - 1;
+        plan.fill_cap.push_back(_sat_add(plan.fill_keys, _sat_mul(plan.fill_keys + 1, plan.fill_cap[h])));
+        plan.max_cap.push_back(_sat_add(max_keys, _sat_mul(max_keys + 1, plan.max_cap[h])));
+        plan.min_cap.push_back(_sat_add(_min_degree - 1, _sat_mul(_min_degree, plan.min_cap[h])));
+    };
+
+    plan.height = 0;
+    while(count > plan.fill_cap[plan.height])
+    {
+        grow();
+        ++plan.height;
+    }
+
+    // The root needs at least two children that each meet the minimum, if there is not enough input for
+    // that at this height a shorter (and fuller) tree is used instead.
+    while(plan.height > 0 && (count + 1) / (plan.min_cap[plan.height - 1] + 1) < 2)
+        --plan.height;
+
+    return plan;
+}
+
+void b_tree::_bulk_load(uint64_t count, const function<pair<int64_t, int64_t>()>& next, double fill_factor)
+{
+    if(!_wal)
+    {
+        _bulk_load_unlogged(count, next, fill_factor);
+        return;
+    }
+
+    // Logging every pair would write the input twice. Instead no other writer runs until the loaded tree
+    // is in a checkpoint, which a crash rolls back to.
+    unique_lock<shared_mutex> g(_checkpointLock);
+    try
+    {
+        _bulk_load_unlogged(count, next, fill_factor);
+    }
+    catch(...)
+    {
+        // A partitioned load may have published some chunks, they have to survive a crash like anything
+        // else search() can already see.
+        _checkpoint();
+        throw;
+    }
+    _checkpoint();
+}
+
+void b_tree::_bulk_load_unlogged(uint64_t count, const function<pair<int64_t, int64_t>()>& next, double fill_factor)
+{
+    if(_partitions == 1)
+    {
+        _bulk_load_partition(0, count, next, fill_factor);
+        return;
+    }
+
+    for(size_t part = 0; part < _partitions; ++part)
+    {
+        if(_p.root_ofs(part) != 0)
+            throw runtime_error("bulk_load requires an empty tree.");
+    }
+
+    optional<int64_t> last_key;
+    vector<pair<int64_t, int64_t>> chunk;
+    while(count > 0)
+    {
+        chunk.clear();
+        for(; count > 0 && chunk.size() < BULK_CHUNK; --count)
+        {
+            auto kv = next();
+            if(last_key && kv.first <= *last_key)
+                throw runtime_error("bulk_load input must be sorted with unique keys.");
+            last_key = kv.first;
+            chunk.push_back(kv);
+        }
+        // What insert_batch() does without a log. With one, _bulk_load() holds the checkpoint lock
+        // exclusively, so there are no other writers to order against and the checkpoint covers the chunk.
+        _insert_batch(chunk);
+    }
+}
+
+void b_tree::_bulk_load_partition(size_t part, uint64_t count, const function<pair<int64_t, int64_t>()>& next, double fill_factor)
+{
+    if(_p.root_ofs(part) != 0)
+        throw runtime_error("bulk_load requires an empty tree.");
+
+    if(count == 0)
+        return;
+
+    auto plan = _bulk_plan(count, fill_factor);
+
+    optional<int64_t> last_key;
+    auto root_ofs = _bulk_build(next, count, plan.height, plan, last_key);
+
+    if(!_p.set_root_ofs(0, root_ofs, part))
+        throw runtime_error("bulk_load raced with another writer.");
+
+    _count_keys((int64_t)count, 0);
+}
+
+int64_t b_tree::_bulk_build(const function<pair<int64_t, int64_t>()>& next, uint64_t count, int h, const bulk_plan& plan, optional<int64_t>& last_key)
+{
+    // The subtree is produced in key order (child 0, key 0, child 1, ...) so the input is consumed in a
+    // single pass and the leaves land in the file in the order of their keys.
+    auto take = [&](b_tree_node& node, uint16_t i){
+        auto kv = next();
+        if(last_key && kv.first <= *last_key)
+            throw runtime_error("bulk_load input must be sorted with unique keys.");
+        last_key = kv.first;
+        if(_filter)
+            _filter->add(kv.first);
+        node._set_key(i, kv.first);
+        node._set_valid_key(i, true);
+        node._set_val(i, kv.second);
+    };
+
+    if(h == 0)
+    {
+        b_tree_node leaf(_p, _layout, _min_degree, true);
+        for(uint16_t i = 0; i < count; ++i)
+            take(leaf, i);
+        leaf._set_num_keys((uint16_t)count);
+        return leaf._ofs();
+    }
+
+    // Aim for children packed at the fill factor but never less than the fewest children that fit the
+    // input (or that this node needs to meet its own minimum) or more than the most children that keeps
+    // every child at or above the minimum.
+    uint64_t min_children = (h == plan.height)?2:_min_degree;
+    auto lo = std::max(min_children, (count + 1 + plan.max_cap[h - 1]) / (plan.max_cap[h - 1] + 1));
+    auto hi = std::min<uint64_t>(2 * _min_degree, (count + 1) / (plan.min_cap[h - 1] + 1));
+    auto target = (count + 1 + plan.fill_cap[h - 1]) / (plan.fill_cap[h - 1] + 1);
+    auto nchildren = std::max(lo, std::min(target, hi));
+
+    b_tree_node node(_p, _layout, _min_degree, false);
+
+    auto remaining = count - (nchildren - 1);
+    auto base = remaining / nchildren;
+    auto extra = remaining % nchildren;
+
+    for(uint64_t c = 0; c < nchildren; ++c)
+    {
+        node._set_child_ofs((uint16_t)c, _bulk_build(next, base + ((c < extra)?1:0), h - 1, plan, last_key));
+        if(c + 1 < nchildren)
+            take(node, (uint16_t)c);
+    }
+
+    node._set_num_keys((uint16_t)(nchildren - 1));
+
+    return node._ofs();
+}
+
+b_tree_node b_tree::_copy_path(int64_t key, int64_t node_ofs, write_attempt& a, size_t level)
+{
+    // Same as _copy_arm() except that the nodes are recorded in a.path (in front of any nodes salvaged
+    // from the last attempt, which the copy links to instead of descending further).
+    b_tree_node current_node(_p, _layout, node_ofs);
+    b_tree_node new_node(_p, _layout, current_node._min_degree(), current_node._leaf(), _spare_page(a));
+    a.path.insert(begin(a.path) + level, arm_node{(uint64_t)node_ofs, (uint64_t)new_node._ofs(), true, {(uint64_t)new_node._ofs()}});
+
+    TDB_TRACE(TRACE_ARM_COPY, new_node._ofs(), node_ofs);
+
+    memcpy(new_node._view.page(), current_node._view.page(), _p.block_size());
+
+    int i = key_lower_bound(current_node._view.keys(), current_node._num_keys(), key);
+
+    if (current_node._leaf() || (i < current_node._num_keys() && current_node._key(i) == key))
+        return new_node;
+
+    if (level + 1 < a.path.size() && (uint64_t)current_node._child_ofs(i) == a.path[level+1].orig)
+    {
+        new_node._set_child_ofs(i, a.path[level+1].copy);
+        return new_node;
+    }
+
+    b_tree_node child_node = _copy_path(key, current_node._child_ofs(i), a, level + 1);
+    new_node._set_child_ofs(i, child_node._ofs());
+
+    return new_node;
+}
+
+b_tree_node b_tree::_copy_arm(int64_t key, int64_t node_ofs, vector<uint64_t>& retired, vector<uint64_t>& allocated)
+{
+    b_tree_node current_node(_p, _layout, node_ofs);
+    b_tree_node new_node(_p, _layout, current_node._min_degree(), current_node._leaf());
+    retired.push_back(node_ofs);
+    allocated.push_back(new_node._ofs());
+
+    TDB_TRACE(TRACE_ARM_COPY, new_node._ofs(), node_ofs);
+
+    // Copy keys, values, and valid flags from the current node to the new node
+    memcpy(new_node._view.page(), current_node._view.page(), _p.block_size());
+
+    int i = key_lower_bound(current_node._view.keys(), current_node._num_keys(), key);
+
+    // If the current node is a leaf (or holds the key, so nothing below it will be touched), return the
+    // new node
+    if (current_node._leaf() || (i < current_node._num_keys() && current_node._key(i) == key))
+        return new_node;
+
+    // If the current node is an internal node, recursively copy the child arm
+    b_tree_node child_node = _copy_arm(key, current_node._child_ofs(i), retired, allocated);
+
+    // Update the child offset in the new node to point to the copied child arm
+    new_node._set_child_ofs(i, child_node._ofs());
+
+    return new_node;
+}
+
+bool b_tree::_insert_atomic_recursive(int64_t key, int64_t value, int64_t node_ofs, write_attempt& a, int level)
+{
+    b_tree_node node(_p, _layout, node_ofs);
+
+    // If the node is a leaf, insert the key-value pair
+    if (node._leaf())
+        return node._insert_non_full(key, value);
+    else
+    {
+        // If the node is an internal node, find the appropriate child to descend into
+        int i = key_lower_bound(node._view.keys(), node._num_keys(), key);
+        if (i < node._num_keys() && node._key(i) == key)
+        {
+            if (node._valid_key(i))
+                throw runtime_error("Duplicate key");
+            // A lazily removed key is made valid again where it is.
+            node._set_valid_key(i, true);
+            node._set_val(i, value);
+            return true;
+        }
+
+        // Deciding on a split only needs the key count of the child, a view is enough.
+        auto child_ofs = node._child_ofs(i);
+        bool child_full = _node_view(_p.pin_page(child_ofs)).num_keys() == 2 * _min_degree - 1;
+        _p.unpin_page(child_ofs, false);
+        if (child_full) {
+            // If the child node is full, split it before descending
+            TDB_TRACE(TRACE_SPLIT, node._ofs(), child_ofs);
+            node._split_child(i, child_ofs, _spare_page(a));
+            ((level < 0)?a.above:a.path[level].pages).push_back(node._child_ofs(i+1));
+            if (level + 1 < (int)a.path.size())
+                a.path[level+1].clean = false;
+            if (key > node._key(i))
+                i++;
+            else if (key == node._key(i))
+            {
+                // The middle key that moved up is the key itself, check it here.
+                return _insert_atomic_recursive(key, value, node_ofs, a, level);
+            }
+        }
+
+        // Recursively insert the key-value pair into the appropriate child
+        return _insert_atomic_recursive(key, value, node._child_ofs(i), a, level + 1);
+    }
+}
+
+uint64_t b_tree::_private_node(uint64_t ofs, cow_version& v)
+{
+    if(v.owned.count(ofs) != 0)
+        return ofs;
+
+    b_tree_node src(_p, _layout, ofs);
+    b_tree_node copy(_p, _layout, src._min_degree(), src._leaf());
+
+    TDB_TRACE(TRACE_ARM_COPY, copy._ofs(), ofs);
+
+    memcpy(copy._view.page(), src._view.page(), _p.block_size());
+
+    v.owned.insert(copy._ofs());
+    v.retired.push_back(ofs);
+    v.allocated.push_back(copy._ofs());
+
+    return copy._ofs();
+}
+
+uint64_t b_tree::_insert_private(int64_t key, int64_t value, uint64_t root_ofs, cow_version& v, bool& revived)
+{
+    revived = false;
+
+    if(root_ofs == 0)
+    {
+        b_tree_node root(_p, _layout, _min_degree, true);
+        v.owned.insert(root._ofs());
+        v.allocated.push_back(root._ofs());
+        root._set_num_keys(1);
+        root._set_key(0, key);
+        root._set_valid_key(0, true);
+        root._set_val(0, value);
+        return root._ofs();
+    }
+
+    root_ofs = _private_node(root_ofs, v);
+
+    {
+        b_tree_node root(_p, _layout, root_ofs);
+        if(root._num_keys() == 2 * _min_degree - 1)
+        {
+            b_tree_node new_root(_p, _layout, _min_degree, false);
+            TDB_TRACE(TRACE_ROOT_SPLIT, new_root._ofs(), root_ofs);
+            v.owned.insert(new_root._ofs());
+            v.allocated.push_back(new_root._ofs());
+            new_root._set_child_ofs(0, root_ofs);
+            new_root._split_child(0, root_ofs);
+            v.owned.insert(new_root._child_ofs(1));
+            v.allocated.push_back(new_root._child_ofs(1));
+            root_ofs = new_root._ofs();
+        }
+    }
+
+    // Same descent as _insert_atomic_recursive() except that children are only copied the first time
+    // this version touches them.
+    auto ofs = root_ofs;
+    while(true)
+    {
+        b_tree_node node(_p, _layout, ofs);
+        if(node._leaf())
+        {
+            revived = node._insert_non_full(key, value);
+            break;
+        }
+
+        int i = key_lower_bound(node._view.keys(), node._num_keys(), key);
+        if(i < node._num_keys() && node._key(i) == key)
+        {
+            if(node._valid_key(i))
+                throw runtime_error("Duplicate key");
+            node._set_valid_key(i, true);
+            node._set_val(i, value);
+            revived = true;
+            break;
+        }
+
+        auto child_ofs = _private_node(node._child_ofs(i), v);
+        node._set_child_ofs(i, child_ofs);
+
+        b_tree_node child(_p, _layout, child_ofs);
+        if(child._num_keys() == 2 * _min_degree - 1)
+        {
+            TDB_TRACE(TRACE_SPLIT, node._ofs(), child_ofs);
+            node._split_child(i, child_ofs);
+            v.owned.insert(node._child_ofs(i+1));
+            v.allocated.push_back(node._child_ofs(i+1));
+            if(key > node._key(i))
+                i++;
+            else if(key == node._key(i))
+                continue;   // the middle key that moved up is the key itself
+        }
+
+        ofs = node._child_ofs(i);
+    }
+
+    return root_ofs;
+}
+
+uint64_t b_tree::_erase_private(int64_t key, uint64_t root_ofs, cow_version& v, uint64_t& swept)
+{
+    root_ofs = _private_node(root_ofs, v);
+    _erase(key, root_ofs, v, swept);
+
+    // A root left without keys is replaced by its only child (or the tree is now empty).
+    b_tree_node root(_p, _layout, root_ofs);
+    if(root._num_keys() > 0)
+        return root_ofs;
+
+    auto new_root_ofs = (root._leaf())?0:(uint64_t)root._child_ofs(0);
+    TDB_TRACE(TRACE_ROOT_COLLAPSE, new_root_ofs, root_ofs);
+    _unlink_node(root_ofs, v);
+    return new_root_ofs;
+}
+
+bool b_tree::_erase(int64_t key, uint64_t ofs, cow_version& v, uint64_t& swept)
+{
+    // Every node this is called on is private and (unless it is the root) has at least min_degree keys,
+    // so taking one key out of it or out of a child it merged never leaves it under the minimum.
+    b_tree_node node(_p, _layout, ofs);
+    uint16_t i = key_lower_bound(node._view.keys(), node._num_keys(), key);
+    bool here = i < node._num_keys() && node._key(i) == key;
+
+    if(node._leaf())
+    {
+        if(here)
+            node._remove_at(i);
+        swept += _sweep_leaf(node);
+        return here;
+    }
+
+    if(!here)
+        return _erase(key, _fill_child(node, i, v), v, swept);
+
+    // The key is in an internal node, replace it with its predecessor or successor if the child that
+    // holds it can spare a key, otherwise merge the two children around it and delete it from the result.
+    {
+        b_tree_node left(_p, _layout, node._child_ofs(i));
+        if(left._num_keys() >= _min_degree)
+        {
+            node._set_child_ofs(i, _private_node(node._child_ofs(i), v));
+            _erase_edge(node._child_ofs(i), true, node, i, v, swept);
+            return true;
+        }
+    }
+
+    {
+        b_tree_node right(_p, _layout, node._child_ofs(i+1));
+        if(right._num_keys() >= _min_degree)
+        {
+            node._set_child_ofs(i+1, _private_node(node._child_ofs(i+1), v));
+            _erase_edge(node._child_ofs(i+1), false, node, i, v, swept);
+            return true;
+        }
+    }
+
+    node._set_child_ofs(i, _private_node(node._child_ofs(i), v));
+    TDB_TRACE(TRACE_MERGE, ofs, node._child_ofs(i));
+    _unlink_node(node._merge_children(i), v);
+    return _erase(key, node._child_ofs(i), v, swept);
+}
+
+void b_tree::_erase_edge(uint64_t ofs, bool largest, b_tree_node& dst, uint16_t i, cow_version& v, uint64_t& swept)
+{
+    while(true)
+    {
+        b_tree_node node(_p, _layout, ofs);
+        if(node._leaf())
+        {
+            uint16_t j = (largest)?node._num_keys() - 1:0;
+            dst._copy_entry(i, node, j);
+            node._remove_at(j);
+            swept += _sweep_leaf(node);
+            return;
+        }
+
+        ofs = _fill_child(node, (largest)?node._num_keys():0, v);
+    }
+}
+
+uint64_t b_tree::_fill_child(b_tree_node& node, uint16_t i, cow_version& v)
+{
+    auto n = node._num_keys();
+
+    {
+        b_tree_node child(_p, _layout, node._child_ofs(i));
+        if(child._num_keys() >= _min_degree)
+        {
+            node._set_child_ofs(i, _private_node(node._child_ofs(i), v));
+            return node._child_ofs(i);
+        }
+    }
+
+    if(i > 0)
+    {
+        b_tree_node left(_p, _layout, node._child_ofs(i-1));
+        if(left._num_keys() >= _min_degree)
+        {
+            node._set_child_ofs(i-1, _private_node(node._child_ofs(i-1), v));
+            node._set_child_ofs(i, _private_node(node._child_ofs(i), v));
+            TDB_TRACE(TRACE_BORROW, node._ofs(), node._child_ofs(i));
+            node._borrow_from_left(i);
+            return node._child_ofs(i);
+        }
+    }
+
+    if(i < n)
+    {
+        b_tree_node right(_p, _layout, node._child_ofs(i+1));
+        if(right._num_keys() >= _min_degree)
+        {
+            node._set_child_ofs(i, _private_node(node._child_ofs(i), v));
+            node._set_child_ofs(i+1, _private_node(node._child_ofs(i+1), v));
+            TDB_TRACE(TRACE_BORROW, node._ofs(), node._child_ofs(i));
+            node._borrow_from_right(i);
+            return node._child_ofs(i);
+        }
+    }
+
+    // Both siblings are at the minimum, merge with one of them. Only the surviving child is copied, the
+    // other is read and unlinked.
+    if(i == n)
+        --i;
+    node._set_child_ofs(i, _private_node(node._child_ofs(i), v));
+    TDB_TRACE(TRACE_MERGE, node._ofs(), node._child_ofs(i));
+    _unlink_node(node._merge_children(i), v);
+    return node._child_ofs(i);
+}
+
+uint16_t b_tree::_sweep_leaf(b_tree_node& leaf)
+{
+    // Drops invalid keys from a leaf this version already owns (it costs no extra copies) as long as the
+    // leaf stays at or above the minimum.
+    uint16_t swept = 0;
+    for(int j = leaf._num_keys() - 1; j >= 0 && leaf._num_keys() > _min_degree - 1; --j)
+    {
+        if(!leaf._valid_key(j))
+        {
+            leaf._remove_at(j);
+            ++swept;
+        }
+    }
+    return swept;
+}
+
+void b_tree::_unlink_node(uint64_t ofs, cow_version& v)
+{
+    // A page this version allocated was never published and can be freed as soon as the version is, a
+    // published page has to be retired like any other replaced page.
+    if(v.owned.erase(ofs) != 0)
+        v.discarded.push_back(ofs);
+    else v.retired.push_back(ofs);
+}
+
+b_tree::snapshot::snapshot(const b_tree& t) :
+    _t(t),
+    _guard(t._p),
+    _roots(t._collect_roots())
+{
+    _t._snapshots.fetch_add(1, memory_order_relaxed);
+}
+
+b_tree::snapshot::~snapshot() noexcept
+{
+    _t._snapshots.fetch_sub(1, memory_order_relaxed);
+}
+
+optional<int64_t> b_tree::snapshot::search(int64_t k) const
+{
+    // The filter has every key of every published version.
+    if(!_t.may_contain(k))
+        return nullopt;
+    return _t._search(_roots[_t._partition(k)], k);
+}
+
+vector<pair<int64_t, int64_t>> b_tree::snapshot::range(int64_t lo, int64_t hi) const
+{
+    vector<pair<int64_t, int64_t>> result;
+
+    cursor c(*this);
+    for(c.seek(lo); c.valid() && c.key() <= hi; c.next())
+        result.push_back(make_pair(c.key(), c.value()));
+
+    return result;
+}
+
+b_tree::cursor::cursor(const b_tree& t) :
+    _guard(make_unique<pager::snapshot_guard>(t._p)),
+    _parts(),
+    _cur(0),
+    _forward(true)
+{
+    for(auto root_ofs : t._collect_roots())
+        _parts.emplace_back(t, root_ofs);
+    _cur = _parts.size();
+}
+
+b_tree::cursor::cursor(const snapshot& s) :
+    _guard(),
+    _parts(),
+    _cur(0),
+    _forward(true)
+{
+    for(auto root_ofs : s._roots)
+        _parts.emplace_back(s._t, root_ofs);
+    _cur = _parts.size();
+}
+
+b_tree::cursor::cursor(const b_tree& t, int64_t root_ofs) :
+    _guard(make_unique<pager::snapshot_guard>(t._p)),
+    _parts(),
+    _cur(0),
+    _forward(true)
+{
+    _parts.emplace_back(t, root_ofs);
+    _cur = _parts.size();
+}
+
+bool b_tree::cursor::seek(int64_t lower)
+{
+    for(auto& p : _parts)
+        p.seek(lower);
+    return _pick(true);
+}
+
+bool b_tree::cursor::seek_first()
+{
+    for(auto& p : _parts)
+        p.seek_first();
+    return _pick(true);
+}
+
+bool b_tree::cursor::seek_last()
+{
+    for(auto& p : _parts)
+        p.seek_last();
+    return _pick(false);
+}
+
+bool b_tree::cursor::next()
+{
+    if(!valid())
+        return false;
+
+    if(!_forward)
+    {
+        // The other parts sit before the current key, move them to the first key after it (keys are
+        // unique across parts, so >= is >).
+        auto k = key();
+        for(size_t i = 0; i < _parts.size(); ++i)
+        {
+            if(i != _cur)
+                _parts[i].seek(k);
+        }
+    }
+
+    _parts[_cur].next();
+    return _pick(true);
+}
+
+bool b_tree::cursor::prev()
+{
+    if(!valid())
+        return false;
+
+    if(_forward)
+    {
+        // The other parts sit after the current key, move them to the last key before it.
+        auto k = key();
+        for(size_t i = 0; i < _parts.size(); ++i)
+        {
+            if(i == _cur)
+                continue;
+            if(_parts[i].seek(k))
+                _parts[i].prev();
+            else _parts[i].seek_last();
+        }
+    }
+
+    _parts[_cur].prev();
+    return _pick(false);
+}
+
+int64_t b_tree::cursor::key() const
+{
+    if(!valid())
+        throw runtime_error("Cursor is not positioned on a key.");
+    return _parts[_cur].key();
+}
+
+int64_t b_tree::cursor::value() const
+{
+    if(!valid())
+        throw runtime_error("Cursor is not positioned on a key.");
+    return _parts[_cur].value();
+}
+
+bool b_tree::cursor::_pick(bool smallest)
+{
+    _forward = smallest;
+    _cur = _parts.size();
+    for(size_t i = 0; i < _parts.size(); ++i)
+    {
+        if(!_parts[i].valid())
+            continue;
+        if(_cur == _parts.size() || (_parts[i].key() < _parts[_cur].key()) == smallest)
+            _cur = i;
+    }
+    return valid();
+}
+
+b_tree::cursor::part::part(const b_tree& t, int64_t root_ofs) :
+    _t(&t),
+    _root_ofs(root_ofs),
+    _stack()
+{
+    _stack.reserve(16);
+}
+
+bool b_tree::cursor::part::seek(int64_t lower)
+{
+    _stack.clear();
+
+    if(_root_ofs == 0)
+        return false;
+
+    // Descend all the way to a leaf. Along the way every internal frame records the child we went into,
+    // which is exactly the state _ascend_forward() needs if the leaf has nothing >= lower.
+    auto ofs = _root_ofs;
+    while(true)
+    {
+        b_tree_node node(_t->_p, _t->_layout, ofs);
+        uint16_t i = key_lower_bound(node._view.keys(), node._num_keys(), lower);
+        _stack.push_back({node, i});
+        if(node._leaf())
+            break;
+        ofs = node._child_ofs(i);
+    }
+
+    if(_top().i >= _top().node._num_keys())
+        _ascend_forward();
+
+    while(valid() && !_top().node._valid_key(_top().i))
+        _step_forward();
+
+    return valid();
+}
+
+bool b_tree::cursor::part::seek_first()
+{
+    _stack.clear();
+
+    if(_root_ofs == 0)
+        return false;
+
+    _descend_leftmost(_root_ofs);
+
+    while(valid() && !_top().node._valid_key(_top().i))
+        _step_forward();
+
+    return valid();
+}
+
+bool b_tree::cursor::part::seek_last()
+{
+    _stack.clear();
+
+    if(_root_ofs == 0)
+        return false;
+
+    _descend_rightmost(_root_ofs);
+
+    while(valid() && !_top().node._valid_key(_top().i))
+        _step_backward();
+
+    return valid();
+}
+
+bool b_tree::cursor::part::next()
+{
+    if(!valid())
+        return false;
+
+    do
+    {
+        _step_forward();
+    } while(valid() && !_top().node._valid_key(_top().i));
+
+    return valid();
+}
+
+bool b_tree::cursor::part::prev()
+{
+    if(!valid())
+        return false;
+
+    do
+    {
+        _step_backward();
+    } while(valid() && !_top().node._valid_key(_top().i));
+
+    return valid();
+}
+
+void b_tree::cursor::part::_descend_leftmost(int64_t ofs)
+{
+    while(true)
+    {
+        b_tree_node node(_t->_p, _t->_layout, ofs);
+        _stack.push_back({node, 0});
+        if(node._leaf())
+            break;
+        ofs = node._child_ofs(0);
+    }
+
+    if(_top().node._num_keys() == 0)
+        _ascend_forward();
+}
+
+void b_tree::cursor::part::_descend_rightmost(int64_t ofs)
+{
+    while(true)
+    {
+        b_tree_node node(_t->_p, _t->_layout, ofs);
+        auto n = node._num_keys();
+        if(node._leaf())
+        {
+            _stack.push_back({node, (uint16_t)((n > 0)?n - 1:0)});
+            if(n == 0)
+                _ascend_backward();
+            break;
+        }
+        _stack.push_back({node, n});
+        ofs = node._child_ofs(n);
+    }
+}
+
+void b_tree::cursor::part::_ascend_forward()
+{
+    // Pop until we reach an ancestor that still has a key to the right of the child we were in.
+    if(!_stack.empty())
+        _stack.pop_back();
+    while(!_stack.empty() && _top().i >= _top().node._num_keys())
+        _stack.pop_back();
+}
+
+void b_tree::cursor::part::_ascend_backward()
+{
+    // Pop until we reach an ancestor that has a key to the left of the child we were in.
+    if(!_stack.empty())
+        _stack.pop_back();
+    while(!_stack.empty())
+    {
+        if(_top().i > 0)
+        {
+            --_top().i;
+            return;
+        }
+        _stack.pop_back();
+    }
+}
+
+bool b_tree::cursor::part::_step_forward()
+{
+    auto& f = _top();
+    ++f.i;
+
+    if(!f.node._leaf())
+        _descend_leftmost(f.node._child_ofs(f.i));
+    else if(f.i >= f.node._num_keys())
+        _ascend_forward();
+
+    return valid();
+}
+
+bool b_tree::cursor::part::_step_backward()
+{
+    auto& f = _top();
+
+    if(!f.node._leaf())
+        _descend_rightmost(f.node._child_ofs(f.i));
+    else if(f.i > 0)
+        --f.i;
+    else _ascend_backward();
+
+    return valid();
 }
@@ -1,149 +1,146 @@
 
 #include "tdb/b_tree_node.h"
+#include "tdb/key_search.h"
 #include <iostream>
+#include <cstring>
 
 using namespace std;
 
-// Object copy constructor, non deep copy
-b_tree_node::b_tree_node(const b_tree_node& obj) :
-    _p(obj._p),
-    _ofs_field(obj._ofs_field),
-    _mm(_p.map_page_from(_ofs_field)),
-    _min_degree_field(nullptr),
-    _leaf_field(nullptr),
-    _num_keys_field(nullptr),
-    _keys_field(nullptr),
-    _valid_keys_field(nullptr),
-    _vals_field(nullptr),
-    _child_ofs_field(nullptr)
-{
-    auto read_ptr = _mm.map().first;
-
-    _min_degree_field = (uint16_t*)read_ptr;
-    read_ptr += sizeof(uint16_t);
+// Every min_degree whose nodes fit in a page, for both layouts.
+static constexpr uint16_t OFFSETS_TABLE_SIZE = 128;
 
-    _leaf_field = (uint16_t*)read_ptr;
-    read_ptr += sizeof(uint16_t);
+struct offsets_table
+{
+    node_offsets entries[2][OFFSETS_TABLE_SIZE];
+};
 
-    _num_keys_field = (uint16_t*)read_ptr;
-    read_ptr += sizeof(uint16_t);
+static constexpr offsets_table _build_offsets_table()
+{
+    offsets_table t {};
+    for(uint16_t min_degree = 0; min_degree < OFFSETS_TABLE_SIZE; ++min_degree)
+    {
+        t.entries[NODE_LAYOUT_PACKED][min_degree] = node_offsets::compute(min_degree, NODE_LAYOUT_PACKED);
+        t.entries[NODE_LAYOUT_ALIGNED][min_degree] = node_offsets::compute(min_degree, NODE_LAYOUT_ALIGNED);
+    }
+    return t;
+}
 
-    _keys_field = (int64_t*)read_ptr;
-    read_ptr += sizeof(int64_t) * ((*_min_degree_field * 2) - 1);
+static constexpr offsets_table OFFSETS_TABLE = _build_offsets_table();
 
-    _valid_keys_field = (uint8_t*)read_ptr;
-    read_ptr += sizeof(uint8_t) * ((*_min_degree_field * 2) - 1);
+static_assert(node_offsets::compute(OFFSETS_TABLE_SIZE, NODE_LAYOUT_PACKED).size > pager::block_size() &&
+              node_offsets::compute(OFFSETS_TABLE_SIZE, NODE_LAYOUT_ALIGNED).size > pager::block_size(),
+              "The offsets table must cover every min_degree that fits in a page.");
 
-    _vals_field = (int64_t*)read_ptr;
-    read_ptr += sizeof(int64_t) * ((*_min_degree_field * 2) - 1);
+const node_offsets& node_offsets::of(uint16_t min_degree, node_layout layout)
+{
+    if(min_degree < 2 || min_degree >= OFFSETS_TABLE_SIZE || (layout != NODE_LAYOUT_PACKED && layout != NODE_LAYOUT_ALIGNED))
+        throw runtime_error("Invalid node min_degree or layout.");
+    return OFFSETS_TABLE.entries[layout][min_degree];
+}
 
-    _child_ofs_field = (int64_t*)read_ptr;
+// Object copy constructor, non deep copy
+b_tree_node::b_tree_node(const b_tree_node& obj) :
+    _p(obj._p),
+    _ofs_field(obj._ofs_field),
+    _view(_p.pin_page(_ofs_field), obj._view.offsets()),
+    _dirty(obj._dirty)
+{
 }
 
-b_tree_node::b_tree_node(const pager& p, uint16_t min_degree, bool leaf) :
+b_tree_node::b_tree_node(const pager& p, node_layout layout, uint16_t min_degree, bool leaf, int64_t ofs) :
     _p(p),
-    _ofs_field(_p.append_page()),
-    _mm(_p.map_page_from(_ofs_field)),
-    _min_degree_field(nullptr),
-    _leaf_field(nullptr),
-    _num_keys_field(nullptr),
-    _keys_field(nullptr),
-    _valid_keys_field(nullptr),
-    _vals_field(nullptr),
-    _child_ofs_field(nullptr)
+    _ofs_field((ofs != 0)?ofs:_p.append_page()),
+    _view(_p.pin_page(_ofs_field), node_offsets::of(min_degree, layout)),
+    _dirty(true)
 {
-    auto read_ptr = _mm.map().first;
-
-    _min_degree_field = (uint16_t*)read_ptr;
-    *(_min_degree_field) = min_degree;
-    read_ptr += sizeof(uint16_t);
-
-    _leaf_field = (uint16_t*)read_ptr;
-    *(_leaf_field) = leaf ? 1 : 0;
-    read_ptr += sizeof(uint16_t);
-
-    _num_keys_field = (uint16_t*)read_ptr;
-    *(_num_keys_field) = 0;
-    read_ptr += sizeof(uint16_t);
-
-    _keys_field = (int64_t*)read_ptr;
-    read_ptr += sizeof(int64_t) * ((*_min_degree_field * 2) - 1);
-
-    _valid_keys_field = (uint8_t*)read_ptr;
-    read_ptr += sizeof(uint8_t) * ((*_min_degree_field * 2) - 1);
-
-    _vals_field = (int64_t*)read_ptr;
-    read_ptr += sizeof(int64_t) * ((*_min_degree_field * 2) - 1);
+    // The page may be a reused one (from the free list or a lost insert attempt).
+    memset(_view.page(), 0, _p.block_size());
 
-    _child_ofs_field = (int64_t*)read_ptr;
+    auto hdr = (uint16_t*)_view.page();
+    hdr[0] = min_degree;
+    hdr[1] = leaf ? 1 : 0;
+    hdr[2] = 0;
 }
 
-b_tree_node::b_tree_node(const pager& p, int64_t ofs) :
+b_tree_node::b_tree_node(const pager& p, node_layout layout, int64_t ofs) :
     _p(p),
     _ofs_field(ofs),
-    _mm(_p.map_page_from(_ofs_field))
+    _view(),
+    _dirty(false)
 {
     if(ofs == 0)
         throw runtime_error("Unable to create b_tree_node from offset 0");
 
-    auto read_ptr = _mm.map().first;
-
-    _min_degree_field = (uint16_t*)read_ptr;
-    read_ptr += sizeof(uint16_t);
-
-    _leaf_field = (uint16_t*)read_ptr;
-    read_ptr += sizeof(uint16_t);
-
-    _num_keys_field = (uint16_t*)read_ptr;
-    read_ptr += sizeof(uint16_t);
-
-    _keys_field = (int64_t*)read_ptr;
-    read_ptr += sizeof(int64_t) * ((*_min_degree_field * 2) - 1);
+    _view = node_view(_p.pin_page(_ofs_field), layout);
+}
 
-    _valid_keys_field = (uint8_t*)read_ptr;
-    read_ptr += sizeof(uint8_t) * ((*_min_degree_field * 2) - 1);
+b_tree_node::~b_tree_node() noexcept
+{
+    try
+    {
+        _p.unpin_page(_ofs_field, _dirty);
+    }
+    catch(...)
+    {
+    }
+}
 
-    _vals_field = (int64_t*)read_ptr;
-    read_ptr += sizeof(int64_t) * ((*_min_degree_field * 2) - 1);
+size_t b_tree_node::node_size(uint16_t min_degree, node_layout layout)
+{
+    return node_offsets::compute(min_degree, layout).size;
+}
 
-    _child_ofs_field = (int64_t*)read_ptr;
+uint16_t b_tree_node::max_min_degree(size_t page_size, node_layout layout)
+{
+    uint16_t min_degree = 2;
+    while(node_size(min_degree + 1, layout) <= page_size)
+        ++min_degree;
+    return min_degree;
 }
 
-void b_tree_node::_insert_non_full(int64_t k, int64_t v)
+bool b_tree_node::_insert_non_full(int64_t k, int64_t v)
 {
-    // Initialize index as index of rightmost element
-    int i = _num_keys()-1;
+    _mark_dirty();
+
+    // Find the index of the rightmost key that is less than or equal to k
+    int i = key_lower_bound(_view.keys(), _num_keys(), k);
+    while (i < _num_keys() && _view.keys()[i] == k)
+        i++;
+    i--;
  
     // If this is a leaf node
     if (_leaf())
     {
-        // The following loop does two things
-        // a) Finds the location of new key to be inserted
-        // b) Moves all greater keys to one place ahead
-        while (i >= 0 && _keys_field[i] > k)
+        // A lazily removed key is made valid again in place (the first equal key is the one a search sees).
+        int found = key_lower_bound(_view.keys(), _num_keys(), k);
+        if(found < _num_keys() && _view.keys()[found] == k)
         {
-            _keys_field[i+1] = _keys_field[i];
-            _valid_keys_field[i+1] = _valid_keys_field[i];
-            _vals_field[i+1] = _vals_field[i];
-            i--;
+            if(_valid_key(found))
+                throw runtime_error("Duplicate key");
+            _set_valid_key(found, true);
+            _view.vals()[found] = v;
+            return true;
         }
 
-        if(i >= 0 && (_keys_field[i] == k && _valid_keys_field[i] == 1))
-            throw runtime_error("Duplicate key");
+        // Move all greater keys to one place ahead
+        for (int j = _num_keys()-1; j > i; j--)
+        {
+            _view.keys()[j+1] = _view.keys()[j];
+            _set_valid_key(j+1, _valid_key(j));
+            _view.vals()[j+1] = _view.vals()[j];
+        }
  
         // Insert the new key at found location
-        _keys_field[i+1] = k;
-        _valid_keys_field[i+1] = 1;
-        _vals_field[i+1] = v;
+        _view.keys()[i+1] = k;
+        _set_valid_key(i+1, true);
+        _view.vals()[i+1] = v;
         _set_num_keys(_num_keys() + 1);
+        return false;
     }
     else // If this node is not leaf
     {
-        // Find the child which is going to have the new key
-        while (i >= 0 && _keys_field[i] > k)
-            i--;
- 
-        b_tree_node child(_p, _child_ofs(i+1));
+        // The child which is going to have the new key is _child_ofs(i+1)
+        b_tree_node child(_p, _layout(), _child_ofs(i+1));
         // See if the found child is full
         if (child._num_keys() == 2*_min_degree() - 1)
         {
@@ -153,37 +150,40 @@ void b_tree_node::_insert_non_full(int64_t k, int64_t v)
             // After split, the middle key of _child_ofs[i] goes up and
             // _child_ofs[i] is splitted into two.  See which of the two
             // is going to have the new key
-            if (_keys_field[i+1] < k)
+            if (_view.keys()[i+1] < k)
                 i++;
         }
 
-        b_tree_node new_child(_p, _child_ofs_field[i+1]);
-        new_child._insert_non_full(k, v);
+        b_tree_node new_child(_p, _layout(), _view.child_ofs()[i+1]);
+        return new_child._insert_non_full(k, v);
     }
 }
 
-void b_tree_node::_split_child(int i, int64_t ofs)
+void b_tree_node::_split_child(int i, int64_t ofs, int64_t new_ofs)
 {
-    b_tree_node original_node(_p, ofs);
+    _mark_dirty();
+
+    b_tree_node original_node(_p, _layout(), ofs);
+    original_node._mark_dirty();
 
     // Create a new node which is going to store (t-1) keys
     // of original_node
-    b_tree_node new_node(_p, original_node._min_degree(), original_node._leaf());
+    b_tree_node new_node(_p, _layout(), original_node._min_degree(), original_node._leaf(), new_ofs);
     new_node._set_num_keys(_min_degree() - 1);
  
     // Copy the last (min_degree-1) keys of original_node to new_node
     for (int j = 0; j < _min_degree()-1; j++)
     {
-        new_node._keys_field[j] = original_node._keys_field[j+_min_degree()];
-        new_node._valid_keys_field[j] = original_node._valid_keys_field[j+_min_degree()];
-        new_node._vals_field[j] = original_node._vals_field[j+_min_degree()];
+        new_node._view.keys()[j] = original_node._view.keys()[j+_min_degree()];
+        new_node._set_valid_key(j, original_node._valid_key(j+_min_degree()));
+        new_node._view.vals()[j] = original_node._view.vals()[j+_min_degree()];
     }
  
     // Copy the last min_degree children of original_node to new_node
     if (original_node._leaf() == false)
     {
         for (int j = 0; j < _min_degree(); j++)
-            new_node._child_ofs_field[j] = original_node._child_ofs_field[j+_min_degree()];
+            new_node._view.child_ofs()[j] = original_node._view.child_ofs()[j+_min_degree()];
     }
  
     // Reduce the number of keys in original_node
@@ -192,69 +192,150 @@ void b_tree_node::_split_child(int i, int64_t ofs)
     // Since this node is going to have a new child,
     // create space of new child
     for (int j = _num_keys(); j >= i+1; j--)
-        _child_ofs_field[j+1] = _child_ofs_field[j];
+        _view.child_ofs()[j+1] = _view.child_ofs()[j];
  
     // Link the new child to this node
-    _child_ofs_field[i+1] = new_node._ofs();
+    _view.child_ofs()[i+1] = new_node._ofs();
  
     // A key of original_node will move to this node. Find the location of
     // new key and move all greater keys one space ahead
     for (int j = _num_keys()-1; j >= i; j--)
     {
-        _keys_field[j+1] = _keys_field[j];
-        _valid_keys_field[j+1] = _valid_keys_field[j];
-        _vals_field[j+1] = _vals_field[j];
+        _view.keys()[j+1] = _view.keys()[j];
+        _set_valid_key(j+1, _valid_key(j));
+        _view.vals()[j+1] = _view.vals()[j];
     }
  
     // Copy the middle key of original_node to this node
-    _keys_field[i] = original_node._keys_field[_min_degree()-1];
-    _valid_keys_field[i] = original_node._valid_keys_field[_min_degree()-1];
-    _vals_field[i] = original_node._vals_field[_min_degree()-1];
+    _view.keys()[i] = original_node._view.keys()[_min_degree()-1];
+    _set_valid_key(i, original_node._valid_key(_min_degree()-1));
+    _view.vals()[i] = original_node._view.vals()[_min_degree()-1];
  
     // Increment count of keys in this node
     _set_num_keys(_num_keys() + 1);
 }
 
-optional<int64_t> b_tree_node::_search(int64_t k)
-{
-    // Find the first key greater than or equal to k
-    int i = 0;
-    while (i < _num_keys() && k > _keys_field[i])
-        i++;
- 
-    optional<int64_t> result;
-    // If the found key is equal to k, return this node
-    if (_keys_field[i] == k)
-    {
-        if(_valid_keys_field[i] == 1)
-            result = _vals_field[i];
-        return result;
-    }
- 
-    // If key is not found here and this is a leaf node
-    if (_leaf() == true)
-        return result;
- 
-    // Go to the appropriate child
-    b_tree_node child(_p, _child_ofs(i));
-    return child._search(k);
-}
-
 void b_tree_node::_remove(int64_t k)
 {
-    int i = 0;
-    while(i < _num_keys() && _keys_field[i] < k)
-        i++;
+    int i = key_lower_bound(_view.keys(), _num_keys(), k);
 
-    if(i < _num_keys() && _keys_field[i] == k)
+    if(i < _num_keys() && _view.keys()[i] == k)
     {
-        _valid_keys_field[i] = 0;
+        _set_valid_key(i, false);
         return;
     }
 
    if(_leaf())
         return;
 
-    b_tree_node child(_p, _child_ofs(i));
+    b_tree_node child(_p, _layout(), _child_ofs(i));
     child._remove(k);
 }
+
+bool b_tree_node::_update(int64_t k, int64_t v)
+{
+    int i = key_lower_bound(_view.keys(), _num_keys(), k);
+
+    if(i < _num_keys() && _view.keys()[i] == k)
+    {
+        if(!_valid_key(i))
+            return false;
+        _set_val(i, v);
+        return true;
+    }
+
+    if(_leaf())
+        return false;
+
+    b_tree_node child(_p, _layout(), _child_ofs(i));
+    return child._update(k, v);
+}
+
+void b_tree_node::_copy_entry(uint16_t i, const b_tree_node& src, uint16_t j)
+{
+    _set_key(i, src._key(j));
+    _set_valid_key(i, src._valid_key(j));
+    _set_val(i, src._val(j));
+}
+
+void b_tree_node::_remove_at(uint16_t i)
+{
+    for(uint16_t j = i; j + 1 < _num_keys(); ++j)
+        _copy_entry(j, *this, j + 1);
+
+    _set_num_keys(_num_keys() - 1);
+}
+
+void b_tree_node::_borrow_from_left(uint16_t i)
+{
+    b_tree_node child(_p, _layout(), _child_ofs(i));
+    b_tree_node left(_p, _layout(), _child_ofs(i-1));
+
+    // Make room at the front of child for the separator (and the last child of left).
+    for(int j = child._num_keys() - 1; j >= 0; --j)
+        child._copy_entry(j+1, child, j);
+    if(!child._leaf())
+    {
+        for(int j = child._num_keys(); j >= 0; --j)
+            child._set_child_ofs(j+1, child._child_ofs(j));
+        child._set_child_ofs(0, left._child_ofs(left._num_keys()));
+    }
+
+    child._copy_entry(0, *this, i-1);
+    _copy_entry(i-1, left, left._num_keys() - 1);
+
+    child._set_num_keys(child._num_keys() + 1);
+    left._set_num_keys(left._num_keys() - 1);
+}
+
+void b_tree_node::_borrow_from_right(uint16_t i)
+{
+    b_tree_node child(_p, _layout(), _child_ofs(i));
+    b_tree_node right(_p, _layout(), _child_ofs(i+1));
+
+    auto n = child._num_keys();
+    child._copy_entry(n, *this, i);
+    if(!child._leaf())
+        child._set_child_ofs(n+1, right._child_ofs(0));
+    child._set_num_keys(n + 1);
+
+    _copy_entry(i, right, 0);
+
+    for(uint16_t j = 0; j + 1 < right._num_keys(); ++j)
+        right._copy_entry(j, right, j+1);
+    if(!right._leaf())
+    {
+        for(uint16_t j = 0; j < right._num_keys(); ++j)
+            right._set_child_ofs(j, right._child_ofs(j+1));
+    }
+    right._set_num_keys(right._num_keys() - 1);
+}
+
+int64_t b_tree_node::_merge_children(uint16_t i)
+{
+    b_tree_node child(_p, _layout(), _child_ofs(i));
+    b_tree_node right(_p, _layout(), _child_ofs(i+1));
+    auto right_ofs = right._ofs();
+
+    // The separator comes down between the two halves.
+    auto n = child._num_keys();
+    child._copy_entry(n, *this, i);
+    for(uint16_t j = 0; j < right._num_keys(); ++j)
+        child._copy_entry(n+1+j, right, j);
+    if(!child._leaf())
+    {
+        for(uint16_t j = 0; j <= right._num_keys(); ++j)
+            child._set_child_ofs(n+1+j, right._child_ofs(j));
+    }
+    child._set_num_keys(n + 1 + right._num_keys());
+
+    // Close the gap left by the separator and the unlinked child.
+    for(uint16_t j = i; j + 1 < _num_keys(); ++j)
+    {
+        _copy_entry(j, *this, j+1);
+        _set_child_ofs(j+1, _child_ofs(j+2));
+    }
+    _set_num_keys(_num_keys() - 1);
+
+    return right_ofs;
+}
@@ -0,0 +1,209 @@
+
+#include "tdb/blob_b_tree.h"
+#include "tdb/b_tree_node.h"
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+// blob_b_tree header layout (within the pagers user header)
+//   [0, 2)    0 (never a valid b_tree min_degree)
+//   [2, 4)    node layout (NODE_LAYOUT_SLOTTED)
+static const size_t LAYOUT_OFS = 2;
+
+// Overflow pages hold the next ofs in their first 8 bytes and value bytes in the rest.
+static const size_t OVERFLOW_HEADER_SIZE = 8;
+
+static string _value(const pager& p, const blob_node& n, uint16_t i)
+{
+    if((n.flags(i) & BLOB_OVERFLOW) == 0)
+        return string(n.inline_value(i));
+
+    string value;
+    auto remaining = n.value_size(i);
+    value.reserve(remaining);
+    auto ofs = n.overflow(i);
+    while(remaining > 0)
+    {
+        if(ofs == 0)
+            throw runtime_error("Overflow chain is shorter than its value.");
+        auto page = p.pin_page(ofs);
+        auto take = std::min<size_t>(remaining, pager::block_size() - OVERFLOW_HEADER_SIZE);
+        value.append((const char*)page + OVERFLOW_HEADER_SIZE, take);
+        auto next = *(uint64_t*)page;
+        p.unpin_page(ofs, false);
+        remaining -= take;
+        ofs = next;
+    }
+    return value;
+}
+
+static uint64_t _write_overflow(const pager& p, string_view value, vector<uint64_t>& pages)
+{
+    auto per_page = pager::block_size() - OVERFLOW_HEADER_SIZE;
+    auto first = pages.size();
+    for(size_t done = 0; done < value.size(); done += per_page)
+        pages.push_back(p.append_page());
+
+    for(size_t i = first; i < pages.size(); ++i)
+    {
+        auto done = (i - first) * per_page;
+        auto take = std::min(per_page, value.size() - done);
+        auto page = p.pin_page(pages[i]);
+        *(uint64_t*)page = (i + 1 < pages.size())?pages[i + 1]:0;
+        memcpy(page + OVERFLOW_HEADER_SIZE, value.data() + done, take);
+        p.unpin_page(pages[i], true);
+    }
+
+    return pages[first];
+}
+
+static void _overflow_pages(const pager& p, uint64_t ofs, vector<uint64_t>& pages)
+{
+    while(ofs != 0)
+    {
+        pages.push_back(ofs);
+        auto page = p.pin_page(ofs);
+        auto next = *(uint64_t*)page;
+        p.unpin_page(ofs, false);
+        ofs = next;
+    }
+}
+
+// The blob_node format as cow_tree sees it.
+struct blob_hooks
+{
+    using node = blob_node;
+    using entry = blob_entry;
+    using key_arg = string_view;
+    using key_type = string;
+    using value_type = string;
+
+    static bool live(const blob_node& n, uint16_t i) {return (n.flags(i) & BLOB_REMOVED) == 0;}
+    static bool live(const blob_entry& e) {return (e.flags & BLOB_REMOVED) == 0;}
+    static blob_entry tombstone(const blob_entry& e) {return {e.key, BLOB_REMOVED, 0, string(), 0, e.child};}
+
+    static void release(const pager& p, const blob_entry& e, vector<uint64_t>& pages)
+    {
+        if(e.flags & BLOB_OVERFLOW)
+            _overflow_pages(p, e.overflow, pages);
+    }
+
+    static string value(const pager& p, const blob_node& n, uint16_t i) {return _value(p, n, i);}
+
+    static size_t encoded_size(const vector<blob_entry>& entries, size_t first, size_t last, bool leaf, uint64_t)
+    {
+        return blob_node::encoded_size(entries, first, last, leaf);
+    }
+
+    static bool write(const pager& p, uint64_t ofs, bool leaf, const vector<blob_entry>& entries, size_t first, size_t last, uint64_t right_child)
+    {
+        if(blob_node::encoded_size(entries, first, last, leaf) > pager::block_size())
+            return false;
+        blob_node::write(p, ofs, leaf, entries, first, last, right_child);
+        return true;
+    }
+
+    // Cells move when a child changes size, there is no cheaper copy than a full write.
+    static bool write_with_child(const pager&, uint64_t, uint64_t, uint16_t, uint64_t) {return false;}
+
+    static size_t split_point(const vector<blob_entry>& entries, bool leaf, uint64_t, size_t)
+    {
+        // The entry that leaves the two halves closest in size. Splitting around the entry that was just
+        // added (or grew) always fits, both halves are then parts of a node that fit before.
+        auto n = entries.size();
+        size_t best = n, best_size = numeric_limits<size_t>::max();
+        for(size_t m = 0; m < n; ++m)
+        {
+            auto ls = blob_node::encoded_size(entries, 0, m, leaf);
+            auto rs = blob_node::encoded_size(entries, m + 1, n, leaf);
+            if(ls <= pager::block_size() && rs <= pager::block_size() && std::max(ls, rs) < best_size)
+            {
+                best = m;
+                best_size = std::max(ls, rs);
+            }
+        }
+        if(best == n)
+            throw runtime_error("Unable to split blob_node.");
+        return best;
+    }
+};
+
+blob_b_tree::blob_b_tree(const string& file_name) :
+    _p(file_name)
+{
+    if(*(uint16_t*)(_p.user_header() + LAYOUT_OFS) != NODE_LAYOUT_SLOTTED)
+        throw runtime_error("File is not a blob_b_tree.");
+}
+
+blob_b_tree::~blob_b_tree() noexcept
+{
+}
+
+void blob_b_tree::insert(string_view key, string_view value)
+{
+    _write(COW_INSERT, key, value);
+}
+
+void blob_b_tree::upsert(string_view key, string_view value)
+{
+    _write(COW_UPSERT, key, value);
+}
+
+optional<string> blob_b_tree::search(string_view key) const
+{
+    return cow_tree<blob_hooks>(_p).search(key);
+}
+
+void blob_b_tree::remove(string_view key)
+{
+    _write(COW_REMOVE, key, string_view());
+}
+
+vector<pair<string, string>> blob_b_tree::range(string_view lo, string_view hi) const
+{
+    return cow_tree<blob_hooks>(_p).range(lo, hi);
+}
+
+void blob_b_tree::create_db_file(const string& file_name)
+{
+    pager::create(file_name);
+
+    pager p(file_name);
+    *(uint16_t*)(p.user_header() + LAYOUT_OFS) = NODE_LAYOUT_SLOTTED;
+}
+
+void blob_b_tree::_write(cow_write_mode mode, string_view key, string_view value)
+{
+    if(key.size() > max_key_size)
+        throw runtime_error("Key is too long.");
+    if(value.size() > numeric_limits<uint32_t>::max())
+        throw runtime_error("Value is too long.");
+
+    vector<uint64_t> staged;
+
+    try
+    {
+        blob_entry e{string(key), 0, (uint32_t)value.size(), string(), 0, 0};
+        if(mode != COW_REMOVE)
+        {
+            if(value.size() > max_inline_value_size)
+            {
+                e.flags = BLOB_OVERFLOW;
+                e.overflow = _write_overflow(_p, value, staged);
+            }
+            else e.value = value;
+        }
+
+        cow_tree<blob_hooks>(_p).write(mode, key, e);
+    }
+    catch(...)
+    {
+        // The write published nothing, so neither was the chain.
+        for(auto ofs : staged)
+            _p.free_page(ofs);
+        throw;
+    }
+}
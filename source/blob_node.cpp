@@ -0,0 +1,189 @@
+
+#include "tdb/blob_node.h"
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+static const size_t HEADER_SIZE = 16;
+
+static size_t _common_prefix(const string& a, const string& b)
+{
+    auto n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while(i < n && a[i] == b[i])
+        ++i;
+    return i;
+}
+
+blob_node::blob_node(const pager& p, uint64_t ofs) :
+    _p(p),
+    _ofs(ofs),
+    _page(nullptr)
+{
+    if(ofs == 0)
+        throw runtime_error("Unable to create blob_node from offset 0");
+
+    _page = _p.pin_page(_ofs);
+}
+
+blob_node::~blob_node() noexcept
+{
+    try
+    {
+        _p.unpin_page(_ofs, false);
+    }
+    catch(...)
+    {
+    }
+}
+
+uint16_t blob_node::lower_bound(string_view k, bool& found) const
+{
+    found = false;
+
+    // Every key starts with the prefix, so comparing the head of k with it settles k against all of them
+    // at once.
+    auto prefix = _prefix();
+    auto c = k.substr(0, prefix.size()).compare(prefix);
+    if(c < 0)
+        return 0;
+    if(c > 0)
+        return count();
+
+    auto rest = k.substr(prefix.size());
+    uint16_t lo = 0, hi = count();
+    while(lo < hi)
+    {
+        uint16_t mid = lo + ((hi - lo) / 2);
+        if(_suffix(mid).compare(rest) < 0)
+            lo = mid + 1;
+        else hi = mid;
+    }
+
+    found = lo < count() && _suffix(lo) == rest;
+    return lo;
+}
+
+string blob_node::key(uint16_t i) const
+{
+    string k(_prefix());
+    k.append(_suffix(i));
+    return k;
+}
+
+string_view blob_node::inline_value(uint16_t i) const
+{
+    auto cell = _cell(i);
+    auto suffix_size = *(uint16_t*)cell;
+    return string_view((const char*)cell + _cell_header() + suffix_size, value_size(i));
+}
+
+uint64_t blob_node::overflow(uint16_t i) const
+{
+    auto cell = _cell(i);
+    auto suffix_size = *(uint16_t*)cell;
+    return *(uint64_t*)(cell + _cell_header() + suffix_size);
+}
+
+uint64_t blob_node::child(uint16_t i) const
+{
+    if(i == count())
+        return *(uint64_t*)(_page + 8);
+    return *(uint64_t*)(_cell(i) + 8);
+}
+
+blob_entry blob_node::entry(uint16_t i) const
+{
+    blob_entry e;
+    e.key = key(i);
+    e.flags = flags(i);
+    e.value_size = value_size(i);
+    e.overflow = 0;
+    if(e.flags & BLOB_OVERFLOW)
+        e.overflow = overflow(i);
+    else if((e.flags & BLOB_REMOVED) == 0)
+        e.value = inline_value(i);
+    e.child = (leaf())?0:child(i);
+    return e;
+}
+
+void blob_node::entries(vector<blob_entry>& out) const
+{
+    out.clear();
+    out.reserve(count() + 1);
+    for(uint16_t i = 0; i < count(); ++i)
+        out.push_back(entry(i));
+}
+
+size_t blob_node::encoded_size(const vector<blob_entry>& entries, size_t first, size_t last, bool leaf)
+{
+    size_t prefix = (last > first)?_common_prefix(entries[first].key, entries[last - 1].key):0;
+    size_t size = HEADER_SIZE + prefix;
+    for(size_t i = first; i < last; ++i)
+    {
+        auto& e = entries[i];
+        size += sizeof(uint16_t) + ((leaf)?8:16) + (e.key.size() - prefix);
+        size += (e.flags & BLOB_OVERFLOW)?sizeof(uint64_t):e.value.size();
+    }
+    return size;
+}
+
+void blob_node::write(const pager& p, uint64_t ofs, bool leaf, const vector<blob_entry>& entries, size_t first, size_t last, uint64_t right_child)
+{
+    if(encoded_size(entries, first, last, leaf) > pager::block_size())
+        throw runtime_error("blob_node entries do not fit in a page.");
+
+    // Keys are sorted, so the prefix shared by the first and last key is shared by all of them.
+    size_t prefix = (last > first)?_common_prefix(entries[first].key, entries[last - 1].key):0;
+
+    auto page = p.pin_page(ofs);
+    memset(page, 0, pager::block_size());
+
+    *(uint16_t*)page = (uint16_t)(last - first);
+    *(uint16_t*)(page + 2) = (leaf)?1:0;
+    *(uint16_t*)(page + 4) = (uint16_t)prefix;
+    *(uint64_t*)(page + 8) = (leaf)?0:right_child;
+    if(prefix > 0)
+        memcpy(page + HEADER_SIZE, entries[first].key.data(), prefix);
+
+    auto slots = (uint16_t*)(page + HEADER_SIZE + prefix);
+    size_t end = pager::block_size();
+    for(size_t i = first; i < last; ++i)
+    {
+        auto& e = entries[i];
+        auto suffix_size = e.key.size() - prefix;
+        auto value_bytes = (e.flags & BLOB_OVERFLOW)?sizeof(uint64_t):e.value.size();
+        size_t header = (leaf)?8:16;
+
+        end -= header + suffix_size + value_bytes;
+        auto cell = page + end;
+        *(uint16_t*)cell = (uint16_t)suffix_size;
+        *(uint16_t*)(cell + 2) = e.flags;
+        *(uint32_t*)(cell + 4) = e.value_size;
+        if(!leaf)
+            *(uint64_t*)(cell + 8) = e.child;
+        memcpy(cell + header, e.key.data() + prefix, suffix_size);
+        if(e.flags & BLOB_OVERFLOW)
+            *(uint64_t*)(cell + header + suffix_size) = e.overflow;
+        else if(value_bytes > 0)
+            memcpy(cell + header + suffix_size, e.value.data(), value_bytes);
+
+        slots[i - first] = (uint16_t)end;
+    }
+
+    p.unpin_page(ofs, true);
+}
+
+const uint8_t* blob_node::_cell(uint16_t i) const
+{
+    auto slots = (const uint16_t*)(_page + HEADER_SIZE + *(uint16_t*)(_page + 4));
+    return _page + slots[i];
+}
+
+string_view blob_node::_suffix(uint16_t i) const
+{
+    auto cell = _cell(i);
+    return string_view((const char*)cell + _cell_header(), *(uint16_t*)cell);
+}
@@ -0,0 +1,133 @@
+
+#include "tdb/bloom_filter.h"
+#include <stdexcept>
+#include <cstring>
+
+using namespace std;
+
+static const size_t BLOCK_SIZE = 64;
+static const size_t BLOCK_WORDS = BLOCK_SIZE / sizeof(uint64_t);
+static const uint64_t BLOCKS_PER_PAGE = pager::block_size() / BLOCK_SIZE;
+
+// Odd multipliers that spread the low half of the hash into one bit index per word (the same scheme as
+// the split block Bloom filters of Parquet, with 64 bit words).
+static const uint32_t SALT[BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// The murmur3 finalizer, every bit of the key affects every bit of the hash.
+static uint64_t _hash(int64_t key)
+{
+    auto h = (uint64_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t _mask(uint64_t h, size_t i)
+{
+    return 1ULL << (((uint32_t)h * SALT[i]) >> 26);
+}
+
+bloom_filter::bloom_filter(const pager& p, uint64_t ofs, uint64_t blocks) :
+    _p(p),
+    _ofs(ofs),
+    _blocks(blocks)
+{
+    if(ofs == 0 || blocks == 0 || blocks > UINT32_MAX)
+        throw runtime_error("Invalid bloom_filter.");
+}
+
+bloom_filter::~bloom_filter() noexcept
+{
+}
+
+void bloom_filter::add(int64_t key) const
+{
+    auto h = _hash(key);
+    auto b = _block(h);
+    auto page_ofs = _page_ofs(b);
+    auto words = (uint64_t*)(_p.pin_page(page_ofs) + ((b % BLOCKS_PER_PAGE) * BLOCK_SIZE));
+
+    bool dirty = false;
+    for(size_t i = 0; i < BLOCK_WORDS; ++i)
+    {
+        // Bits that are already set are left alone so re-adding a key does not take the line exclusive.
+        auto m = _mask(h, i);
+        if((__atomic_load_n(&words[i], __ATOMIC_RELAXED) & m) != m)
+        {
+            __atomic_fetch_or(&words[i], m, __ATOMIC_RELEASE);
+            dirty = true;
+        }
+    }
+
+    _p.unpin_page(page_ofs, dirty);
+}
+
+bool bloom_filter::may_contain(int64_t key) const
+{
+    auto h = _hash(key);
+    auto b = _block(h);
+    auto page_ofs = _page_ofs(b);
+    auto words = (const uint64_t*)(_p.pin_page(page_ofs) + ((b % BLOCKS_PER_PAGE) * BLOCK_SIZE));
+
+    // Every word is tested, there is no branch to mispredict on the way.
+    bool found = true;
+    for(size_t i = 0; i < BLOCK_WORDS; ++i)
+    {
+        auto m = _mask(h, i);
+        found &= (__atomic_load_n(&words[i], __ATOMIC_ACQUIRE) & m) == m;
+    }
+
+    _p.unpin_page(page_ofs, false);
+    return found;
+}
+
+uint64_t bloom_filter::capacity() const
+{
+    return (_blocks * BLOCK_SIZE * 8) / bits_per_key;
+}
+
+uint64_t bloom_filter::blocks_for(uint64_t keys)
+{
+    auto bits = BLOCK_SIZE * 8;
+    auto blocks = ((keys * bits_per_key) + bits - 1) / bits;
+    return (blocks == 0)?1:blocks;
+}
+
+uint64_t bloom_filter::create(const pager& p, uint64_t blocks)
+{
+    if(blocks == 0 || blocks > UINT32_MAX)
+        throw runtime_error("Invalid bloom_filter size.");
+
+    auto pages = (blocks + BLOCKS_PER_PAGE - 1) / BLOCKS_PER_PAGE;
+    uint64_t first = 0;
+    for(uint64_t i = 0; i < pages; ++i)
+    {
+        auto ofs = p.append_page();
+        if(i == 0)
+            first = ofs;
+        else if(ofs != first + (i * pager::block_size()))
+            throw runtime_error("bloom_filter pages are not contiguous.");
+
+        auto page = p.pin_page(ofs);
+        memset(page, 0, pager::block_size());
+        p.unpin_page(ofs, true);
+    }
+
+    return first;
+}
+
+uint64_t bloom_filter::_block(uint64_t h) const
+{
+    // The high half of the hash scaled into [0, blocks), the low half picks the bits.
+    return ((h >> 32) * _blocks) >> 32;
+}
+
+uint64_t bloom_filter::_page_ofs(uint64_t block) const
+{
+    return _ofs + ((block / BLOCKS_PER_PAGE) * pager::block_size());
+}
@@ -0,0 +1,434 @@
+
+#include "tdb/buffer_pool.h"
+#include <list>
+#include <array>
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+// CLOCK approximates LRU with a single reference bit per frame. The hand sweeps the frames clearing
+// reference bits and evicts the first unpinned frame it finds with its bit already clear.
+class clock_policy final : public eviction_policy
+{
+public:
+    clock_policy(size_t nFrames) :
+        _ref(nFrames, 0),
+        _resident(nFrames, 0),
+        _hand(0)
+    {
+    }
+
+    virtual void loaded(size_t frame, uint64_t) override
+    {
+        _ref[frame] = 1;
+        _resident[frame] = 1;
+    }
+
+    virtual void accessed(size_t frame) override
+    {
+        _ref[frame] = 1;
+    }
+
+    virtual void evicted(size_t frame, uint64_t) override
+    {
+        _ref[frame] = 0;
+        _resident[frame] = 0;
+    }
+
+    virtual bool victim(const function<bool(size_t)>& evictable, size_t& frame) override
+    {
+        auto n = _ref.size();
+
+        // Two full sweeps are always enough, the first clears every reference bit it passes.
+        for(size_t i = 0; i < 2*n; ++i)
+        {
+            auto f = _hand;
+            _hand = (_hand + 1) % n;
+
+            if(!_resident[f] || !evictable(f))
+                continue;
+
+            if(_ref[f])
+            {
+                _ref[f] = 0;
+                continue;
+            }
+
+            frame = f;
+            return true;
+        }
+
+        return false;
+    }
+
+private:
+    vector<uint8_t> _ref;
+    vector<uint8_t> _resident;
+    size_t _hand;
+};
+
+// LRU-K (with K=2) evicts the page whose second most recent reference is furthest in the past. Pages
+// that have been referenced only once are evicted first (oldest first), which keeps a one time scan from
+// flushing the frequently used upper levels of a tree out of the pool. Reference history for recently
+// evicted pages is retained so a page that comes back quickly is recognized.
+class lru_k_policy final : public eviction_policy
+{
+public:
+    lru_k_policy(size_t nFrames) :
+        _hist(nFrames),
+        _resident(nFrames, 0),
+        _clock(0),
+        _retained(),
+        _retainedOrder(),
+        _maxRetained(nFrames)
+    {
+    }
+
+    virtual void loaded(size_t frame, uint64_t ofs) override
+    {
+        _hist[frame] = {0, 0};
+
+        auto found = _retained.find(ofs);
+        if(found != _retained.end())
+        {
+            _hist[frame] = found->second;
+            _retained.erase(found);
+        }
+
+        _resident[frame] = 1;
+        _touch(frame);
+    }
+
+    virtual void accessed(size_t frame) override
+    {
+        _touch(frame);
+    }
+
+    virtual void evicted(size_t frame, uint64_t ofs) override
+    {
+        _resident[frame] = 0;
+
+        _retained[ofs] = _hist[frame];
+        _retainedOrder.push_back(ofs);
+
+        while(_retainedOrder.size() > _maxRetained)
+        {
+            _retained.erase(_retainedOrder.front());
+            _retainedOrder.pop_front();
+        }
+    }
+
+    virtual bool victim(const function<bool(size_t)>& evictable, size_t& frame) override
+    {
+        bool found = false;
+        uint64_t bestKth = numeric_limits<uint64_t>::max();
+        uint64_t bestLast = numeric_limits<uint64_t>::max();
+
+        for(size_t f = 0; f < _hist.size(); ++f)
+        {
+            if(!_resident[f] || !evictable(f))
+                continue;
+
+            // A kth reference time of 0 means fewer than K references, i.e. an infinite backward
+            // K-distance. Ties are broken by plain LRU.
+            auto kth = _hist[f][1];
+            auto last = _hist[f][0];
+
+            if(kth < bestKth || (kth == bestKth && last < bestLast))
+            {
+                bestKth = kth;
+                bestLast = last;
+                frame = f;
+                found = true;
+            }
+        }
+
+        return found;
+    }
+
+private:
+    void _touch(size_t frame)
+    {
+        _hist[frame][1] = _hist[frame][0];
+        _hist[frame][0] = ++_clock;
+    }
+
+    vector<array<uint64_t, 2>> _hist;
+    vector<uint8_t> _resident;
+    uint64_t _clock;
+    unordered_map<uint64_t, array<uint64_t, 2>> _retained;
+    deque<uint64_t> _retainedOrder;
+    size_t _maxRetained;
+};
+
+// 2Q admits new pages into a small FIFO (A1in). Pages evicted from A1in are remembered in a ghost queue
+// (A1out) and if they are referenced again while remembered they are admitted to the main LRU (Am).
+class two_q_policy final : public eviction_policy
+{
+public:
+    two_q_policy(size_t nFrames) :
+        _kIn(std::max<size_t>(1, nFrames / 4)),
+        _kOut(std::max<size_t>(1, nFrames / 2)),
+        _a1in(),
+        _am(),
+        _a1out(),
+        _a1outIndex(),
+        _where(nFrames, NONE),
+        _pos(nFrames)
+    {
+    }
+
+    virtual void loaded(size_t frame, uint64_t ofs) override
+    {
+        auto ghost = _a1outIndex.find(ofs);
+        if(ghost != _a1outIndex.end())
+        {
+            _a1out.erase(ghost->second);
+            _a1outIndex.erase(ghost);
+            _am.push_front(frame);
+            _where[frame] = AM;
+            _pos[frame] = _am.begin();
+        }
+        else
+        {
+            _a1in.push_front(frame);
+            _where[frame] = A1IN;
+            _pos[frame] = _a1in.begin();
+        }
+    }
+
+    virtual void accessed(size_t frame) override
+    {
+        // Hits in A1in are deliberately ignored, correlated references shortly after a page is loaded
+        // should not promote it.
+        if(_where[frame] == AM)
+            _am.splice(_am.begin(), _am, _pos[frame]);
+    }
+
+    virtual void evicted(size_t frame, uint64_t ofs) override
+    {
+        if(_where[frame] == A1IN)
+        {
+            _a1in.erase(_pos[frame]);
+            _a1out.push_front(ofs);
+            _a1outIndex[ofs] = _a1out.begin();
+            while(_a1out.size() > _kOut)
+            {
+                _a1outIndex.erase(_a1out.back());
+                _a1out.pop_back();
+            }
+        }
+        else if(_where[frame] == AM)
+            _am.erase(_pos[frame]);
+
+        _where[frame] = NONE;
+    }
+
+    virtual bool victim(const function<bool(size_t)>& evictable, size_t& frame) override
+    {
+        if(_a1in.size() > _kIn && _oldest(_a1in, evictable, frame))
+            return true;
+        if(_oldest(_am, evictable, frame))
+            return true;
+        return _oldest(_a1in, evictable, frame);
+    }
+
+private:
+    enum queue { NONE, A1IN, AM };
+
+    static bool _oldest(const list<size_t>& q, const function<bool(size_t)>& evictable, size_t& frame)
+    {
+        for(auto i = q.rbegin(); i != q.rend(); ++i)
+        {
+            if(evictable(*i))
+            {
+                frame = *i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t _kIn;
+    size_t _kOut;
+    list<size_t> _a1in;
+    list<size_t> _am;
+    list<uint64_t> _a1out;
+    unordered_map<uint64_t, list<uint64_t>::iterator> _a1outIndex;
+    vector<queue> _where;
+    vector<list<size_t>::iterator> _pos;
+};
+
+unique_ptr<eviction_policy> eviction_policy::create(eviction ev, size_t nFrames)
+{
+    switch(ev)
+    {
+        case EVICT_CLOCK:
+            return make_unique<clock_policy>(nFrames);
+        case EVICT_LRU_K:
+            return make_unique<lru_k_policy>(nFrames);
+        case EVICT_2Q:
+            return make_unique<two_q_policy>(nFrames);
+    }
+    throw runtime_error("Unknown eviction policy.");
+}
+
+buffer_pool::buffer_pool(int fd, size_t nFrames, eviction ev, size_t pageSize) :
+    _fd(fd),
+    _pageSize(pageSize),
+    _mem(),
+    _frames(nFrames),
+    _free(),
+    _table(),
+    _policy(eviction_policy::create(ev, nFrames)),
+    _lock(),
+    _hits(0),
+    _misses(0),
+    _evictions(0),
+    _writeBacks(0)
+{
+    if(nFrames == 0)
+        throw runtime_error("A buffer pool needs at least one frame.");
+
+    _mem.reset(new uint8_t[nFrames * _pageSize]);
+
+    _free.reserve(nFrames);
+    for(size_t i = nFrames; i > 0; --i)
+    {
+        _frames[i-1] = {0, 0, false, false};
+        _free.push_back(i-1);
+    }
+}
+
+buffer_pool::~buffer_pool() noexcept
+{
+    try
+    {
+        flush();
+    }
+    catch(...)
+    {
+    }
+}
+
+uint8_t* buffer_pool::pin(uint64_t ofs)
+{
+    lock_guard<mutex> g(_lock);
+
+    auto found = _table.find(ofs);
+    if(found != _table.end())
+    {
+        ++_frames[found->second].pins;
+        _policy->accessed(found->second);
+        _hits.fetch_add(1, memory_order_relaxed);
+        return _frame_mem(found->second);
+    }
+
+    _misses.fetch_add(1, memory_order_relaxed);
+
+    auto f = _acquire_frame();
+    auto mem = _frame_mem(f);
+
+    size_t done = 0;
+    while(done < _pageSize)
+    {
+        auto r = pread(_fd, mem + done, _pageSize - done, ofs + done);
+        if(r < 0)
+        {
+            _free.push_back(f);
+            throw runtime_error("pread failed");
+        }
+        if(r == 0)
+        {
+            // Reading past the end of the file is a freshly appended (and not yet written) page.
+            memset(mem + done, 0, _pageSize - done);
+            break;
+        }
+        done += r;
+    }
+
+    _frames[f] = {ofs, 1, true, false};
+    _table[ofs] = f;
+    _policy->loaded(f, ofs);
+
+    return mem;
+}
+
+void buffer_pool::unpin(uint64_t ofs, bool dirty)
+{
+    lock_guard<mutex> g(_lock);
+
+    auto found = _table.find(ofs);
+    if(found == _table.end() || _frames[found->second].pins == 0)
+        throw runtime_error("Unpin of a page that is not pinned.");
+
+    auto& fr = _frames[found->second];
+    --fr.pins;
+    fr.dirty = fr.dirty || dirty;
+}
+
+void buffer_pool::flush()
+{
+    lock_guard<mutex> g(_lock);
+
+    for(size_t f = 0; f < _frames.size(); ++f)
+    {
+        if(_frames[f].valid && _frames[f].dirty)
+            _write_back(f);
+    }
+}
+
+buffer_pool_stats buffer_pool::stats() const
+{
+    buffer_pool_stats s;
+    s.hits = _hits.load(memory_order_relaxed);
+    s.misses = _misses.load(memory_order_relaxed);
+    s.evictions = _evictions.load(memory_order_relaxed);
+    s.write_backs = _writeBacks.load(memory_order_relaxed);
+    return s;
+}
+
+size_t buffer_pool::_acquire_frame()
+{
+    if(!_free.empty())
+    {
+        auto f = _free.back();
+        _free.pop_back();
+        return f;
+    }
+
+    size_t f;
+    if(!_policy->victim([this](size_t i){return _frames[i].valid && _frames[i].pins == 0;}, f))
+        throw runtime_error("Buffer pool exhausted, every frame is pinned.");
+
+    if(_frames[f].dirty)
+        _write_back(f);
+
+    _table.erase(_frames[f].ofs);
+    _policy->evicted(f, _frames[f].ofs);
+    _frames[f].valid = false;
+    _evictions.fetch_add(1, memory_order_relaxed);
+
+    return f;
+}
+
+void buffer_pool::_write_back(size_t f)
+{
+    auto mem = _frame_mem(f);
+    size_t done = 0;
+    while(done < _pageSize)
+    {
+        auto w = pwrite(_fd, mem + done, _pageSize - done, _frames[f].ofs + done);
+        if(w <= 0)
+            throw runtime_error("pwrite failed");
+        done += w;
+    }
+
+    _frames[f].dirty = false;
+    _writeBacks.fetch_add(1, memory_order_relaxed);
+}
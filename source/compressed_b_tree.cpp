@@ -0,0 +1,123 @@
+
+#include "tdb/compressed_b_tree.h"
+#include "tdb/b_tree_node.h"
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+// compressed_b_tree header layout (within the pagers user header)
+//   [0, 2)    0 (never a valid b_tree min_degree)
+//   [2, 4)    node layout (NODE_LAYOUT_COMPRESSED)
+static const size_t LAYOUT_OFS = 2;
+
+// The compressed_node format as cow_tree sees it.
+struct compressed_hooks
+{
+    using node = compressed_node;
+    using entry = compressed_entry;
+    using key_arg = int64_t;
+    using key_type = int64_t;
+    using value_type = int64_t;
+
+    static bool live(const compressed_node& n, uint16_t i) {return n.valid(i);}
+    static bool live(const compressed_entry& e) {return e.valid;}
+    static compressed_entry tombstone(const compressed_entry& e) {return {e.key, 0, false, e.child};}
+    static void release(const pager&, const compressed_entry&, vector<uint64_t>&) {}
+    static int64_t value(const pager&, const compressed_node& n, uint16_t i) {return n.value(i);}
+
+    static size_t encoded_size(const vector<compressed_entry>& entries, size_t first, size_t last, bool leaf, uint64_t right_child)
+    {
+        return compressed_node::encoded_size(entries, first, last, leaf, right_child);
+    }
+
+    static bool write(const pager& p, uint64_t ofs, bool leaf, const vector<compressed_entry>& entries, size_t first, size_t last, uint64_t right_child)
+    {
+        return compressed_node::write(p, ofs, leaf, entries, first, last, right_child);
+    }
+
+    static bool write_with_child(const pager& p, uint64_t ofs, uint64_t src_ofs, uint16_t i, uint64_t child)
+    {
+        return compressed_node::write_with_child(p, ofs, src_ofs, i, child);
+    }
+
+    static size_t split_point(const vector<compressed_entry>& entries, bool leaf, uint64_t right_child, size_t changed)
+    {
+        auto n = entries.size();
+        auto fits = [&](size_t m){
+            return compressed_node::encoded_size(entries, 0, m, leaf, entries[m].child) <= pager::block_size() &&
+                   compressed_node::encoded_size(entries, m + 1, n, leaf, right_child) <= pager::block_size();
+        };
+
+        if(n < 3)
+            throw runtime_error("Unable to split compressed_node.");
+
+        // Appending: keep as much as fits on the left, the right node is where the next appends go.
+        if(changed + 1 == n)
+        {
+            for(size_t m = n - 2; m >= 1; --m)
+            {
+                if(fits(m))
+                    return m;
+            }
+        }
+        else
+        {
+            // Otherwise as close to the middle as fits.
+            for(size_t d = 0; d < n / 2; ++d)
+            {
+                if(fits((n / 2) - d))
+                    return (n / 2) - d;
+                if((n / 2) + d + 1 < n - 1 && fits((n / 2) + d + 1))
+                    return (n / 2) + d + 1;
+            }
+        }
+
+        throw runtime_error("Unable to split compressed_node.");
+    }
+};
+
+compressed_b_tree::compressed_b_tree(const string& file_name) :
+    _p(file_name)
+{
+    if(*(uint16_t*)(_p.user_header() + LAYOUT_OFS) != NODE_LAYOUT_COMPRESSED)
+        throw runtime_error("File is not a compressed_b_tree.");
+}
+
+compressed_b_tree::~compressed_b_tree() noexcept
+{
+}
+
+void compressed_b_tree::insert(int64_t key, int64_t value)
+{
+    cow_tree<compressed_hooks>(_p).write(COW_INSERT, key, {key, value, true, 0});
+}
+
+void compressed_b_tree::upsert(int64_t key, int64_t value)
+{
+    cow_tree<compressed_hooks>(_p).write(COW_UPSERT, key, {key, value, true, 0});
+}
+
+optional<int64_t> compressed_b_tree::search(int64_t key) const
+{
+    return cow_tree<compressed_hooks>(_p).search(key);
+}
+
+void compressed_b_tree::remove(int64_t key)
+{
+    cow_tree<compressed_hooks>(_p).write(COW_REMOVE, key, {key, 0, false, 0});
+}
+
+vector<pair<int64_t, int64_t>> compressed_b_tree::range(int64_t lo, int64_t hi) const
+{
+    return cow_tree<compressed_hooks>(_p).range(lo, hi);
+}
+
+void compressed_b_tree::create_db_file(const string& file_name)
+{
+    pager::create(file_name);
+
+    pager p(file_name);
+    *(uint16_t*)(p.user_header() + LAYOUT_OFS) = NODE_LAYOUT_COMPRESSED;
+}
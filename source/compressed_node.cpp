@@ -0,0 +1,302 @@
+
+#include "tdb/compressed_node.h"
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+static const size_t HEADER_SIZE = 32;
+
+// Bits needed to hold every difference up to range.
+static unsigned _width(uint64_t range)
+{
+    return (range == 0)?0:64 - __builtin_clzll(range);
+}
+
+static size_t _words(size_t n, unsigned width)
+{
+    return ((n * width) + 63) / 64;
+}
+
+static uint64_t _unpack(const uint64_t* words, size_t i, unsigned width)
+{
+    if(width == 0)
+        return 0;
+
+    auto pos = i * width;
+    auto w = pos >> 6;
+    auto s = pos & 63;
+    uint64_t v = words[w] >> s;
+    if(s + width > 64)
+        v |= words[w + 1] << (64 - s);
+    return (width == 64)?v:v & ((1ULL << width) - 1);
+}
+
+static void _pack(uint64_t* words, size_t i, unsigned width, uint64_t v)
+{
+    if(width == 0)
+        return;
+
+    auto pos = i * width;
+    auto w = pos >> 6;
+    auto s = pos & 63;
+    words[w] |= v << s;
+    if(s + width > 64)
+        words[w + 1] |= v >> (64 - s);
+}
+
+static void _clear(uint64_t* words, size_t i, unsigned width)
+{
+    if(width == 0)
+        return;
+
+    auto pos = i * width;
+    auto w = pos >> 6;
+    auto s = pos & 63;
+    auto mask = (width == 64)?~0ULL:(1ULL << width) - 1;
+    words[w] &= ~(mask << s);
+    if(s + width > 64)
+        words[w + 1] &= ~(mask >> (64 - s));
+}
+
+// The base and width of a frame of reference over the values get(first) .. get(last - 1).
+template<typename GET>
+static void _frame(size_t first, size_t last, const GET& get, uint64_t& base, unsigned& width)
+{
+    base = 0;
+    width = 0;
+    if(last <= first)
+        return;
+
+    // Compared as signed, stored as the unsigned difference from the smallest.
+    auto lo = (int64_t)get(first), hi = lo;
+    for(size_t i = first + 1; i < last; ++i)
+    {
+        auto v = (int64_t)get(i);
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+    }
+    base = (uint64_t)lo;
+    width = _width((uint64_t)hi - (uint64_t)lo);
+}
+
+compressed_node::compressed_node(const pager& p, uint64_t ofs) :
+    _p(p),
+    _ofs(ofs),
+    _page(nullptr)
+{
+    if(ofs == 0)
+        throw runtime_error("Unable to create compressed_node from offset 0");
+
+    _page = _p.pin_page(_ofs);
+}
+
+compressed_node::~compressed_node() noexcept
+{
+    try
+    {
+        _p.unpin_page(_ofs, false);
+    }
+    catch(...)
+    {
+    }
+}
+
+uint16_t compressed_node::lower_bound(int64_t k, bool& found) const
+{
+    found = false;
+
+    auto n = count();
+    auto base = *(const int64_t*)(_page + 8);
+    if(n == 0 || k < base)
+        return 0;
+
+    // Keys are sorted and never below the base, so their differences from it are sorted too and k can be
+    // compared as a difference without decoding anything.
+    auto target = (uint64_t)k - (uint64_t)base;
+    auto words = _key_words();
+    auto width = _page[3];
+
+    uint16_t lo = 0, len = n;
+    while(len > 1)
+    {
+        uint16_t half = len / 2;
+        lo = (_unpack(words, lo + half - 1, width) < target)?lo + half:lo;
+        len -= half;
+    }
+    auto d = _unpack(words, lo, width);
+    if(d < target)
+        return lo + 1;
+
+    found = d == target;
+    return lo;
+}
+
+int64_t compressed_node::key(uint16_t i) const
+{
+    return (int64_t)(*(const uint64_t*)(_page + 8) + _unpack(_key_words(), i, _page[3]));
+}
+
+int64_t compressed_node::value(uint16_t i) const
+{
+    return (int64_t)(*(const uint64_t*)(_page + 16) + _unpack(_value_words(), i, _page[4]));
+}
+
+bool compressed_node::valid(uint16_t i) const
+{
+    return ((_valid_words()[i >> 6] >> (i & 63)) & 1) != 0;
+}
+
+uint64_t compressed_node::child(uint16_t i) const
+{
+    return (*(const uint64_t*)(_page + 24) + _unpack(_child_words(), i, _page[5])) * pager::block_size();
+}
+
+void compressed_node::entries(vector<compressed_entry>& out) const
+{
+    auto n = count();
+    out.resize(n);
+
+    auto key_base = *(const uint64_t*)(_page + 8);
+    auto value_base = *(const uint64_t*)(_page + 16);
+    auto child_base = *(const uint64_t*)(_page + 24);
+    auto valid = _valid_words();
+    auto keys = valid + _words(n, 1);
+    auto values = keys + _words(n, _page[3]);
+    auto children = values + _words(n, _page[4]);
+    for(uint16_t i = 0; i < n; ++i)
+    {
+        auto& e = out[i];
+        e.key = (int64_t)(key_base + _unpack(keys, i, _page[3]));
+        e.value = (int64_t)(value_base + _unpack(values, i, _page[4]));
+        e.valid = ((valid[i >> 6] >> (i & 63)) & 1) != 0;
+        e.child = (leaf())?0:(child_base + _unpack(children, i, _page[5])) * pager::block_size();
+    }
+}
+
+// The frames of the entries of a node.
+struct frames
+{
+    uint64_t key_base;
+    uint64_t value_base;
+    uint64_t child_base;
+    unsigned key_width;
+    unsigned value_width;
+    unsigned child_width;
+    size_t size;
+};
+
+static frames _frames(const vector<compressed_entry>& entries, size_t first, size_t last, bool leaf, uint64_t right_child)
+{
+    frames f {};
+    auto n = last - first;
+
+    // Keys are sorted, the frame is their first and last.
+    if(n > 0)
+    {
+        f.key_base = (uint64_t)entries[first].key;
+        f.key_width = _width((uint64_t)entries[last - 1].key - f.key_base);
+    }
+    _frame(first, last, [&](size_t i){return entries[i].value;}, f.value_base, f.value_width);
+    if(!leaf)
+    {
+        auto block = [&](size_t i){return (int64_t)(((i < last)?entries[i].child:right_child) / pager::block_size());};
+        _frame(first, last + 1, block, f.child_base, f.child_width);
+    }
+
+    f.size = HEADER_SIZE + ((_words(n, 1) + _words(n, f.key_width) + _words(n, f.value_width)) * 8);
+    if(!leaf)
+        f.size += _words(n + 1, f.child_width) * 8;
+    return f;
+}
+
+size_t compressed_node::encoded_size(const vector<compressed_entry>& entries, size_t first, size_t last, bool leaf, uint64_t right_child)
+{
+    if(last - first > max_entries)
+        return numeric_limits<size_t>::max();
+    return _frames(entries, first, last, leaf, right_child).size;
+}
+
+bool compressed_node::write(const pager& p, uint64_t ofs, bool leaf, const vector<compressed_entry>& entries, size_t first, size_t last, uint64_t right_child)
+{
+    auto n = last - first;
+    if(n > max_entries)
+        return false;
+    auto f = _frames(entries, first, last, leaf, right_child);
+    if(f.size > pager::block_size())
+        return false;
+
+    auto page = p.pin_page(ofs);
+    memset(page, 0, f.size);
+
+    *(uint16_t*)page = (uint16_t)n;
+    page[2] = (leaf)?1:0;
+    page[3] = (uint8_t)f.key_width;
+    page[4] = (uint8_t)f.value_width;
+    page[5] = (uint8_t)f.child_width;
+    *(uint64_t*)(page + 8) = f.key_base;
+    *(uint64_t*)(page + 16) = f.value_base;
+    *(uint64_t*)(page + 24) = f.child_base;
+
+    auto valid = (uint64_t*)(page + HEADER_SIZE);
+    auto keys = valid + _words(n, 1);
+    auto values = keys + _words(n, f.key_width);
+    auto children = values + _words(n, f.value_width);
+    for(size_t i = 0; i < n; ++i)
+    {
+        auto& e = entries[first + i];
+        _pack(valid, i, 1, (e.valid)?1:0);
+        _pack(keys, i, f.key_width, (uint64_t)e.key - f.key_base);
+        _pack(values, i, f.value_width, (uint64_t)e.value - f.value_base);
+    }
+    if(!leaf)
+    {
+        for(size_t i = 0; i <= n; ++i)
+        {
+            auto child = (first + i < last)?entries[first + i].child:right_child;
+            _pack(children, i, f.child_width, (child / pager::block_size()) - f.child_base);
+        }
+    }
+
+    p.unpin_page(ofs, true);
+    return true;
+}
+
+bool compressed_node::write_with_child(const pager& p, uint64_t ofs, uint64_t src_ofs, uint16_t i, uint64_t child)
+{
+    compressed_node src(p, src_ofs);
+    auto width = src._page[5];
+    auto base = *(const uint64_t*)(src._page + 24);
+    auto block = child / pager::block_size();
+    if(block < base || _width(block - base) > width)
+        return false;
+
+    auto children_ofs = (const uint8_t*)src._child_words() - src._page;
+    auto size = children_ofs + (_words(src.count() + 1, width) * 8);
+
+    auto page = p.pin_page(ofs);
+    memcpy(page, src._page, size);
+    auto children = (uint64_t*)(page + children_ofs);
+    _clear(children, i, width);
+    _pack(children, i, width, block - base);
+    p.unpin_page(ofs, true);
+
+    return true;
+}
+
+const uint64_t* compressed_node::_key_words() const
+{
+    return _valid_words() + _words(count(), 1);
+}
+
+const uint64_t* compressed_node::_value_words() const
+{
+    return _key_words() + _words(count(), _page[3]);
+}
+
+const uint64_t* compressed_node::_child_words() const
+{
+    return _value_words() + _words(count(), _page[4]);
+}
@@ -0,0 +1,142 @@
+
+#include "tdb/external_sort.h"
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+// Entries read from a run per refill.
+static const size_t RUN_READ_CHUNK = 8192;
+
+external_sorter::external_sorter(const string& run_prefix, size_t memory_budget) :
+    _run_prefix(run_prefix),
+    _max_buffered(std::max<size_t>(1, memory_budget / sizeof(pair<int64_t, int64_t>))),
+    _buffer(),
+    _run_files(),
+    _run_sizes(),
+    _runs(),
+    _heap(),
+    _buffer_pos(0),
+    _size(0),
+    _finished(false)
+{
+}
+
+external_sorter::~external_sorter() noexcept
+{
+    _runs.clear();
+    for(auto& name : _run_files)
+        unlink(name.c_str());
+}
+
+void external_sorter::add(int64_t key, int64_t value)
+{
+    if(_finished)
+        throw runtime_error("external_sorter::add() after finish().");
+
+    _buffer.push_back(make_pair(key, value));
+    ++_size;
+
+    if(_buffer.size() >= _max_buffered)
+        _spill();
+}
+
+void external_sorter::finish()
+{
+    if(_finished)
+        return;
+    _finished = true;
+
+    // Everything fit in memory, no merge needed.
+    if(_run_files.empty())
+    {
+        sort(begin(_buffer), end(_buffer));
+        return;
+    }
+
+    if(!_buffer.empty())
+        _spill();
+    _buffer.clear();
+    _buffer.shrink_to_fit();
+
+    for(size_t i = 0; i < _run_files.size(); ++i)
+    {
+        auto r = make_unique<run>();
+        r->f = r_file::open(_run_files[i], "r");
+        r->pos = 0;
+        r->remaining = _run_sizes[i];
+        _runs.push_back(move(r));
+    }
+
+    for(size_t i = 0; i < _runs.size(); ++i)
+    {
+        if(_refill(*_runs[i]))
+            _heap.push_back(i);
+    }
+
+    make_heap(begin(_heap), end(_heap), [this](size_t a, size_t b){
+        return _runs[a]->buffer[_runs[a]->pos] > _runs[b]->buffer[_runs[b]->pos];
+    });
+}
+
+bool external_sorter::next(pair<int64_t, int64_t>& kv)
+{
+    if(!_finished)
+        throw runtime_error("external_sorter::next() before finish().");
+
+    if(_runs.empty())
+    {
+        if(_buffer_pos >= _buffer.size())
+            return false;
+        kv = _buffer[_buffer_pos++];
+        return true;
+    }
+
+    if(_heap.empty())
+        return false;
+
+    auto greater = [this](size_t a, size_t b){
+        return _runs[a]->buffer[_runs[a]->pos] > _runs[b]->buffer[_runs[b]->pos];
+    };
+
+    pop_heap(begin(_heap), end(_heap), greater);
+    auto i = _heap.back();
+    auto& r = *_runs[i];
+
+    kv = r.buffer[r.pos++];
+
+    if(r.pos < r.buffer.size() || _refill(r))
+        push_heap(begin(_heap), end(_heap), greater);
+    else _heap.pop_back();
+
+    return true;
+}
+
+void external_sorter::_spill()
+{
+    sort(begin(_buffer), end(_buffer));
+
+    auto name = _run_prefix + to_string(_run_files.size());
+    auto f = r_file::open(name, "w");
+    _run_files.push_back(name);
+    _run_sizes.push_back(_buffer.size());
+
+    block_write_file(_buffer.data(), _buffer.size() * sizeof(pair<int64_t, int64_t>), f);
+
+    _buffer.clear();
+}
+
+bool external_sorter::_refill(run& r)
+{
+    if(r.remaining == 0)
+        return false;
+
+    auto n = (size_t)std::min<uint64_t>(r.remaining, RUN_READ_CHUNK);
+    r.buffer.resize(n);
+    block_read_file(r.buffer.data(), n * sizeof(pair<int64_t, int64_t>), r.f);
+    r.remaining -= n;
+    r.pos = 0;
+
+    return true;
+}
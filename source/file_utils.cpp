@@ -9,8 +9,25 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <fcntl.h>
 
 using namespace std;
+
+string dir_name(const string& path)
+{
+    auto slash = path.find_last_of('/');
+    return (slash == string::npos)?string("."):path.substr(0, (slash == 0)?1:slash);
+}
+
+void fsync_dir_of(const string& path)
+{
+    auto dir_fd = open(dir_name(path).c_str(), O_RDONLY | O_DIRECTORY);
+    if(dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
     
 r_file::r_file() :
     _f(nullptr) 
@@ -89,6 +106,12 @@ r_memory_map::r_memory_map(int fd, uint64_t offset, uint64_t len, uint32_t prot,
         throw runtime_error("r_memory_map does not support fixed mappings.");
 
     _mem = mmap64(NULL, _length, _get_posix_prot_flags(prot), _get_posix_access_flags(flags), fd, offset);
+
+    if(_mem == MAP_FAILED)
+    {
+        _mem = NULL;
+        throw runtime_error("Unable to memory map file.");
+    }
 }
 
 r_memory_map::~r_memory_map() noexcept
@@ -0,0 +1,157 @@
+
+#include "tdb/key_search.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEY_SEARCH_X86
+#include <immintrin.h>
+#endif
+
+// The SIMD paths narrow the range with the branchless binary search until it is this small and then
+// count the keys less than k with vector compares. Counting is exact because the keys are sorted.
+static const uint16_t SIMD_WINDOW = 16;
+
+// Branchless binary search. The compare feeds a conditional move rather than a branch so there are no
+// mispredictions, the loop always runs log2(n) times.
+static inline const int64_t* _narrow(const int64_t* base, uint16_t& len, int64_t k, uint16_t window)
+{
+    while(len > window)
+    {
+        uint16_t half = len / 2;
+        base = (base[half] < k)?base + half:base;
+        len -= half;
+    }
+    return base;
+}
+
+uint16_t lower_bound_linear(const int64_t* keys, uint16_t n, int64_t k)
+{
+    uint16_t i = 0;
+    while(i < n && k > keys[i])
+        i++;
+    return i;
+}
+
+uint16_t lower_bound_binary(const int64_t* keys, uint16_t n, int64_t k)
+{
+    if(n == 0)
+        return 0;
+
+    uint16_t len = n;
+    auto base = _narrow(keys, len, k, 1);
+    return (uint16_t)((base - keys) + (*base < k));
+}
+
+#ifdef KEY_SEARCH_X86
+
+__attribute__((target("sse4.2,popcnt")))
+uint16_t lower_bound_sse42(const int64_t* keys, uint16_t n, int64_t k)
+{
+    uint16_t len = n;
+    auto base = _narrow(keys, len, k, SIMD_WINDOW);
+
+    auto kv = _mm_set1_epi64x(k);
+    uint16_t count = 0;
+    uint16_t i = 0;
+    for(; i + 2 <= len; i += 2)
+    {
+        auto v = _mm_loadu_si128((const __m128i*)(base + i));
+        auto lt = _mm_cmpgt_epi64(kv, v);
+        count += _mm_popcnt_u32(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+    }
+    for(; i < len; ++i)
+        count += (base[i] < k);
+
+    return (uint16_t)((base - keys) + count);
+}
+
+__attribute__((target("avx2,popcnt")))
+uint16_t lower_bound_avx2(const int64_t* keys, uint16_t n, int64_t k)
+{
+    uint16_t len = n;
+    auto base = _narrow(keys, len, k, SIMD_WINDOW);
+
+    auto kv = _mm256_set1_epi64x(k);
+    uint16_t count = 0;
+    uint16_t i = 0;
+    for(; i + 4 <= len; i += 4)
+    {
+        auto v = _mm256_loadu_si256((const __m256i*)(base + i));
+        auto lt = _mm256_cmpgt_epi64(kv, v);
+        count += _mm_popcnt_u32(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+    }
+    for(; i < len; ++i)
+        count += (base[i] < k);
+
+    return (uint16_t)((base - keys) + count);
+}
+
+#else
+
+uint16_t lower_bound_sse42(const int64_t* keys, uint16_t n, int64_t k)
+{
+    return lower_bound_binary(keys, n, k);
+}
+
+uint16_t lower_bound_avx2(const int64_t* keys, uint16_t n, int64_t k)
+{
+    return lower_bound_binary(keys, n, k);
+}
+
+#endif
+
+bool key_search_supported(key_search_kind kind)
+{
+    switch(kind)
+    {
+        case KEY_SEARCH_LINEAR:
+        case KEY_SEARCH_BINARY:
+            return true;
+#ifdef KEY_SEARCH_X86
+        case KEY_SEARCH_SSE42:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+        case KEY_SEARCH_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+        default:
+            return false;
+    }
+}
+
+key_search_kind key_search_impl()
+{
+    if(key_search_supported(KEY_SEARCH_AVX2))
+        return KEY_SEARCH_AVX2;
+    if(key_search_supported(KEY_SEARCH_SSE42))
+        return KEY_SEARCH_SSE42;
+    return KEY_SEARCH_BINARY;
+}
+
+const char* key_search_name(key_search_kind kind)
+{
+    switch(kind)
+    {
+        case KEY_SEARCH_LINEAR: return "linear";
+        case KEY_SEARCH_BINARY: return "binary";
+        case KEY_SEARCH_SSE42: return "sse4.2";
+        case KEY_SEARCH_AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+static uint16_t _resolve_lower_bound(const int64_t* keys, uint16_t n, int64_t k)
+{
+    // Racing resolvers are harmless, every thread stores the same pointer.
+    key_search_fn fn = lower_bound_binary;
+    switch(key_search_impl())
+    {
+        case KEY_SEARCH_AVX2: fn = lower_bound_avx2; break;
+        case KEY_SEARCH_SSE42: fn = lower_bound_sse42; break;
+        default: break;
+    }
+    _key_lower_bound.store(fn, std::memory_order_relaxed);
+    return fn(keys, n, k);
+}
+
+std::atomic<key_search_fn> _key_lower_bound(_resolve_lower_bound);
@@ -0,0 +1,681 @@
+
+#include "tdb/lsm_tree.h"
+#include "tdb/file_utils.h"
+#include <fstream>
+#include <algorithm>
+#include <set>
+#include <cstdio>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Writers stall once this many frozen memtables are waiting to be flushed.
+static const size_t MAX_IMMUTABLES = 2;
+
+static const char* MANIFEST_MAGIC = "tdb_lsm";
+static const int MANIFEST_VERSION = 1;
+
+lsm_tree::run::run(const string& name, uint64_t id, uint32_t tier) :
+    id(id),
+    tier(tier),
+    puts_name(name + ".run." + to_string(id) + ".puts"),
+    dels_name(name + ".run." + to_string(id) + ".dels"),
+    puts(make_unique<b_tree>(puts_name)),
+    dels(make_unique<b_tree>(dels_name)),
+    obsolete(false)
+{
+}
+
+lsm_tree::run::~run() noexcept
+{
+    puts.reset();
+    dels.reset();
+
+    if(obsolete.load())
+    {
+        unlink(puts_name.c_str());
+        unlink(dels_name.c_str());
+    }
+}
+
+lsm_tree::lsm_tree(const string& name, size_t memtable_entries, durability d) :
+    _name(name),
+    _memtableEntries(std::max<size_t>(1, memtable_entries)),
+    _durability(d),
+    _memLock(),
+    _workCond(),
+    _active(),
+    _immutables(),
+    _flushing(false),
+    _compactPending(false),
+    _compacting(false),
+    _stop(false),
+    _error(),
+    _runsLock(),
+    _runs(make_shared<const run_list>()),
+    _nextRunId(1),
+    _flushedGen(0),
+    _flushes(0),
+    _compactions(0),
+    _flusher(),
+    _compactor()
+{
+    _open();
+    // Runs left by an earlier session may already be due for a merge.
+    _compactPending = true;
+    _flusher = thread(&lsm_tree::_flush_thread, this);
+    _compactor = thread(&lsm_tree::_compact_thread, this);
+}
+
+lsm_tree::~lsm_tree() noexcept
+{
+    bool drained = false;
+    try
+    {
+        unique_lock<shared_mutex> g(_memLock);
+        if(!_active->table.empty() && !_error)
+            _rotate(g, 1);
+        drained = _active->table.empty();
+    }
+    catch(...)
+    {
+    }
+
+    {
+        unique_lock<shared_mutex> g(_memLock);
+        _stop = true;
+    }
+    _workCond.notify_all();
+    // The flusher drains every frozen memtable first, the compactor stops after the merge it is in.
+    _flusher.join();
+    _compactor.join();
+
+    // Everything in the log of the (empty) active memtable is already in a run.
+    if(drained && _active->log && !_error)
+    {
+        _active->log.reset();
+        unlink(_wal_name(_active->gen).c_str());
+    }
+}
+
+void lsm_tree::put(int64_t key, int64_t value)
+{
+    _write(key, {value, false});
+}
+
+void lsm_tree::remove(int64_t key)
+{
+    _write(key, {0, true});
+}
+
+optional<int64_t> lsm_tree::get(int64_t key) const
+{
+    // Memtables are checked before the runs are captured. A memtable is only dropped after its run has
+    // been installed, so a key can not slip between the two.
+    {
+        shared_lock<shared_mutex> g(_memLock);
+
+        auto found = _active->table.find(key);
+        if(found != _active->table.end())
+            return (found->second.removed)?optional<int64_t>():optional<int64_t>(found->second.value);
+
+        for(auto i = _immutables.rbegin(); i != _immutables.rend(); ++i)
+        {
+            found = (*i)->table.find(key);
+            if(found != (*i)->table.end())
+                return (found->second.removed)?optional<int64_t>():optional<int64_t>(found->second.value);
+        }
+    }
+
+    auto runs = _runs_snapshot();
+    for(auto& r : *runs)
+    {
+        auto v = r->puts->search(key);
+        if(v)
+            return v;
+        if(r->dels->search(key))
+            return optional<int64_t>();
+    }
+
+    return optional<int64_t>();
+}
+
+vector<pair<int64_t, int64_t>> lsm_tree::range(int64_t lo, int64_t hi) const
+{
+    vector<pair<int64_t, int64_t>> result;
+    if(lo > hi)
+        return result;
+
+    // Oldest first.
+    vector<vector<pair<int64_t, entry>>> layers;
+    {
+        shared_lock<shared_mutex> g(_memLock);
+
+        auto copy = [&](const memtable& t){
+            layers.push_back(vector<pair<int64_t, entry>>(t.lower_bound(lo), t.upper_bound(hi)));
+        };
+
+        for(auto& m : _immutables)
+            copy(m->table);
+        copy(_active->table);
+    }
+
+    auto runs = _runs_snapshot();
+
+    // Newer sources are applied later and win.
+    map<int64_t, entry> merged;
+    for(auto r = runs->rbegin(); r != runs->rend(); ++r)
+    {
+        b_tree::cursor p(*(*r)->puts);
+        for(p.seek(lo); p.valid() && p.key() <= hi; p.next())
+            merged[p.key()] = {p.value(), false};
+
+        b_tree::cursor d(*(*r)->dels);
+        for(d.seek(lo); d.valid() && d.key() <= hi; d.next())
+            merged[d.key()] = {0, true};
+    }
+
+    for(auto& layer : layers)
+    {
+        for(auto& kv : layer)
+            merged[kv.first] = kv.second;
+    }
+
+    for(auto& kv : merged)
+    {
+        if(!kv.second.removed)
+            result.push_back(make_pair(kv.first, kv.second.value));
+    }
+
+    return result;
+}
+
+void lsm_tree::flush()
+{
+    unique_lock<shared_mutex> g(_memLock);
+
+    if(_error)
+        rethrow_exception(_error);
+
+    if(!_active->table.empty())
+        _rotate(g, 1);
+
+    _workCond.wait(g, [this](){
+        return (_immutables.empty() && !_flushing && !_compactPending && !_compacting) || _error;
+    });
+
+    if(_error)
+        rethrow_exception(_error);
+}
+
+lsm_stats lsm_tree::stats() const
+{
+    lsm_stats s;
+    s.flushes = _flushes.load();
+    s.compactions = _compactions.load();
+    s.runs = _runs_snapshot()->size();
+    return s;
+}
+
+void lsm_tree::_write(int64_t key, const entry& e)
+{
+    shared_ptr<wal> log;
+    uint64_t lsn = 0;
+
+    {
+        // The memtable update and the log append happen under the same lock so the log has writes to a key
+        // in the order they were applied.
+        unique_lock<shared_mutex> g(_memLock);
+
+        if(_error)
+            rethrow_exception(_error);
+
+        _active->table[key] = e;
+
+        if(_active->log)
+        {
+            log = _active->log;
+            lsn = log->append((e.removed)?WAL_REMOVE:WAL_INSERT, key, e.value);
+        }
+
+        if(_active->table.size() >= _memtableEntries)
+            _rotate(g, _memtableEntries);
+    }
+
+    if(log)
+        log->commit(lsn);
+}
+
+void lsm_tree::_rotate(unique_lock<shared_mutex>& g, size_t min_entries)
+{
+    _workCond.wait(g, [this](){return _immutables.size() < MAX_IMMUTABLES || _error;});
+
+    if(_error)
+        rethrow_exception(_error);
+
+    // Someone else may have rotated while we waited.
+    if(_active->table.size() < min_entries)
+        return;
+
+    _immutables.push_back(_active);
+    _active = _new_mem(_active->gen + 1);
+
+    _workCond.notify_all();
+}
+
+shared_ptr<lsm_tree::mem> lsm_tree::_new_mem(uint64_t gen)
+{
+    auto m = make_shared<mem>();
+    m->gen = gen;
+    if(_durability == DURABILITY_WAL)
+        m->log = make_shared<wal>(_wal_name(gen), 1);
+    return m;
+}
+
+shared_ptr<const lsm_tree::run_list> lsm_tree::_runs_snapshot() const
+{
+    lock_guard<mutex> g(_runsLock);
+    return _runs;
+}
+
+shared_ptr<lsm_tree::run> lsm_tree::_build_run(uint32_t tier, const function<stream()>& open_stream, bool keep_tombstones)
+{
+    uint64_t id;
+    {
+        lock_guard<mutex> g(_runsLock);
+        id = _nextRunId++;
+    }
+
+    auto base = _name + ".run." + to_string(id);
+    auto puts_name = base + ".puts";
+    auto dels_name = base + ".dels";
+
+    try
+    {
+        // The first pass counts the values (bulk loading needs the count up front) and collects the
+        // tombstones, which are usually few. The second pass streams the values into place.
+        uint64_t count = 0;
+        vector<pair<int64_t, int64_t>> dels;
+        {
+            auto s = open_stream();
+            int64_t k;
+            entry e;
+            while(s(k, e))
+            {
+                if(!e.removed)
+                    ++count;
+                else if(keep_tombstones)
+                    dels.push_back(make_pair(k, 0));
+            }
+        }
+
+        // Runs are searched newest first, so a key is usually looked for in runs that do not have it.
+        b_tree::create_db_file(puts_name, 0, NODE_LAYOUT_PACKED, 1, count);
+        b_tree::create_db_file(dels_name, 0, NODE_LAYOUT_PACKED, 1, dels.size());
+
+        {
+            b_tree t(puts_name);
+            auto s = open_stream();
+            t._bulk_load(count, [&s](){
+                int64_t k;
+                entry e;
+                do
+                {
+                    if(!s(k, e))
+                        throw runtime_error("lsm_tree run input changed between passes.");
+                } while(e.removed);
+                return make_pair(k, e.value);
+            }, 1.0);
+            t._p.sync();
+        }
+
+        {
+            b_tree t(dels_name);
+            t.bulk_load(begin(dels), end(dels));
+            t._p.sync();
+        }
+
+        return make_shared<run>(_name, id, tier);
+    }
+    catch(...)
+    {
+        unlink(puts_name.c_str());
+        unlink(dels_name.c_str());
+        throw;
+    }
+}
+
+void lsm_tree::_flush_mem(const shared_ptr<mem>& m)
+{
+    auto runs = _runs_snapshot();
+
+    auto r = _build_run(0, [&m](){
+        auto i = m->table.cbegin();
+        auto end = m->table.cend();
+        return stream([i, end](int64_t& k, entry& e) mutable {
+            if(i == end)
+                return false;
+            k = i->first;
+            e = i->second;
+            ++i;
+            return true;
+        });
+    }, !runs->empty());
+
+    _install([&r](run_list& current){current.insert(begin(current), r);}, m->gen);
+
+    if(m->log)
+        unlink(_wal_name(m->gen).c_str());
+
+    _flushes.fetch_add(1);
+}
+
+bool lsm_tree::_compact_once()
+{
+    auto runs = _runs_snapshot();
+
+    // Tiers never decrease from the newest run to the oldest so every tier is a contiguous group.
+    size_t b = 0;
+    while(b < runs->size())
+    {
+        size_t e = b;
+        while(e < runs->size() && (*runs)[e]->tier == (*runs)[b]->tier)
+            ++e;
+
+        if(e - b >= fanout)
+        {
+            run_list group(runs->begin() + b, runs->begin() + e);
+
+            // The newest source to mention a key decides it.
+            auto merged = _build_run(group.front()->tier + 1, [&group](){
+                struct source
+                {
+                    shared_ptr<b_tree::cursor> c;
+                    bool removed;
+                };
+
+                vector<source> sources;
+                for(auto& r : group)
+                {
+                    sources.push_back({make_shared<b_tree::cursor>(*r->puts), false});
+                    sources.push_back({make_shared<b_tree::cursor>(*r->dels), true});
+                }
+                for(auto& s : sources)
+                    s.c->seek_first();
+
+                return stream([group, sources](int64_t& k, entry& e) mutable {
+                    bool found = false;
+                    for(auto& s : sources)
+                    {
+                        if(s.c->valid() && (!found || s.c->key() < k))
+                        {
+                            k = s.c->key();
+                            found = true;
+                        }
+                    }
+
+                    if(!found)
+                        return false;
+
+                    bool decided = false;
+                    for(auto& s : sources)
+                    {
+                        if(s.c->valid() && s.c->key() == k)
+                        {
+                            if(!decided)
+                            {
+                                e = {(s.removed)?0:s.c->value(), s.removed};
+                                decided = true;
+                            }
+                            s.c->next();
+                        }
+                    }
+
+                    return true;
+                });
+            }, e != runs->size());
+
+            // Flushes only add runs in front of the group, it is still contiguous.
+            _install([&group, &merged](run_list& current){
+                auto first = find(begin(current), end(current), group.front());
+                if(first == end(current) || (size_t)(end(current) - first) < group.size())
+                    throw runtime_error("lsm_tree compaction group vanished.");
+                auto last = first + group.size();
+                first = current.erase(first, last);
+                current.insert(first, merged);
+            }, 0);
+
+            for(auto& r : group)
+                r->obsolete.store(true);
+
+            _compactions.fetch_add(1);
+
+            return true;
+        }
+
+        b = e;
+    }
+
+    return false;
+}
+
+void lsm_tree::_install(const function<void(run_list&)>& change, uint64_t flushed_gen)
+{
+    lock_guard<mutex> g(_runsLock);
+    run_list runs = *_runs;
+    change(runs);
+    flushed_gen = std::max(flushed_gen, _flushedGen);
+    _write_manifest(runs, flushed_gen);
+    _runs = make_shared<const run_list>(runs);
+    _flushedGen = flushed_gen;
+}
+
+void lsm_tree::_open()
+{
+    run_list runs;
+
+    ifstream manifest(_name + ".manifest");
+    if(manifest.is_open())
+    {
+        string magic, tag;
+        int version;
+        size_t count;
+        manifest >> magic >> version;
+        if(!manifest || magic != MANIFEST_MAGIC || version != MANIFEST_VERSION)
+            throw runtime_error("Invalid lsm_tree manifest: " + _name + ".manifest");
+
+        manifest >> tag >> _nextRunId >> tag >> _flushedGen >> tag >> count;
+        for(size_t i = 0; i < count; ++i)
+        {
+            uint64_t id;
+            uint32_t tier;
+            manifest >> id >> tier;
+            if(!manifest)
+                throw runtime_error("Truncated lsm_tree manifest: " + _name + ".manifest");
+            runs.push_back(make_shared<run>(_name, id, tier));
+        }
+    }
+
+    _runs = make_shared<const run_list>(runs);
+
+    _remove_orphans();
+
+    // Replay the logs of memtables that never made it into a run (regardless of the durability asked
+    // for this time) and turn them into a run right away.
+    auto recovered = make_shared<mem>();
+    recovered->gen = _flushedGen;
+    vector<string> replayed;
+    for(auto gen = _flushedGen + 1; access(_wal_name(gen).c_str(), F_OK) == 0; ++gen)
+    {
+        for(auto& r : wal::read(_wal_name(gen)))
+        {
+            if((r.op & ~WAL_MORE) == WAL_INSERT)
+                recovered->table[r.key] = {r.value, false};
+            else recovered->table[r.key] = {0, true};
+        }
+        recovered->gen = gen;
+        replayed.push_back(_wal_name(gen));
+    }
+
+    if(!recovered->table.empty())
+        _flush_mem(recovered);
+
+    for(auto& name : replayed)
+        unlink(name.c_str());
+
+    _active = _new_mem(_flushedGen + 1);
+}
+
+void lsm_tree::_write_manifest(const run_list& runs, uint64_t flushed_gen)
+{
+    auto temp_name = _name + ".manifest.tmp";
+
+    {
+        auto f = r_file::open(temp_name, "w");
+        fprintf(f, "%s %d\n", MANIFEST_MAGIC, MANIFEST_VERSION);
+        fprintf(f, "next_id %llu\n", (unsigned long long)_nextRunId);
+        fprintf(f, "flushed_gen %llu\n", (unsigned long long)flushed_gen);
+        fprintf(f, "runs %llu\n", (unsigned long long)runs.size());
+        for(auto& r : runs)
+            fprintf(f, "%llu %u\n", (unsigned long long)r->id, r->tier);
+
+        if(fflush(f) != 0 || fsync(fileno(f)) != 0)
+            throw runtime_error("Unable to write lsm_tree manifest.");
+    }
+
+    if(rename(temp_name.c_str(), (_name + ".manifest").c_str()) != 0)
+        throw runtime_error("Unable to rename lsm_tree manifest into place.");
+
+    fsync_dir_of(_name);
+}
+
+void lsm_tree::_remove_orphans()
+{
+    // Runs that were being built (or compacted away) and logs that were already flushed when the process
+    // last died.
+    set<uint64_t> live;
+    for(auto& r : *_runs)
+        live.insert(r->id);
+
+    auto dir = dir_name(_name);
+    auto slash = _name.find_last_of('/');
+    auto base = (slash == string::npos)?_name:_name.substr(slash + 1);
+    auto run_prefix = base + ".run.";
+    auto wal_prefix = base + ".wal.";
+
+    auto d = opendir(dir.c_str());
+    if(!d)
+        return;
+
+    vector<string> doomed;
+    while(auto ent = readdir(d))
+    {
+        string file = ent->d_name;
+        if(file.compare(0, run_prefix.size(), run_prefix) == 0)
+        {
+            auto id = strtoull(file.c_str() + run_prefix.size(), nullptr, 10);
+            if(live.count(id) == 0)
+                doomed.push_back(file);
+        }
+        else if(file.compare(0, wal_prefix.size(), wal_prefix) == 0)
+        {
+            auto gen = strtoull(file.c_str() + wal_prefix.size(), nullptr, 10);
+            if(gen <= _flushedGen)
+                doomed.push_back(file);
+        }
+        else if(file == base + ".manifest.tmp")
+            doomed.push_back(file);
+    }
+    closedir(d);
+
+    for(auto& file : doomed)
+        unlink((dir + "/" + file).c_str());
+}
+
+string lsm_tree::_wal_name(uint64_t gen) const
+{
+    return _name + ".wal." + to_string(gen);
+}
+
+void lsm_tree::_flush_thread()
+{
+    while(true)
+    {
+        shared_ptr<mem> m;
+        {
+            unique_lock<shared_mutex> g(_memLock);
+            _workCond.wait(g, [this](){return _stop || !_immutables.empty();});
+            if(_immutables.empty())
+                return;
+            m = _immutables.front();
+            _flushing = true;
+        }
+
+        try
+        {
+            _flush_mem(m);
+        }
+        catch(...)
+        {
+            // Writers and flush() report it, nothing more is written.
+            unique_lock<shared_mutex> g(_memLock);
+            _error = current_exception();
+            _flushing = false;
+            _workCond.notify_all();
+            return;
+        }
+
+        {
+            unique_lock<shared_mutex> g(_memLock);
+            _immutables.pop_front();
+            _flushing = false;
+            _compactPending = true;
+        }
+        _workCond.notify_all();
+    }
+}
+
+void lsm_tree::_compact_thread()
+{
+    while(true)
+    {
+        {
+            unique_lock<shared_mutex> g(_memLock);
+            _workCond.wait(g, [this](){return _stop || _compactPending || _error;});
+            if(_stop || _error)
+                return;
+            _compactPending = false;
+            _compacting = true;
+        }
+
+        try
+        {
+            // A merge can take as long as it likes, flushes carry on installing runs in front of it.
+            bool more = true;
+            while(more)
+            {
+                {
+                    shared_lock<shared_mutex> g(_memLock);
+                    if(_stop)
+                        break;
+                }
+                more = _compact_once();
+            }
+        }
+        catch(...)
+        {
+            unique_lock<shared_mutex> g(_memLock);
+            _error = current_exception();
+            _compacting = false;
+            _workCond.notify_all();
+            return;
+        }
+
+        {
+            unique_lock<shared_mutex> g(_memLock);
+            _compacting = false;
+        }
+        _workCond.notify_all();
+    }
+}
@@ -1,25 +1,123 @@
 
 #include "tdb/pager.h"
 #include "tdb/file_utils.h"
+#include "tdb/trace.h"
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <thread>
 
 using namespace std;
 
-pager::pager(const std::string& fileName) :
+// Header page layout
+//   [0, 4)    nblocks
+//   [4, 12)   root ofs (root slot 0)
+//   [12, 16)  reserved for the pager
+//   [16, 24)  free list head (block index << 32 | ABA tag)
+//   [24, 64)  reserved for the pager
+//   [64, 2048) user header
+//   [2048, 4096) root slots 1 and up, one per 64 byte line (slot 0 is the root ofs above)
+static const size_t PAGER_HEADER_SIZE = 64;
+static const size_t FREE_HEAD_OFS = 16;
+static const size_t ROOT_OFS = 4;
+static const size_t ROOT_SLOTS_OFS = 2048;
+static const size_t ROOT_SLOT_STRIDE = 64;
+
+// Concurrent readers that can be registered at once (threads beyond this wait for a slot).
+static const size_t EPOCH_SLOTS = 256;
+// Distinct epochs that long lived readers can pin at once.
+static const size_t SNAPSHOT_SLOTS = 256;
+// Retired pages allowed to pile up before retire_pages() tries to reclaim them.
+static const size_t RECLAIM_THRESHOLD = 64;
+
+static uint64_t _file_size(int fd)
+{
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        throw std::runtime_error("fstat failed");
+    return (uint64_t)st.st_size;
+}
+
+pager::pager(const std::string& fileName, uint64_t reserveSize) :
+    _fileName(fileName),
+    _f(r_file::open(fileName, "r+")),
+    _reserveSize(std::max(reserveSize, _file_size(fileno(_f)))),
+    _mm(fileno(_f),
+        0,
+        _reserveSize,
+        r_memory_map::MM_PROT_READ | r_memory_map::MM_PROT_WRITE,
+        r_memory_map::MM_TYPE_FILE | r_memory_map::MM_SHARED),
+    _growLock(),
+    _fileSize(_file_size(fileno(_f))),
+    _extentSize(default_extent_size()),
+    _preallocate(false),
+    _pool(),
+    _epoch(1),
+    _slots(new epoch_slot[EPOCH_SLOTS]),
+    _snapshotLock(),
+    _snapshotSlots(new snapshot_slot[SNAPSHOT_SLOTS]()),
+    _limboLock(),
+    _limbo()
+{
+}
+
+pager::pager(const std::string& fileName, size_t poolFrames, eviction ev) :
     _fileName(fileName),
     _f(r_file::open(fileName, "r+")),
-    _mm(map_page_from(0))
+    _reserveSize(pager::block_size()),
+    _mm(fileno(_f),
+        0,
+        _reserveSize,
+        r_memory_map::MM_PROT_READ | r_memory_map::MM_PROT_WRITE,
+        r_memory_map::MM_TYPE_FILE | r_memory_map::MM_SHARED),
+    _growLock(),
+    _fileSize(_file_size(fileno(_f))),
+    _extentSize(default_extent_size()),
+    _preallocate(false),
+    _pool(std::make_unique<buffer_pool>(fileno(_f), poolFrames, ev, pager::block_size())),
+    _epoch(1),
+    _slots(new epoch_slot[EPOCH_SLOTS]),
+    _snapshotLock(),
+    _snapshotSlots(new snapshot_slot[SNAPSHOT_SLOTS]()),
+    _limboLock(),
+    _limbo()
 {
 }
 
 pager::~pager() noexcept
 {
+    // No reader can outlive the pager, everything still in limbo is free.
+    try
+    {
+        reclaim();
+        _trim_file();
+    }
+    catch(...)
+    {
+    }
+}
+
+uint64_t pager::default_reserve_size()
+{
+    // Address space is cheap on 64 bit systems and a shared file mapping beyond EOF costs nothing
+    // until the file is extended into it.
+    return 64ULL * 1024 * 1024 * 1024;
 }
 
-size_t pager::block_size()
+uint64_t pager::default_extent_size()
 {
-    return 4096;
+    return 1024 * 1024;
+}
+
+void pager::set_extent_size(uint64_t extent_size, bool preallocate)
+{
+    if(extent_size == 0 || (extent_size % pager::block_size()) != 0)
+        throw std::runtime_error("extent_size must be a non zero multiple of the block size.");
+
+    _extentSize.store(extent_size);
+    _preallocate.store(preallocate);
 }
 
 void pager::create(const std::string& fileName)
@@ -30,7 +128,7 @@ void pager::create(const std::string& fileName)
 
     memset(&block[0], 0, pager::block_size());
     *(uint32_t*)&block[0] = 1;
-    *(uint64_t*)&block[4] = 0;
+    *(uint64_t*)&block[ROOT_OFS] = 0;
 
     block_write_file(&block[0], pager::block_size(), f);
 }
@@ -40,74 +138,375 @@ uint64_t pager::block_start_from(uint64_t ofs) const
     return (ofs / pager::block_size()) * pager::block_size();
 }
 
-r_memory_map pager::map_page_from(uint64_t ofs) const
+uint8_t* pager::page_from(uint64_t ofs) const
 {
-    auto blockStart = block_start_from(ofs);
-    size_t blockOfs = ofs - blockStart;
+    // In buffer pool mode only the header page is mapped.
+    if(ofs >= _reserveSize)
+        throw std::runtime_error("Offset is beyond the pager reservation.");
 
-    return std::move(r_memory_map(fileno(_f),
-                                blockStart,
-                                pager::block_size(),
-                                r_memory_map::MM_PROT_READ | r_memory_map::MM_PROT_WRITE,
-                                r_memory_map::MM_TYPE_FILE | r_memory_map::MM_SHARED,
-                                blockOfs));
+    return _mm.map().first + ofs;
 }
 
 uint64_t pager::append_page() const
 {
-    uint32_t lastNBlocks;
+    auto reused = _pop_free();
+    if(reused != 0)
+        return reused;
+
+    // Claiming the block is a single atomic add on nblocks in the header. The block is claimed first and
+    // the file is grown afterwards (if it is not already long enough) so that a slow thread can never
+    // shrink the file out from under a block that was handed out to someone else.
+    auto blk = _claim_nblocks();
+
+    if(!_pool && ((uint64_t)blk+1)*pager::block_size() > _reserveSize)
+    {
+        _unclaim_nblocks();
+        throw std::runtime_error("pager reservation exhausted");
+    }
+
+    _grow_file(((uint64_t)blk+1)*pager::block_size());
 
-    // The idea here is that we want to append space for 1 block to the end of the file and update our
-    // nblocks field in the special block at the beginning of the file. We'd also like to return the file
-    // offset of the new blocks.
-    //
-    // To keep this lock free I'm calling _update_nblocks() (which uses the gcc compiler intrinsic for
-    // compare and swap).
+    TDB_TRACE(TRACE_PAGE_APPEND, blk * pager::block_size(), 0);
 
-    do {
-        lastNBlocks = _read_nblocks();
-        auto err = ftruncate(fileno(_f), ((lastNBlocks+1)*pager::block_size()));
-        if(err != 0)
-            throw std::runtime_error("ftruncate failed");
-    } while(!_update_nblocks(lastNBlocks, lastNBlocks+1));
-    
-    //return pager::block_size() + (lastNBlocks * pager::block_size());
-    return lastNBlocks * pager::block_size();
+    return blk * pager::block_size();
 }
 
-uint64_t pager::root_ofs() const
+void pager::free_page(uint64_t ofs) const
 {
-    return _read_root_ofs();
+    _push_free(ofs);
 }
 
-bool pager::set_root_ofs(uint64_t lastVal, uint64_t newVal) const
+void pager::retire_pages(const vector<uint64_t>& pages) const
 {
-    return _update_root_ofs(lastVal, newVal);
+    size_t retired;
+    {
+        lock_guard<mutex> g(_limboLock);
+
+        // Read under the lock so that limbo stays ordered by epoch.
+        auto e = _epoch.load();
+        for(auto ofs : pages)
+            _limbo.push_back(make_pair(e, ofs));
+        retired = _limbo.size();
+    }
+
+    if(retired >= RECLAIM_THRESHOLD)
+        reclaim();
+}
+
+void pager::reclaim() const
+{
+    // Every reader that enters from now on will see an epoch newer than anything already in limbo. Pages
+    // retired from here on may be retired in the new epoch while a reader that entered after the scan below
+    // holds them, so nothing from the new epoch is freed even if no reader is active.
+    uint64_t oldest_active = _epoch.fetch_add(1) + 1;
+    for(size_t i = 0; i < EPOCH_SLOTS; ++i)
+    {
+        auto a = _slots[i].active.load();
+        if(a != 0 && a < oldest_active)
+            oldest_active = a;
+    }
+    {
+        lock_guard<mutex> g(_snapshotLock);
+        for(size_t i = 0; i < SNAPSHOT_SLOTS; ++i)
+        {
+            auto& s = _snapshotSlots[i];
+            if(s.refs != 0 && s.epoch < oldest_active)
+                oldest_active = s.epoch;
+        }
+    }
+
+    // A page retired in epoch e was unlinked before e was read, so only readers that entered in e or
+    // earlier can hold it.
+    lock_guard<mutex> g(_limboLock);
+    while(!_limbo.empty() && _limbo.front().first < oldest_active)
+    {
+        _push_free(_limbo.front().second);
+        _limbo.pop_front();
+    }
+}
+
+void pager::reset_free_list() const
+{
+    __atomic_store_n(_free_head(), 0, __ATOMIC_RELEASE);
+}
+
+uint64_t pager::free_page_count() const
+{
+    // Not safe against concurrent allocation, intended for tests and diagnostics.
+    uint64_t count = 0;
+    auto blk = __atomic_load_n(_free_head(), __ATOMIC_ACQUIRE) >> 32;
+    while(blk != 0)
+    {
+        ++count;
+        blk = _read_next_free(blk * pager::block_size());
+    }
+    return count;
+}
+
+size_t pager::retired_page_count() const
+{
+    lock_guard<mutex> g(_limboLock);
+    return _limbo.size();
+}
+
+size_t pager::snapshot_slots()
+{
+    return SNAPSHOT_SLOTS;
+}
+
+uint8_t* pager::user_header() const
+{
+    return page_from(0) + PAGER_HEADER_SIZE;
+}
+
+size_t pager::user_header_size()
+{
+    return ROOT_SLOTS_OFS - PAGER_HEADER_SIZE;
+}
+
+size_t pager::root_slots()
+{
+    return (pager::block_size() - ROOT_SLOTS_OFS) / ROOT_SLOT_STRIDE;
+}
+
+uint64_t pager::root_ofs(size_t slot) const
+{
+    return _read_root_ofs(slot);
+}
+
+bool pager::set_root_ofs(uint64_t lastVal, uint64_t newVal, size_t slot) const
+{
+    return _update_root_ofs(lastVal, newVal, slot);
+}
+
+buffer_pool_stats pager::pool_stats() const
+{
+    if(_pool)
+        return _pool->stats();
+    return {0, 0, 0, 0};
 }
 
 void pager::sync() const
 {
+    if(_pool)
+        _pool->flush();
     fsync(fileno(_f));
 }
 
 uint32_t pager::_read_nblocks() const
 {
-    auto mp = _mm.map();
-    return *((uint32_t*)mp.first);
+    return __atomic_load_n((uint32_t*)page_from(0), __ATOMIC_ACQUIRE);
+}
+
+uint32_t pager::_claim_nblocks() const
+{
+    return __atomic_fetch_add((uint32_t*)page_from(0), 1, __ATOMIC_ACQ_REL);
+}
+
+void pager::_unclaim_nblocks() const
+{
+    // Only appenders that overran the reservation give their block back, so nblocks ends up at the
+    // reservation limit once they have all backed out.
+    __atomic_fetch_sub((uint32_t*)page_from(0), 1, __ATOMIC_ACQ_REL);
+}
+
+uint64_t pager::_read_root_ofs(size_t slot) const
+{
+    return __atomic_load_n(_root_slot(slot), __ATOMIC_ACQUIRE);
+}
+
+bool pager::_update_root_ofs(uint64_t lastVal, uint64_t newVal, size_t slot) const
+{
+    return __sync_bool_compare_and_swap(_root_slot(slot), lastVal, newVal);
+}
+
+uint64_t* pager::_root_slot(size_t slot) const
+{
+    if(slot >= root_slots())
+        throw std::runtime_error("Invalid root slot.");
+
+    // Slot 0 stays where the single root has always been.
+    if(slot == 0)
+        return (uint64_t*)(page_from(0) + ROOT_OFS);
+    return (uint64_t*)(page_from(0) + ROOT_SLOTS_OFS + (slot * ROOT_SLOT_STRIDE));
+}
+
+void pager::_grow_file(uint64_t size) const
+{
+    if(_fileSize.load(memory_order_acquire) >= size)
+        return;
+
+    // Growth only ever moves the end of the file forward. Without the lock two appenders could race
+    // their ftruncate() calls and the smaller one could cut off a block the larger one already owns.
+    std::lock_guard<std::mutex> g(_growLock);
+
+    // Another pager on the same file may have grown it further than we know about.
+    auto current = std::max(_fileSize.load(memory_order_acquire), _file_size(fileno(_f)));
+    if(current >= size)
+    {
+        _fileSize.store(current, memory_order_release);
+        return;
+    }
+
+    auto extent = _extentSize.load();
+    auto target = ((size + extent - 1) / extent) * extent;
+    if(!_pool)
+        target = std::max(size, std::min(target, _reserveSize));
+
+    bool grown = false;
+#ifdef __linux__
+    if(_preallocate.load())
+        grown = fallocate(fileno(_f), 0, current, target - current) == 0;
+#endif
+    if(!grown && ftruncate(fileno(_f), target) != 0)
+        throw std::runtime_error("ftruncate failed");
+
+    TDB_TRACE(TRACE_FILE_GROW, target, current);
+
+    _fileSize.store(target, memory_order_release);
+}
+
+void pager::_trim_file() const
+{
+    std::lock_guard<std::mutex> g(_growLock);
+
+    auto size = (uint64_t)_read_nblocks() * pager::block_size();
+    if(_file_size(fileno(_f)) > size && ftruncate(fileno(_f), size) == 0)
+        _fileSize.store(size);
+}
+
+uint64_t* pager::_free_head() const
+{
+    return (uint64_t*)(page_from(0) + FREE_HEAD_OFS);
+}
+
+uint64_t pager::_read_next_free(uint64_t ofs) const
+{
+    auto next = *(uint64_t*)pin_page(ofs);
+    unpin_page(ofs, false);
+    return next;
+}
+
+void pager::_write_next_free(uint64_t ofs, uint64_t next) const
+{
+    *(uint64_t*)pin_page(ofs) = next;
+    unpin_page(ofs, true);
+}
+
+uint64_t pager::_pop_free() const
+{
+    // The head packs the block index of the first free page with a tag that changes on every update, so
+    // a pop that read a stale next pointer (the page was popped and reused under it) fails its CAS instead
+    // of corrupting the list.
+    auto head = _free_head();
+    while(true)
+    {
+        auto h = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+        auto blk = h >> 32;
+        if(blk == 0)
+            return 0;
+
+        auto next = _read_next_free(blk * pager::block_size());
+        auto tag = (uint32_t)h + 1;
+        if(__sync_bool_compare_and_swap(head, h, (next << 32) | tag))
+            return blk * pager::block_size();
+    }
+}
+
+void pager::_push_free(uint64_t ofs) const
+{
+    if(ofs == 0 || (ofs % pager::block_size()) != 0)
+        throw std::runtime_error("Attempt to free an invalid page.");
+
+    auto head = _free_head();
+    auto blk = ofs / pager::block_size();
+    while(true)
+    {
+        auto h = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+        _write_next_free(ofs, h >> 32);
+        auto tag = (uint32_t)h + 1;
+        if(__sync_bool_compare_and_swap(head, h, (blk << 32) | tag))
+            return;
+    }
+}
+
+size_t pager::_enter_epoch() const
+{
+    thread_local size_t hint = 0;
+
+    while(true)
+    {
+        for(size_t n = 0; n < EPOCH_SLOTS; ++n)
+        {
+            auto i = (hint + n) % EPOCH_SLOTS;
+            uint64_t expected = 0;
+            if(_slots[i].active.load(memory_order_relaxed) == 0 &&
+               _slots[i].active.compare_exchange_strong(expected, _epoch.load()))
+            {
+                hint = i;
+                return i;
+            }
+        }
+        this_thread::yield();
+    }
+}
+
+void pager::_exit_epoch(size_t slot) const
+{
+    _slots[slot].active.store(0);
+}
+
+size_t pager::_pin_snapshot() const
+{
+    lock_guard<mutex> g(_snapshotLock);
+
+    // Read under the lock, so a reclaim() that advances the epoch after this either sees the entry or
+    // began its scan before the snapshot reads anything.
+    auto e = _epoch.load();
+    size_t free_slot = SNAPSHOT_SLOTS;
+    for(size_t i = 0; i < SNAPSHOT_SLOTS; ++i)
+    {
+        auto& s = _snapshotSlots[i];
+        if(s.refs != 0 && s.epoch == e)
+        {
+            ++s.refs;
+            return i;
+        }
+        if(s.refs == 0 && free_slot == SNAPSHOT_SLOTS)
+            free_slot = i;
+    }
+
+    if(free_slot == SNAPSHOT_SLOTS)
+        throw std::runtime_error("Too many epochs pinned by snapshots.");
+
+    _snapshotSlots[free_slot] = {e, 1};
+    return free_slot;
+}
+
+void pager::_unpin_snapshot(size_t slot) const
+{
+    lock_guard<mutex> g(_snapshotLock);
+    --_snapshotSlots[slot].refs;
+}
+
+pager::epoch_guard::epoch_guard(const pager& p) :
+    _p(p),
+    _slot(p._enter_epoch())
+{
 }
 
-bool pager::_update_nblocks(uint32_t lastVal, uint32_t newVal) const
+pager::epoch_guard::~epoch_guard() noexcept
 {
-    return __sync_bool_compare_and_swap((uint32_t*)map_page_from(0).map().first, lastVal, newVal);
+    _p._exit_epoch(_slot);
 }
 
-uint64_t pager::_read_root_ofs() const
+pager::snapshot_guard::snapshot_guard(const pager& p) :
+    _p(p),
+    _slot(p._pin_snapshot())
 {
-    auto mp = _mm.map();
-    return *((uint64_t*)(mp.first + 4));
 }
 
-bool pager::_update_root_ofs(uint64_t lastVal, uint64_t newVal) const
+pager::snapshot_guard::~snapshot_guard() noexcept
 {
-    return __sync_bool_compare_and_swap((uint64_t*)(map_page_from(0).map().first + 4), lastVal, newVal);
+    _p._unpin_snapshot(_slot);
 }
@@ -0,0 +1,103 @@
+
+#include "tdb/trace.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+struct trace_ring
+{
+    array<trace_record, TDB_TRACE_RING_SIZE> records;
+    atomic<uint64_t> head {0};
+    uint64_t thread {0};
+};
+
+// Rings are shared so that a threads records can still be dumped after the thread has exited.
+static mutex _rings_lock;
+static vector<shared_ptr<trace_ring>> _rings;
+static atomic<uint64_t> _next_thread {1};
+
+static trace_ring& _thread_ring()
+{
+    thread_local shared_ptr<trace_ring> ring;
+
+    if(!ring)
+    {
+        ring = make_shared<trace_ring>();
+        ring->thread = _next_thread.fetch_add(1);
+        lock_guard<mutex> g(_rings_lock);
+        _rings.push_back(ring);
+    }
+
+    return *ring;
+}
+
+const char* trace_event_name(trace_event ev)
+{
+    switch(ev)
+    {
+        case TRACE_ARM_COPY: return "arm_copy";
+        case TRACE_SPLIT: return "split";
+        case TRACE_ROOT_SPLIT: return "root_split";
+        case TRACE_ROOT_CAS_RETRY: return "root_cas_retry";
+        case TRACE_BORROW: return "borrow";
+        case TRACE_MERGE: return "merge";
+        case TRACE_ROOT_COLLAPSE: return "root_collapse";
+        case TRACE_FILE_GROW: return "file_grow";
+        case TRACE_PAGE_APPEND: return "page_append";
+    }
+    return "unknown";
+}
+
+void trace_record_event(trace_event ev, int64_t a, int64_t b)
+{
+    auto& ring = _thread_ring();
+
+    auto h = ring.head.load(memory_order_relaxed);
+    auto& r = ring.records[h % TDB_TRACE_RING_SIZE];
+    r.ts = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    r.thread = ring.thread;
+    r.event = ev;
+    r.a = a;
+    r.b = b;
+    ring.head.store(h + 1, memory_order_release);
+}
+
+vector<trace_record> trace_snapshot()
+{
+    vector<trace_record> out;
+
+    lock_guard<mutex> g(_rings_lock);
+    for(auto& ring : _rings)
+    {
+        auto h = ring->head.load(memory_order_acquire);
+        auto n = (h < TDB_TRACE_RING_SIZE)?h:TDB_TRACE_RING_SIZE;
+        for(auto i = h - n; i < h; ++i)
+            out.push_back(ring->records[i % TDB_TRACE_RING_SIZE]);
+    }
+
+    return out;
+}
+
+void trace_dump(FILE* f)
+{
+    for(auto& r : trace_snapshot())
+    {
+        fprintf(f, "%llu %llu %s %lld %lld\n",
+                (unsigned long long)r.thread,
+                (unsigned long long)r.ts,
+                trace_event_name(r.event),
+                (long long)r.a,
+                (long long)r.b);
+    }
+}
+
+void trace_clear()
+{
+    lock_guard<mutex> g(_rings_lock);
+    for(auto& ring : _rings)
+        ring->head.store(0, memory_order_release);
+}
@@ -0,0 +1,202 @@
+
+#include "tdb/wal.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static_assert(sizeof(wal_record) == 32, "wal_record must stay a fixed 32 bytes on disk.");
+
+wal::wal(const string& file_name, uint64_t next_lsn) :
+    _fileName(file_name),
+    _fd(open(file_name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)),
+    _lock(),
+    _cond(),
+    _pending(),
+    _nextLsn(next_lsn),
+    _durableLsn(next_lsn - 1),
+    _flushing(false),
+    _failed(false),
+    _records(0),
+    _syncs(0)
+{
+    if(_fd < 0)
+        throw runtime_error("Unable to open write ahead log: " + file_name);
+    if(next_lsn == 0)
+        throw runtime_error("Log sequence numbers start at 1.");
+}
+
+wal::~wal() noexcept
+{
+    close(_fd);
+}
+
+uint64_t wal::append(wal_op op, int64_t key, int64_t value)
+{
+    wal_record r;
+    r.key = key;
+    r.value = value;
+    r.op = op;
+
+    lock_guard<mutex> g(_lock);
+    r.lsn = _nextLsn++;
+    r.check = _check(r);
+    _pending.push_back(r);
+    _records.fetch_add(1, memory_order_relaxed);
+
+    return r.lsn;
+}
+
+uint64_t wal::append_batch(wal_op op, const vector<pair<int64_t, int64_t>>& kvs)
+{
+    if(kvs.empty())
+        throw runtime_error("Empty write ahead log batch.");
+
+    lock_guard<mutex> g(_lock);
+    for(size_t i = 0; i < kvs.size(); ++i)
+    {
+        wal_record r;
+        r.lsn = _nextLsn++;
+        r.key = kvs[i].first;
+        r.value = kvs[i].second;
+        r.op = op | ((i + 1 < kvs.size())?WAL_MORE:0);
+        r.check = _check(r);
+        _pending.push_back(r);
+    }
+    _records.fetch_add(kvs.size(), memory_order_relaxed);
+
+    return _nextLsn - 1;
+}
+
+void wal::commit(uint64_t lsn)
+{
+    unique_lock<mutex> g(_lock);
+
+    while(_durableLsn < lsn)
+    {
+        if(_failed)
+            throw runtime_error("Write ahead log is unusable after a failed flush.");
+
+        if(_flushing)
+        {
+            _cond.wait(g);
+            continue;
+        }
+
+        // Become the leader. Our record is still pending (a finished flush would have covered it) so the
+        // batch is never empty.
+        _flushing = true;
+        vector<wal_record> batch;
+        batch.swap(_pending);
+        g.unlock();
+
+        bool ok = true;
+        auto p = (const uint8_t*)batch.data();
+        size_t remaining = batch.size() * sizeof(wal_record);
+        while(ok && remaining > 0)
+        {
+            auto w = write(_fd, p, remaining);
+            if(w <= 0)
+                ok = false;
+            else
+            {
+                p += w;
+                remaining -= w;
+            }
+        }
+        if(ok && fdatasync(_fd) != 0)
+            ok = false;
+
+        g.lock();
+        _flushing = false;
+        if(ok)
+        {
+            _durableLsn = std::max(_durableLsn, batch.back().lsn);
+            _syncs.fetch_add(1, memory_order_relaxed);
+        }
+        else _failed = true;
+        _cond.notify_all();
+    }
+}
+
+uint64_t wal::last_lsn() const
+{
+    lock_guard<mutex> g(_lock);
+    return _nextLsn - 1;
+}
+
+void wal::truncate(uint64_t through_lsn)
+{
+    unique_lock<mutex> g(_lock);
+
+    while(_flushing)
+        _cond.wait(g);
+
+    vector<wal_record> keep;
+    for(auto& r : _pending)
+    {
+        if(r.lsn > through_lsn)
+            keep.push_back(r);
+    }
+    _pending.swap(keep);
+
+    if(ftruncate(_fd, 0) != 0 || fdatasync(_fd) != 0)
+        throw runtime_error("Unable to truncate write ahead log.");
+
+    _durableLsn = std::max(_durableLsn, through_lsn);
+    _cond.notify_all();
+}
+
+wal_stats wal::stats() const
+{
+    wal_stats s;
+    s.records = _records.load(memory_order_relaxed);
+    s.syncs = _syncs.load(memory_order_relaxed);
+    return s;
+}
+
+vector<wal_record> wal::read(const string& file_name)
+{
+    vector<wal_record> records;
+
+    auto fd = open(file_name.c_str(), O_RDONLY);
+    if(fd < 0)
+        return records;
+
+    wal_record r;
+    uint64_t last = 0;
+    size_t complete = 0;
+    while(::read(fd, &r, sizeof(r)) == sizeof(r))
+    {
+        auto op = r.op & ~WAL_MORE;
+        if(r.check != _check(r) || r.lsn <= last || (op != WAL_INSERT && op != WAL_REMOVE && op != WAL_UPSERT))
+            break;
+        last = r.lsn;
+        records.push_back(r);
+        if((r.op & WAL_MORE) == 0)
+            complete = records.size();
+    }
+
+    close(fd);
+
+    // Drop the front of a batch whose end never made it to the log.
+    records.resize(complete);
+
+    return records;
+}
+
+uint32_t wal::_check(const wal_record& r)
+{
+    // FNV-1a over everything but the check field. This only has to catch torn and unwritten tails.
+    uint64_t h = 14695981039346656037ULL;
+    auto p = (const uint8_t*)&r;
+    for(size_t i = 0; i < offsetof(wal_record, check); ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
@@ -17,6 +17,25 @@ public:
       TEST(test_b_tree::test_search_non_existent_keys);
       TEST(test_b_tree::test_large_number_of_keys);
       TEST(test_b_tree::test_concurrent_inserts);
+      TEST(test_b_tree::test_concurrent_inserts_and_removes);
+      TEST(test_b_tree::test_trace);
+      TEST(test_b_tree::test_auto_min_degree);
+      TEST(test_b_tree::test_aligned_layout);
+      TEST(test_b_tree::test_cursor);
+      TEST(test_b_tree::test_range);
+      TEST(test_b_tree::test_bulk_load);
+      TEST(test_b_tree::test_bulk_load_unsorted);
+      TEST(test_b_tree::test_vacuum);
+      TEST(test_b_tree::test_page_reuse);
+      TEST(test_b_tree::test_insert_batch);
+      TEST(test_b_tree::test_physical_remove);
+      TEST(test_b_tree::test_tombstone_ratio);
+      TEST(test_b_tree::test_upsert);
+      TEST(test_b_tree::test_compare_and_set);
+      TEST(test_b_tree::test_write_retries);
+      TEST(test_b_tree::test_partitions);
+      TEST(test_b_tree::test_snapshot);
+      TEST(test_b_tree::test_filter);
     RTF_FIXTURE_END();
 
     virtual ~test_b_tree() throw() {}
@@ -36,4 +55,23 @@ public:
     void test_search_non_existent_keys();
     void test_large_number_of_keys();
     void test_concurrent_inserts();
+    void test_concurrent_inserts_and_removes();
+    void test_trace();
+    void test_auto_min_degree();
+    void test_aligned_layout();
+    void test_cursor();
+    void test_range();
+    void test_bulk_load();
+    void test_bulk_load_unsorted();
+    void test_vacuum();
+    void test_page_reuse();
+    void test_insert_batch();
+    void test_physical_remove();
+    void test_tombstone_ratio();
+    void test_upsert();
+    void test_compare_and_set();
+    void test_write_retries();
+    void test_partitions();
+    void test_snapshot();
+    void test_filter();
 };
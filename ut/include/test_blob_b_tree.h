@@ -0,0 +1,27 @@
+
+#include "framework.h"
+
+class test_blob_b_tree : public test_fixture
+{
+public:
+    RTF_FIXTURE(test_blob_b_tree);
+      TEST(test_blob_b_tree::test_basic);
+      TEST(test_blob_b_tree::test_matches_model);
+      TEST(test_blob_b_tree::test_overflow_values);
+      TEST(test_blob_b_tree::test_concurrent_inserts);
+      TEST(test_blob_b_tree::test_format_tag);
+      TEST(test_blob_b_tree::test_removes_merge_leaves);
+    RTF_FIXTURE_END();
+
+    virtual ~test_blob_b_tree() throw() {}
+
+    virtual void setup();
+    virtual void teardown();
+
+    void test_basic();
+    void test_matches_model();
+    void test_overflow_values();
+    void test_concurrent_inserts();
+    void test_format_tag();
+    void test_removes_merge_leaves();
+};
@@ -0,0 +1,25 @@
+
+#include "framework.h"
+
+class test_buffer_pool : public test_fixture
+{
+public:
+    RTF_FIXTURE(test_buffer_pool);
+      TEST(test_buffer_pool::test_pin_unpin_and_counters);
+      TEST(test_buffer_pool::test_pinned_frames_are_not_evicted);
+      TEST(test_buffer_pool::test_hot_page_survives_scan);
+      TEST(test_buffer_pool::test_b_tree_in_pool_mode);
+      TEST(test_buffer_pool::test_extent_growth);
+    RTF_FIXTURE_END();
+
+    virtual ~test_buffer_pool() throw() {}
+
+    virtual void setup();
+    virtual void teardown();
+
+    void test_pin_unpin_and_counters();
+    void test_pinned_frames_are_not_evicted();
+    void test_hot_page_survives_scan();
+    void test_b_tree_in_pool_mode();
+    void test_extent_growth();
+};
@@ -0,0 +1,31 @@
+
+#include "framework.h"
+
+class test_compressed_b_tree : public test_fixture
+{
+public:
+    RTF_FIXTURE(test_compressed_b_tree);
+      TEST(test_compressed_b_tree::test_basic);
+      TEST(test_compressed_b_tree::test_matches_model);
+      TEST(test_compressed_b_tree::test_timestamps_compress);
+      TEST(test_compressed_b_tree::test_concurrent_appends);
+      TEST(test_compressed_b_tree::test_removed_separator_frame);
+      TEST(test_compressed_b_tree::test_child_frame_overflow);
+      TEST(test_compressed_b_tree::test_mixed_sign_keys);
+      TEST(test_compressed_b_tree::test_append_split);
+    RTF_FIXTURE_END();
+
+    virtual ~test_compressed_b_tree() throw() {}
+
+    virtual void setup();
+    virtual void teardown();
+
+    void test_basic();
+    void test_matches_model();
+    void test_timestamps_compress();
+    void test_concurrent_appends();
+    void test_removed_separator_frame();
+    void test_child_frame_overflow();
+    void test_mixed_sign_keys();
+    void test_append_split();
+};
@@ -0,0 +1,19 @@
+
+#include "framework.h"
+
+class test_key_search : public test_fixture
+{
+public:
+    RTF_FIXTURE(test_key_search);
+      TEST(test_key_search::test_matches_std_lower_bound);
+      TEST(test_key_search::test_extremes);
+    RTF_FIXTURE_END();
+
+    virtual ~test_key_search() throw() {}
+
+    virtual void setup() {}
+    virtual void teardown() {}
+
+    void test_matches_std_lower_bound();
+    void test_extremes();
+};
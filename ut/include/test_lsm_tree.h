@@ -0,0 +1,27 @@
+
+#include "framework.h"
+
+class test_lsm_tree : public test_fixture
+{
+public:
+    RTF_FIXTURE(test_lsm_tree);
+      TEST(test_lsm_tree::test_matches_model);
+      TEST(test_lsm_tree::test_compaction_drops_garbage);
+      TEST(test_lsm_tree::test_reopen);
+      TEST(test_lsm_tree::test_recovery_after_crash);
+      TEST(test_lsm_tree::test_concurrent_writers);
+      TEST(test_lsm_tree::test_writes_during_compaction);
+    RTF_FIXTURE_END();
+
+    virtual ~test_lsm_tree() throw() {}
+
+    virtual void setup();
+    virtual void teardown();
+
+    void test_matches_model();
+    void test_compaction_drops_garbage();
+    void test_reopen();
+    void test_recovery_after_crash();
+    void test_concurrent_writers();
+    void test_writes_during_compaction();
+};
@@ -0,0 +1,27 @@
+
+#include "framework.h"
+
+class test_typed_b_tree : public test_fixture
+{
+public:
+    RTF_FIXTURE(test_typed_b_tree);
+      TEST(test_typed_b_tree::test_layout);
+      TEST(test_typed_b_tree::test_uint32_matches_model);
+      TEST(test_typed_b_tree::test_uuid_keys);
+      TEST(test_typed_b_tree::test_small_min_degree);
+      TEST(test_typed_b_tree::test_concurrent_inserts);
+      TEST(test_typed_b_tree::test_format_tag);
+    RTF_FIXTURE_END();
+
+    virtual ~test_typed_b_tree() throw() {}
+
+    virtual void setup();
+    virtual void teardown();
+
+    void test_layout();
+    void test_uint32_matches_model();
+    void test_uuid_keys();
+    void test_small_min_degree();
+    void test_concurrent_inserts();
+    void test_format_tag();
+};
@@ -0,0 +1,11 @@
+
+#ifndef __test_utils_h
+#define __test_utils_h
+
+#include <string>
+#include <cstdint>
+
+// Bytes in the named file, 0 if it does not exist.
+uint64_t file_size(const std::string& name);
+
+#endif
@@ -0,0 +1,29 @@
+
+#include "framework.h"
+
+class test_wal : public test_fixture
+{
+public:
+    RTF_FIXTURE(test_wal);
+      TEST(test_wal::test_torn_tail_is_ignored);
+      TEST(test_wal::test_group_commit);
+      TEST(test_wal::test_recovery_after_crash);
+      TEST(test_wal::test_update_recovery_after_crash);
+      TEST(test_wal::test_bulk_load_survives_crash);
+      TEST(test_wal::test_partitioned_recovery);
+      TEST(test_wal::test_partitioned_bulk_load_survives_crash);
+    RTF_FIXTURE_END();
+
+    virtual ~test_wal() throw() {}
+
+    virtual void setup();
+    virtual void teardown();
+
+    void test_torn_tail_is_ignored();
+    void test_group_commit();
+    void test_recovery_after_crash();
+    void test_update_recovery_after_crash();
+    void test_bulk_load_survives_crash();
+    void test_partitioned_recovery();
+    void test_partitioned_bulk_load_survives_crash();
+};
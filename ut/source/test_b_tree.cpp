@@ -1,17 +1,22 @@
 
 #include "test_b_tree.h"
+#include "test_utils.h"
 #include "tdb/b_tree.h"
+#include "tdb/trace.h"
 #include <algorithm>
 #include <numeric>
 #include <random>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <queue>
+#include <map>
 #include <thread>
+#include <atomic>
 #include <cstdint>
 
 using namespace std;
@@ -42,8 +47,8 @@ void insert_all(T& t, const vector<int64_t>& keys)
 
 void test_b_tree::setup()
 {
-    b_tree::create_db_file("test.db");
-    b_tree t("test.db", 4);
+    b_tree::create_db_file("test.db", 4);
+    b_tree t("test.db");
 
     std::iota(begin(test_keys), end(test_keys), 0);
     std::iota(begin(test_vals), end(test_vals), test_keys.size());
@@ -80,7 +85,7 @@ void test_b_tree::test_CAS()
 
 void test_b_tree::test_basic()
 {
-    b_tree t("test.db", 4);
+    b_tree t("test.db");
 
     RTF_ASSERT(t.search(47) == 147);
     RTF_ASSERT(t.search(0) == 100);
@@ -89,22 +94,27 @@ void test_b_tree::test_basic()
 
 void test_b_tree::test_duplicate_key_insert()
 {
-    b_tree t("test.db", 4);
+    b_tree t("test.db");
 
     RTF_ASSERT_THROWS(t.insert(99, 99), std::runtime_error);
+
+    // Including keys that a split on the way down moves into the parent.
+    for(auto k : test_keys)
+        RTF_ASSERT_THROWS(t.insert(k, 0), std::runtime_error);
+    RTF_ASSERT(t.range(INT64_MIN, INT64_MAX).size() == test_keys.size());
 }
 
 void test_b_tree::test_dot_file()
 {
-    b_tree t("test.db", 4);
+    b_tree t("test.db");
 
     t.write_dot_file("dotfile.txt");
 }
 
 void test_b_tree::test_basic_remove()
 {
-    b_tree::create_db_file("test_basic_remove.db");
-    b_tree t("test_basic_remove.db", 4);
+    b_tree::create_db_file("test_basic_remove.db", 4);
+    b_tree t("test_basic_remove.db");
 
     insert_all(t, {10, 20, 30, 40, 50, 60, 70, 80, 90, 100});
 
@@ -118,7 +128,7 @@ void test_b_tree::test_basic_remove()
 
 void test_b_tree::test_lots_of_inserts_and_removes()
 {
-    b_tree t("test.db", 4);
+    b_tree t("test.db");
 
     auto keys = test_keys;
 
@@ -136,8 +146,8 @@ void test_b_tree::test_lots_of_inserts_and_removes()
 
 void test_b_tree::test_insert_ascending_order()
 {
-    b_tree::create_db_file("test_insert_ascending_order.db");
-    b_tree t("test_insert_ascending_order.db", 4);
+    b_tree::create_db_file("test_insert_ascending_order.db", 4);
+    b_tree t("test_insert_ascending_order.db");
 
     std::vector<int64_t> keys(100);
     std::iota(begin(keys), end(keys), 1);
@@ -151,8 +161,8 @@ void test_b_tree::test_insert_ascending_order()
 
 void test_b_tree::test_insert_descending_order()
 {
-    b_tree::create_db_file("test_insert_descending_order.db");
-    b_tree t("test_insert_descending_order.db", 4);
+    b_tree::create_db_file("test_insert_descending_order.db", 4);
+    b_tree t("test_insert_descending_order.db");
 
     std::vector<int64_t> keys(100);
     std::iota(rbegin(keys), rend(keys), 1);
@@ -166,8 +176,8 @@ void test_b_tree::test_insert_descending_order()
 
 void test_b_tree::test_remove_random_order()
 {
-    b_tree::create_db_file("test_remove_random_order.db");
-    b_tree t("test_remove_random_order.db", 4);
+    b_tree::create_db_file("test_remove_random_order.db", 4);
+    b_tree t("test_remove_random_order.db");
 
     std::vector<int64_t> keys(100);
     std::iota(begin(keys), end(keys), 1);
@@ -188,7 +198,7 @@ void test_b_tree::test_remove_random_order()
 
 void test_b_tree::test_search_non_existent_keys()
 {
-    b_tree t("test.db", 4);
+    b_tree t("test.db");
 
     std::vector<int64_t> non_existent_keys = {-10, -5, 200, 500};
 
@@ -199,8 +209,8 @@ void test_b_tree::test_search_non_existent_keys()
 
 void test_b_tree::test_large_number_of_keys()
 {
-    b_tree::create_db_file("test_large_number_of_keys.db");
-    b_tree t("test_large_number_of_keys.db", 4);
+    b_tree::create_db_file("test_large_number_of_keys.db", 4);
+    b_tree t("test_large_number_of_keys.db");
 
     std::vector<int64_t> keys(10000);
     std::iota(begin(keys), end(keys), 1);
@@ -225,10 +235,10 @@ void test_b_tree::test_large_number_of_keys()
 
 void test_b_tree::test_concurrent_inserts()
 {
-    b_tree::create_db_file("test_concurrent_inserts.db");
-    b_tree t("test_concurrent_inserts.db", 4);
+    b_tree::create_db_file("test_concurrent_inserts.db", 4);
+    b_tree t("test_concurrent_inserts.db");
 
-    const int num_threads = 1;
+    const int num_threads = 8;
     const int num_inserts_per_thread = 1000;
 
     std::vector<std::thread> threads;
@@ -258,4 +268,1198 @@ void test_b_tree::test_concurrent_inserts()
     t.write_dot_file("big_dotfile.txt");
 
     unlink("test_concurrent_inserts.db");
+    unlink("big_dotfile.txt");
+}
+
+void test_b_tree::test_concurrent_inserts_and_removes()
+{
+    b_tree::create_db_file("test_concurrent_inserts_and_removes.db", 4);
+    b_tree t("test_concurrent_inserts_and_removes.db");
+
+    const int num_threads = 8;
+    const int num_inserts_per_thread = 2000;
+
+    std::atomic<bool> done(false);
+    std::atomic<int> bad_reads(0);
+
+    // Writers interleave inserts of their own keys with removes of every third key they already inserted,
+    // so removes keep racing with the arm copies of other writers.
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            for (int j = 0; j < num_inserts_per_thread; ++j) {
+                int64_t key = j * num_threads + i;
+                t.insert(key, key + 100);
+                if (j >= 10 && (j - 10) % 3 == 0) {
+                    int64_t victim = (j - 10) * num_threads + i;
+                    t.remove(victim);
+                }
+            }
+        });
+    }
+
+    // A reader checks that whatever it sees is a value that was written for that key.
+    std::thread reader([&]() {
+        while (!done.load()) {
+            for (int64_t k = 0; k < num_threads * num_inserts_per_thread; k += 97) {
+                auto v = t.search(k);
+                if (v && *v != k + 100)
+                    ++bad_reads;
+            }
+        }
+    });
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    done.store(true);
+    reader.join();
+
+    RTF_ASSERT(bad_reads.load() == 0);
+
+    std::vector<int64_t> live;
+    for (int i = 0; i < num_threads; ++i) {
+        for (int j = 0; j < num_inserts_per_thread; ++j) {
+            int64_t key = j * num_threads + i;
+            bool removed = (j + 10 < num_inserts_per_thread) && (j % 3 == 0);
+            if (removed)
+                RTF_ASSERT(!t.search(key));
+            else live.push_back(key);
+        }
+    }
+    RTF_ASSERT(has_all_keys(t, live));
+
+    std::sort(begin(live), end(live));
+    auto all = t.range(INT64_MIN, INT64_MAX);
+    RTF_ASSERT(all.size() == live.size());
+    for (size_t i = 0; i < all.size(); ++i)
+        RTF_ASSERT(all[i].first == live[i]);
+
+    unlink("test_concurrent_inserts_and_removes.db");
+}
+
+void test_b_tree::test_trace()
+{
+    b_tree::create_db_file("test_trace.db", 4);
+    b_tree t("test_trace.db");
+
+    trace_clear();
+
+    std::vector<int64_t> keys(100);
+    std::iota(begin(keys), end(keys), 1);
+    insert_all(t, keys);
+
+    // Physical removes of every key rebalance all the way down to an empty tree.
+    t.set_tombstone_ratio(0.0);
+    for(auto k : keys)
+        t.remove(k);
+
+    auto records = trace_snapshot();
+
+    auto count = [&](trace_event ev) {
+        return std::count_if(begin(records), end(records), [ev](const trace_record& r){return r.event == ev;});
+    };
+
+    if(trace_enabled())
+    {
+        RTF_ASSERT(count(TRACE_ARM_COPY) > 0);
+        RTF_ASSERT(count(TRACE_SPLIT) > 0);
+        RTF_ASSERT(count(TRACE_ROOT_SPLIT) > 0);
+        RTF_ASSERT(count(TRACE_PAGE_APPEND) > 0);
+        RTF_ASSERT(count(TRACE_BORROW) > 0);
+        RTF_ASSERT(count(TRACE_MERGE) > 0);
+        RTF_ASSERT(count(TRACE_ROOT_COLLAPSE) > 0);
+    }
+    else RTF_ASSERT(records.empty());
+
+    unlink("test_trace.db");
+}
+
+void test_b_tree::test_auto_min_degree()
+{
+    b_tree::create_db_file("test_auto_min_degree.db");
+
+    std::vector<int64_t> keys(10000);
+    std::iota(begin(keys), end(keys), 1);
+    std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+    {
+        b_tree t("test_auto_min_degree.db");
+
+        // The fanout fills the page.
+        auto md = t.min_degree();
+        RTF_ASSERT(md == b_tree_node::max_min_degree(pager::block_size()));
+        RTF_ASSERT(b_tree_node::node_size(md) <= pager::block_size());
+        RTF_ASSERT(b_tree_node::node_size(md + 1) > pager::block_size());
+
+        insert_all(t, keys);
+    }
+
+    // Reopening picks the fanout up from the header.
+    b_tree t("test_auto_min_degree.db");
+    RTF_ASSERT(t.min_degree() == b_tree_node::max_min_degree(pager::block_size()));
+    RTF_ASSERT(has_all_keys(t, keys));
+
+    RTF_ASSERT_THROWS(b_tree::create_db_file("test_auto_min_degree.db", 1000), std::runtime_error);
+
+    unlink("test_auto_min_degree.db");
+}
+
+void test_b_tree::test_aligned_layout()
+{
+    // The bitmap makes aligned nodes smaller even though the header is padded out to a cache line.
+    RTF_ASSERT(b_tree_node::node_size(82, NODE_LAYOUT_ALIGNED) < b_tree_node::node_size(82, NODE_LAYOUT_PACKED));
+    RTF_ASSERT(b_tree_node::max_min_degree(pager::block_size(), NODE_LAYOUT_ALIGNED) >=
+               b_tree_node::max_min_degree(pager::block_size(), NODE_LAYOUT_PACKED));
+
+    // Nodes take their offsets from a table, which has to cover every min_degree that fits in a page.
+    for(auto layout : {NODE_LAYOUT_PACKED, NODE_LAYOUT_ALIGNED})
+    {
+        for(uint16_t md = 2; md <= b_tree_node::max_min_degree(pager::block_size(), layout); ++md)
+            RTF_ASSERT(node_offsets::of(md, layout).size == b_tree_node::node_size(md, layout));
+    }
+    RTF_ASSERT_THROWS(node_offsets::of(1, NODE_LAYOUT_PACKED), std::runtime_error);
+    RTF_ASSERT_THROWS(node_offsets::of(4, NODE_LAYOUT_SLOTTED), std::runtime_error);
+
+    for(uint16_t md : {(uint16_t)4, (uint16_t)0})
+    {
+        b_tree::create_db_file("test_aligned_layout.db", md, NODE_LAYOUT_ALIGNED);
+        b_tree t("test_aligned_layout.db");
+        RTF_ASSERT(t.layout() == NODE_LAYOUT_ALIGNED);
+
+        std::vector<int64_t> keys(5000);
+        std::iota(begin(keys), end(keys), 1);
+        std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+        insert_all(t, keys);
+        RTF_ASSERT(has_all_keys(t, keys));
+
+        for(size_t i = 0; i < keys.size(); i += 2)
+            t.remove(keys[i]);
+
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            if(i % 2 == 0)
+                RTF_ASSERT(!t.search(keys[i]));
+            else RTF_ASSERT(t.search(keys[i]) == keys[i] + 100);
+        }
+
+        unlink("test_aligned_layout.db");
+    }
+}
+
+void test_b_tree::test_cursor()
+{
+    b_tree::create_db_file("test_cursor.db", 4);
+    b_tree t("test_cursor.db");
+
+    {
+        b_tree::cursor c(t);
+        RTF_ASSERT(!c.seek_first());
+        RTF_ASSERT(!c.seek(0));
+        RTF_ASSERT(!c.next());
+    }
+
+    // Even keys only, so seeks land between keys too.
+    std::vector<int64_t> keys(1000);
+    for(size_t i = 0; i < keys.size(); ++i)
+        keys[i] = (int64_t)i * 2;
+    std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+    insert_all(t, keys);
+
+    std::vector<int64_t> live;
+    for(auto k : keys)
+    {
+        if(k % 3 == 0)
+            t.remove(k);
+        else live.push_back(k);
+    }
+    std::sort(begin(live), end(live));
+
+    b_tree::cursor c(t);
+
+    std::vector<int64_t> forward;
+    for(c.seek_first(); c.valid(); c.next())
+    {
+        RTF_ASSERT(c.value() == c.key() + 100);
+        forward.push_back(c.key());
+    }
+    RTF_ASSERT(forward == live);
+
+    std::vector<int64_t> backward;
+    for(c.seek_last(); c.valid(); c.prev())
+        backward.push_back(c.key());
+    std::reverse(begin(backward), end(backward));
+    RTF_ASSERT(backward == live);
+
+    for(int64_t lower = -5; lower < 2005; ++lower)
+    {
+        auto expected = std::lower_bound(begin(live), end(live), lower);
+        if(expected == end(live))
+            RTF_ASSERT(!c.seek(lower));
+        else
+        {
+            RTF_ASSERT(c.seek(lower));
+            RTF_ASSERT(c.key() == *expected);
+
+            // Step back and forth around the seek position.
+            if(expected != begin(live))
+            {
+                RTF_ASSERT(c.prev());
+                RTF_ASSERT(c.key() == *(expected - 1));
+                RTF_ASSERT(c.next());
+                RTF_ASSERT(c.key() == *expected);
+            }
+        }
+    }
+
+    // The cursor keeps reading the version of the tree it was opened on.
+    b_tree::cursor snapshot(t);
+    t.insert(1, 101);
+    t.insert(3, 103);
+    RTF_ASSERT(snapshot.seek(1));
+    RTF_ASSERT(snapshot.key() == 2);
+    b_tree::cursor current(t);
+    RTF_ASSERT(current.seek(1));
+    RTF_ASSERT(current.key() == 1);
+
+    unlink("test_cursor.db");
+}
+
+void test_b_tree::test_range()
+{
+    b_tree t("test.db");
+
+    auto r = t.range(10, 19);
+    RTF_ASSERT(r.size() == 10);
+    for(size_t i = 0; i < r.size(); ++i)
+    {
+        RTF_ASSERT(r[i].first == (int64_t)(10 + i));
+        RTF_ASSERT(r[i].second == (int64_t)(110 + i));
+    }
+
+    t.remove(15);
+    RTF_ASSERT(t.range(10, 19).size() == 9);
+    RTF_ASSERT(t.range(-10, -1).empty());
+    RTF_ASSERT(t.range(90, 1000).size() == 10);
+    RTF_ASSERT(t.range(20, 10).empty());
+}
+
+void test_b_tree::test_bulk_load()
+{
+    for(uint16_t md : {(uint16_t)2, (uint16_t)4, (uint16_t)0})
+    {
+        for(double fill : {1.0, 0.7, 0.1})
+        {
+            for(size_t n : {(size_t)1, (size_t)7, (size_t)8, (size_t)100, (size_t)10000})
+            {
+                b_tree::create_db_file("test_bulk_load.db", md);
+                b_tree t("test_bulk_load.db");
+
+                std::vector<std::pair<int64_t, int64_t>> kvs(n);
+                for(size_t i = 0; i < n; ++i)
+                    kvs[i] = std::make_pair((int64_t)i * 3, (int64_t)i * 3 + 100);
+
+                t.bulk_load(begin(kvs), end(kvs), fill);
+
+                for(auto& kv : kvs)
+                    RTF_ASSERT(t.search(kv.first) == kv.second);
+                RTF_ASSERT(!t.search(1));
+
+                RTF_ASSERT(t.range(INT64_MIN, INT64_MAX) == kvs);
+
+                // The loaded tree is an ordinary tree, regular inserts and removes keep working.
+                t.insert(1, 101);
+                t.remove(0);
+                RTF_ASSERT(t.search(1) == 101);
+                RTF_ASSERT(!t.search(0));
+                RTF_ASSERT(t.range(INT64_MIN, INT64_MAX).size() == n);
+
+                unlink("test_bulk_load.db");
+            }
+        }
+    }
+
+    // Full pages, so the file is a small fraction of what inserting key by key produces.
+    std::vector<std::pair<int64_t, int64_t>> kvs(100000);
+    for(size_t i = 0; i < kvs.size(); ++i)
+        kvs[i] = std::make_pair((int64_t)i, (int64_t)i);
+
+    b_tree::create_db_file("test_bulk_load.db");
+    {
+        b_tree t("test_bulk_load.db");
+        t.bulk_load(begin(kvs), end(kvs));
+    }
+    auto leaves = kvs.size() / ((2 * b_tree_node::max_min_degree(pager::block_size())) - 1);
+    RTF_ASSERT(file_size("test_bulk_load.db") < (leaves + (leaves / 10) + 2) * pager::block_size());
+
+    // Input has to be sorted and the tree has to be empty.
+    {
+        b_tree t("test_bulk_load.db");
+        RTF_ASSERT_THROWS(t.bulk_load(begin(kvs), end(kvs)), std::runtime_error);
+    }
+    b_tree::create_db_file("test_bulk_load.db");
+    {
+        b_tree t("test_bulk_load.db");
+        std::swap(kvs[500], kvs[501]);
+        RTF_ASSERT_THROWS(t.bulk_load(begin(kvs), end(kvs)), std::runtime_error);
+        RTF_ASSERT(!t.search(0));
+    }
+
+    unlink("test_bulk_load.db");
+}
+
+void test_b_tree::test_bulk_load_unsorted()
+{
+    std::vector<int64_t> keys(50000);
+    std::iota(begin(keys), end(keys), 1);
+    std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+    b_tree::create_db_file("test_bulk_load_unsorted.db", 4);
+    b_tree t("test_bulk_load_unsorted.db");
+
+    {
+        // Small enough budget to force a multi run merge.
+        external_sorter sorter("test_bulk_load_unsorted.run", 16 * 1024);
+        for(auto k : keys)
+            sorter.add(k, k + 100);
+        t.bulk_load(sorter, 0.8);
+    }
+
+    RTF_ASSERT(has_all_keys(t, keys));
+    RTF_ASSERT(t.search(777) == 877);
+
+    auto all = t.range(INT64_MIN, INT64_MAX);
+    RTF_ASSERT(all.size() == keys.size());
+    for(size_t i = 0; i < all.size(); ++i)
+        RTF_ASSERT(all[i].first == (int64_t)(i + 1));
+
+    // Run files are cleaned up with the sorter.
+    RTF_ASSERT(access("test_bulk_load_unsorted.run0", F_OK) != 0);
+
+    unlink("test_bulk_load_unsorted.db");
+}
+
+void test_b_tree::test_vacuum()
+{
+    for(auto layout : {NODE_LAYOUT_PACKED, NODE_LAYOUT_ALIGNED})
+    {
+        b_tree::create_db_file("test_vacuum.db", 4, layout);
+
+        std::vector<int64_t> keys(2000);
+        std::iota(begin(keys), end(keys), 1);
+        std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+        std::vector<int64_t> live, removed;
+        {
+            b_tree t("test_vacuum.db");
+            insert_all(t, keys);
+            for(auto k : keys)
+            {
+                if(k % 4 == 0)
+                    live.push_back(k);
+                else
+                {
+                    t.remove(k);
+                    removed.push_back(k);
+                }
+            }
+        }
+        std::sort(begin(live), end(live));
+
+        auto before = file_size("test_vacuum.db");
+        b_tree::vacuum("test_vacuum.db");
+        auto after = file_size("test_vacuum.db");
+
+        RTF_ASSERT(after * 4 < before);
+        RTF_ASSERT(access("test_vacuum.db.vacuum", F_OK) != 0);
+
+        b_tree t("test_vacuum.db");
+        RTF_ASSERT(t.min_degree() == 4);
+        RTF_ASSERT(t.layout() == layout);
+        RTF_ASSERT(has_all_keys(t, live));
+        for(auto k : removed)
+            RTF_ASSERT(!t.search(k));
+
+        auto all = t.range(INT64_MIN, INT64_MAX);
+        RTF_ASSERT(all.size() == live.size());
+        for(size_t i = 0; i < all.size(); ++i)
+            RTF_ASSERT(all[i].first == live[i] && all[i].second == live[i] + 100);
+
+        // The vacuumed file is an ordinary db file.
+        t.insert(3, 103);
+        RTF_ASSERT(t.search(3) == 103);
+    }
+
+    // An empty tree stays empty.
+    b_tree::create_db_file("test_vacuum.db");
+    b_tree::vacuum("test_vacuum.db");
+    {
+        b_tree t("test_vacuum.db");
+        RTF_ASSERT(!t.search(1));
+    }
+
+    unlink("test_vacuum.db");
+}
+
+void test_b_tree::test_page_reuse()
+{
+    std::vector<int64_t> keys(2000);
+    std::iota(begin(keys), end(keys), 1);
+    std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+    {
+        b_tree::create_db_file("test_page_reuse.db", 4);
+        b_tree t("test_page_reuse.db");
+        insert_all(t, keys);
+        RTF_ASSERT(has_all_keys(t, keys));
+    }
+
+    // Without reuse every insert leaves a whole copied arm behind.
+    RTF_ASSERT(file_size("test_page_reuse.db") / pager::block_size() < keys.size() / 2);
+
+    {
+        // The free list survives reopening the file and is used in buffer pool mode too.
+        auto before = file_size("test_page_reuse.db");
+        {
+            b_tree t("test_page_reuse.db", 32, EVICT_CLOCK);
+            for(int64_t k = 3000; k < 3200; ++k)
+                t.insert(k, k + 100);
+        }
+        RTF_ASSERT(file_size("test_page_reuse.db") - before < 200 * pager::block_size());
+
+        b_tree t("test_page_reuse.db", 32, EVICT_CLOCK);
+        b_tree::cursor c(t);
+        for(int64_t k = 4000; k < 4200; ++k)
+            t.insert(k, k + 100);
+
+        // The cursor holds the version it started from, none of its pages may have been reused.
+        uint64_t n = 0;
+        int64_t last = 0;
+        for(c.seek_first(); c.valid(); c.next())
+        {
+            RTF_ASSERT(c.key() > last);
+            RTF_ASSERT(c.value() == c.key() + 100);
+            last = c.key();
+            ++n;
+        }
+        RTF_ASSERT(n == keys.size() + 200);
+
+        RTF_ASSERT(has_all_keys(t, keys));
+    }
+
+    unlink("test_page_reuse.db");
+}
+
+void test_b_tree::test_insert_batch()
+{
+    std::vector<int64_t> keys(20000);
+    std::iota(begin(keys), end(keys), 1);
+    std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+    for(auto layout : {NODE_LAYOUT_PACKED, NODE_LAYOUT_ALIGNED})
+    {
+        b_tree::create_db_file("test_insert_batch.db", 4, layout);
+        b_tree::create_db_file("test_insert_batch_single.db", 4, layout);
+
+        {
+            b_tree t("test_insert_batch.db");
+            b_tree single("test_insert_batch_single.db");
+
+            // Open cursors keep every replaced page from being reused, so the file sizes below count
+            // every page either approach wrote.
+            b_tree::cursor hold(t), hold_single(single);
+
+            for(size_t b = 0; b < keys.size(); b += 2000)
+            {
+                std::vector<std::pair<int64_t, int64_t>> batch;
+                for(size_t i = b; i < b + 2000; ++i)
+                    batch.push_back(std::make_pair(keys[i], keys[i] + 100));
+                t.insert_batch(batch);
+            }
+
+            insert_all(single, keys);
+
+            RTF_ASSERT(has_all_keys(t, keys));
+            auto all = t.range(INT64_MIN, INT64_MAX);
+            RTF_ASSERT(all.size() == keys.size());
+
+            // All or nothing, the batch holds a key that is already present.
+            RTF_ASSERT_THROWS(t.insert_batch({{30000, 1}, {keys[0], 1}, {30001, 1}}), std::runtime_error);
+            RTF_ASSERT(!t.search(30000));
+            RTF_ASSERT(!t.search(30001));
+
+            t.insert_batch({{30000, 30100}, {30001, 30101}});
+            RTF_ASSERT(t.search(30000) == 30100);
+            RTF_ASSERT(t.search(30001) == 30101);
+        }
+
+        // Sharing copied nodes across a batch writes far fewer pages than an arm copy per key.
+        RTF_ASSERT(file_size("test_insert_batch.db") * 5 < file_size("test_insert_batch_single.db"));
+
+        unlink("test_insert_batch.db");
+        unlink("test_insert_batch_single.db");
+    }
+}
+
+void test_b_tree::test_physical_remove()
+{
+    for(auto layout : {NODE_LAYOUT_PACKED, NODE_LAYOUT_ALIGNED})
+    {
+        for(uint16_t min_degree : {2, 4})
+        {
+            b_tree::create_db_file("test_physical_remove.db", min_degree, layout);
+
+            std::vector<int64_t> keys(4000);
+            std::iota(begin(keys), end(keys), 1);
+            std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+            {
+                b_tree t("test_physical_remove.db");
+                t.set_tombstone_ratio(0.0);
+                insert_all(t, keys);
+
+                // Remove three quarters of the keys in random order, checking the whole tree as it shrinks.
+                std::map<int64_t, int64_t> model;
+                for(auto k : keys)
+                    model[k] = k + 100;
+
+                for(size_t i = 0; i < keys.size(); ++i)
+                {
+                    if(i % 4 == 0)
+                        continue;
+                    t.remove(keys[i]);
+                    model.erase(keys[i]);
+                    RTF_ASSERT(!t.search(keys[i]));
+
+                    if(i % 500 == 1)
+                    {
+                        std::vector<std::pair<int64_t, int64_t>> expected(begin(model), end(model));
+                        RTF_ASSERT(t.range(INT64_MIN, INT64_MAX) == expected);
+                    }
+                }
+
+                for(auto& kv : model)
+                    RTF_ASSERT(t.search(kv.first) == kv.second);
+                RTF_ASSERT(t.tombstones() == 0);
+                RTF_ASSERT(t.live_keys() == model.size());
+
+                // Removed keys can be inserted again.
+                for(int64_t k = 2; k < 400; ++k)
+                {
+                    if(model.count(k) != 0)
+                        continue;
+                    t.insert(k, k + 1000);
+                    RTF_ASSERT(t.search(k) == k + 1000);
+                }
+
+                for(auto k : keys)
+                    t.remove(k);
+                RTF_ASSERT(t.range(INT64_MIN, INT64_MAX).empty());
+                RTF_ASSERT(t.live_keys() == 0);
+            }
+
+            // Every node went back to the free list, filling the tree again does not grow the file.
+            auto before = file_size("test_physical_remove.db");
+            {
+                b_tree t("test_physical_remove.db");
+                insert_all(t, keys);
+                RTF_ASSERT(has_all_keys(t, keys));
+            }
+            RTF_ASSERT(file_size("test_physical_remove.db") <= before);
+
+            unlink("test_physical_remove.db");
+        }
+    }
+}
+
+void test_b_tree::test_tombstone_ratio()
+{
+    std::vector<int64_t> keys(4000);
+    std::iota(begin(keys), end(keys), 1);
+    std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+    b_tree::create_db_file("test_tombstone_ratio.db", 4);
+
+    {
+        b_tree t("test_tombstone_ratio.db");
+        RTF_ASSERT_THROWS(t.set_tombstone_ratio(1.5), std::runtime_error);
+
+        insert_all(t, keys);
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            if(i % 4 != 0)
+                t.remove(keys[i]);
+        }
+
+        // Lazy removes stop once tombstones pass the ratio and physical removes sweep them back out.
+        RTF_ASSERT(t.live_keys() == keys.size() / 4);
+        RTF_ASSERT(t.tombstones() > 0);
+        RTF_ASSERT(t.tombstones() <= (t.live_keys() + t.tombstones()) * b_tree::default_tombstone_ratio + 1);
+
+        for(size_t i = 0; i < keys.size(); ++i)
+            RTF_ASSERT(t.search(keys[i]).has_value() == (i % 4 == 0));
+
+        // A ratio of 1 never escalates.
+        t.set_tombstone_ratio(1.0);
+        auto dead = t.tombstones();
+        for(size_t i = 0; i < keys.size(); i += 8)
+            t.remove(keys[i]);
+        RTF_ASSERT(t.tombstones() == dead + keys.size() / 8);
+    }
+
+    {
+        // The counts are kept in the file header.
+        b_tree t("test_tombstone_ratio.db");
+        RTF_ASSERT(t.live_keys() == keys.size() / 8);
+        RTF_ASSERT(t.live_keys() == t.range(INT64_MIN, INT64_MAX).size());
+    }
+
+    unlink("test_tombstone_ratio.db");
+}
+
+void test_b_tree::test_upsert()
+{
+    b_tree::create_db_file("test_upsert.db", 4);
+
+    {
+        b_tree t("test_upsert.db");
+        // Every remove stays lazy so re-inserted keys land on their own tombstones.
+        t.set_tombstone_ratio(1.0);
+
+        std::vector<int64_t> keys(2000);
+        std::iota(begin(keys), end(keys), 1);
+        std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+        // New keys are inserted, present keys (in leaves and internal nodes alike) are overwritten.
+        for(auto k : keys)
+            t.upsert(k, k + 100);
+        for(auto k : keys)
+            t.upsert(k, k + 200);
+        RTF_ASSERT(t.live_keys() == keys.size());
+        for(auto k : keys)
+            RTF_ASSERT(t.search(k) == k + 200);
+
+        // Removed keys come back, through upsert and plain insert.
+        for(auto k : keys)
+            t.remove(k);
+        RTF_ASSERT(t.live_keys() == 0 && t.tombstones() == keys.size());
+        for(auto k : keys)
+        {
+            if(k % 2 == 0)
+                t.upsert(k, k + 300);
+            else t.insert(k, k + 300);
+        }
+        RTF_ASSERT(t.live_keys() == keys.size() && t.tombstones() == 0);
+        RTF_ASSERT_THROWS(t.insert(keys[0], 1), std::runtime_error);
+
+        auto all = t.range(INT64_MIN, INT64_MAX);
+        RTF_ASSERT(all.size() == keys.size());
+        for(size_t i = 0; i < all.size(); ++i)
+            RTF_ASSERT(all[i].first == (int64_t)i + 1 && all[i].second == all[i].first + 300);
+
+        t.insert_batch({{keys[0] + 5000, 1}});
+        t.remove(keys[1]);
+        t.insert_batch({{keys[1], 2}});
+        RTF_ASSERT(t.search(keys[1]) == 2);
+    }
+
+    {
+        // An update only copies the arm down to the key, the file does not grow.
+        b_tree t("test_upsert.db");
+        t.upsert(1, 1);
+        auto before = file_size("test_upsert.db");
+        for(int i = 0; i < 1000; ++i)
+            t.upsert(1 + (i % 50), i);
+        RTF_ASSERT(file_size("test_upsert.db") == before);
+    }
+
+    unlink("test_upsert.db");
+}
+
+void test_b_tree::test_compare_and_set()
+{
+    b_tree::create_db_file("test_compare_and_set.db", 4);
+    b_tree t("test_compare_and_set.db");
+
+    RTF_ASSERT(!t.compare_and_set(1, 0, 1));
+    RTF_ASSERT(!t.search(1));
+
+    const int64_t num_counters = 16;
+    for(int64_t k = 0; k < num_counters; ++k)
+        t.insert(k, 0);
+
+    RTF_ASSERT(!t.compare_and_set(0, 5, 6));
+    RTF_ASSERT(t.search(0) == 0);
+
+    // Counters incremented with read / compare_and_set retry loops never lose an increment.
+    const int num_threads = 8;
+    const int num_increments = 500;
+    std::atomic<int> failed_cas(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back([&, i](){
+            for(int j = 0; j < num_increments; ++j)
+            {
+                int64_t k = (i + j) % num_counters;
+                while(true)
+                {
+                    auto current = *t.search(k);
+                    if(t.compare_and_set(k, current, current + 1))
+                        break;
+                    ++failed_cas;
+                }
+            }
+        });
+    }
+    for(auto& th : threads)
+        th.join();
+
+    int64_t total = 0;
+    for(int64_t k = 0; k < num_counters; ++k)
+        total += *t.search(k);
+    RTF_ASSERT(total == num_threads * num_increments);
+    RTF_ASSERT(t.live_keys() == num_counters);
+
+    // A removed key can not be compared.
+    t.remove(3);
+    RTF_ASSERT(!t.compare_and_set(3, *t.search(4), 1));
+    RTF_ASSERT(!t.search(3));
+
+    unlink("test_compare_and_set.db");
+}
+
+void test_b_tree::test_write_retries()
+{
+    b_tree::create_db_file("test_write_retries.db", 4);
+    b_tree t("test_write_retries.db");
+
+    const int num_threads = 8;
+    const int num_inserts_per_thread = 2000;
+
+    // Interleaved keys keep the writers in the same leaves, so root CASes are lost all the time.
+    std::vector<std::thread> threads;
+    for(int i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back([&, i](){
+            for(int j = 0; j < num_inserts_per_thread; ++j)
+                t.insert(j * num_threads + i, i);
+        });
+    }
+    for(auto& th : threads)
+        th.join();
+
+    std::vector<int64_t> keys(num_threads * num_inserts_per_thread);
+    std::iota(begin(keys), end(keys), 0);
+    RTF_ASSERT(has_all_keys(t, keys));
+    RTF_ASSERT(t.live_keys() == keys.size());
+
+    auto s = t.stats();
+    RTF_ASSERT(s.writes == keys.size());
+    RTF_ASSERT(s.max_retries <= s.retries);
+    // Only a retry can reuse or recycle anything.
+    if(s.retries == 0)
+        RTF_ASSERT(s.reused_nodes == 0 && s.recycled_pages == 0);
+
+    // Updates and removes are counted too (a remove of a missing key is not a write).
+    t.upsert(0, 42);
+    t.remove(1);
+    t.remove(-1);
+    RTF_ASSERT(t.stats().writes == keys.size() + 2);
+
+    unlink("test_write_retries.db");
+}
+
+void test_b_tree::test_partitions()
+{
+    b_tree::create_db_file("test_partitions.db", 4, NODE_LAYOUT_PACKED, 8);
+
+    const int num_threads = 8;
+    const int num_inserts_per_thread = 2000;
+    const int64_t n = num_threads * num_inserts_per_thread;
+
+    std::map<int64_t, int64_t> model;
+    {
+        b_tree t("test_partitions.db");
+        RTF_ASSERT(t.partitions() == 8);
+
+        std::vector<std::thread> threads;
+        for(int i = 0; i < num_threads; ++i)
+        {
+            threads.emplace_back([&, i](){
+                for(int j = 0; j < num_inserts_per_thread; ++j)
+                    t.insert(j * num_threads + i, i);
+            });
+        }
+        for(auto& th : threads)
+            th.join();
+
+        for(int64_t k = 0; k < n; ++k)
+            model[k] = k % num_threads;
+        RTF_ASSERT(t.stats().writes == (uint64_t)n);
+
+        for(int64_t k = 0; k < n; k += 3)
+        {
+            t.remove(k);
+            model.erase(k);
+        }
+        t.upsert(1, 42);
+        model[1] = 42;
+
+        // A batch spans partitions and still fails as a whole.
+        bool threw = false;
+        try
+        {
+            t.insert_batch({{n, 0}, {n + 1, 0}, {2, 0}});
+        }
+        catch(const std::exception&)
+        {
+            threw = true;
+        }
+        RTF_ASSERT(threw);
+        RTF_ASSERT(!t.search(n) && !t.search(n + 1));
+
+        t.insert_batch({{n, 1}, {n + 1, 2}, {n + 2, 3}, {n + 3, 4}});
+        for(int64_t k = n; k < n + 4; ++k)
+            model[k] = k - n + 1;
+
+        RTF_ASSERT(t.live_keys() == model.size());
+    }
+
+    // The cursor merges the partitions in key order in both directions.
+    auto check = [&](b_tree& t){
+        b_tree::cursor c(t);
+        auto m = model.begin();
+        for(c.seek_first(); c.valid(); c.next(), ++m)
+        {
+            if(m == model.end() || c.key() != m->first || c.value() != m->second)
+                return false;
+        }
+        if(m != model.end())
+            return false;
+
+        auto r = model.rbegin();
+        for(c.seek_last(); c.valid(); c.prev(), ++r)
+        {
+            if(r == model.rend() || c.key() != r->first)
+                return false;
+        }
+        if(r != model.rend())
+            return false;
+
+        // Changing direction in the middle.
+        c.seek(1000);
+        auto at = model.lower_bound(1000);
+        for(int step = 0; step < 50; ++step)
+        {
+            if(step % 7 < 4)
+            {
+                c.next();
+                ++at;
+            }
+            else
+            {
+                c.prev();
+                --at;
+            }
+            if(!c.valid() || c.key() != at->first)
+                return false;
+        }
+
+        auto rng = t.range(500, 600);
+        std::vector<std::pair<int64_t, int64_t>> expected(model.lower_bound(500), model.upper_bound(600));
+        return rng == expected;
+    };
+
+    {
+        b_tree t("test_partitions.db");
+        RTF_ASSERT(t.partitions() == 8);
+        RTF_ASSERT(check(t));
+    }
+
+    b_tree::vacuum("test_partitions.db");
+    {
+        b_tree t("test_partitions.db");
+        RTF_ASSERT(t.partitions() == 8);
+        RTF_ASSERT(check(t));
+        RTF_ASSERT(t.live_keys() == model.size());
+    }
+
+    // A partitioned bulk load goes through insert_batch.
+    b_tree::create_db_file("test_partitions.db", 4, NODE_LAYOUT_PACKED, 8);
+    {
+        b_tree t("test_partitions.db");
+        std::vector<std::pair<int64_t, int64_t>> input(model.begin(), model.end());
+        t.bulk_load(begin(input), end(input));
+        RTF_ASSERT(check(t));
+    }
+
+    bool threw = false;
+    try
+    {
+        b_tree::create_db_file("test_partitions.db", 4, NODE_LAYOUT_PACKED, (uint16_t)(pager::root_slots() + 1));
+    }
+    catch(const std::exception&)
+    {
+        threw = true;
+    }
+    RTF_ASSERT(threw);
+
+    // Batches racing single inserts of the same keys. Whatever part of a batch gets published is counted,
+    // so the key counts still match the tree.
+    b_tree::create_db_file("test_partitions.db", 4, NODE_LAYOUT_PACKED, 8);
+    {
+        b_tree t("test_partitions.db");
+        const int64_t keys = 20000;
+        std::thread single([&](){
+            for(int64_t k = 0; k < keys; k += 3)
+            {
+                try
+                {
+                    t.insert(k, k);
+                }
+                catch(const std::exception&)
+                {
+                }
+            }
+        });
+
+        for(int64_t base = 0; base < keys; base += 16)
+        {
+            std::vector<std::pair<int64_t, int64_t>> batch;
+            for(int64_t k = base; k < base + 16; ++k)
+                batch.push_back(std::make_pair(k, k));
+            try
+            {
+                t.insert_batch(batch);
+            }
+            catch(const std::exception&)
+            {
+            }
+        }
+        single.join();
+
+        RTF_ASSERT(t.live_keys() == t.range(INT64_MIN, INT64_MAX).size());
+        RTF_ASSERT(t.tombstones() == 0);
+    }
+
+    unlink("test_partitions.db");
+}
+
+void test_b_tree::test_snapshot()
+{
+    for(uint16_t partitions : {1, 4})
+    {
+        b_tree::create_db_file("test_snapshot.db", 4, NODE_LAYOUT_PACKED, partitions);
+        b_tree t("test_snapshot.db");
+        t.set_tombstone_ratio(0.0);
+
+        const int64_t n = 2000;
+        for(int64_t k = 0; k < n; ++k)
+            t.insert(k, k);
+
+        std::vector<std::pair<int64_t, int64_t>> original;
+        for(int64_t k = 0; k < n; ++k)
+            original.push_back(std::make_pair(k, k));
+
+        std::atomic<bool> done(false);
+        std::atomic<int64_t> written(n);
+        std::thread writer([&](){
+            // Keys past n are inserted strictly in order, so a snapshot that sees one of them has to see
+            // every key before it (whichever partitions they live in).
+            for(int64_t k = 0; k < n; ++k)
+            {
+                t.upsert(k, k + 1000000);
+                if(k % 3 == 0)
+                    t.remove(k);
+                t.insert(n + k, k);
+                written.store(n + k + 1);
+            }
+            done.store(true);
+        });
+
+        b_tree::snapshot s(t);
+        RTF_ASSERT(t.open_snapshots() == 1);
+
+        int bad = 0;
+        while(!done.load())
+        {
+            for(int64_t k = 0; k < n; k += 97)
+            {
+                if(s.search(k) != k)
+                    ++bad;
+            }
+            if(s.range(0, n - 1) != original || s.search(n))
+                ++bad;
+
+            b_tree::snapshot later(t);
+            auto seen = later.range(n, 2 * n);
+            for(size_t i = 0; i < seen.size(); ++i)
+            {
+                if(seen[i].first != n + (int64_t)i)
+                    ++bad;
+            }
+        }
+        writer.join();
+        RTF_ASSERT(bad == 0);
+
+        b_tree::cursor c(s);
+        int64_t count = 0;
+        for(c.seek_first(); c.valid(); c.next())
+            ++count;
+        RTF_ASSERT(count == n);
+        RTF_ASSERT(s.range(0, n - 1) == original);
+
+        // The tree itself has moved on.
+        RTF_ASSERT(!t.search(0));
+        RTF_ASSERT(t.search(1) == 1000001);
+        RTF_ASSERT(t.search(2 * n - 1) == n - 1);
+
+        b_tree::snapshot now(t);
+        RTF_ASSERT(t.open_snapshots() == 2);
+        RTF_ASSERT(now.search(1) == 1000001);
+        RTF_ASSERT(!now.search(0));
+    }
+
+    // Snapshots and their cursors are registered apart from the slots of ordinary readers, so far more of
+    // them than there are reader slots leave searches and writes running.
+    {
+        b_tree::create_db_file("test_snapshot.db", 4);
+        b_tree t("test_snapshot.db");
+        for(int64_t k = 0; k < 100; ++k)
+            t.insert(k, k);
+
+        std::vector<std::unique_ptr<b_tree::snapshot>> held;
+        std::vector<std::unique_ptr<b_tree::cursor>> cursors;
+        for(int i = 0; i < 1000; ++i)
+        {
+            held.push_back(std::make_unique<b_tree::snapshot>(t));
+            cursors.push_back(std::make_unique<b_tree::cursor>(*held.back()));
+            cursors.back()->seek_first();
+        }
+        RTF_ASSERT(t.search(5) == 5);
+        t.insert(100, 100);
+        RTF_ASSERT(t.search(100) == 100);
+        RTF_ASSERT(held.back()->search(99) == 99 && !held.back()->search(100));
+        cursors.clear();
+        held.clear();
+
+        // While snapshots hold retired pages every write advances the epoch, so each new snapshot pins an
+        // epoch of its own until the registry is full. That fails fast instead of blocking.
+        bool full = false;
+        for(size_t i = 0; i < pager::snapshot_slots() * 4 && !full; ++i)
+        {
+            t.upsert((int64_t)(i % 100), (int64_t)i);
+            try
+            {
+                held.push_back(std::make_unique<b_tree::snapshot>(t));
+            }
+            catch(std::runtime_error&)
+            {
+                full = true;
+            }
+        }
+        RTF_ASSERT(full);
+        RTF_ASSERT_THROWS(b_tree::cursor c(t), std::runtime_error);
+        RTF_ASSERT(t.search(100) == 100);
+        t.insert(101, 101);
+
+        held.clear();
+        b_tree::snapshot s(t);
+        RTF_ASSERT(s.search(101) == 101);
+    }
+
+    unlink("test_snapshot.db");
+}
+
+void test_b_tree::test_filter()
+{
+    // Without a filter every key may be present.
+    {
+        b_tree::create_db_file("test_filter.db", 4);
+        b_tree t("test_filter.db");
+        RTF_ASSERT(t.filter_capacity() == 0);
+        RTF_ASSERT(t.may_contain(42));
+    }
+
+    auto false_positives = [](const b_tree& t, const std::vector<int64_t>& missing){
+        size_t n = 0;
+        for(auto k : missing)
+            n += (t.may_contain(k))?1:0;
+        return (double)n / missing.size();
+    };
+
+    // Even keys are inserted, odd keys never are.
+    std::vector<int64_t> keys(20000), missing(100000);
+    for(size_t i = 0; i < keys.size(); ++i)
+        keys[i] = (int64_t)i * 2;
+    for(size_t i = 0; i < missing.size(); ++i)
+        missing[i] = ((int64_t)i * 2) + 1;
+    std::shuffle(begin(keys), end(keys), std::default_random_engine{});
+
+    for(uint16_t partitions : {1, 4})
+    {
+        b_tree::create_db_file("test_filter.db", 0, NODE_LAYOUT_ALIGNED, partitions, keys.size());
+
+        {
+            b_tree t("test_filter.db");
+            RTF_ASSERT(t.filter_capacity() >= keys.size());
+
+            // Every way of writing a key adds it.
+            size_t i = 0;
+            for(; i < keys.size() / 4; ++i)
+                t.insert(keys[i], keys[i] + 100);
+            for(; i < keys.size() / 2; ++i)
+                t.upsert(keys[i], keys[i] + 100);
+            std::vector<std::pair<int64_t, int64_t>> batch;
+            for(; i < keys.size(); ++i)
+                batch.push_back(std::make_pair(keys[i], keys[i] + 100));
+            t.insert_batch(batch);
+
+            for(auto k : keys)
+                RTF_ASSERT(t.may_contain(k) && t.search(k) == k + 100);
+            for(auto k : missing)
+                RTF_ASSERT(!t.search(k));
+            RTF_ASSERT(false_positives(t, missing) < 0.03);
+
+            // A compare_and_set never adds a key.
+            RTF_ASSERT(!t.compare_and_set(missing[0], 0, 1));
+            b_tree::snapshot s(t);
+            for(size_t j = 0; j < 1000; ++j)
+                RTF_ASSERT(s.search(keys[j]) == keys[j] + 100 && !s.search(missing[j]));
+
+            // Removed keys stay in the filter.
+            for(size_t j = 0; j < keys.size() / 2; ++j)
+                t.remove(keys[j]);
+            for(size_t j = 0; j < keys.size() / 2; ++j)
+                RTF_ASSERT(t.may_contain(keys[j]) && !t.search(keys[j]));
+        }
+
+        // The filter persists and is rebuilt from the live keys by a vacuum.
+        b_tree::vacuum("test_filter.db");
+        {
+            b_tree t("test_filter.db");
+            RTF_ASSERT(t.filter_capacity() >= keys.size());
+            std::vector<int64_t> removed(begin(keys), begin(keys) + (keys.size() / 2));
+            RTF_ASSERT(false_positives(t, removed) < 0.03);
+            for(size_t j = keys.size() / 2; j < keys.size(); ++j)
+                RTF_ASSERT(t.search(keys[j]) == keys[j] + 100);
+        }
+    }
+
+    // A bulk loaded file fills its filter too.
+    {
+        std::vector<std::pair<int64_t, int64_t>> sorted;
+        for(int64_t k = 0; k < 40000; k += 2)
+            sorted.push_back(std::make_pair(k, k + 100));
+        b_tree::create_db_file("test_filter.db", 0, NODE_LAYOUT_PACKED, 1, sorted.size());
+        b_tree t("test_filter.db");
+        t.bulk_load(begin(sorted), end(sorted));
+        for(auto& kv : sorted)
+            RTF_ASSERT(t.search(kv.first) == kv.second);
+        RTF_ASSERT(false_positives(t, missing) < 0.03);
+    }
+
+    unlink("test_filter.db");
 }
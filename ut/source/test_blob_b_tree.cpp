@@ -0,0 +1,298 @@
+
+#include "test_blob_b_tree.h"
+#include "test_utils.h"
+#include "tdb/blob_b_tree.h"
+#include "tdb/b_tree.h"
+#include "tdb/blob_node.h"
+#include <map>
+#include <algorithm>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+REGISTER_TEST_FIXTURE(test_blob_b_tree);
+
+void test_blob_b_tree::setup()
+{
+    blob_b_tree::create_db_file("test_blob.db");
+}
+
+void test_blob_b_tree::teardown()
+{
+    unlink("test_blob.db");
+    unlink("test_blob_int.db");
+}
+
+void test_blob_b_tree::test_basic()
+{
+    blob_b_tree t("test_blob.db");
+
+    RTF_ASSERT(!t.search("missing"));
+    t.remove("missing");
+
+    t.insert("apple", "red");
+    t.insert("banana", "yellow");
+    t.insert("", "empty key");
+    t.insert("cherry", "");
+
+    RTF_ASSERT(t.search("apple") == string("red"));
+    RTF_ASSERT(t.search("banana") == string("yellow"));
+    RTF_ASSERT(t.search("") == string("empty key"));
+    RTF_ASSERT(t.search("cherry") == string(""));
+    RTF_ASSERT(!t.search("app"));
+    RTF_ASSERT(!t.search("applesauce"));
+
+    bool threw = false;
+    try
+    {
+        t.insert("apple", "green");
+    }
+    catch(const std::exception&)
+    {
+        threw = true;
+    }
+    RTF_ASSERT(threw);
+    RTF_ASSERT(t.search("apple") == string("red"));
+
+    t.upsert("apple", "green");
+    RTF_ASSERT(t.search("apple") == string("green"));
+
+    t.remove("banana");
+    RTF_ASSERT(!t.search("banana"));
+    t.insert("banana", "brown");
+    RTF_ASSERT(t.search("banana") == string("brown"));
+
+    threw = false;
+    try
+    {
+        t.insert(string(blob_b_tree::max_key_size + 1, 'k'), "v");
+    }
+    catch(const std::exception&)
+    {
+        threw = true;
+    }
+    RTF_ASSERT(threw);
+
+    auto r = t.range("b", "c");
+    RTF_ASSERT(r.size() == 1 && r[0].first == "banana");
+}
+
+void test_blob_b_tree::test_matches_model()
+{
+    // Keys share long prefixes (so nodes are prefix compressed) and vary in length up to the maximum.
+    std::mt19937_64 rng(17);
+    auto make_key = [&](){
+        auto n = rng() % 2000;
+        string k = "tenant/" + to_string(n % 7) + "/user/" + to_string(n);
+        if(n % 13 == 0)
+            k += string(rng() % (blob_b_tree::max_key_size - k.size()), 'x');
+        return k;
+    };
+    auto make_value = [&](){
+        return string(rng() % 200, (char)('a' + rng() % 26));
+    };
+
+    map<string, string> model;
+    {
+        blob_b_tree t("test_blob.db");
+        for(int op = 0; op < 20000; ++op)
+        {
+            auto k = make_key();
+            auto which = rng() % 10;
+            if(which < 5)
+            {
+                auto v = make_value();
+                bool present = model.count(k) != 0;
+                bool threw = false;
+                try
+                {
+                    t.insert(k, v);
+                }
+                catch(const std::exception&)
+                {
+                    threw = true;
+                }
+                RTF_ASSERT(threw == present);
+                if(!present)
+                    model[k] = v;
+            }
+            else if(which < 7)
+            {
+                auto v = make_value();
+                t.upsert(k, v);
+                model[k] = v;
+            }
+            else
+            {
+                t.remove(k);
+                model.erase(k);
+            }
+        }
+
+        for(auto& kv : model)
+            RTF_ASSERT(t.search(kv.first) == kv.second);
+    }
+
+    // Reopened, and scanned in order.
+    blob_b_tree t("test_blob.db");
+    vector<pair<string, string>> all(model.begin(), model.end());
+    RTF_ASSERT(t.range("", string(blob_b_tree::max_key_size, '\xff')) == all);
+
+    vector<pair<string, string>> some(model.lower_bound("tenant/3/"), model.upper_bound("tenant/4"));
+    RTF_ASSERT(t.range("tenant/3/", "tenant/4") == some);
+}
+
+void test_blob_b_tree::test_overflow_values()
+{
+    blob_b_tree t("test_blob.db");
+
+    string big(20000, 'b');
+    for(size_t i = 0; i < big.size(); ++i)
+        big[i] = (char)(i * 7);
+    string just_inline(blob_b_tree::max_inline_value_size, 'i');
+    string just_over(blob_b_tree::max_inline_value_size + 1, 'o');
+
+    t.insert("big", big);
+    t.insert("inline", just_inline);
+    t.insert("over", just_over);
+    RTF_ASSERT(t.search("big") == big);
+    RTF_ASSERT(t.search("inline") == just_inline);
+    RTF_ASSERT(t.search("over") == just_over);
+
+    auto r = t.range("a", "z");
+    RTF_ASSERT(r.size() == 3 && r[0].second == big && r[2].second == just_over);
+
+    // Replaced and removed values give their overflow pages back, so rewriting a large value over and over
+    // does not grow the file by the size of every version.
+    auto before = file_size("test_blob.db");
+    for(int i = 0; i < 500; ++i)
+    {
+        big[i] = 'x';
+        t.upsert("big", big);
+    }
+    RTF_ASSERT(t.search("big") == big);
+    RTF_ASSERT(file_size("test_blob.db") < before + (50 * big.size()));
+
+    t.remove("big");
+    RTF_ASSERT(!t.search("big"));
+    t.insert("big", "small now");
+    RTF_ASSERT(t.search("big") == string("small now"));
+}
+
+void test_blob_b_tree::test_concurrent_inserts()
+{
+    blob_b_tree t("test_blob.db");
+
+    const int num_threads = 8;
+    const int num_inserts_per_thread = 1000;
+
+    vector<thread> threads;
+    for(int i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back([&, i](){
+            for(int j = 0; j < num_inserts_per_thread; ++j)
+            {
+                auto k = "key/" + to_string(j) + "/" + to_string(i);
+                t.insert(k, string((size_t)(j % 300), (char)('a' + i)));
+            }
+        });
+    }
+    for(auto& th : threads)
+        th.join();
+
+    for(int i = 0; i < num_threads; ++i)
+    {
+        for(int j = 0; j < num_inserts_per_thread; ++j)
+        {
+            auto k = "key/" + to_string(j) + "/" + to_string(i);
+            RTF_ASSERT(t.search(k) == string((size_t)(j % 300), (char)('a' + i)));
+        }
+    }
+    RTF_ASSERT(t.range("key/", "key0").size() == num_threads * num_inserts_per_thread);
+}
+
+void test_blob_b_tree::test_format_tag()
+{
+    RTF_ASSERT_THROWS(b_tree("test_blob.db"), std::runtime_error);
+
+    b_tree::create_db_file("test_blob_int.db", 4);
+    RTF_ASSERT_THROWS(blob_b_tree("test_blob_int.db"), std::runtime_error);
+    unlink("test_blob_int.db");
+
+    RTF_ASSERT_THROWS(b_tree::create_db_file("test_blob_int.db", 4, NODE_LAYOUT_SLOTTED), std::runtime_error);
+}
+
+// Appends the entry count of each node of the subtree at ofs.
+static void _walk(const pager& p, uint64_t ofs, vector<size_t>& leaves, size_t& internal)
+{
+    blob_node n(p, ofs);
+    if(n.leaf())
+    {
+        leaves.push_back(n.count());
+        return;
+    }
+
+    ++internal;
+    for(uint16_t i = 0; i <= n.count(); ++i)
+        _walk(p, n.child(i), leaves, internal);
+}
+
+void test_blob_b_tree::test_removes_merge_leaves()
+{
+    std::mt19937_64 rng(5);
+    vector<string> keys;
+    for(int i = 0; i < 20000; ++i)
+        keys.push_back("key/" + to_string(i));
+    shuffle(keys.begin(), keys.end(), rng);
+
+    map<string, string> model;
+    {
+        blob_b_tree t("test_blob.db");
+        for(auto& k : keys)
+        {
+            t.insert(k, string(40, k.back()));
+            model[k] = string(40, k.back());
+        }
+
+        // Remove all but every 50th key, in another order.
+        shuffle(keys.begin(), keys.end(), rng);
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            if(i % 50 == 0)
+                continue;
+            t.remove(keys[i]);
+            model.erase(keys[i]);
+        }
+
+        for(auto& k : keys)
+        {
+            auto found = model.find(k);
+            RTF_ASSERT(t.search(k) == ((found == model.end())?optional<string>():found->second));
+        }
+        vector<pair<string, string>> all(model.begin(), model.end());
+        RTF_ASSERT(t.range("", "l") == all);
+    }
+
+    // The 400 keys left fit in a handful of leaves, no leaf was left empty or nearly so.
+    {
+        pager p("test_blob.db");
+        vector<size_t> leaves;
+        size_t internal = 0;
+        _walk(p, p.root_ofs(), leaves, internal);
+        RTF_ASSERT(leaves.size() < 40);
+        for(auto count : leaves)
+            RTF_ASSERT(count > 0);
+    }
+
+    // Removing the rest leaves an empty tree that still takes inserts.
+    blob_b_tree t("test_blob.db");
+    for(auto& kv : model)
+        t.remove(kv.first);
+    RTF_ASSERT(t.range("", "l").empty());
+    t.insert("again", "value");
+    RTF_ASSERT(t.search("again") == string("value"));
+}
@@ -0,0 +1,172 @@
+
+#include "test_buffer_pool.h"
+#include "test_utils.h"
+#include "tdb/b_tree.h"
+#include "tdb/pager.h"
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+REGISTER_TEST_FIXTURE(test_buffer_pool);
+
+void test_buffer_pool::setup()
+{
+    pager::create("test_buffer_pool.db");
+}
+
+void test_buffer_pool::teardown()
+{
+    unlink("test_buffer_pool.db");
+}
+
+void test_buffer_pool::test_pin_unpin_and_counters()
+{
+    vector<uint64_t> pages;
+
+    {
+        pager p("test_buffer_pool.db", 4, EVICT_CLOCK);
+        RTF_ASSERT(p.pooled());
+
+        for(int i = 0; i < 8; ++i)
+        {
+            auto ofs = p.append_page();
+            pages.push_back(ofs);
+            auto page = p.pin_page(ofs);
+            *(uint64_t*)page = ofs + 42;
+            p.unpin_page(ofs, true);
+        }
+
+        auto s = p.pool_stats();
+        RTF_ASSERT(s.misses == 8);
+        RTF_ASSERT(s.hits == 0);
+        RTF_ASSERT(s.evictions == 4);
+        RTF_ASSERT(s.write_backs == 4);
+
+        // The last page written is still resident.
+        p.pin_page(pages.back());
+        p.unpin_page(pages.back(), false);
+        RTF_ASSERT(p.pool_stats().hits == 1);
+    }
+
+    // Everything dirty was written back when the pool went away, read it back through the mapping.
+    pager p("test_buffer_pool.db");
+    for(auto ofs : pages)
+        RTF_ASSERT(*(uint64_t*)p.page_from(ofs) == ofs + 42);
+}
+
+void test_buffer_pool::test_pinned_frames_are_not_evicted()
+{
+    pager p("test_buffer_pool.db", 2, EVICT_LRU_K);
+
+    auto a = p.append_page();
+    auto b = p.append_page();
+    auto c = p.append_page();
+
+    p.pin_page(a);
+    p.pin_page(b);
+
+    RTF_ASSERT_THROWS(p.pin_page(c), std::runtime_error);
+
+    p.unpin_page(a, false);
+    RTF_ASSERT_NO_THROW(p.pin_page(c));
+    p.unpin_page(c, false);
+    p.unpin_page(b, false);
+
+    RTF_ASSERT_THROWS(p.unpin_page(b, false), std::runtime_error);
+}
+
+void test_buffer_pool::test_hot_page_survives_scan()
+{
+    for(auto ev : {EVICT_LRU_K, EVICT_2Q})
+    {
+        pager::create("test_buffer_pool.db");
+        pager p("test_buffer_pool.db", 4, ev);
+
+        vector<uint64_t> pages;
+        for(int i = 0; i < 20; ++i)
+            pages.push_back(p.append_page());
+
+        auto touch = [&](uint64_t ofs){p.pin_page(ofs); p.unpin_page(ofs, false);};
+
+        // Make pages[0] hot. For 2Q a page has to be re-referenced after leaving A1in to be promoted.
+        touch(pages[0]);
+        touch(pages[0]);
+        for(int i = 1; i < 5; ++i)
+            touch(pages[i]);
+        touch(pages[0]);
+
+        // A one time scan should not push it out.
+        for(int i = 5; i < 20; ++i)
+            touch(pages[i]);
+
+        auto before = p.pool_stats().hits;
+        touch(pages[0]);
+        RTF_ASSERT(p.pool_stats().hits == before + 1);
+    }
+}
+
+void test_buffer_pool::test_b_tree_in_pool_mode()
+{
+    vector<int64_t> keys(1000);
+    iota(begin(keys), end(keys), 1);
+    shuffle(begin(keys), end(keys), default_random_engine{});
+
+    for(auto ev : {EVICT_CLOCK, EVICT_LRU_K, EVICT_2Q})
+    {
+        b_tree::create_db_file("test_buffer_pool.db", 4);
+
+        {
+            b_tree t("test_buffer_pool.db", 16, ev);
+
+            for(auto k : keys)
+                t.insert(k, k + 100);
+
+            for(auto k : keys)
+                RTF_ASSERT(t.search(k) == k + 100);
+
+            auto s = t.pool_stats();
+            RTF_ASSERT(s.evictions > 0);
+            RTF_ASSERT(s.hits > 0);
+        }
+
+        b_tree t("test_buffer_pool.db");
+        for(auto k : keys)
+            RTF_ASSERT(t.search(k) == k + 100);
+    }
+}
+
+void test_buffer_pool::test_extent_growth()
+{
+    auto bs = pager::block_size();
+
+    for(auto preallocate : {false, true})
+    {
+        pager::create("test_buffer_pool.db");
+
+        {
+            pager p("test_buffer_pool.db");
+            RTF_ASSERT_THROWS(p.set_extent_size(bs + 1), std::runtime_error);
+            p.set_extent_size(16 * bs, preallocate);
+
+            // The first append grows the file by a whole extent, the rest of the extent costs nothing.
+            RTF_ASSERT(p.append_page() == bs);
+            RTF_ASSERT(file_size("test_buffer_pool.db") == 16 * bs);
+            for(int i = 0; i < 14; ++i)
+                p.append_page();
+            RTF_ASSERT(file_size("test_buffer_pool.db") == 16 * bs);
+
+            RTF_ASSERT(p.append_page() == 16 * bs);
+            RTF_ASSERT(file_size("test_buffer_pool.db") == 32 * bs);
+        }
+
+        // Closing trims the file back to the pages that were actually handed out.
+        RTF_ASSERT(file_size("test_buffer_pool.db") == 17 * bs);
+
+        pager p("test_buffer_pool.db", 4, EVICT_CLOCK);
+        RTF_ASSERT(p.append_page() == 17 * bs);
+    }
+}
@@ -0,0 +1,465 @@
+
+#include "test_compressed_b_tree.h"
+#include "test_utils.h"
+#include "tdb/compressed_b_tree.h"
+#include "tdb/compressed_node.h"
+#include "tdb/b_tree.h"
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <optional>
+#include <unistd.h>
+
+using namespace std;
+
+REGISTER_TEST_FIXTURE(test_compressed_b_tree);
+
+void test_compressed_b_tree::setup()
+{
+    compressed_b_tree::create_db_file("test_compressed.db");
+}
+
+void test_compressed_b_tree::teardown()
+{
+    unlink("test_compressed.db");
+    unlink("test_compressed_other.db");
+}
+
+void test_compressed_b_tree::test_basic()
+{
+    compressed_b_tree t("test_compressed.db");
+
+    RTF_ASSERT(!t.search(0));
+    t.remove(0);
+
+    // The extremes make a frame as wide as it gets.
+    auto lo = numeric_limits<int64_t>::min(), hi = numeric_limits<int64_t>::max();
+    t.insert(lo, hi);
+    t.insert(hi, lo);
+    t.insert(0, 0);
+    t.insert(-5, 5);
+
+    RTF_ASSERT(t.search(lo) == hi);
+    RTF_ASSERT(t.search(hi) == lo);
+    RTF_ASSERT(t.search(0) == 0);
+    RTF_ASSERT(t.search(-5) == 5);
+    RTF_ASSERT(!t.search(1));
+    RTF_ASSERT(!t.search(-6));
+
+    RTF_ASSERT_THROWS(t.insert(0, 1), std::runtime_error);
+    RTF_ASSERT(t.search(0) == 0);
+
+    t.upsert(0, 42);
+    RTF_ASSERT(t.search(0) == 42);
+
+    t.remove(-5);
+    RTF_ASSERT(!t.search(-5));
+    t.insert(-5, 6);
+    RTF_ASSERT(t.search(-5) == 6);
+
+    auto r = t.range(lo, hi);
+    RTF_ASSERT(r.size() == 4 && r.front().first == lo && r.back().first == hi);
+    RTF_ASSERT(t.range(-5, 0) == (vector<pair<int64_t, int64_t>>{{-5, 6}, {0, 42}}));
+
+    // The file is tagged NODE_LAYOUT_COMPRESSED, which b_tree refuses and can not create.
+    RTF_ASSERT_THROWS(b_tree("test_compressed.db"), std::runtime_error);
+    b_tree::create_db_file("test_compressed_other.db", 4);
+    RTF_ASSERT_THROWS(compressed_b_tree("test_compressed_other.db"), std::runtime_error);
+    RTF_ASSERT_THROWS(b_tree::create_db_file("test_compressed_other.db", 4, NODE_LAYOUT_COMPRESSED), std::runtime_error);
+}
+
+void test_compressed_b_tree::test_matches_model()
+{
+    // Keys drawn both from a narrow range (packs tightly) and from the whole int64_t range (does not), so
+    // nodes are split at very different entry counts.
+    std::mt19937_64 rng(23);
+    auto make_key = [&](){
+        if(rng() % 4 == 0)
+            return (int64_t)rng();
+        return (int64_t)(rng() % 50000);
+    };
+
+    map<int64_t, int64_t> model;
+    {
+        compressed_b_tree t("test_compressed.db");
+        for(int op = 0; op < 100000; ++op)
+        {
+            auto k = make_key();
+            auto v = (rng() % 2 == 0)?(int64_t)(rng() % 100):(int64_t)rng();
+            auto which = rng() % 10;
+            if(which < 5)
+            {
+                bool present = model.count(k) != 0;
+                bool threw = false;
+                try
+                {
+                    t.insert(k, v);
+                }
+                catch(const std::exception&)
+                {
+                    threw = true;
+                }
+                RTF_ASSERT(threw == present);
+                if(!present)
+                    model[k] = v;
+            }
+            else if(which < 7)
+            {
+                t.upsert(k, v);
+                model[k] = v;
+            }
+            else
+            {
+                t.remove(k);
+                model.erase(k);
+            }
+        }
+
+        for(auto& kv : model)
+            RTF_ASSERT(t.search(kv.first) == kv.second);
+        for(int i = 0; i < 10000; ++i)
+        {
+            auto k = make_key();
+            auto found = model.find(k);
+            RTF_ASSERT(t.search(k) == ((found == model.end())?optional<int64_t>():found->second));
+        }
+    }
+
+    // Reopened, and scanned in order.
+    compressed_b_tree t("test_compressed.db");
+    vector<pair<int64_t, int64_t>> all(model.begin(), model.end());
+    RTF_ASSERT(t.range(numeric_limits<int64_t>::min(), numeric_limits<int64_t>::max()) == all);
+
+    vector<pair<int64_t, int64_t>> some(model.lower_bound(1000), model.upper_bound(2000));
+    RTF_ASSERT(t.range(1000, 2000) == some);
+}
+
+void test_compressed_b_tree::test_timestamps_compress()
+{
+    // Increasing nanosecond timestamps about a microsecond apart, with sequence numbers as values.
+    const int64_t n = 200000;
+    std::mt19937_64 rng(3);
+    vector<pair<int64_t, int64_t>> kvs;
+    int64_t ts = 1700000000000000000LL;
+    for(int64_t i = 0; i < n; ++i)
+    {
+        ts += 500 + (int64_t)(rng() % 1000);
+        kvs.push_back(make_pair(ts, i));
+    }
+
+    {
+        compressed_b_tree t("test_compressed.db");
+        for(auto& kv : kvs)
+            t.insert(kv.first, kv.second);
+
+        for(auto& kv : kvs)
+            RTF_ASSERT(t.search(kv.first) == kv.second);
+        RTF_ASSERT(!t.search(kvs.front().first - 1));
+        RTF_ASSERT(t.range(kvs[1000].first, kvs[1999].first).size() == 1000);
+    }
+
+    b_tree::create_db_file("test_compressed_other.db", 0, NODE_LAYOUT_ALIGNED);
+    {
+        b_tree t("test_compressed_other.db");
+        for(auto& kv : kvs)
+            t.insert(kv.first, kv.second);
+    }
+
+    // The same keys in a b_tree take 24 bytes each (key, value, child) plus half empty nodes, here they
+    // take a few bytes each in full nodes.
+    auto compressed = file_size("test_compressed.db");
+    auto plain = file_size("test_compressed_other.db");
+    RTF_ASSERT(compressed * 5 < plain);
+}
+
+// Appends the keys of the subtree at ofs in order, and the entry count of each of its leaves.
+static void _walk(const pager& p, uint64_t ofs, vector<int64_t>& keys, vector<size_t>& leaves)
+{
+    compressed_node n(p, ofs);
+    if(n.leaf())
+    {
+        for(uint16_t i = 0; i < n.count(); ++i)
+            keys.push_back(n.key(i));
+        leaves.push_back(n.count());
+        return;
+    }
+
+    for(uint16_t i = 0; i < n.count(); ++i)
+    {
+        _walk(p, n.child(i), keys, leaves);
+        keys.push_back(n.key(i));
+    }
+    _walk(p, n.child(n.count()), keys, leaves);
+}
+
+void test_compressed_b_tree::test_concurrent_appends()
+{
+    // Writers appending interleaved timestamps all race for the rightmost leaf, each lost CAS re-encodes it.
+    const int64_t num_threads = 8;
+    const int64_t num_inserts_per_thread = 10000;
+    const int64_t base = 1700000000000000000LL;
+
+    {
+        compressed_b_tree t("test_compressed.db");
+
+        vector<thread> threads;
+        for(int64_t i = 0; i < num_threads; ++i)
+        {
+            threads.emplace_back([&, i](){
+                for(int64_t j = 0; j < num_inserts_per_thread; ++j)
+                    t.insert(base + ((j * num_threads) + i) * 1000, j);
+            });
+        }
+        for(auto& th : threads)
+            th.join();
+
+        for(int64_t k = 0; k < num_threads * num_inserts_per_thread; ++k)
+            RTF_ASSERT(t.search(base + k * 1000) == k / num_threads);
+        RTF_ASSERT(!t.search(base + 1));
+        RTF_ASSERT(t.range(base, numeric_limits<int64_t>::max()).size() == (size_t)(num_threads * num_inserts_per_thread));
+    }
+
+    // Out of order arrivals split some leaves in the middle, the leaves still hold their entries in well
+    // under the 8 bytes a plain int64_t key takes.
+    pager p("test_compressed.db");
+    vector<int64_t> keys;
+    vector<size_t> leaves;
+    _walk(p, p.root_ofs(), keys, leaves);
+    RTF_ASSERT(keys.size() == (size_t)(num_threads * num_inserts_per_thread));
+    RTF_ASSERT(is_sorted(keys.begin(), keys.end()));
+    RTF_ASSERT(leaves.size() * pager::block_size() < keys.size() * 8);
+}
+
+void test_compressed_b_tree::test_removed_separator_frame()
+{
+    // Values that pack in a few bits, and keys enough for a root with separators.
+    const int64_t n = 50000;
+    {
+        compressed_b_tree t("test_compressed.db");
+        for(int64_t k = 0; k < n; ++k)
+            t.insert(k, k % 100);
+    }
+
+    int64_t sep = 0;
+    {
+        pager p("test_compressed.db");
+        compressed_node root(p, p.root_ofs());
+        RTF_ASSERT(!root.leaf());
+        sep = root.key(0);
+    }
+
+    // The value widths are in the header of the node, byte 4.
+    auto root_value_width = [](){
+        pager p("test_compressed.db");
+        auto ofs = p.root_ofs();
+        auto width = p.pin_page(ofs)[4];
+        p.unpin_page(ofs, false);
+        return width;
+    };
+    auto narrow = root_value_width();
+    RTF_ASSERT(narrow <= 7);
+
+    {
+        compressed_b_tree t("test_compressed.db");
+        t.upsert(sep, numeric_limits<int64_t>::max());
+        RTF_ASSERT(t.search(sep) == numeric_limits<int64_t>::max());
+    }
+    RTF_ASSERT(root_value_width() >= 63);
+
+    // The separator stays in the root but its value goes, and with it the wide frame.
+    {
+        compressed_b_tree t("test_compressed.db");
+        t.remove(sep);
+        RTF_ASSERT(!t.search(sep));
+        RTF_ASSERT(t.range(sep - 1, sep + 1) == (vector<pair<int64_t, int64_t>>{{sep - 1, (sep - 1) % 100}, {sep + 1, (sep + 1) % 100}}));
+    }
+    {
+        pager p("test_compressed.db");
+        compressed_node root(p, p.root_ofs());
+        RTF_ASSERT(root.key(0) == sep && !root.valid(0));
+    }
+    RTF_ASSERT(root_value_width() <= narrow);
+}
+
+void test_compressed_b_tree::test_child_frame_overflow()
+{
+    unlink("test_compressed.db");
+    pager::create("test_compressed.db");
+    pager p("test_compressed.db");
+
+    // Children at the ofs of blocks 10, 11 and 12 pack 2 bits wide above a base of 10.
+    vector<uint64_t> pages;
+    while(pages.empty() || pages.back() < 16 * pager::block_size())
+        pages.push_back(p.append_page());
+    auto block = [&](uint64_t b){return b * pager::block_size();};
+    RTF_ASSERT(find(pages.begin(), pages.end(), block(10)) != pages.end());
+
+    vector<compressed_entry> entries = {{100, 1, true, block(10)}, {200, 2, true, block(11)}};
+    auto src = block(1);
+    auto dst = block(2);
+    RTF_ASSERT(compressed_node::write(p, src, false, entries, 0, 2, block(12)));
+
+    // Block 13 is the widest difference 2 bits hold.
+    RTF_ASSERT(compressed_node::write_with_child(p, dst, src, 1, block(13)));
+    {
+        compressed_node n(p, dst);
+        RTF_ASSERT(n.count() == 2);
+        RTF_ASSERT(n.child(0) == block(10));
+        RTF_ASSERT(n.child(1) == block(13));
+        RTF_ASSERT(n.child(2) == block(12));
+        RTF_ASSERT(n.key(1) == 200 && n.value(1) == 2);
+    }
+
+    // One past the width, and one below the base, both need the node written out in full.
+    RTF_ASSERT(!compressed_node::write_with_child(p, dst, src, 1, block(14)));
+    RTF_ASSERT(!compressed_node::write_with_child(p, dst, src, 2, block(9)));
+
+    // The rightmost child goes through the same frame.
+    RTF_ASSERT(compressed_node::write_with_child(p, dst, src, 2, block(10)));
+    {
+        compressed_node n(p, dst);
+        RTF_ASSERT(n.child(1) == block(11));
+        RTF_ASSERT(n.child(2) == block(10));
+    }
+}
+
+void test_compressed_b_tree::test_mixed_sign_keys()
+{
+    unlink("test_compressed.db");
+    pager::create("test_compressed.db");
+    {
+        pager p("test_compressed.db");
+        auto ofs = p.append_page();
+
+        // A frame straddling zero is based at its negative first key, and one spanning all of int64_t
+        // is 64 bits wide.
+        vector<vector<int64_t>> frames = {
+            {-3, -2, -1, 0, 1, 3},
+            {numeric_limits<int64_t>::min(), -1, 0, 1, numeric_limits<int64_t>::max()}
+        };
+        for(auto& keys : frames)
+        {
+            vector<compressed_entry> entries;
+            for(auto k : keys)
+                entries.push_back({k, -k / 2, true, 0});
+            RTF_ASSERT(compressed_node::write(p, ofs, true, entries, 0, entries.size(), 0));
+
+            compressed_node n(p, ofs);
+            RTF_ASSERT(n.count() == keys.size());
+            for(uint16_t i = 0; i < n.count(); ++i)
+            {
+                RTF_ASSERT(n.key(i) == keys[i]);
+                RTF_ASSERT(n.value(i) == -keys[i] / 2);
+
+                bool found = false;
+                RTF_ASSERT(n.lower_bound(keys[i], found) == i && found);
+                if(i > 0 && keys[i] - 1 != keys[i - 1])
+                {
+                    RTF_ASSERT(n.lower_bound(keys[i] - 1, found) == i && !found);
+                }
+            }
+
+            bool found = true;
+            if(keys.front() != numeric_limits<int64_t>::min())
+            {
+                RTF_ASSERT(n.lower_bound(keys.front() - 1, found) == 0 && !found);
+                RTF_ASSERT(n.lower_bound(numeric_limits<int64_t>::min(), found) == 0 && !found);
+            }
+            if(keys.back() != numeric_limits<int64_t>::max())
+            {
+                RTF_ASSERT(n.lower_bound(keys.back() + 1, found) == keys.size() && !found);
+                RTF_ASSERT(n.lower_bound(numeric_limits<int64_t>::max(), found) == keys.size() && !found);
+            }
+        }
+    }
+
+    unlink("test_compressed.db");
+    compressed_b_tree::create_db_file("test_compressed.db");
+
+    // Keys either side of zero, so most nodes' frames have a negative base.
+    std::mt19937_64 rng(11);
+    map<int64_t, int64_t> model;
+    compressed_b_tree t("test_compressed.db");
+    for(int i = 0; i < 50000; ++i)
+    {
+        auto k = (int64_t)(rng() % 100001) - 50000;
+        auto v = (int64_t)(rng() % 2001) - 1000;
+        if(rng() % 8 == 0)
+        {
+            t.remove(k);
+            model.erase(k);
+        }
+        else
+        {
+            t.upsert(k, v);
+            model[k] = v;
+        }
+    }
+
+    for(int64_t k = -50001; k <= 50001; ++k)
+    {
+        auto found = model.find(k);
+        RTF_ASSERT(t.search(k) == ((found == model.end())?optional<int64_t>():found->second));
+    }
+
+    vector<pair<int64_t, int64_t>> around_zero(model.lower_bound(-2000), model.upper_bound(2000));
+    RTF_ASSERT(t.range(-2000, 2000) == around_zero);
+    vector<pair<int64_t, int64_t>> negative(model.begin(), model.upper_bound(-1));
+    RTF_ASSERT(t.range(numeric_limits<int64_t>::min(), -1) == negative);
+}
+
+void test_compressed_b_tree::test_append_split()
+{
+    // Ascending inserts always change the last entry of the rightmost leaf, so every split keeps as much
+    // as fits on the left and leaves one entry on the right.
+    const int64_t n = 100000;
+    {
+        compressed_b_tree t("test_compressed.db");
+        for(int64_t k = 0; k < n; ++k)
+            t.insert(k, k);
+    }
+
+    size_t full = 0;
+    {
+        pager p("test_compressed.db");
+        vector<int64_t> keys;
+        vector<size_t> leaves;
+        _walk(p, p.root_ofs(), keys, leaves);
+
+        vector<int64_t> expected(n);
+        iota(expected.begin(), expected.end(), 0);
+        RTF_ASSERT(keys == expected);
+
+        // Every key spans the same frame, so every leaf but the last was left equally full.
+        RTF_ASSERT(leaves.size() > 2);
+        full = leaves.front();
+        for(size_t i = 0; i + 1 < leaves.size(); ++i)
+            RTF_ASSERT(leaves[i] == full);
+        RTF_ASSERT(leaves.back() <= full);
+    }
+
+    // Two keys past a full leaf is the first split: the full leaf, the separator and a single key.
+    unlink("test_compressed.db");
+    compressed_b_tree::create_db_file("test_compressed.db");
+    {
+        compressed_b_tree t("test_compressed.db");
+        for(int64_t k = 0; k < (int64_t)full + 2; ++k)
+            t.insert(k, k);
+    }
+
+    pager p("test_compressed.db");
+    compressed_node root(p, p.root_ofs());
+    RTF_ASSERT(!root.leaf());
+    RTF_ASSERT(root.count() == 1);
+    RTF_ASSERT(root.key(0) == (int64_t)full);
+
+    compressed_node left(p, root.child(0));
+    compressed_node right(p, root.child(1));
+    RTF_ASSERT(left.leaf() && left.count() == full);
+    RTF_ASSERT(right.leaf() && right.count() == 1);
+    RTF_ASSERT(right.key(0) == (int64_t)full + 1);
+}
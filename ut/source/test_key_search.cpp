@@ -0,0 +1,59 @@
+
+#include "test_key_search.h"
+#include "tdb/key_search.h"
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <limits>
+
+using namespace std;
+
+REGISTER_TEST_FIXTURE(test_key_search);
+
+static vector<key_search_fn> _supported()
+{
+    vector<key_search_fn> fns = {lower_bound_linear, lower_bound_binary, key_lower_bound};
+    if(key_search_supported(KEY_SEARCH_SSE42))
+        fns.push_back(lower_bound_sse42);
+    if(key_search_supported(KEY_SEARCH_AVX2))
+        fns.push_back(lower_bound_avx2);
+    return fns;
+}
+
+void test_key_search::test_matches_std_lower_bound()
+{
+    auto fns = _supported();
+    std::default_random_engine rng;
+
+    for(uint16_t n = 0; n <= 200; ++n)
+    {
+        // A narrow key range so that duplicates (lazily removed keys that were inserted again) occur.
+        std::uniform_int_distribution<int64_t> dist(-100, 300);
+        vector<int64_t> keys(n);
+        for(auto& k : keys)
+            k = dist(rng);
+        sort(begin(keys), end(keys));
+
+        for(int64_t probe = -110; probe <= 310; ++probe)
+        {
+            auto expected = (uint16_t)(lower_bound(begin(keys), end(keys), probe) - begin(keys));
+            for(auto fn : fns)
+                RTF_ASSERT(fn(keys.data(), n, probe) == expected);
+        }
+    }
+}
+
+void test_key_search::test_extremes()
+{
+    auto lo = numeric_limits<int64_t>::min();
+    auto hi = numeric_limits<int64_t>::max();
+
+    vector<int64_t> keys = {lo, lo, -1, 0, 1, 1LL << 40, hi - 1, hi};
+    for(auto fn : _supported())
+    {
+        RTF_ASSERT(fn(keys.data(), (uint16_t)keys.size(), lo) == 0);
+        RTF_ASSERT(fn(keys.data(), (uint16_t)keys.size(), lo + 1) == 2);
+        RTF_ASSERT(fn(keys.data(), (uint16_t)keys.size(), 0) == 3);
+        RTF_ASSERT(fn(keys.data(), (uint16_t)keys.size(), hi) == 7);
+    }
+}
@@ -0,0 +1,291 @@
+
+#include "test_lsm_tree.h"
+#include "tdb/lsm_tree.h"
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+REGISTER_TEST_FIXTURE(test_lsm_tree);
+
+static void _remove_lsm_files(const string& base)
+{
+    auto d = opendir(".");
+    if(!d)
+        return;
+
+    vector<string> doomed;
+    while(auto ent = readdir(d))
+    {
+        string file = ent->d_name;
+        if(file.compare(0, base.size() + 1, base + ".") == 0)
+            doomed.push_back(file);
+    }
+    closedir(d);
+
+    for(auto& file : doomed)
+        unlink(file.c_str());
+}
+
+static size_t _count_files(const string& prefix)
+{
+    auto d = opendir(".");
+    if(!d)
+        return 0;
+
+    size_t n = 0;
+    while(auto ent = readdir(d))
+    {
+        if(string(ent->d_name).compare(0, prefix.size(), prefix) == 0)
+            ++n;
+    }
+    closedir(d);
+
+    return n;
+}
+
+static bool _matches(lsm_tree& t, const map<int64_t, int64_t>& model, int64_t max_key)
+{
+    for(int64_t k = 0; k < max_key; ++k)
+    {
+        auto found = model.find(k);
+        auto v = t.get(k);
+        if(found == model.end())
+        {
+            if(v)
+                return false;
+        }
+        else if(v != found->second)
+            return false;
+    }
+
+    auto all = t.range(INT64_MIN, INT64_MAX);
+    return all == vector<pair<int64_t, int64_t>>(model.begin(), model.end());
+}
+
+void test_lsm_tree::setup()
+{
+    _remove_lsm_files("test_lsm");
+}
+
+void test_lsm_tree::teardown()
+{
+    _remove_lsm_files("test_lsm");
+}
+
+void test_lsm_tree::test_matches_model()
+{
+    const int64_t max_key = 3000;
+
+    lsm_tree t("test_lsm", 500);
+    map<int64_t, int64_t> model;
+
+    std::default_random_engine rng;
+    std::uniform_int_distribution<int64_t> key(0, max_key - 1);
+    for(int i = 0; i < 20000; ++i)
+    {
+        auto k = key(rng);
+        if(i % 5 == 0)
+        {
+            t.remove(k);
+            model.erase(k);
+        }
+        else
+        {
+            t.put(k, i);
+            model[k] = i;
+        }
+
+        // Check while flushes and compactions are running in the background too.
+        if(i % 5000 == 4999)
+            RTF_ASSERT(_matches(t, model, max_key));
+    }
+
+    t.flush();
+    RTF_ASSERT(_matches(t, model, max_key));
+
+    auto s = t.stats();
+    RTF_ASSERT(s.flushes > 10);
+    RTF_ASSERT(s.compactions > 0);
+    RTF_ASSERT(s.runs < s.flushes);
+
+    auto some = t.range(100, 200);
+    vector<pair<int64_t, int64_t>> expected(model.lower_bound(100), model.upper_bound(200));
+    RTF_ASSERT(some == expected);
+    RTF_ASSERT(t.range(200, 100).empty());
+}
+
+void test_lsm_tree::test_compaction_drops_garbage()
+{
+    {
+        lsm_tree t("test_lsm", 100);
+        for(int round = 0; round < (int)lsm_tree::fanout; ++round)
+        {
+            for(int64_t k = 0; k < 100; ++k)
+            {
+                if(round == (int)lsm_tree::fanout - 1)
+                    t.remove(k);
+                else t.put(k, round);
+            }
+            t.flush();
+        }
+
+        // The four tier 0 runs were merged into one, and since that included the oldest run the tombstones
+        // went too.
+        auto s = t.stats();
+        RTF_ASSERT(s.compactions == 1);
+        RTF_ASSERT(s.runs == 1);
+        RTF_ASSERT(t.range(INT64_MIN, INT64_MAX).empty());
+        RTF_ASSERT(!t.get(50));
+    }
+
+    // Compacted runs are removed once nothing reads them.
+    RTF_ASSERT(_count_files("test_lsm.run.") == 2);
+}
+
+void test_lsm_tree::test_reopen()
+{
+    {
+        lsm_tree t("test_lsm", 1000);
+        for(int64_t k = 0; k < 5000; ++k)
+            t.put(k, k + 100);
+        for(int64_t k = 0; k < 5000; k += 7)
+            t.remove(k);
+        t.put(7, 42);
+    }
+
+    // Closing flushed the memtable and the log of the last (empty) one is gone.
+    RTF_ASSERT(_count_files("test_lsm.wal.") == 0);
+
+    lsm_tree t("test_lsm", 1000);
+    for(int64_t k = 0; k < 5000; ++k)
+    {
+        if(k == 7)
+            RTF_ASSERT(t.get(k) == 42);
+        else if(k % 7 == 0)
+            RTF_ASSERT(!t.get(k));
+        else RTF_ASSERT(t.get(k) == k + 100);
+    }
+}
+
+void test_lsm_tree::test_recovery_after_crash()
+{
+    auto pid = fork();
+    if(pid == 0)
+    {
+        lsm_tree t("test_lsm", 1000, DURABILITY_WAL);
+        for(int64_t k = 0; k < 2500; ++k)
+            t.put(k, k + 100);
+        t.remove(10);
+        _exit(0);
+    }
+
+    int status = 0;
+    RTF_ASSERT(waitpid(pid, &status, 0) == pid);
+    RTF_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // At least the last 500 puts and the remove only ever made it to a log.
+    RTF_ASSERT(_count_files("test_lsm.wal.") > 0);
+
+    lsm_tree t("test_lsm", 1000, DURABILITY_WAL);
+    RTF_ASSERT(!t.get(10));
+    for(int64_t k = 0; k < 2500; ++k)
+    {
+        if(k != 10)
+            RTF_ASSERT(t.get(k) == k + 100);
+    }
+}
+
+void test_lsm_tree::test_concurrent_writers()
+{
+    const int num_threads = 4;
+    const int num_puts_per_thread = 5000;
+
+    {
+        lsm_tree t("test_lsm", 1000, DURABILITY_WAL);
+
+        vector<thread> threads;
+        for(int i = 0; i < num_threads; ++i)
+        {
+            threads.emplace_back([&, i](){
+                for(int j = 0; j < num_puts_per_thread; ++j)
+                {
+                    int64_t key = j * num_threads + i;
+                    t.put(key, key + 100);
+                }
+            });
+        }
+
+        // Readers run alongside, a key is either not there yet or has its value.
+        bool consistent = true;
+        for(int64_t k = 0; k < num_threads * num_puts_per_thread; k += 13)
+        {
+            auto v = t.get(k);
+            if(v && *v != k + 100)
+                consistent = false;
+        }
+
+        for(auto& th : threads)
+            th.join();
+
+        RTF_ASSERT(consistent);
+    }
+
+    lsm_tree t("test_lsm");
+    auto all = t.range(INT64_MIN, INT64_MAX);
+    RTF_ASSERT(all.size() == num_threads * num_puts_per_thread);
+    for(auto& kv : all)
+        RTF_ASSERT(kv.second == kv.first + 100);
+}
+
+void test_lsm_tree::test_writes_during_compaction()
+{
+    // Three large tier 0 runs, one short of a merge.
+    const int64_t big = 200000;
+    {
+        lsm_tree t("test_lsm", big);
+        for(int64_t r = 0; r < 3; ++r)
+        {
+            for(int64_t k = 0; k < big; ++k)
+                t.put((k * 3) + r, k);
+            t.flush();
+        }
+        RTF_ASSERT(t.stats().runs == 3 && t.stats().compactions == 0);
+    }
+
+    // With small memtables the first flush completes the tier and starts a long merge. Writes keep being
+    // flushed while it runs instead of waiting for it behind the frozen memtables.
+    lsm_tree t("test_lsm", 1000);
+    int64_t k = 3 * big;
+    for(; k < (3 * big) + 1000; ++k)
+        t.put(k, k);
+    while(t.stats().flushes == 0)
+        this_thread::yield();
+
+    // Stalled writers would leave flushes at 1 (plus the frozen memtables) until the merge is done.
+    bool flushed_during_merge = false;
+    for(; k < (3 * big) + 100000 && !flushed_during_merge; ++k)
+    {
+        t.put(k, k);
+        if(k % 1000 == 0)
+        {
+            auto s = t.stats();
+            if(s.compactions > 0)
+                break;
+            flushed_during_merge = s.flushes >= 5;
+        }
+    }
+    RTF_ASSERT(flushed_during_merge);
+
+    t.flush();
+    RTF_ASSERT(t.stats().compactions >= 1);
+    for(int64_t j = 0; j < 3 * big; j += 997)
+        RTF_ASSERT(t.get(j) == j / 3);
+    for(int64_t j = 3 * big; j < k; j += 97)
+        RTF_ASSERT(t.get(j) == j);
+}
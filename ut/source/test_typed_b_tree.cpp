@@ -0,0 +1,209 @@
+
+#include "test_typed_b_tree.h"
+#include "tdb/typed_b_tree.h"
+#include "tdb/b_tree.h"
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+REGISTER_TEST_FIXTURE(test_typed_b_tree);
+
+typedef typed_b_tree<uint32_t, uint32_t> id_tree;
+typedef typed_b_tree<uuid_key, uint64_t> uuid_tree;
+
+static uuid_key _random_uuid(std::mt19937_64& rng)
+{
+    uuid_key u;
+    auto a = rng(), b = rng();
+    memcpy(u.bytes, &a, 8);
+    memcpy(u.bytes + 8, &b, 8);
+    return u;
+}
+
+void test_typed_b_tree::setup()
+{
+}
+
+void test_typed_b_tree::teardown()
+{
+    unlink("test_typed.db");
+    unlink("test_typed_other.db");
+}
+
+void test_typed_b_tree::test_layout()
+{
+    // Everything here is known at compile time.
+    static_assert(id_tree::layout.size <= pager::block_size(), "");
+    static_assert(id_tree::layout.keys % alignof(uint32_t) == 0 && id_tree::layout.child_ofs % 8 == 0, "");
+    static_assert(uuid_tree::layout.vals % alignof(uint64_t) == 0, "");
+    static_assert(typed_b_tree<uint32_t, uint32_t, std::less<uint32_t>, 8>::max_keys == 15, "");
+
+    // uint32_t keys and values are not padded out to int64_t, so a page holds more of them than it holds of
+    // b_tree's keys, and 16 byte keys cost only their own size.
+    RTF_ASSERT(id_tree::min_degree > b_tree_node::max_min_degree(pager::block_size(), NODE_LAYOUT_ALIGNED));
+    RTF_ASSERT(id_tree::layout.vals - id_tree::layout.keys == sizeof(uint32_t) * id_tree::max_keys);
+    RTF_ASSERT(uuid_tree::layout.vals - uuid_tree::layout.keys == sizeof(uuid_key) * uuid_tree::max_keys);
+    RTF_ASSERT(id_tree::layout_type::of(id_tree::min_degree + 1).size > pager::block_size());
+}
+
+void test_typed_b_tree::test_uint32_matches_model()
+{
+    id_tree::create_db_file("test_typed.db");
+
+    std::mt19937_64 rng(5);
+    map<uint32_t, uint32_t> model;
+    {
+        id_tree t("test_typed.db");
+        for(int op = 0; op < 50000; ++op)
+        {
+            uint32_t k = (uint32_t)(rng() % 20000);
+            uint32_t v = (uint32_t)rng();
+            auto which = rng() % 10;
+            if(which < 5)
+            {
+                bool present = model.count(k) != 0;
+                bool threw = false;
+                try
+                {
+                    t.insert(k, v);
+                }
+                catch(const std::exception&)
+                {
+                    threw = true;
+                }
+                RTF_ASSERT(threw == present);
+                if(!present)
+                    model[k] = v;
+            }
+            else if(which < 7)
+            {
+                t.upsert(k, v);
+                model[k] = v;
+            }
+            else
+            {
+                t.remove(k);
+                model.erase(k);
+            }
+        }
+
+        for(uint32_t k = 0; k < 20000; ++k)
+        {
+            auto found = model.find(k);
+            auto v = t.search(k);
+            if(found == model.end())
+                RTF_ASSERT(!v);
+            else RTF_ASSERT(v && *v == found->second);
+        }
+    }
+
+    // Reopened, and scanned in order.
+    id_tree t("test_typed.db");
+    vector<pair<uint32_t, uint32_t>> all(model.begin(), model.end());
+    RTF_ASSERT(t.range(0, numeric_limits<uint32_t>::max()) == all);
+
+    vector<pair<uint32_t, uint32_t>> some(model.lower_bound(5000), model.upper_bound(6000));
+    RTF_ASSERT(t.range(5000, 6000) == some);
+}
+
+void test_typed_b_tree::test_uuid_keys()
+{
+    uuid_tree::create_db_file("test_typed.db");
+    uuid_tree t("test_typed.db");
+
+    std::mt19937_64 rng(11);
+    vector<uuid_key> keys;
+    for(int i = 0; i < 20000; ++i)
+    {
+        auto u = _random_uuid(rng);
+        keys.push_back(u);
+        t.insert(u, (uint64_t)i);
+    }
+
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+        auto v = t.search(keys[i]);
+        RTF_ASSERT(v && *v == i);
+    }
+    RTF_ASSERT(!t.search(_random_uuid(rng)));
+
+    uuid_key lo, hi;
+    memset(lo.bytes, 0, sizeof(lo.bytes));
+    memset(hi.bytes, 0xff, sizeof(hi.bytes));
+    auto all = t.range(lo, hi);
+    RTF_ASSERT(all.size() == keys.size());
+    for(size_t i = 1; i < all.size(); ++i)
+        RTF_ASSERT(all[i - 1].first < all[i].first);
+
+    t.remove(keys[0]);
+    RTF_ASSERT(!t.search(keys[0]));
+    RTF_ASSERT(t.range(lo, hi).size() == keys.size() - 1);
+}
+
+void test_typed_b_tree::test_small_min_degree()
+{
+    // A tiny min_degree gives a deep tree, which exercises splits at every level (and a descending
+    // Compare orders the tree the other way).
+    typedef typed_b_tree<int32_t, int32_t, std::greater<int32_t>, 2> small_tree;
+    small_tree::create_db_file("test_typed.db");
+    small_tree t("test_typed.db");
+
+    map<int32_t, int32_t, std::greater<int32_t>> model;
+    for(int32_t i = 0; i < 3000; ++i)
+    {
+        t.insert((i * 7919) % 3001, i);
+        model[(i * 7919) % 3001] = i;
+    }
+
+    for(auto& kv : model)
+        RTF_ASSERT(t.search(kv.first) == kv.second);
+
+    vector<pair<int32_t, int32_t>> expected(model.lower_bound(2000), model.upper_bound(1000));
+    RTF_ASSERT(expected.size() > 900);
+    RTF_ASSERT(t.range(2000, 1000) == expected);
+}
+
+void test_typed_b_tree::test_concurrent_inserts()
+{
+    id_tree::create_db_file("test_typed.db");
+    id_tree t("test_typed.db");
+
+    const uint32_t num_threads = 8;
+    const uint32_t num_inserts_per_thread = 5000;
+
+    vector<thread> threads;
+    for(uint32_t i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back([&, i](){
+            for(uint32_t j = 0; j < num_inserts_per_thread; ++j)
+                t.insert((j * num_threads) + i, j);
+        });
+    }
+    for(auto& th : threads)
+        th.join();
+
+    for(uint32_t k = 0; k < num_threads * num_inserts_per_thread; ++k)
+        RTF_ASSERT(t.search(k) == k / num_threads);
+    RTF_ASSERT(t.range(0, numeric_limits<uint32_t>::max()).size() == num_threads * num_inserts_per_thread);
+}
+
+void test_typed_b_tree::test_format_tag()
+{
+    id_tree::create_db_file("test_typed.db");
+
+    typedef typed_b_tree<uint64_t, uint32_t> wide_key_tree;
+    typedef typed_b_tree<uint32_t, uint32_t, std::less<uint32_t>, 8> small_id_tree;
+    RTF_ASSERT_THROWS(b_tree("test_typed.db"), std::runtime_error);
+    RTF_ASSERT_THROWS(wide_key_tree("test_typed.db"), std::runtime_error);
+    RTF_ASSERT_THROWS(small_id_tree("test_typed.db"), std::runtime_error);
+    {
+        id_tree t("test_typed.db");
+    }
+
+    b_tree::create_db_file("test_typed_other.db", 4);
+    RTF_ASSERT_THROWS(id_tree("test_typed_other.db"), std::runtime_error);
+}
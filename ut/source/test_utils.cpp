@@ -0,0 +1,13 @@
+
+#include "test_utils.h"
+#include <sys/stat.h>
+
+using namespace std;
+
+uint64_t file_size(const string& name)
+{
+    struct stat st;
+    if(stat(name.c_str(), &st) != 0)
+        return 0;
+    return (uint64_t)st.st_size;
+}
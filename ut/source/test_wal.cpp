@@ -0,0 +1,275 @@
+
+#include "test_wal.h"
+#include "tdb/wal.h"
+#include "tdb/b_tree.h"
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+REGISTER_TEST_FIXTURE(test_wal);
+
+void test_wal::setup()
+{
+    b_tree::create_db_file("test_wal.db", 4);
+}
+
+void test_wal::teardown()
+{
+    unlink("test_wal.db");
+    unlink("test_wal.db.wal");
+    unlink("test_wal.log");
+}
+
+void test_wal::test_torn_tail_is_ignored()
+{
+    {
+        wal w("test_wal.log", 1);
+        RTF_ASSERT(w.append(WAL_INSERT, 10, 100) == 1);
+        RTF_ASSERT(w.append(WAL_REMOVE, 20, 0) == 2);
+        w.commit(2);
+
+        // The batch is committed but its tail is torn off below.
+        RTF_ASSERT(w.append_batch(WAL_INSERT, {{30, 300}, {40, 400}, {50, 500}}) == 5);
+        w.commit(5);
+        RTF_ASSERT(w.last_lsn() == 5);
+    }
+
+    auto records = wal::read("test_wal.log");
+    RTF_ASSERT(records.size() == 5);
+    RTF_ASSERT(records[0].op == WAL_INSERT && records[0].key == 10 && records[0].value == 100);
+    RTF_ASSERT(records[1].op == WAL_REMOVE && records[1].key == 20);
+    RTF_ASSERT(records[4].op == WAL_INSERT && records[4].key == 50);
+
+    RTF_ASSERT(truncate("test_wal.log", 4 * sizeof(wal_record) + 7) == 0);
+    RTF_ASSERT(wal::read("test_wal.log").size() == 2);
+
+    RTF_ASSERT(wal::read("test_wal.missing").empty());
+}
+
+void test_wal::test_group_commit()
+{
+    const int num_threads = 8;
+    const int num_inserts_per_thread = 200;
+
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+
+        vector<thread> threads;
+        for(int i = 0; i < num_threads; ++i)
+        {
+            threads.emplace_back([&, i](){
+                for(int j = 0; j < num_inserts_per_thread; ++j)
+                {
+                    int64_t key = i * num_inserts_per_thread + j;
+                    t.insert(key, key + 100);
+                }
+            });
+        }
+
+        for(auto& th : threads)
+            th.join();
+
+        auto s = t.log_stats();
+        RTF_ASSERT(s.records == num_threads * num_inserts_per_thread);
+        RTF_ASSERT(s.syncs > 0 && s.syncs <= s.records);
+    }
+
+    // Closing checkpointed everything into the data file and emptied the log.
+    RTF_ASSERT(wal::read("test_wal.db.wal").empty());
+
+    b_tree t("test_wal.db");
+    for(int64_t k = 0; k < num_threads * num_inserts_per_thread; ++k)
+        RTF_ASSERT(t.search(k) == k + 100);
+}
+
+void test_wal::test_recovery_after_crash()
+{
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        for(int64_t k = 0; k < 500; ++k)
+            t.insert(k, k + 100);
+    }
+
+    // The child dies without running any destructors, everything after its checkpoint lives only in the
+    // log.
+    auto pid = fork();
+    if(pid == 0)
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        for(int64_t k = 500; k < 1000; ++k)
+            t.insert(k, k + 100);
+        for(int64_t k = 0; k < 1000; k += 10)
+            t.remove(k);
+        t.insert(1500, 42);
+        t.insert_batch({{2000, 2100}, {2001, 2101}});
+        _exit(0);
+    }
+
+    int status = 0;
+    RTF_ASSERT(waitpid(pid, &status, 0) == pid);
+    RTF_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    RTF_ASSERT(!wal::read("test_wal.db.wal").empty());
+
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        RTF_ASSERT(t.search(1500) == 42);
+        for(int64_t k = 0; k < 1000; ++k)
+        {
+            if(k % 10 == 0)
+                RTF_ASSERT(!t.search(k));
+            else RTF_ASSERT(t.search(k) == k + 100);
+        }
+        RTF_ASSERT(t.search(2000) == 2100);
+        RTF_ASSERT(t.search(2001) == 2101);
+
+        // Recovery checkpointed the replayed operations.
+        RTF_ASSERT(wal::read("test_wal.db.wal").empty());
+        t.insert(3000, 3100);
+    }
+
+    b_tree t("test_wal.db");
+    RTF_ASSERT(t.search(3000) == 3100);
+    RTF_ASSERT(t.search(999) == 1099);
+}
+
+void test_wal::test_update_recovery_after_crash()
+{
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        for(int64_t k = 0; k < 100; ++k)
+            t.insert(k, k + 100);
+    }
+
+    // Updates are logged as their outcome, a failed compare_and_set logs nothing.
+    auto pid = fork();
+    if(pid == 0)
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        t.upsert(1, 7);
+        t.upsert(2500, 2600);
+        t.compare_and_set(3, 103, 8);
+        t.compare_and_set(4, 0, 9);
+        t.remove(10);
+        t.insert(10, 11);
+        _exit(0);
+    }
+
+    int status = 0;
+    RTF_ASSERT(waitpid(pid, &status, 0) == pid);
+    RTF_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    b_tree t("test_wal.db", DURABILITY_WAL);
+    RTF_ASSERT(t.search(1) == 7);
+    RTF_ASSERT(t.search(2500) == 2600);
+    RTF_ASSERT(t.search(3) == 8);
+    RTF_ASSERT(t.search(4) == 104);
+    RTF_ASSERT(t.search(10) == 11);
+    RTF_ASSERT(t.search(99) == 199);
+    RTF_ASSERT(t.live_keys() == 101);
+}
+
+void test_wal::test_bulk_load_survives_crash()
+{
+    // bulk_load writes nothing to the log, the child relies on the checkpoint it takes.
+    auto pid = fork();
+    if(pid == 0)
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        vector<pair<int64_t, int64_t>> kvs;
+        for(int64_t k = 0; k < 1000; ++k)
+            kvs.push_back(make_pair(k, k + 100));
+        t.bulk_load(kvs.begin(), kvs.end());
+        if(t.search(5) != 105)
+            _exit(1);
+
+        // Logged on top of the checkpoint.
+        t.remove(7);
+        t.insert(5000, 5100);
+        _exit(0);
+    }
+
+    int status = 0;
+    RTF_ASSERT(waitpid(pid, &status, 0) == pid);
+    RTF_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    b_tree t("test_wal.db", DURABILITY_WAL);
+    for(int64_t k = 0; k < 1000; ++k)
+    {
+        if(k == 7)
+            RTF_ASSERT(!t.search(k));
+        else RTF_ASSERT(t.search(k) == k + 100);
+    }
+    RTF_ASSERT(t.search(5000) == 5100);
+    RTF_ASSERT(t.live_keys() == 1000);
+}
+
+void test_wal::test_partitioned_recovery()
+{
+    b_tree::create_db_file("test_wal.db", 4, NODE_LAYOUT_PACKED, 4);
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        for(int64_t k = 0; k < 500; ++k)
+            t.insert(k, k + 100);
+    }
+
+    // Every partition has its own checkpointed root to roll back to.
+    auto pid = fork();
+    if(pid == 0)
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        for(int64_t k = 500; k < 1000; ++k)
+            t.insert(k, k + 100);
+        for(int64_t k = 0; k < 1000; k += 10)
+            t.remove(k);
+        t.insert_batch({{2000, 2100}, {2001, 2101}, {2002, 2102}, {2003, 2103}});
+        _exit(0);
+    }
+
+    int status = 0;
+    RTF_ASSERT(waitpid(pid, &status, 0) == pid);
+    RTF_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    b_tree t("test_wal.db", DURABILITY_WAL);
+    RTF_ASSERT(t.partitions() == 4);
+    for(int64_t k = 0; k < 1000; ++k)
+    {
+        if(k % 10 == 0)
+            RTF_ASSERT(!t.search(k));
+        else RTF_ASSERT(t.search(k) == k + 100);
+    }
+    for(int64_t k = 2000; k < 2004; ++k)
+        RTF_ASSERT(t.search(k) == k + 100);
+    RTF_ASSERT(t.live_keys() == 904);
+}
+
+void test_wal::test_partitioned_bulk_load_survives_crash()
+{
+    // Large enough to be applied in several chunks, each published on its own.
+    const int64_t n = 150000;
+    b_tree::create_db_file("test_wal.db", 4, NODE_LAYOUT_PACKED, 4);
+
+    auto pid = fork();
+    if(pid == 0)
+    {
+        b_tree t("test_wal.db", DURABILITY_WAL);
+        vector<pair<int64_t, int64_t>> kvs;
+        for(int64_t k = 0; k < n; ++k)
+            kvs.push_back(make_pair(k, k + 100));
+        t.bulk_load(kvs.begin(), kvs.end());
+        t.insert(n, n + 100);
+        _exit(0);
+    }
+
+    int status = 0;
+    RTF_ASSERT(waitpid(pid, &status, 0) == pid);
+    RTF_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    b_tree t("test_wal.db", DURABILITY_WAL);
+    for(int64_t k = 0; k <= n; ++k)
+        RTF_ASSERT(t.search(k) == k + 100);
+    RTF_ASSERT(t.live_keys() == (uint64_t)n + 1);
+}